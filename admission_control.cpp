@@ -0,0 +1,112 @@
+#include "admission_control.h"
+#include "async_log.h"
+#include "msg.h"
+#include "server_config.h"
+
+Admission_Control::Admission_Control () :
+    sessions_ (0),
+    loop_lag_msec_ (0),
+    max_sessions_ (DEFAULT_MAX_SESSIONS),
+    max_sessions_per_ip_ (DEFAULT_MAX_SESSIONS_PER_IP),
+    max_sessions_per_user_ (DEFAULT_MAX_SESSIONS_PER_USER),
+    max_loop_lag_msec_ (DEFAULT_MAX_LOOP_LAG_MSEC)
+{}
+
+Admission_Control *Admission_Control::instance ()
+{
+    static Admission_Control admission_control;
+    return &admission_control;
+}
+
+void Admission_Control::configure ()
+{
+    Server_Config *config = Server_Config::instance ();
+    std::lock_guard<std::mutex> guard (lock_);
+    max_sessions_ = config->get_int ("max_sessions", DEFAULT_MAX_SESSIONS);
+    max_sessions_per_ip_ = config->get_int ("max_sessions_per_ip", DEFAULT_MAX_SESSIONS_PER_IP);
+    max_sessions_per_user_ = config->get_int ("max_sessions_per_user", DEFAULT_MAX_SESSIONS_PER_USER);
+    max_loop_lag_msec_ = config->get_int ("max_loop_lag_ms", DEFAULT_MAX_LOOP_LAG_MSEC);
+}
+
+int Admission_Control::admit_connection (const std::string &ip_addr)
+{
+    // cheap checks first, they need no lock
+    if (max_loop_lag_msec_ > 0 && 
+        loop_lag_msec_.load (std::memory_order_relaxed) > max_loop_lag_msec_)
+        return Admission_Results::REJECT_OVERLOAD;
+    if (max_sessions_ > 0 && sessions_.load (std::memory_order_relaxed) >= max_sessions_)
+        return Admission_Results::REJECT_SERVER_FULL;
+
+    std::lock_guard<std::mutex> guard (lock_);
+    if (max_sessions_ > 0 && sessions_.load (std::memory_order_relaxed) >= max_sessions_)
+        return Admission_Results::REJECT_SERVER_FULL;
+    size_t &ip_count = ip_sessions_[ip_addr];
+    if (max_sessions_per_ip_ > 0 && ip_count >= max_sessions_per_ip_)
+    {
+        if (ip_count == 0)
+            ip_sessions_.erase (ip_addr);
+        return Admission_Results::REJECT_IP_LIMIT;
+    }
+    ++ip_count;
+    sessions_.fetch_add (1, std::memory_order_relaxed);
+    return Admission_Results::ADMITTED;
+}
+
+void Admission_Control::release_connection (const std::string &ip_addr)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    auto ite = ip_sessions_.find (ip_addr);
+    if (ite == ip_sessions_.end ())
+    {
+        FTP_LOG (LOG_LEVEL_DEBUG, "release unknown connection %s\n", ip_addr.c_str ());
+        return;
+    }
+    if (--ite->second == 0)
+        ip_sessions_.erase (ite);
+    sessions_.fetch_sub (1, std::memory_order_relaxed);
+}
+
+int Admission_Control::admit_user (const std::string &username)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    size_t &user_count = user_sessions_[username];
+    if (max_sessions_per_user_ > 0 && user_count >= max_sessions_per_user_)
+        return Admission_Results::REJECT_USER_LIMIT;
+    ++user_count;
+    return Admission_Results::ADMITTED;
+}
+
+void Admission_Control::release_user (const std::string &username)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    auto ite = user_sessions_.find (username);
+    if (ite == user_sessions_.end ())
+        return;
+    if (--ite->second == 0)
+        user_sessions_.erase (ite);
+}
+
+void Admission_Control::update_loop_lag (const ACE_Time_Value &lag)
+{
+    long lag_msec = lag < ACE_Time_Value::zero ? 0 : static_cast<long> (lag.msec ());
+    long last_msec = loop_lag_msec_.exchange (lag_msec, std::memory_order_relaxed);
+    if (max_loop_lag_msec_ > 0 && lag_msec > max_loop_lag_msec_ && last_msec <= max_loop_lag_msec_)
+        FTP_LOG (LOG_LEVEL_INFO, "event loop lag %d ms, shedding new connections\n", (int)lag_msec);
+    else if (max_loop_lag_msec_ > 0 && lag_msec <= max_loop_lag_msec_ && last_msec > max_loop_lag_msec_)
+        FTP_LOG (LOG_LEVEL_INFO, "event loop lag back to %d ms\n", (int)lag_msec);
+}
+
+const char *Admission_Control::reject_message (int reason)
+{
+    switch (reason)
+    {
+    case Admission_Results::REJECT_IP_LIMIT:
+        return MSG_TOO_MANY_FROM_IP;
+    case Admission_Results::REJECT_USER_LIMIT:
+        return MSG_TOO_MANY_FOR_USER;
+    case Admission_Results::REJECT_OVERLOAD:
+        return MSG_SERVER_BUSY;
+    default:
+        return MSG_TOO_MANY_USERS;
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include "ace/Time_Value.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define DEFAULT_MAX_SESSIONS 1024
+#define DEFAULT_MAX_SESSIONS_PER_IP 32
+#define DEFAULT_MAX_SESSIONS_PER_USER 64
+#define DEFAULT_MAX_LOOP_LAG_MSEC 500
+
+enum Admission_Results
+{
+    ADMITTED = 0,
+    REJECT_SERVER_FULL = -1,
+    REJECT_IP_LIMIT = -2,
+    REJECT_USER_LIMIT = -3,
+    REJECT_OVERLOAD = -4,
+};
+
+class Admission_Control
+{
+public:
+    /**
+     * @brief Get the process-wide admission control
+     * 
+     * @return Admission_Control* 
+     */
+    static Admission_Control *instance ();
+
+    /**
+     * @brief Read limits from Server_Config, keys are max_sessions, max_sessions_per_ip,
+     *        max_sessions_per_user and max_loop_lag_ms. 0 disables a limit.
+     */
+    void configure ();
+
+    /**
+     * @brief Decide whether a new command connection from ip_addr may be served.
+     *        When admitted, the session is counted until release_connection ().
+     * 
+     * @param ip_addr client address
+     * @return int , enum Admission_Results, ADMITTED (0) or the reason of rejection
+     */
+    int admit_connection (const std::string &ip_addr);
+
+    /**
+     * @brief Release a session counted by admit_connection ()
+     * 
+     * @param ip_addr client address
+     */
+    void release_connection (const std::string &ip_addr);
+
+    /**
+     * @brief Decide whether one more session of this user may log in.
+     *        When admitted, the login is counted until release_user ().
+     * 
+     * @param username 
+     * @return int , ADMITTED (0) or REJECT_USER_LIMIT
+     */
+    int admit_user (const std::string &username);
+
+    /**
+     * @brief Release a login counted by admit_user ()
+     * 
+     * @param username 
+     */
+    void release_user (const std::string &username);
+
+    /**
+     * @brief Record the latest measured event loop lag, new connections are shed
+     *        while it is above max_loop_lag_
+     * 
+     * @param lag how late the last probe timer fired
+     */
+    void update_loop_lag (const ACE_Time_Value &lag);
+
+    /**
+     * @brief Get the number of admitted sessions
+     * 
+     * @return size_t 
+     */
+    size_t get_sessions () const { return sessions_.load (std::memory_order_relaxed); }
+
+    /**
+     * @brief Get the response message for a rejection, see msg.h
+     * 
+     * @param reason enum Admission_Results
+     * @return const char* 
+     */
+    static const char *reject_message (int reason);
+
+private:
+    Admission_Control ();
+
+    std::mutex lock_;                                       // protects the maps below
+    std::atomic<size_t> sessions_;                          // admitted sessions
+    std::unordered_map<std::string, size_t> ip_sessions_;   // admitted sessions of each ip
+    std::unordered_map<std::string, size_t> user_sessions_; // logged in sessions of each user
+    std::atomic<long> loop_lag_msec_;                       // last measured event loop lag
+
+    size_t max_sessions_;           // global limit of sessions
+    size_t max_sessions_per_ip_;    // limit of sessions from one address
+    size_t max_sessions_per_user_;  // limit of logged in sessions of one user
+    long max_loop_lag_msec_;        // shed new connections above this lag
+};
+
+#endif
@@ -0,0 +1,363 @@
+#include "ascii_convert.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_CONVERT_X86
+#endif
+
+typedef size_t (*Lf_To_Crlf) (const char *, size_t, char *);
+typedef size_t (*Crlf_To_Lf) (const char *, size_t, char *);
+
+/**
+ * @brief Convert LF to CRLF byte runs found by memchr, also the tail of the vector versions
+ */
+static size_t lf_to_crlf_scalar (const char *src, size_t length, char *des)
+{
+    char *out = des;
+    const char *end = src + length;
+    while (src < end)
+    {
+        const char *lf = (const char *)memchr (src, '\n', end - src);
+        size_t run = (lf == nullptr ? end : lf) - src;
+        memcpy (out, src, run);
+        out += run;
+        src += run;
+        if (lf == nullptr)
+            break;
+        *out++ = '\r';
+        *out++ = '\n';
+        ++src;
+    }
+    return out - des;
+}
+
+/**
+ * @brief Drop every CR followed by LF, a CR ending src is dropped too and
+ *        decided by the caller
+ */
+static size_t crlf_to_lf_scalar (const char *src, size_t length, char *des)
+{
+    char *out = des;
+    const char *end = src + length;
+    while (src < end)
+    {
+        const char *cr = (const char *)memchr (src, '\r', end - src);
+        size_t run = (cr == nullptr ? end : cr) - src;
+        memcpy (out, src, run);
+        out += run;
+        src += run;
+        if (cr == nullptr)
+            break;
+        if (cr + 1 < end && cr[1] != '\n')
+            *out++ = '\r';
+        ++src;
+    }
+    return out - des;
+}
+
+#ifdef ASCII_CONVERT_X86
+
+/**
+ * @brief Copy one vector of LF to CRLF conversion, mask has a bit per LF;
+ *        with is_padded the runs are copied as whole vectors, reading up to
+ *        2 * width bytes of src and writing past the output
+ */
+static inline char *expand_lines (const char *src, unsigned mask, size_t width, bool is_padded, char *out)
+{
+    size_t done = 0;
+    while (mask != 0)
+    {
+        size_t lf = __builtin_ctz (mask);
+        if (is_padded)
+            memcpy (out, src + done, width);
+        else
+            memcpy (out, src + done, lf - done);
+        out += lf - done;
+        *out++ = '\r';
+        *out++ = '\n';
+        done = lf + 1;
+        mask &= mask - 1;
+    }
+    memcpy (out, src + done, width - done);
+    return out + width - done;
+}
+
+/**
+ * @brief Copy one vector of CRLF to LF conversion, mask has a bit per dropped CR,
+ *        is_padded as for expand_lines ()
+ */
+static inline char *squeeze_lines (const char *src, unsigned mask, size_t width, bool is_padded, char *out)
+{
+    size_t done = 0;
+    while (mask != 0)
+    {
+        size_t cr = __builtin_ctz (mask);
+        if (is_padded)
+            memcpy (out, src + done, width);
+        else
+            memcpy (out, src + done, cr - done);
+        out += cr - done;
+        done = cr + 1;
+        mask &= mask - 1;
+    }
+    memcpy (out, src + done, width - done);
+    return out + width - done;
+}
+
+__attribute__((target("sse2")))
+static size_t lf_to_crlf_sse2 (const char *src, size_t length, char *des)
+{
+    const __m128i lf = _mm_set1_epi8 ('\n');
+    char *out = des;
+    size_t pos = 0;
+    for (; pos + 16 <= length; pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128 ((const __m128i *)(src + pos));
+        unsigned mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, lf));
+        if (mask == 0)
+        {
+            _mm_storeu_si128 ((__m128i *)out, chunk);
+            out += 16;
+        }
+        else
+            out = expand_lines (src + pos, mask, 16, pos + 2 * 16 <= length, out);
+    }
+    return (out - des) + lf_to_crlf_scalar (src + pos, length - pos, out);
+}
+
+__attribute__((target("sse2")))
+static size_t crlf_to_lf_sse2 (const char *src, size_t length, char *des)
+{
+    const __m128i cr = _mm_set1_epi8 ('\r');
+    const __m128i lf = _mm_set1_epi8 ('\n');
+    char *out = des;
+    size_t pos = 0;
+    // the byte after the vector must exist to tell a CRLF
+    for (; pos + 16 < length; pos += 16)
+    {
+        __m128i chunk = _mm_loadu_si128 ((const __m128i *)(src + pos));
+        __m128i next = _mm_loadu_si128 ((const __m128i *)(src + pos + 1));
+        unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (chunk, cr),
+                                                          _mm_cmpeq_epi8 (next, lf)));
+        if (mask == 0)
+        {
+            _mm_storeu_si128 ((__m128i *)out, chunk);
+            out += 16;
+        }
+        else
+            out = squeeze_lines (src + pos, mask, 16, pos + 2 * 16 <= length, out);
+    }
+    return (out - des) + crlf_to_lf_scalar (src + pos, length - pos, out);
+}
+
+/**
+ * pshufb controls converting 8 bytes with a given LF or CR mask, so a vector
+ * with line endings is converted without a branch per line
+ */
+struct Shuffle_Tables
+{
+    unsigned char expand[256][16];      // source byte of each output byte, 0x80 for the CR inserted
+    unsigned char expand_cr[256][16];   // the CRs inserted, or'ed into the shuffled bytes
+    unsigned char squeeze[256][16];     // source byte of each output byte, dropped CRs skipped
+};
+
+static const Shuffle_Tables &shuffle_tables ()
+{
+    static Shuffle_Tables tables;
+    static bool is_built = [] {
+        memset (&tables, 0x80, sizeof (tables));
+        memset (tables.expand_cr, 0, sizeof (tables.expand_cr));
+        for (int mask = 0; mask < 256; ++mask)
+        {
+            int expanded = 0, squeezed = 0;
+            for (int i = 0; i < 8; ++i)
+            {
+                if (mask & (1 << i))
+                    tables.expand_cr[mask][expanded++] = '\r';
+                else
+                    tables.squeeze[mask][squeezed++] = i;
+                tables.expand[mask][expanded++] = i;
+            }
+        }
+        return true;
+    } ();
+    (void)is_built;
+    return tables;
+}
+
+__attribute__((target("avx2")))
+static size_t lf_to_crlf_avx2 (const char *src, size_t length, char *des)
+{
+    const Shuffle_Tables &tables = shuffle_tables ();
+    const __m256i lf = _mm256_set1_epi8 ('\n');
+    char *out = des;
+    size_t pos = 0;
+    for (; pos + 32 <= length; pos += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256 ((const __m256i *)(src + pos));
+        unsigned mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (chunk, lf));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256 ((__m256i *)out, chunk);
+            out += 32;
+            continue;
+        }
+        // 8 bytes grow to at most 16, des has room for twice the input
+        for (int group = 0; group < 4; ++group, mask >>= 8)
+        {
+            unsigned group_mask = mask & 0xff;
+            __m128i bytes = _mm_loadl_epi64 ((const __m128i *)(src + pos + group * 8));
+            __m128i converted = _mm_or_si128 (
+                _mm_shuffle_epi8 (bytes, _mm_loadu_si128 ((const __m128i *)tables.expand[group_mask])),
+                _mm_loadu_si128 ((const __m128i *)tables.expand_cr[group_mask]));
+            _mm_storeu_si128 ((__m128i *)out, converted);
+            out += 8 + __builtin_popcount (group_mask);
+        }
+    }
+    return (out - des) + lf_to_crlf_scalar (src + pos, length - pos, out);
+}
+
+__attribute__((target("avx2")))
+static size_t crlf_to_lf_avx2 (const char *src, size_t length, char *des)
+{
+    const Shuffle_Tables &tables = shuffle_tables ();
+    const __m256i cr = _mm256_set1_epi8 ('\r');
+    const __m256i lf = _mm256_set1_epi8 ('\n');
+    char *out = des;
+    size_t pos = 0;
+    for (; pos + 32 < length; pos += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256 ((const __m256i *)(src + pos));
+        __m256i next = _mm256_loadu_si256 ((const __m256i *)(src + pos + 1));
+        unsigned mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8 (chunk, cr),
+                                                                _mm256_cmpeq_epi8 (next, lf)));
+        if (mask == 0)
+        {
+            _mm256_storeu_si256 ((__m256i *)out, chunk);
+            out += 32;
+            continue;
+        }
+        for (int group = 0; group < 4; ++group, mask >>= 8)
+        {
+            unsigned group_mask = mask & 0xff;
+            __m128i bytes = _mm_loadl_epi64 ((const __m128i *)(src + pos + group * 8));
+            __m128i converted = _mm_shuffle_epi8 (bytes, _mm_loadu_si128 ((const __m128i *)tables.squeeze[group_mask]));
+            _mm_storel_epi64 ((__m128i *)out, converted);
+            out += 8 - __builtin_popcount (group_mask);
+        }
+    }
+    return (out - des) + crlf_to_lf_scalar (src + pos, length - pos, out);
+}
+
+#endif
+
+struct Ascii_Convert_Impl
+{
+    const char *isa;
+    Lf_To_Crlf lf_to_crlf;
+    Crlf_To_Lf crlf_to_lf;
+};
+
+static const Ascii_Convert_Impl scalar_impl = { "scalar", lf_to_crlf_scalar, crlf_to_lf_scalar };
+#ifdef ASCII_CONVERT_X86
+static const Ascii_Convert_Impl sse2_impl = { "sse2", lf_to_crlf_sse2, crlf_to_lf_sse2 };
+static const Ascii_Convert_Impl avx2_impl = { "avx2", lf_to_crlf_avx2, crlf_to_lf_avx2 };
+#endif
+
+/**
+ * @brief Pick the widest implementation the CPU runs
+ */
+static const Ascii_Convert_Impl *detect_impl ()
+{
+#ifdef ASCII_CONVERT_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        return &avx2_impl;
+    if (__builtin_cpu_supports ("sse2"))
+        return &sse2_impl;
+#endif
+    return &scalar_impl;
+}
+
+static const Ascii_Convert_Impl *&current_impl ()
+{
+    static const Ascii_Convert_Impl *impl = detect_impl ();
+    return impl;
+}
+
+size_t lf_to_crlf (const char *src, size_t length, char *des)
+{
+    return current_impl ()->lf_to_crlf (src, length, des);
+}
+
+int lf_to_crlf_file (int src_fd, int des_fd)
+{
+    std::string input (ASCII_CHUNK_SIZE, '\0');
+    std::string output (2 * ASCII_CHUNK_SIZE, '\0');
+    off_t offset = 0;
+    while (true)
+    {
+        ssize_t read_count = pread (src_fd, &input[0], input.size (), offset);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count <= 0)
+            return read_count == 0 ? 0 : -1;
+        offset += read_count;
+        size_t length = lf_to_crlf (input.data (), read_count, &output[0]);
+        const char *data = output.data ();
+        while (length > 0)
+        {
+            ssize_t write_count = write (des_fd, data, length);
+            if (write_count < 0 && errno == EINTR)
+                continue;
+            if (write_count <= 0)
+                return -1;
+            data += write_count;
+            length -= write_count;
+        }
+    }
+}
+
+size_t crlf_to_lf (const char *src, size_t length, char *des, bool &is_cr_pending)
+{
+    char *out = des;
+    if (is_cr_pending && length > 0)
+    {
+        // the CR held back ends a line only when LF starts this piece
+        if (src[0] != '\n')
+            *out++ = '\r';
+        is_cr_pending = false;
+    }
+    if (length == 0)
+        return 0;
+    out += current_impl ()->crlf_to_lf (src, length, out);
+    is_cr_pending = (src[length - 1] == '\r');
+    return out - des;
+}
+
+const char *ascii_convert_isa ()
+{
+    return current_impl ()->isa;
+}
+
+int ascii_convert_select (const char *isa)
+{
+    const Ascii_Convert_Impl *impl = nullptr;
+    if (strcmp (isa, "scalar") == 0)
+        impl = &scalar_impl;
+#ifdef ASCII_CONVERT_X86
+    else if (strcmp (isa, "sse2") == 0 && __builtin_cpu_supports ("sse2"))
+        impl = &sse2_impl;
+    else if (strcmp (isa, "avx2") == 0 && __builtin_cpu_supports ("avx2"))
+        impl = &avx2_impl;
+#endif
+    if (impl == nullptr)
+        return -1;
+    current_impl () = impl;
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef ASCII_CONVERT_H
+#define ASCII_CONVERT_H
+
+#include <cstddef>
+
+#define ASCII_CHUNK_SIZE (64 * 1024)    // file bytes converted at a time by TYPE A RETR
+
+/**
+ * Line ending conversion of TYPE A transfers: the file keeps LF, the wire
+ * carries CRLF. The scanners compare 32 (AVX2) or 16 (SSE2) bytes at a time
+ * and copy runs without line endings as whole vectors; the implementation is
+ * chosen once from the CPU, with a memchr based one for other machines.
+ */
+
+/**
+ * @brief Convert LF to CRLF, for RETR
+ *
+ * @param src
+ * @param length
+ * @param des room for 2 * length bytes
+ * @return size_t , bytes written to des
+ */
+size_t lf_to_crlf (const char *src, size_t length, char *des);
+
+/**
+ * @brief Convert a whole file from LF to CRLF on the calling thread, for Transform_Cache
+ *
+ * @param src_fd read with pread from offset 0
+ * @param des_fd
+ * @return int , 0 for success, -1 for failure
+ */
+int lf_to_crlf_file (int src_fd, int des_fd);
+
+/**
+ * @brief Convert CRLF to LF, for STOR; a CR at the end of src is held back
+ *        until the next call tells whether LF follows, the caller writes a CR
+ *        still held back at the end of the file
+ *
+ * @param src
+ * @param length
+ * @param des room for length + 1 bytes
+ * @param is_cr_pending in: a CR was held back by the previous call, out: one is held back now
+ * @return size_t , bytes written to des
+ */
+size_t crlf_to_lf (const char *src, size_t length, char *des, bool &is_cr_pending);
+
+/**
+ * @brief Get the name of the implementation in use: "avx2", "sse2" or "scalar"
+ *
+ * @return const char*
+ */
+const char *ascii_convert_isa ();
+
+/**
+ * @brief Force an implementation, for tests and benchmarks
+ *
+ * @param isa "avx2", "sse2" or "scalar"
+ * @return int , 0 for success, -1 for not supported by the CPU
+ */
+int ascii_convert_select (const char *isa);
+
+#endif
@@ -0,0 +1,188 @@
+#include "async_log.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <system_error>
+#include <unistd.h>
+
+static const char *const level_names[] = { "debug", "info", "error", "off" };
+
+/**
+ * @brief Write formatted lines to stderr
+ * 
+ * @param out formatted lines
+ */
+static void write_out (const std::string &out)
+{
+    size_t written = 0;
+    while (written < out.size ())
+    {
+        ssize_t n = ::write (STDERR_FILENO, out.data () + written, out.size () - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        written += n;
+    }
+}
+
+Async_Log *Async_Log::instance ()
+{
+    static Async_Log async_log;
+    return &async_log;
+}
+
+int Async_Log::open ()
+{
+    if (is_running_.load ())
+        return 0;
+    is_running_.store (true);
+    try
+    {
+        drainer_ = std::thread (&Async_Log::drain_loop, this);
+    }
+    catch (const std::system_error &)
+    {
+        is_running_.store (false);
+        return -1;
+    }
+    return 0;
+}
+
+void Async_Log::close ()
+{
+    if (!is_running_.exchange (false))
+        return;
+    if (drainer_.joinable ())
+        drainer_.join ();
+    drain ();
+}
+
+int Async_Log::parse_level (const std::string &name)
+{
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; ++level)
+    {
+        if (name == level_names[level])
+            return level;
+    }
+    return -1;
+}
+
+Log_Ring *Async_Log::ring ()
+{
+    thread_local Log_Ring *thread_ring = nullptr;
+    if (thread_ring == nullptr)
+    {
+        std::unique_ptr<Log_Ring> new_ring (new Log_Ring);
+        new_ring->head.store (0);
+        new_ring->tail.store (0);
+        new_ring->dropped.store (0);
+        thread_ring = new_ring.get ();
+        // rings live until exit, the drainer may still read a dead thread's lines
+        std::lock_guard<std::mutex> guard (rings_lock_);
+        rings_.push_back (std::move (new_ring));
+    }
+    return thread_ring;
+}
+
+void Async_Log::log (int level, const char *format, ...)
+{
+    long long usec = std::chrono::duration_cast<std::chrono::microseconds> (
+        std::chrono::system_clock::now ().time_since_epoch ()).count ();
+    va_list args;
+    if (!is_running_.load (std::memory_order_acquire))
+    {
+        Log_Slot slot;
+        slot.level = level;
+        slot.usec = usec;
+        va_start (args, format);
+        vsnprintf (slot.line, LOG_LINE_SIZE, format, args);
+        va_end (args);
+        std::string out;
+        format_slot (slot, out);
+        write_out (out);
+        return;
+    }
+
+    Log_Ring *thread_ring = ring ();
+    size_t head = thread_ring->head.load (std::memory_order_relaxed);
+    if (head - thread_ring->tail.load (std::memory_order_acquire) >= LOG_RING_SLOTS)
+    {
+        thread_ring->dropped.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+    Log_Slot &slot = thread_ring->slots[head & (LOG_RING_SLOTS - 1)];
+    slot.level = level;
+    slot.usec = usec;
+    va_start (args, format);
+    vsnprintf (slot.line, LOG_LINE_SIZE, format, args);
+    va_end (args);
+    thread_ring->head.store (head + 1, std::memory_order_release);
+}
+
+void Async_Log::drain_loop ()
+{
+    while (is_running_.load ())
+    {
+        if (drain () == 0)
+            std::this_thread::sleep_for (std::chrono::milliseconds (LOG_DRAIN_IDLE_MSEC));
+    }
+}
+
+size_t Async_Log::drain ()
+{
+    std::string out;
+    size_t drained = 0;
+    long long dropped = 0;
+    {
+        std::lock_guard<std::mutex> guard (rings_lock_);
+        for (auto &thread_ring : rings_)
+        {
+            size_t tail = thread_ring->tail.load (std::memory_order_relaxed);
+            size_t head = thread_ring->head.load (std::memory_order_acquire);
+            for (; tail != head; ++tail, ++drained)
+                format_slot (thread_ring->slots[tail & (LOG_RING_SLOTS - 1)], out);
+            thread_ring->tail.store (tail, std::memory_order_release);
+            dropped += thread_ring->dropped.load (std::memory_order_relaxed);
+        }
+    }
+    if (dropped > reported_dropped_)
+    {
+        char buf[64];
+        int n = snprintf (buf, sizeof (buf), "%lld log lines dropped\n", dropped - reported_dropped_);
+        if (n > 0)
+            out.append (buf, n);
+        reported_dropped_ = dropped;
+    }
+    if (!out.empty ())
+        write_out (out);
+    return drained;
+}
+
+void Async_Log::format_slot (const Log_Slot &slot, std::string &out)
+{
+    time_t sec = slot.usec / 1000000;
+    struct tm tm_buf;
+    localtime_r (&sec, &tm_buf);
+    char prefix[48];
+    size_t n = strftime (prefix, sizeof (prefix), "%Y-%m-%d %H:%M:%S", &tm_buf);
+    n += snprintf (prefix + n, sizeof (prefix) - n, ".%06lld %c ",
+                   slot.usec % 1000000,
+                   level_names[slot.level][0] - 'a' + 'A');
+    out.append (prefix, n);
+    out.append (slot.line);
+    if (out.back () != '\n')
+        out.push_back ('\n');
+}
+
+long long Async_Log::get_dropped ()
+{
+    std::lock_guard<std::mutex> guard (rings_lock_);
+    long long dropped = 0;
+    for (auto &thread_ring : rings_)
+        dropped += thread_ring->dropped.load (std::memory_order_relaxed);
+    return dropped;
+}
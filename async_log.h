@@ -0,0 +1,173 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LOG_RING_SLOTS 1024     // slots of a thread's ring, power of 2
+#define LOG_LINE_SIZE 256       // longer lines are truncated
+#define LOG_DRAIN_IDLE_MSEC 5   // drainer sleep when all rings are empty
+
+// levels below it are compiled out, set by -DFTP_LOG_COMPILE_LEVEL=N
+#ifndef FTP_LOG_COMPILE_LEVEL
+#define FTP_LOG_COMPILE_LEVEL 0
+#endif
+
+enum Log_Levels
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,
+    LOG_LEVEL_ERROR = 2,
+    LOG_LEVEL_OFF = 3,
+};
+
+/**
+ * @brief Check whether a level is logged, guards work done only for logging
+ */
+#define FTP_LOG_ENABLED(level) \
+    ((level) >= FTP_LOG_COMPILE_LEVEL && Async_Log::instance ()->is_enabled (level))
+
+/**
+ * @brief Log a printf style message, a disabled level costs one relaxed load,
+ *        a level below FTP_LOG_COMPILE_LEVEL costs nothing
+ */
+#define FTP_LOG(level, ...) \
+    do \
+    { \
+        if (FTP_LOG_ENABLED (level)) \
+            Async_Log::instance ()->log ((level), __VA_ARGS__); \
+    } while (0)
+
+/**
+ * One log line waiting in a ring.
+ */
+struct Log_Slot
+{
+    int level;                  // enum Log_Levels
+    long long usec;             // wall clock time in microseconds
+    char line[LOG_LINE_SIZE];   // formatted message
+};
+
+/**
+ * Single producer single consumer ring of one thread.
+ * The owning thread advances head, the drainer advances tail.
+ */
+struct Log_Ring
+{
+    std::atomic<size_t> head;           // next slot to write
+    std::atomic<size_t> tail;           // next slot to drain
+    std::atomic<long long> dropped;     // lines dropped because the ring was full
+    Log_Slot slots[LOG_RING_SLOTS];
+};
+
+/**
+ * Logging backend of the event loop threads. Every thread formats into its
+ * own ring without locking, a background thread writes the rings to stderr.
+ * When a ring is full the line is dropped and counted, a thread never waits.
+ */
+class Async_Log
+{
+public:
+    /**
+     * @brief Get the process-wide log
+     * 
+     * @return Async_Log*
+     */
+    static Async_Log *instance ();
+
+    /**
+     * @brief Start the drainer thread, lines logged before are written synchronously
+     * 
+     * @return int , 0 for success, -1 for failure
+     */
+    int open ();
+
+    /**
+     * @brief Write the queued lines and stop the drainer thread
+     */
+    void close ();
+
+    /**
+     * @brief Check whether a level is enabled at runtime
+     * 
+     * @param level enum Log_Levels
+     * @return true , lines of the level are logged
+     * @return false , lines of the level are discarded
+     */
+    bool is_enabled (int level) const { return level >= level_.load (std::memory_order_relaxed); }
+
+    /**
+     * @brief Set the lowest logged level
+     * 
+     * @param level enum Log_Levels
+     */
+    void set_level (int level) { level_.store (level, std::memory_order_relaxed); }
+
+    /**
+     * @brief Get a level by name
+     * 
+     * @param name "debug", "info", "error" or "off"
+     * @return int , enum Log_Levels, -1 for unknown name
+     */
+    static int parse_level (const std::string &name);
+
+    /**
+     * @brief Queue a line into the ring of the calling thread, use FTP_LOG instead
+     * 
+     * @param level enum Log_Levels
+     * @param format printf style format
+     */
+    void log (int level, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
+
+    /**
+     * @brief Get the number of dropped lines
+     * 
+     * @return long long
+     */
+    long long get_dropped ();
+
+    ~Async_Log () { close (); }
+
+private:
+    Async_Log () : level_ (LOG_LEVEL_DEBUG), is_running_ (false), reported_dropped_ (0) {}
+
+    /**
+     * @brief Get the ring of the calling thread, registered on first use
+     * 
+     * @return Log_Ring*
+     */
+    Log_Ring *ring ();
+
+    /**
+     * @brief Body of the drainer thread
+     */
+    void drain_loop ();
+
+    /**
+     * @brief Move every queued line to the output
+     * 
+     * @return size_t number of drained lines
+     */
+    size_t drain ();
+
+    /**
+     * @brief Format a slot as an output line
+     * 
+     * @param slot the slot
+     * @param out output buffer, appended
+     */
+    static void format_slot (const Log_Slot &slot, std::string &out);
+
+    std::atomic<int> level_;                        // lowest logged level
+    std::atomic<bool> is_running_;                  // whether the drainer is running
+    std::mutex rings_lock_;                         // guards rings_, held by registration and the drainer
+    std::vector<std::unique_ptr<Log_Ring>> rings_;  // rings of every thread that logged
+    long long reported_dropped_;                    // dropped lines already reported, drainer only
+    std::thread drainer_;                           // drainer thread
+};
+
+#endif
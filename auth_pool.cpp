@@ -0,0 +1,227 @@
+#include "auth_pool.h"
+#include "async_log.h"
+#include "command_handler.h"
+#include "credential_store.h"
+#include "metrics.h"
+#include "server_config.h"
+#include "user_inf.h"
+
+#include <algorithm>
+#include <iterator>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <system_error>
+
+Auth_Pool *Auth_Pool::instance ()
+{
+    static Auth_Pool pool;
+    return &pool;
+}
+
+int Auth_Pool::open ()
+{
+    Server_Config *config = Server_Config::instance ();
+    {
+        std::lock_guard<std::mutex> guard (state_lock_);
+        backoff_msec_ = config->get_int ("auth_backoff_ms", DEFAULT_AUTH_BACKOFF_MSEC);
+        backoff_max_msec_ = config->get_int ("auth_backoff_max_ms", DEFAULT_AUTH_BACKOFF_MAX_MSEC);
+        cache_sec_ = config->get_int ("auth_cache_sec", DEFAULT_AUTH_CACHE_SEC);
+    }
+    long threads = config->get_int ("auth_threads", DEFAULT_AUTH_THREADS);
+
+    std::lock_guard<std::mutex> guard (lock_);
+    if (!workers_.empty ())
+        return 0;
+    is_stopping_ = false;
+    try
+    {
+        for (long i = 0; i < threads; ++i)
+            workers_.emplace_back (&Auth_Pool::work_loop, this);
+    }
+    catch (const std::system_error &)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "start auth worker failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int Auth_Pool::verify (Command_Handler *handler, const std::string &client_addr,
+                       const std::string &username, const std::string &password)
+{
+    Auth_Job job;
+    job.handler = handler;
+    job.client_addr = client_addr;
+    job.username = username;
+    {
+        // the user may have been removed by a reload since USER
+        Credential_Store::Reader reader;
+        const User_Entry *entry = reader.find (username);
+        if (entry != nullptr)
+            job.stored = entry->password;
+    }
+    if (job.stored.empty ())
+    {
+        record_result (job, Auth_Results::AUTH_FAILED);
+        return Auth_Results::AUTH_FAILED;
+    }
+    job.password = password;
+
+    int result = check_shortcuts (job);
+    if (result != Auth_Results::AUTH_PENDING)
+    {
+        OPENSSL_cleanse (&job.password[0], job.password.length ());
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!workers_.empty ())
+        {
+            if (queue_.size () >= MAX_AUTH_QUEUE)
+            {
+                OPENSSL_cleanse (&job.password[0], job.password.length ());
+                return Auth_Results::AUTH_BUSY;
+            }
+            handler->add_reference ();
+            queue_.push_back (std::move (job));
+            ready_.notify_one ();
+            return Auth_Results::AUTH_PENDING;
+        }
+    }
+
+    // no workers, as in tests and benchmarks
+    result = User_Inf::verify_password (job.password, job.stored);
+    Metrics::instance ()->add (Metric_Counters::METRIC_AUTH_VERIFICATIONS);
+    record_result (job, result);
+    OPENSSL_cleanse (&job.password[0], job.password.length ());
+    return result;
+}
+
+int Auth_Pool::check_shortcuts (const Auth_Job &job)
+{
+    Clock::time_point now = Clock::now ();
+    std::lock_guard<std::mutex> guard (state_lock_);
+    auto backoff_ite = backoff_.find (job.client_addr);
+    if (backoff_ite != backoff_.end () && now < backoff_ite->second.until)
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_AUTH_BACKOFFS);
+        return Auth_Results::AUTH_FAILED;
+    }
+
+    auto cache_ite = cache_.find (job.username);
+    if (cache_ite != cache_.end () && now < cache_ite->second.expires &&
+        cache_ite->second.digest == cache_digest (job.password, job.stored))
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_AUTH_CACHE_HITS);
+        if (backoff_ite != backoff_.end ())
+            backoff_.erase (backoff_ite);
+        return Auth_Results::AUTH_OK;
+    }
+    return Auth_Results::AUTH_PENDING;
+}
+
+void Auth_Pool::record_result (const Auth_Job &job, int result)
+{
+    Clock::time_point now = Clock::now ();
+    std::lock_guard<std::mutex> guard (state_lock_);
+    if (result == Auth_Results::AUTH_OK)
+    {
+        backoff_.erase (job.client_addr);
+        if (cache_sec_ <= 0)
+            return;
+        if (cache_.size () >= MAX_AUTH_CACHE && cache_.find (job.username) == cache_.end ())
+        {
+            for (auto ite = cache_.begin (); ite != cache_.end (); )
+                ite = (now >= ite->second.expires ? cache_.erase (ite) : std::next (ite));
+            if (cache_.size () >= MAX_AUTH_CACHE)
+                return;
+        }
+        std::string digest = cache_digest (job.password, job.stored);
+        if (digest.empty ())
+            return;
+        Cache_Entry &entry = cache_[job.username];
+        entry.digest = digest;
+        entry.expires = now + std::chrono::seconds (cache_sec_);
+        return;
+    }
+
+    if (backoff_msec_ <= 0)
+        return;
+    auto ite = backoff_.find (job.client_addr);
+    if (ite == backoff_.end ())
+    {
+        if (backoff_.size () >= MAX_AUTH_BACKOFF_ADDRS)
+        {
+            Clock::time_point forget = now - std::chrono::milliseconds (backoff_max_msec_);
+            for (auto old = backoff_.begin (); old != backoff_.end (); )
+                old = (old->second.until <= forget ? backoff_.erase (old) : std::next (old));
+            if (backoff_.size () >= MAX_AUTH_BACKOFF_ADDRS)
+                return;
+        }
+        ite = backoff_.emplace (job.client_addr, Backoff_Entry { 0, now }).first;
+    }
+    // an address quiet for the longest refusal starts over
+    if (now - ite->second.until > std::chrono::milliseconds (backoff_max_msec_))
+        ite->second.failures = 0;
+    int shift = std::min (ite->second.failures, 20);
+    long delay_msec = std::min (backoff_msec_ << shift, backoff_max_msec_);
+    ++ite->second.failures;
+    ite->second.until = now + std::chrono::milliseconds (delay_msec);
+}
+
+std::string Auth_Pool::cache_digest (const std::string &password, const std::string &stored)
+{
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    unsigned int length = 0;
+    EVP_MD_CTX *md = EVP_MD_CTX_new ();
+    bool is_done = (md != nullptr &&
+                    EVP_DigestInit_ex (md, EVP_sha256 (), nullptr) == 1 &&
+                    EVP_DigestUpdate (md, stored.c_str (), stored.length () + 1) == 1 &&
+                    EVP_DigestUpdate (md, password.c_str (), password.length ()) == 1 &&
+                    EVP_DigestFinal_ex (md, hash, &length) == 1);
+    EVP_MD_CTX_free (md);
+    // an empty digest is never cached
+    return is_done ? std::string ((const char *)hash, length) : std::string ();
+}
+
+void Auth_Pool::work_loop ()
+{
+    std::unique_lock<std::mutex> guard (lock_);
+    while (true)
+    {
+        ready_.wait (guard, [this] { return is_stopping_ || !queue_.empty (); });
+        if (is_stopping_)
+            break;
+        Auth_Job job = std::move (queue_.front ());
+        queue_.pop_front ();
+        guard.unlock ();
+
+        int result = User_Inf::verify_password (job.password, job.stored);
+        Metrics::instance ()->add (Metric_Counters::METRIC_AUTH_VERIFICATIONS);
+        record_result (job, result);
+        OPENSSL_cleanse (&job.password[0], job.password.length ());
+        job.handler->auth_complete (result);
+        job.handler->remove_reference ();
+
+        guard.lock ();
+    }
+}
+
+void Auth_Pool::close ()
+{
+    std::vector<std::thread> workers;
+    std::deque<Auth_Job> queue;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        is_stopping_ = true;
+        workers.swap (workers_);
+        queue.swap (queue_);
+    }
+    ready_.notify_all ();
+    for (std::thread &worker : workers)
+        worker.join ();
+    for (Auth_Job &job : queue)
+        job.handler->remove_reference ();
+}
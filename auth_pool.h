@@ -0,0 +1,151 @@
+#ifndef AUTH_POOL_H
+#define AUTH_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define DEFAULT_AUTH_THREADS 2
+#define MAX_AUTH_QUEUE 256
+#define DEFAULT_AUTH_BACKOFF_MSEC 500
+#define DEFAULT_AUTH_BACKOFF_MAX_MSEC 30000
+#define DEFAULT_AUTH_CACHE_SEC 300
+#define MAX_AUTH_CACHE 4096
+#define MAX_AUTH_BACKOFF_ADDRS 65536
+
+class Command_Handler;
+
+enum Auth_Results
+{
+    AUTH_OK = 0,        // password correct
+    AUTH_FAILED = -1,   // password wrong, user unknown or address backing off
+    AUTH_PENDING = 1,   // queued, Command_Handler::auth_complete () is called later
+    AUTH_BUSY = 2,      // queue full
+};
+
+/**
+ * Verifies passwords on worker threads so the slow password hash never runs
+ * on the event loop. Recent successful verifications are cached per user,
+ * keyed on the stored hash so a changed password misses, and an address
+ * whose logins keep failing is refused without hashing for a doubling delay.
+ */
+class Auth_Pool
+{
+public:
+    /**
+     * @brief Get the process-wide auth pool
+     *
+     * @return Auth_Pool*
+     */
+    static Auth_Pool *instance ();
+
+    /**
+     * @brief Read the settings from Server_Config and start the workers,
+     *        passwords are verified inline until then
+     *
+     * @return int , 0 for success, -1 for failure
+     */
+    int open ();
+
+    /**
+     * @brief Verify the password of a user logging in from an address
+     *
+     * @param handler the session, referenced until auth_complete () returns
+     * @param client_addr client's ip address
+     * @param username
+     * @param password
+     * @return int , see enum Auth_Results
+     */
+    int verify (Command_Handler *handler, const std::string &client_addr,
+                const std::string &username, const std::string &password);
+
+    /**
+     * @brief Stop the workers, queued verifications are dropped
+     */
+    void close ();
+
+    ~Auth_Pool () { close (); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Auth_Job
+    {
+        Command_Handler *handler;   // session waiting for the result
+        std::string client_addr;    // client's ip address
+        std::string username;       // user logging in
+        std::string password;       // password received
+        std::string stored;         // password hash from the credential store
+    };
+
+    struct Backoff_Entry
+    {
+        int failures;               // failed logins in a row
+        Clock::time_point until;    // logins are refused until then
+    };
+
+    struct Cache_Entry
+    {
+        std::string digest;         // cache_digest () of the verified password
+        Clock::time_point expires;  // entry is ignored from then
+    };
+
+    Auth_Pool () :
+        is_stopping_ (false),
+        backoff_msec_ (DEFAULT_AUTH_BACKOFF_MSEC),
+        backoff_max_msec_ (DEFAULT_AUTH_BACKOFF_MAX_MSEC),
+        cache_sec_ (DEFAULT_AUTH_CACHE_SEC)
+    {}
+
+    /**
+     * @brief Body of a worker thread
+     */
+    void work_loop ();
+
+    /**
+     * @brief Update the cache and the backoff of the address with a result
+     *
+     * @param job the verified login
+     * @param result AUTH_OK or AUTH_FAILED
+     */
+    void record_result (const Auth_Job &job, int result);
+
+    /**
+     * @brief Check the backoff and the cache before hashing
+     *
+     * @param job the login to verify
+     * @return int , AUTH_OK for a cache hit, AUTH_FAILED for backing off,
+     *               AUTH_PENDING for needing the hash
+     */
+    int check_shortcuts (const Auth_Job &job);
+
+    /**
+     * @brief Fast digest of a password bound to its stored hash, kept in the
+     *        cache instead of the password
+     *
+     * @param password
+     * @param stored
+     * @return std::string , empty for failure
+     */
+    static std::string cache_digest (const std::string &password, const std::string &stored);
+
+    std::mutex lock_;                       // guards queue_ and is_stopping_
+    std::condition_variable ready_;         // signaled when a job is queued or on close
+    std::deque<Auth_Job> queue_;            // logins waiting for a worker
+    bool is_stopping_;                      // workers exit when set
+    std::vector<std::thread> workers_;      // worker threads
+
+    std::mutex state_lock_;                 // guards backoff_ and cache_
+    std::unordered_map<std::string, Backoff_Entry> backoff_;   // failed logins by address
+    std::unordered_map<std::string, Cache_Entry> cache_;       // verified logins by user
+    long backoff_msec_;                     // refusal after the first failure, doubled by each next one
+    long backoff_max_msec_;                 // longest refusal
+    long cache_sec_;                        // lifetime of a cache entry, 0 disables the cache
+};
+
+#endif
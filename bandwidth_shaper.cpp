@@ -0,0 +1,73 @@
+#include "bandwidth_shaper.h"
+#include "server_config.h"
+
+#include <algorithm>
+
+Bandwidth_Shaper *Bandwidth_Shaper::instance ()
+{
+    static Bandwidth_Shaper shaper;
+    return &shaper;
+}
+
+void Bandwidth_Shaper::configure ()
+{
+    Server_Config *config = Server_Config::instance ();
+    global_.set_rate (config->get_int ("global_rate_limit", 0));
+    session_rate_ = config->get_int ("session_rate_limit", 0);
+}
+
+std::shared_ptr<Token_Bucket> Bandwidth_Shaper::get_user_bucket (const std::string &username, long rate)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    std::shared_ptr<Token_Bucket> &bucket = user_buckets_[username];
+    auto rate_ite = user_rates_.find (username);
+    if (rate_ite != user_rates_.end ())
+        rate = rate_ite->second;
+    if (!bucket)
+        bucket = std::make_shared<Token_Bucket> (rate);
+    else if (bucket->get_rate () != rate)
+        bucket->set_rate (rate);
+    return bucket;
+}
+
+std::shared_ptr<Token_Bucket> Bandwidth_Shaper::new_session_bucket ()
+{
+    return std::make_shared<Token_Bucket> (session_rate_);
+}
+
+void Bandwidth_Shaper::set_user_rate (const std::string &username, long rate)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    user_rates_[username] = rate;
+    auto ite = user_buckets_.find (username);
+    if (ite != user_buckets_.end ())
+        ite->second->set_rate (rate);
+}
+
+size_t Bandwidth_Shaper::allowance (Token_Bucket *user, Token_Bucket *session, size_t wanted, long &wait_usec)
+{
+    Token_Bucket *buckets[] = { &global_, user, session };
+    long allowed = (long)wanted;
+    long min_grant = std::min (allowed, (long)MIN_GRANT_SIZE);
+    wait_usec = 0;
+    for (Token_Bucket *bucket : buckets)
+    {
+        if (bucket == nullptr)
+            continue;
+        long tokens = bucket->available ();
+        if (tokens < min_grant)
+            wait_usec = std::max (wait_usec, std::max (1L, bucket->usec_until (min_grant)));
+        else
+            allowed = std::min (allowed, tokens);
+    }
+    return wait_usec > 0 ? 0 : (size_t)allowed;
+}
+
+void Bandwidth_Shaper::charge (Token_Bucket *user, Token_Bucket *session, size_t bytes)
+{
+    global_.take ((long)bytes);
+    if (user != nullptr)
+        user->take ((long)bytes);
+    if (session != nullptr)
+        session->take ((long)bytes);
+}
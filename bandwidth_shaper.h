@@ -0,0 +1,100 @@
+#ifndef BANDWIDTH_SHAPER_H
+#define BANDWIDTH_SHAPER_H
+
+#include "token_bucket.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define MIN_GRANT_SIZE 4096
+
+class Bandwidth_Shaper
+{
+public:
+    /**
+     * @brief Get the process-wide shaper
+     * 
+     * @return Bandwidth_Shaper* 
+     */
+    static Bandwidth_Shaper *instance ();
+
+    /**
+     * @brief Read global_rate_limit and session_rate_limit (bytes per second,
+     *        0 for unlimited) from Server_Config
+     */
+    void configure ();
+
+    /**
+     * @brief Get the bucket shared by all sessions of a user, create it on first login
+     * 
+     * @param username 
+     * @param rate rate from User_Inf, ignored when the rate has been changed at runtime
+     * @return std::shared_ptr<Token_Bucket> 
+     */
+    std::shared_ptr<Token_Bucket> get_user_bucket (const std::string &username, long rate);
+
+    /**
+     * @brief Create a bucket for a new session with the configured session rate
+     * 
+     * @return std::shared_ptr<Token_Bucket> 
+     */
+    std::shared_ptr<Token_Bucket> new_session_bucket ();
+
+    /**
+     * @brief Get the configured session rate
+     * 
+     * @return long bytes per second, 0 for unlimited
+     */
+    long get_session_rate () const { return session_rate_; }
+
+    /**
+     * @brief Change the global rate at runtime
+     * 
+     * @param rate bytes per second, 0 for unlimited
+     */
+    void set_global_rate (long rate) { global_.set_rate (rate); }
+
+    /**
+     * @brief Change a user's rate at runtime, it overrides User_Inf until restart
+     * 
+     * @param username 
+     * @param rate bytes per second, 0 for unlimited
+     */
+    void set_user_rate (const std::string &username, long rate);
+
+    /**
+     * @brief How many bytes a transfer may move now, limited by the global,
+     *        the user and the session buckets. Nothing is taken, call charge ()
+     *        with what was really moved.
+     * 
+     * @param user user bucket, may be null
+     * @param session session bucket, may be null
+     * @param wanted bytes the transfer wants to move
+     * @param wait_usec set to how long to sleep when 0 is returned
+     * @return size_t allowed bytes, 0 when the transfer must sleep
+     */
+    size_t allowance (Token_Bucket *user, Token_Bucket *session, size_t wanted, long &wait_usec);
+
+    /**
+     * @brief Take moved bytes from the global, the user and the session buckets
+     * 
+     * @param user user bucket, may be null
+     * @param session session bucket, may be null
+     * @param bytes moved bytes
+     */
+    void charge (Token_Bucket *user, Token_Bucket *session, size_t bytes);
+
+private:
+    Bandwidth_Shaper () : session_rate_ (0) {}
+
+    Token_Bucket global_;   // shared by all transfers
+    long session_rate_;     // default rate of a new session
+
+    std::mutex lock_;       // protects the maps below
+    std::unordered_map<std::string, std::shared_ptr<Token_Bucket>> user_buckets_;
+    std::unordered_map<std::string, long> user_rates_;  // rates changed at runtime
+};
+
+#endif
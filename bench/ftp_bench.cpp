@@ -0,0 +1,963 @@
+/**
+ * Loopback load generator for my_ftp_server.
+ * Drives many simulated sessions with a weighted mix of operations and
+ * reports throughput, per-command latency percentiles and CPU per GB.
+ * 
+ * usage: ftp_bench [--host H] [--port P] [--in-process] [--sessions N] [--threads T]
+ *                  [--duration SEC] [--user U] [--pass P] [--retr-file PATH]
+ *                  [--list-dir PATH] [--stor-dir PATH] [--stor-size BYTES]
+ *                  [--idle-msec MSEC] [--mix churn=1,retr=4,stor=1,list=1,idle=1]
+ *                  [--server-pid PID]
+ */
+#include "async_log.h"
+#include "ftp_server.h"
+#include "metrics.h"
+#include "server_config.h"
+
+#include "ace/Reactor.h"
+#include "ace/TP_Reactor.h"
+#include "ace/Thread_Manager.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_BUFFER_SIZE 65536
+#define BENCH_RECONNECT_MSEC 100
+#define BENCH_SERVER_THREADS 4
+
+typedef std::chrono::steady_clock Clock;
+
+enum Bench_Ops
+{
+    OP_CHURN = 0,   // QUIT, reconnect and log in again
+    OP_RETR = 1,    // PASV + RETR
+    OP_STOR = 2,    // PASV + STOR
+    OP_LIST = 3,    // PASV + LIST
+    OP_IDLE = 4,    // hold the session without traffic
+    BENCH_OPS = 5,
+};
+
+static const char *op_names[BENCH_OPS] = { "churn", "retr", "stor", "list", "idle" };
+
+enum Bench_Latencies
+{
+    LAT_CONNECT = 0,    // connect to greeting
+    LAT_USER = 1,
+    LAT_PASS = 2,
+    LAT_PASV = 3,
+    LAT_RETR = 4,       // command to the final reply, including the data
+    LAT_STOR = 5,
+    LAT_LIST = 6,
+    LAT_QUIT = 7,
+    BENCH_LATENCIES = 8,
+};
+
+static const char *latency_names[BENCH_LATENCIES] =
+    { "connect", "user", "pass", "pasv", "retr", "stor", "list", "quit" };
+
+enum Bench_States
+{
+    BENCH_CLOSED = 0,
+    BENCH_CONNECTING = 1,
+    BENCH_GREETING = 2,
+    BENCH_USER = 3,
+    BENCH_PASS = 4,
+    BENCH_QUIT = 5,
+    BENCH_PASV = 6,
+    BENCH_TRANSFER_CMD = 7,     // waiting for 150
+    BENCH_TRANSFER = 8,         // data moving, waiting for the final reply
+    BENCH_IDLE = 9,
+    BENCH_RECONNECT = 10,       // waiting to connect again after a failure
+};
+
+struct Bench_Options
+{
+    std::string host;
+    int port;
+    bool is_in_process;
+    int sessions;
+    int threads;
+    int duration;
+    std::string user;
+    std::string pass;
+    std::string retr_file;
+    std::string list_dir;
+    std::string stor_dir;
+    long long stor_size;
+    int idle_msec;
+    int mix[BENCH_OPS];
+    int server_pid;
+
+    Bench_Options () :
+        host ("127.0.0.1"), port (2121), is_in_process (false), sessions (100), threads (4),
+        duration (10), user ("test"), pass ("test"), stor_dir ("/tmp"), stor_size (1 << 20),
+        idle_msec (1000), mix { 1, 4, 1, 1, 1 }, server_pid (0)
+    {
+    }
+};
+
+struct Bench_Session;
+
+/**
+ * One socket of a session, registered to epoll.
+ */
+struct Bench_Endpoint
+{
+    Bench_Session *session;
+    int fd;
+    bool is_data;
+};
+
+/**
+ * State of one simulated client.
+ */
+struct Bench_Session
+{
+    Bench_Endpoint ctrl;            // control connection
+    Bench_Endpoint data;            // data connection of the current transfer
+    int id;
+    int state;                      // enum Bench_States
+    int op;                         // enum Bench_Ops in progress
+    std::string reply_buffer;       // partial control replies
+    std::string multi_line_code;    // code of a multi-line reply being read
+    long long stor_left;            // bytes of STOR still to write
+    bool is_data_done;              // data connection reached EOF or was fully written
+    bool is_reply_done;             // final reply of the transfer received
+    int latency;                    // enum Bench_Latencies being measured
+    Clock::time_point sent_at;      // when the measured command was sent
+};
+
+/**
+ * Per-thread results, merged after the run.
+ */
+struct Bench_Results
+{
+    std::vector<unsigned long long> latency[BENCH_LATENCIES];
+    unsigned long long latency_count[BENCH_LATENCIES];
+    unsigned long long latency_max[BENCH_LATENCIES];
+    unsigned long long ops[BENCH_OPS];
+    unsigned long long errors;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+
+    Bench_Results () : errors (0), bytes_in (0), bytes_out (0)
+    {
+        for (int i = 0; i < BENCH_LATENCIES; ++i)
+        {
+            latency[i].assign (HISTOGRAM_BUCKETS, 0);
+            latency_count[i] = 0;
+            latency_max[i] = 0;
+        }
+        for (int i = 0; i < BENCH_OPS; ++i)
+            ops[i] = 0;
+    }
+
+    void merge (const Bench_Results &other)
+    {
+        for (int i = 0; i < BENCH_LATENCIES; ++i)
+        {
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+                latency[i][bucket] += other.latency[i][bucket];
+            latency_count[i] += other.latency_count[i];
+            latency_max[i] = std::max (latency_max[i], other.latency_max[i]);
+        }
+        for (int i = 0; i < BENCH_OPS; ++i)
+            ops[i] += other.ops[i];
+        errors += other.errors;
+        bytes_in += other.bytes_in;
+        bytes_out += other.bytes_out;
+    }
+};
+
+/**
+ * Drives a share of the sessions on its own epoll instance.
+ */
+class Bench_Worker
+{
+public:
+    Bench_Worker (const Bench_Options &options, const sockaddr_in &server_addr, int first_id, int sessions) :
+        options_ (options),
+        server_addr_ (server_addr),
+        epoll_fd_ (-1),
+        sessions_ (sessions),
+        random_ (first_id + 1),
+        buffer_ (BENCH_BUFFER_SIZE, 0)
+    {
+        for (int i = 0; i < sessions; ++i)
+            sessions_[i].id = first_id + i;
+        mix_total_ = 0;
+        for (int i = 0; i < BENCH_OPS; ++i)
+            mix_total_ += options_.mix[i];
+    }
+
+    /**
+     * @brief Run the sessions until the deadline
+     * 
+     * @param deadline when to stop issuing operations
+     */
+    void run (Clock::time_point deadline);
+
+    const Bench_Results &get_results () const { return results_; }
+
+private:
+    void start_session (Bench_Session &session);
+    void close_session (Bench_Session &session, bool is_error);
+    void close_data (Bench_Session &session);
+    void next_op (Bench_Session &session);
+    int send_command (Bench_Session &session, const std::string &command, int latency);
+    void record (Bench_Session &session);
+    void handle_ctrl (Bench_Session &session, uint32_t events);
+    void handle_data (Bench_Session &session, uint32_t events);
+    void handle_reply (Bench_Session &session, int code, const std::string &line);
+    int open_data (Bench_Session &session, const std::string &line);
+    void finish_transfer (Bench_Session &session);
+    void finish_quit (Bench_Session &session);
+    void wake_at (Bench_Session &session, int msec, int state);
+
+    const Bench_Options &options_;
+    sockaddr_in server_addr_;
+    int epoll_fd_;
+    std::vector<Bench_Session> sessions_;
+    std::multimap<Clock::time_point, Bench_Session *> timers_;
+    std::mt19937 random_;
+    int mix_total_;
+    std::string buffer_;
+    Bench_Results results_;
+    Clock::time_point deadline_;
+};
+
+static int set_nonblock (int fd)
+{
+    int flags = fcntl (fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int connect_nonblock (const sockaddr_in &addr)
+{
+    int fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    int one = 1;
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    if (set_nonblock (fd) == -1 ||
+        (connect (fd, (const sockaddr *)&addr, sizeof (addr)) == -1 && errno != EINPROGRESS))
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+void Bench_Worker::run (Clock::time_point deadline)
+{
+    deadline_ = deadline;
+    epoll_fd_ = epoll_create1 (0);
+    if (epoll_fd_ == -1)
+    {
+        perror ("epoll_create1");
+        return;
+    }
+    for (auto &session : sessions_)
+        start_session (session);
+
+    epoll_event events[BENCH_MAX_EVENTS];
+    while (true)
+    {
+        Clock::time_point now = Clock::now ();
+        while (!timers_.empty () && timers_.begin ()->first <= now)
+        {
+            Bench_Session *session = timers_.begin ()->second;
+            timers_.erase (timers_.begin ());
+            if (session->state == Bench_States::BENCH_IDLE)
+            {
+                ++results_.ops[Bench_Ops::OP_IDLE];
+                next_op (*session);
+            }
+            else if (session->state == Bench_States::BENCH_RECONNECT)
+                start_session (*session);
+        }
+        if (now >= deadline_)
+            break;
+
+        int timeout_msec = (int)std::chrono::duration_cast<std::chrono::milliseconds> (deadline_ - now).count ();
+        if (!timers_.empty ())
+        {
+            int timer_msec = (int)std::chrono::duration_cast<std::chrono::milliseconds> (
+                timers_.begin ()->first - now).count ();
+            timeout_msec = std::min (timeout_msec, timer_msec);
+        }
+        int n = epoll_wait (epoll_fd_, events, BENCH_MAX_EVENTS, std::max (timeout_msec, 0) + 1);
+        if (n == -1 && errno != EINTR)
+        {
+            perror ("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            Bench_Endpoint *endpoint = static_cast<Bench_Endpoint *> (events[i].data.ptr);
+            Bench_Session &session = *endpoint->session;
+            // an earlier event of this round may have closed the endpoint
+            if (endpoint->fd == -1)
+                continue;
+            if (endpoint->is_data)
+                handle_data (session, events[i].events);
+            else
+                handle_ctrl (session, events[i].events);
+        }
+    }
+
+    for (auto &session : sessions_)
+        close_session (session, false);
+    close (epoll_fd_);
+}
+
+void Bench_Worker::start_session (Bench_Session &session)
+{
+    session.ctrl.session = &session;
+    session.ctrl.is_data = false;
+    session.data.session = &session;
+    session.data.is_data = true;
+    session.data.fd = -1;
+    session.reply_buffer.clear ();
+    session.multi_line_code.clear ();
+    session.ctrl.fd = connect_nonblock (server_addr_);
+    if (session.ctrl.fd == -1)
+    {
+        ++results_.errors;
+        wake_at (session, BENCH_RECONNECT_MSEC, Bench_States::BENCH_RECONNECT);
+        return;
+    }
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = &session.ctrl;
+    epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, session.ctrl.fd, &event);
+    session.state = Bench_States::BENCH_CONNECTING;
+    session.latency = Bench_Latencies::LAT_CONNECT;
+    session.sent_at = Clock::now ();
+}
+
+void Bench_Worker::close_data (Bench_Session &session)
+{
+    if (session.data.fd == -1)
+        return;
+    epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, session.data.fd, nullptr);
+    close (session.data.fd);
+    session.data.fd = -1;
+}
+
+void Bench_Worker::close_session (Bench_Session &session, bool is_error)
+{
+    if (is_error)
+        ++results_.errors;
+    close_data (session);
+    if (session.ctrl.fd != -1)
+    {
+        epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, session.ctrl.fd, nullptr);
+        close (session.ctrl.fd);
+        session.ctrl.fd = -1;
+    }
+    session.state = Bench_States::BENCH_CLOSED;
+    if (is_error && Clock::now () < deadline_)
+        wake_at (session, BENCH_RECONNECT_MSEC, Bench_States::BENCH_RECONNECT);
+}
+
+void Bench_Worker::wake_at (Bench_Session &session, int msec, int state)
+{
+    session.state = state;
+    timers_.emplace (Clock::now () + std::chrono::milliseconds (msec), &session);
+}
+
+int Bench_Worker::send_command (Bench_Session &session, const std::string &command, int latency)
+{
+    std::string line = command + "\r\n";
+    session.latency = latency;
+    session.sent_at = Clock::now ();
+    if (send (session.ctrl.fd, line.data (), line.size (), MSG_NOSIGNAL) != (ssize_t)line.size ())
+    {
+        close_session (session, true);
+        return -1;
+    }
+    return 0;
+}
+
+void Bench_Worker::record (Bench_Session &session)
+{
+    unsigned long long usec = std::chrono::duration_cast<std::chrono::microseconds> (
+        Clock::now () - session.sent_at).count ();
+    ++results_.latency[session.latency][histogram_bucket (usec)];
+    ++results_.latency_count[session.latency];
+    results_.latency_max[session.latency] = std::max (results_.latency_max[session.latency], usec);
+}
+
+void Bench_Worker::next_op (Bench_Session &session)
+{
+    if (Clock::now () >= deadline_)
+        return;
+    int pick = std::uniform_int_distribution<int> (0, mix_total_ - 1) (random_);
+    int op = 0;
+    while (pick >= options_.mix[op])
+        pick -= options_.mix[op++];
+    session.op = op;
+
+    switch (op)
+    {
+    case Bench_Ops::OP_CHURN:
+        session.state = Bench_States::BENCH_QUIT;
+        send_command (session, "QUIT", Bench_Latencies::LAT_QUIT);
+        break;
+    case Bench_Ops::OP_IDLE:
+        wake_at (session, options_.idle_msec, Bench_States::BENCH_IDLE);
+        break;
+    default:
+        session.state = Bench_States::BENCH_PASV;
+        send_command (session, "PASV", Bench_Latencies::LAT_PASV);
+        break;
+    }
+}
+
+void Bench_Worker::handle_ctrl (Bench_Session &session, uint32_t events)
+{
+    if (session.state == Bench_States::BENCH_CONNECTING)
+    {
+        int error = 0;
+        socklen_t len = sizeof (error);
+        if (getsockopt (session.ctrl.fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+        {
+            close_session (session, true);
+            return;
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &session.ctrl;
+        epoll_ctl (epoll_fd_, EPOLL_CTL_MOD, session.ctrl.fd, &event);
+        session.state = Bench_States::BENCH_GREETING;
+        if ((events & EPOLLIN) == 0)
+            return;
+    }
+
+    ssize_t n = recv (session.ctrl.fd, &buffer_[0], buffer_.size (), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        // the server closes the connection on QUIT
+        if (session.state == Bench_States::BENCH_QUIT)
+            finish_quit (session);
+        else
+            close_session (session, true);
+        return;
+    }
+    session.reply_buffer.append (buffer_, 0, n);
+
+    size_t pos;
+    while (session.ctrl.fd != -1 && (pos = session.reply_buffer.find ("\r\n")) != std::string::npos)
+    {
+        std::string line = session.reply_buffer.substr (0, pos);
+        session.reply_buffer.erase (0, pos + 2);
+        if (line.size () < 3)
+            continue;
+        std::string code = line.substr (0, 3);
+        if (!session.multi_line_code.empty ())
+        {
+            // inside a multi-line reply, only "code " ends it
+            if (code != session.multi_line_code || (line.size () > 3 && line[3] == '-'))
+                continue;
+            session.multi_line_code.clear ();
+        }
+        else if (line.size () > 3 && line[3] == '-')
+        {
+            session.multi_line_code = code;
+            continue;
+        }
+        handle_reply (session, std::atoi (code.c_str ()), line);
+    }
+}
+
+void Bench_Worker::handle_reply (Bench_Session &session, int code, const std::string &line)
+{
+    switch (session.state)
+    {
+    case Bench_States::BENCH_GREETING:
+        if (code != 220)
+        {
+            close_session (session, true);
+            return;
+        }
+        record (session);
+        session.state = Bench_States::BENCH_USER;
+        send_command (session, "USER " + options_.user, Bench_Latencies::LAT_USER);
+        return;
+
+    case Bench_States::BENCH_USER:
+        if (code != 331)
+        {
+            close_session (session, true);
+            return;
+        }
+        record (session);
+        session.state = Bench_States::BENCH_PASS;
+        send_command (session, "PASS " + options_.pass, Bench_Latencies::LAT_PASS);
+        return;
+
+    case Bench_States::BENCH_PASS:
+        if (code != 230)
+        {
+            close_session (session, true);
+            return;
+        }
+        record (session);
+        next_op (session);
+        return;
+
+    case Bench_States::BENCH_QUIT:
+        finish_quit (session);
+        return;
+
+    case Bench_States::BENCH_PASV:
+        if (code != 227)
+        {
+            close_session (session, true);
+            return;
+        }
+        record (session);
+        if (open_data (session, line) == -1)
+        {
+            close_session (session, true);
+            return;
+        }
+        session.state = Bench_States::BENCH_TRANSFER_CMD;
+        if (session.op == Bench_Ops::OP_RETR)
+            send_command (session, "RETR " + options_.retr_file, Bench_Latencies::LAT_RETR);
+        else if (session.op == Bench_Ops::OP_STOR)
+            send_command (session,
+                          "STOR " + options_.stor_dir + "/ftp_bench_" + std::to_string (session.id),
+                          Bench_Latencies::LAT_STOR);
+        else
+            send_command (session,
+                          options_.list_dir.empty () ? "LIST" : "LIST " + options_.list_dir,
+                          Bench_Latencies::LAT_LIST);
+        return;
+
+    case Bench_States::BENCH_TRANSFER_CMD:
+        if (code != 150)
+        {
+            // refused transfer, the session goes on
+            ++results_.errors;
+            close_data (session);
+            next_op (session);
+            return;
+        }
+        session.state = Bench_States::BENCH_TRANSFER;
+        if (session.op == Bench_Ops::OP_STOR && session.data.fd != -1)
+        {
+            epoll_event event;
+            event.events = EPOLLOUT;
+            event.data.ptr = &session.data;
+            epoll_ctl (epoll_fd_, EPOLL_CTL_MOD, session.data.fd, &event);
+        }
+        return;
+
+    case Bench_States::BENCH_TRANSFER:
+        if (code / 100 != 2)
+        {
+            ++results_.errors;
+            close_data (session);
+            next_op (session);
+            return;
+        }
+        session.is_reply_done = true;
+        finish_transfer (session);
+        return;
+
+    default:
+        close_session (session, true);
+        return;
+    }
+}
+
+int Bench_Worker::open_data (Bench_Session &session, const std::string &line)
+{
+    size_t pos = line.find ('(');
+    std::string numbers = line.substr (pos == std::string::npos ? 4 : pos + 1);
+    std::replace (numbers.begin (), numbers.end (), ',', ' ');
+    std::istringstream param (numbers);
+    int h1, h2, h3, h4, p1, p2;
+    if (!(param >> h1 >> h2 >> h3 >> h4 >> p1 >> p2))
+        return -1;
+
+    // the data connection goes to --host, the address in the reply may not be reachable
+    sockaddr_in data_addr = server_addr_;
+    data_addr.sin_port = htons ((uint16_t)((p1 << 8) + p2));
+    session.data.fd = connect_nonblock (data_addr);
+    if (session.data.fd == -1)
+        return -1;
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &session.data;
+    epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, session.data.fd, &event);
+    session.stor_left = options_.stor_size;
+    session.is_data_done = false;
+    session.is_reply_done = false;
+    return 0;
+}
+
+void Bench_Worker::handle_data (Bench_Session &session, uint32_t events)
+{
+    if (session.op == Bench_Ops::OP_STOR)
+    {
+        if ((events & EPOLLOUT) == 0 || session.state != Bench_States::BENCH_TRANSFER)
+            return;
+        while (session.stor_left > 0)
+        {
+            size_t chunk = (size_t)std::min<long long> (session.stor_left, buffer_.size ());
+            ssize_t n = send (session.data.fd, buffer_.data (), chunk, MSG_NOSIGNAL);
+            if (n < 0 && errno == EAGAIN)
+                return;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                close_session (session, true);
+                return;
+            }
+            session.stor_left -= n;
+            results_.bytes_out += n;
+        }
+        // closing the data connection ends the upload
+        close_data (session);
+        session.is_data_done = true;
+        finish_transfer (session);
+        return;
+    }
+
+    while (true)
+    {
+        ssize_t n = recv (session.data.fd, &buffer_[0], buffer_.size (), 0);
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            close_session (session, true);
+            return;
+        }
+        if (n == 0)
+            break;
+        results_.bytes_in += n;
+    }
+    close_data (session);
+    session.is_data_done = true;
+    finish_transfer (session);
+}
+
+void Bench_Worker::finish_quit (Bench_Session &session)
+{
+    record (session);
+    ++results_.ops[Bench_Ops::OP_CHURN];
+    close_session (session, false);
+    if (Clock::now () < deadline_)
+        start_session (session);
+}
+
+void Bench_Worker::finish_transfer (Bench_Session &session)
+{
+    if (!session.is_data_done || !session.is_reply_done)
+        return;
+    record (session);
+    ++results_.ops[session.op];
+    next_op (session);
+}
+
+/**
+ * @brief Estimate a percentile from a histogram
+ * 
+ * @param buckets histogram
+ * @param count number of samples
+ * @param quantile between 0 and 1
+ * @return unsigned long long microseconds
+ */
+static unsigned long long percentile (const std::vector<unsigned long long> &buckets,
+                                      unsigned long long count, double quantile)
+{
+    unsigned long long rank = (unsigned long long)(quantile * count);
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+    {
+        seen += buckets[bucket];
+        if (seen > rank)
+            return histogram_bucket_floor (bucket);
+    }
+    return histogram_bucket_floor (HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * @brief CPU time of a process from /proc
+ * 
+ * @param pid process id
+ * @return double seconds, -1 for failure
+ */
+static double process_cpu_seconds (int pid)
+{
+    std::string path = "/proc/" + std::to_string (pid) + "/stat";
+    FILE *file = fopen (path.c_str (), "r");
+    if (file == nullptr)
+        return -1;
+    char buf[1024];
+    size_t n = fread (buf, 1, sizeof (buf) - 1, file);
+    fclose (file);
+    buf[n] = '\0';
+    // fields after the parenthesized command name, utime and stime are 14th and 15th
+    char *rest = strrchr (buf, ')');
+    if (rest == nullptr)
+        return -1;
+    unsigned long utime = 0, stime = 0;
+    if (sscanf (rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf (_SC_CLK_TCK);
+}
+
+static double self_cpu_seconds ()
+{
+    rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void *server_event_loop (void *arg)
+{
+    ACE_Reactor *reactor = static_cast<ACE_Reactor *> (arg);
+    reactor->run_reactor_event_loop ();
+    return 0;
+}
+
+static int parse_mix (const std::string &text, int *mix)
+{
+    for (int i = 0; i < BENCH_OPS; ++i)
+        mix[i] = 0;
+    std::istringstream items (text);
+    std::string item;
+    while (std::getline (items, item, ','))
+    {
+        size_t pos = item.find ('=');
+        if (pos == std::string::npos)
+            return -1;
+        std::string name = item.substr (0, pos);
+        int i = 0;
+        while (i < BENCH_OPS && name != op_names[i])
+            ++i;
+        if (i == BENCH_OPS)
+            return -1;
+        mix[i] = std::atoi (item.c_str () + pos + 1);
+    }
+    return 0;
+}
+
+static int parse_options (int argc, char *argv[], Bench_Options &options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string key = argv[i];
+        if (key == "--in-process")
+        {
+            options.is_in_process = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return -1;
+        std::string value = argv[++i];
+        if (key == "--host")
+            options.host = value;
+        else if (key == "--port")
+            options.port = std::atoi (value.c_str ());
+        else if (key == "--sessions")
+            options.sessions = std::atoi (value.c_str ());
+        else if (key == "--threads")
+            options.threads = std::atoi (value.c_str ());
+        else if (key == "--duration")
+            options.duration = std::atoi (value.c_str ());
+        else if (key == "--user")
+            options.user = value;
+        else if (key == "--pass")
+            options.pass = value;
+        else if (key == "--retr-file")
+            options.retr_file = value;
+        else if (key == "--list-dir")
+            options.list_dir = value;
+        else if (key == "--stor-dir")
+            options.stor_dir = value;
+        else if (key == "--stor-size")
+            options.stor_size = std::atoll (value.c_str ());
+        else if (key == "--idle-msec")
+            options.idle_msec = std::atoi (value.c_str ());
+        else if (key == "--server-pid")
+            options.server_pid = std::atoi (value.c_str ());
+        else if (key == "--mix")
+        {
+            if (parse_mix (value, options.mix) == -1)
+                return -1;
+        }
+        else
+            return -1;
+    }
+    if (options.retr_file.empty ())
+        options.mix[Bench_Ops::OP_RETR] = 0;
+    int mix_total = 0;
+    for (int i = 0; i < BENCH_OPS; ++i)
+        mix_total += options.mix[i];
+    if (mix_total <= 0 || options.sessions <= 0 || options.threads <= 0 || options.duration <= 0)
+        return -1;
+    options.threads = std::min (options.threads, options.sessions);
+    return 0;
+}
+
+static void report (const Bench_Options &options, const Bench_Results &results,
+                    double seconds, double cpu_seconds, double server_cpu_seconds)
+{
+    unsigned long long total_ops = 0;
+    for (int i = 0; i < BENCH_OPS; ++i)
+        total_ops += results.ops[i];
+    double bytes = (double)(results.bytes_in + results.bytes_out);
+
+    printf ("sessions %d, threads %d, %.1f s\n", options.sessions, options.threads, seconds);
+    printf ("operations %llu (%.1f/s), errors %llu\n", total_ops, total_ops / seconds, results.errors);
+    for (int i = 0; i < BENCH_OPS; ++i)
+        printf ("  %-8s %10llu %10.1f/s\n", op_names[i], results.ops[i], results.ops[i] / seconds);
+    printf ("bytes in %llu, out %llu, %.2f MB/s\n",
+            results.bytes_in, results.bytes_out, bytes / seconds / (1 << 20));
+    printf ("cpu %.2f s (this process%s)", cpu_seconds, options.is_in_process ? ", server included" : "");
+    if (bytes > 0)
+        printf (", %.2f s/GB", cpu_seconds / (bytes / 1e9));
+    printf ("\n");
+    if (server_cpu_seconds >= 0)
+    {
+        printf ("server cpu %.2f s", server_cpu_seconds);
+        if (bytes > 0)
+            printf (", %.2f s/GB", server_cpu_seconds / (bytes / 1e9));
+        printf ("\n");
+    }
+
+    printf ("%-8s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p99 us", "p999 us", "max us");
+    for (int i = 0; i < BENCH_LATENCIES; ++i)
+    {
+        unsigned long long count = results.latency_count[i];
+        if (count == 0)
+            continue;
+        printf ("%-8s %10llu %10llu %10llu %10llu %10llu\n",
+                latency_names[i],
+                count,
+                percentile (results.latency[i], count, 0.5),
+                percentile (results.latency[i], count, 0.99),
+                percentile (results.latency[i], count, 0.999),
+                results.latency_max[i]);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    Bench_Options options;
+    if (parse_options (argc, argv, options) == -1)
+    {
+        fprintf (stderr, "usage: ftp_bench [--host H] [--port P] [--in-process] [--sessions N] "
+                         "[--threads T] [--duration SEC] [--user U] [--pass P] [--retr-file PATH] "
+                         "[--list-dir PATH] [--stor-dir PATH] [--stor-size BYTES] [--idle-msec MSEC] "
+                         "[--mix churn=1,retr=4,stor=1,list=1,idle=1] [--server-pid PID]\n");
+        return 1;
+    }
+
+    sockaddr_in server_addr;
+    memset (&server_addr, 0, sizeof (server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons ((uint16_t)options.port);
+    if (inet_pton (AF_INET, options.host.c_str (), &server_addr.sin_addr) != 1)
+    {
+        fprintf (stderr, "bad host %s\n", options.host.c_str ());
+        return 1;
+    }
+
+    // the server under test shares this process, it reads ./ftpd.conf and ./users.txt
+    std::unique_ptr<ACE_TP_Reactor> tp_reactor;
+    std::unique_ptr<ACE_Reactor> reactor;
+    std::unique_ptr<Ftp_Server> server;
+    if (options.is_in_process)
+    {
+        Server_Config::instance ()->load ();
+        Async_Log::instance ()->set_level (Log_Levels::LOG_LEVEL_ERROR);
+        Async_Log::instance ()->open ();
+        tp_reactor.reset (new ACE_TP_Reactor);
+        reactor.reset (new ACE_Reactor (tp_reactor.get ()));
+        ACE_INET_Addr local_addr;
+        local_addr.set ((u_short)options.port, (ACE_UINT32) INADDR_ANY);
+        server.reset (new Ftp_Server (reactor.get ()));
+        if (server->open (local_addr) == -1)
+        {
+            fprintf (stderr, "open in-process server failed\n");
+            return 1;
+        }
+        ACE_Thread_Manager::instance ()->spawn_n (BENCH_SERVER_THREADS, server_event_loop, reactor.get ());
+    }
+
+    double cpu_begin = self_cpu_seconds ();
+    double server_cpu_begin = options.server_pid > 0 ? process_cpu_seconds (options.server_pid) : -1;
+    Clock::time_point begin = Clock::now ();
+    Clock::time_point deadline = begin + std::chrono::seconds (options.duration);
+
+    std::vector<std::unique_ptr<Bench_Worker>> workers;
+    std::vector<std::thread> threads;
+    int first_id = 0;
+    for (int i = 0; i < options.threads; ++i)
+    {
+        int sessions = options.sessions / options.threads + (i < options.sessions % options.threads ? 1 : 0);
+        workers.emplace_back (new Bench_Worker (options, server_addr, first_id, sessions));
+        first_id += sessions;
+    }
+    for (auto &worker : workers)
+        threads.emplace_back (&Bench_Worker::run, worker.get (), deadline);
+    for (auto &thread : threads)
+        thread.join ();
+
+    double seconds = std::chrono::duration<double> (Clock::now () - begin).count ();
+    double cpu_seconds = self_cpu_seconds () - cpu_begin;
+    double server_cpu_seconds = -1;
+    if (server_cpu_begin >= 0)
+    {
+        double server_cpu_end = process_cpu_seconds (options.server_pid);
+        if (server_cpu_end >= 0)
+            server_cpu_seconds = server_cpu_end - server_cpu_begin;
+    }
+
+    Bench_Results results;
+    for (auto &worker : workers)
+        results.merge (worker->get_results ());
+    report (options, results, seconds, cpu_seconds, server_cpu_seconds);
+
+    if (options.is_in_process)
+    {
+        reactor->end_reactor_event_loop ();
+        ACE_Thread_Manager::instance ()->wait ();
+        server.reset ();
+        Async_Log::instance ()->close ();
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * Microbenchmarks of the hot internal functions, no network needed.
+ * Run with --benchmark_format=json to compare results across commits.
+ */
+#include "ascii_convert.h"
+#include "command_handler.h"
+#include "data_handler.h"
+#include "user_inf.h"
+
+#include "ace/Reactor.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BENCH_LIST_FILES 1000
+
+/**
+ * Reaches the internals of the handlers, granted by friend declarations.
+ */
+struct Bench_Access
+{
+    static void set_command (Command_Handler &command_handler, const char *command)
+    {
+        strncpy (command_handler.recv_buffer_, command, MAX_COMMAND_BUFFER_SIZE - 1);
+    }
+
+    static void relative_to_absolute (Command_Handler &command_handler, std::string &path)
+    {
+        command_handler.relative_to_absolute (path);
+    }
+
+    static void mode_to_letters (Data_Handler &data_handler, mode_t mode, char *buf)
+    {
+        data_handler.mode_to_letters (mode, buf);
+    }
+
+    static int append_list_line (Data_Handler &data_handler, const struct stat &file_stat, const char *name)
+    {
+        return data_handler.append_list_line (file_stat, name);
+    }
+
+    static void clear_list (Data_Handler &data_handler) { data_handler.list_buffer_.clear (); }
+};
+
+/**
+ * A Command_Handler whose replies go to a socketpair drained by the benchmark.
+ */
+class Bench_Command_Handler
+{
+public:
+    Bench_Command_Handler () : handler_ (new Command_Handler (&reactor_))
+    {
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds_) == 0)
+        {
+            fcntl (fds_[0], F_SETFL, O_NONBLOCK);
+            fcntl (fds_[1], F_SETFL, O_NONBLOCK);
+            handler_->get_command_link ().set_handle (fds_[0]);
+        }
+    }
+
+    Command_Handler &get () { return *handler_; }
+
+    void drain ()
+    {
+        char buf[4096];
+        while (recv (fds_[1], buf, sizeof (buf), MSG_DONTWAIT) > 0)
+            ;
+    }
+
+    ~Bench_Command_Handler ()
+    {
+        handler_->remove_reference ();
+        close (fds_[1]);
+    }
+
+private:
+    ACE_Reactor reactor_;
+    Command_Handler *handler_;
+    int fds_[2];
+};
+
+/**
+ * @brief handle_command () dispatch on canned commands: lookup, checks and reply
+ */
+static void BM_handle_command (benchmark::State &state)
+{
+    static const char *commands[] = { "USER bench", "PWD", "TYPE I", "NOOP", "CWD /tmp", "SITE STATS" };
+    const char *command = commands[state.range (0)];
+    Bench_Command_Handler command_handler;
+    for (auto _ : state)
+    {
+        Bench_Access::set_command (command_handler.get (), command);
+        benchmark::DoNotOptimize (command_handler.get ().handle_command ());
+        command_handler.drain ();
+    }
+    state.SetLabel (command);
+}
+BENCHMARK (BM_handle_command)->DenseRange (0, 5);
+
+static void BM_relative_to_absolute (benchmark::State &state)
+{
+    Bench_Command_Handler command_handler;
+    for (auto _ : state)
+    {
+        std::string path = "some/relative/file.bin";
+        Bench_Access::relative_to_absolute (command_handler.get (), path);
+        benchmark::DoNotOptimize (path.data ());
+    }
+}
+BENCHMARK (BM_relative_to_absolute);
+
+static void BM_mode_to_letters (benchmark::State &state)
+{
+    ACE_Reactor reactor;
+    Data_Handler *data_handler = new Data_Handler (&reactor, Data_Types::IMAGE);
+    char buf[11] = {0};
+    mode_t mode = S_IFREG | 0644;
+    for (auto _ : state)
+    {
+        Bench_Access::mode_to_letters (*data_handler, mode, buf);
+        benchmark::DoNotOptimize (buf);
+    }
+    data_handler->remove_reference ();
+}
+BENCHMARK (BM_mode_to_letters);
+
+/**
+ * @brief One LIST line: mode letters, owner and group lookup and formatting
+ */
+static void BM_append_list_line (benchmark::State &state)
+{
+    ACE_Reactor reactor;
+    Data_Handler *data_handler = new Data_Handler (&reactor, Data_Types::IMAGE);
+    struct stat file_stat;
+    stat ("/", &file_stat);
+    int lines = 0;
+    for (auto _ : state)
+    {
+        if (++lines == BENCH_LIST_FILES)
+        {
+            Bench_Access::clear_list (*data_handler);
+            lines = 0;
+        }
+        benchmark::DoNotOptimize (Bench_Access::append_list_line (*data_handler, file_stat, "file.bin"));
+    }
+    data_handler->remove_reference ();
+}
+BENCHMARK (BM_append_list_line);
+
+/**
+ * @brief list_dir () of a directory of BENCH_LIST_FILES files
+ */
+static void BM_list_dir (benchmark::State &state)
+{
+    char dir_path[] = "/tmp/ftpd_microbench_XXXXXX";
+    if (mkdtemp (dir_path) == nullptr)
+    {
+        state.SkipWithError ("mkdtemp failed");
+        return;
+    }
+    std::string dir = dir_path;
+    for (int i = 0; i < BENCH_LIST_FILES; ++i)
+    {
+        std::string file = dir + "/file_" + std::to_string (i);
+        FILE *file_ptr = fopen (file.c_str (), "w");
+        if (file_ptr != nullptr)
+            fclose (file_ptr);
+    }
+
+    ACE_Reactor reactor;
+    Data_Handler *data_handler = new Data_Handler (&reactor, Data_Types::IMAGE);
+    for (auto _ : state)
+        benchmark::DoNotOptimize (data_handler->list_dir (dir));
+    state.SetItemsProcessed (state.iterations () * BENCH_LIST_FILES);
+    data_handler->remove_reference ();
+
+    for (int i = 0; i < BENCH_LIST_FILES; ++i)
+        unlink ((dir + "/file_" + std::to_string (i)).c_str ());
+    rmdir (dir.c_str ());
+}
+BENCHMARK (BM_list_dir);
+
+static void BM_sha256 (benchmark::State &state)
+{
+    User_Inf user;
+    std::string hash;
+    std::string password = std::string ("benchmark-password") + SALT;
+    for (auto _ : state)
+    {
+        user.sha256 (password, hash);
+        benchmark::DoNotOptimize (hash.data ());
+    }
+}
+BENCHMARK (BM_sha256);
+
+/**
+ * @brief check_password () of a wrong password, as a failed login does
+ */
+static void BM_check_password (benchmark::State &state)
+{
+    User_Inf::read_passwords ();
+    User_Inf user;
+    user.check_username ("bench");
+    for (auto _ : state)
+        benchmark::DoNotOptimize (user.check_password ("wrong-password"));
+}
+BENCHMARK (BM_check_password);
+
+/**
+ * @brief verify_password () of a scrypt hash, the cost Auth_Pool moves off the event loop
+ */
+static void BM_verify_scrypt (benchmark::State &state)
+{
+    std::string hash;
+    User_Inf::hash_password ("benchmark-password", hash);
+    for (auto _ : state)
+        benchmark::DoNotOptimize (User_Inf::verify_password ("benchmark-password", hash));
+}
+BENCHMARK (BM_verify_scrypt)->Unit (benchmark::kMillisecond);
+
+/**
+ * @brief TYPE A conversion of a 64 KiB text chunk, 0 scalar, 1 sse2, 2 avx2;
+ *        compare with BM_memcpy
+ */
+static void BM_lf_to_crlf (benchmark::State &state)
+{
+    static const char *isas[] = { "scalar", "sse2", "avx2" };
+    if (ascii_convert_select (isas[state.range (0)]) == -1)
+    {
+        state.SkipWithError ("not supported by the CPU");
+        return;
+    }
+    std::string text (ASCII_CHUNK_SIZE, 'a');
+    for (size_t pos = 60; pos < text.size (); pos += 61)
+        text[pos] = '\n';
+    std::string out (text.size () * 2, '\0');
+    for (auto _ : state)
+        benchmark::DoNotOptimize (lf_to_crlf (text.data (), text.size (), &out[0]));
+    state.SetBytesProcessed (state.iterations () * text.size ());
+}
+BENCHMARK (BM_lf_to_crlf)->DenseRange (0, 2);
+
+static void BM_memcpy (benchmark::State &state)
+{
+    std::string text (ASCII_CHUNK_SIZE, 'a');
+    std::string out (text.size (), '\0');
+    for (auto _ : state)
+    {
+        memcpy (&out[0], text.data (), text.size ());
+        benchmark::ClobberMemory ();
+    }
+    state.SetBytesProcessed (state.iterations () * text.size ());
+}
+BENCHMARK (BM_memcpy);
+
+BENCHMARK_MAIN ();
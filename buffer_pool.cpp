@@ -0,0 +1,68 @@
+#include "buffer_pool.h"
+
+#include <cstdlib>
+
+Buffer_Pool *Buffer_Pool::instance ()
+{
+    static Buffer_Pool pool;
+    return &pool;
+}
+
+void Buffer_Pool::acquire (std::string &buffer)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (buffers_.empty ())
+        return;
+    buffer.swap (buffers_.back ());
+    buffers_.pop_back ();
+}
+
+void Buffer_Pool::release (std::string &buffer)
+{
+    buffer.clear ();
+    std::string released;
+    released.swap (buffer);
+    if (released.capacity () < MIN_POOLED_CAPACITY || released.capacity () > MAX_POOLED_CAPACITY)
+        return;
+    std::lock_guard<std::mutex> guard (lock_);
+    if (buffers_.size () < MAX_POOLED_BUFFERS)
+        buffers_.push_back (std::move (released));
+}
+
+char *Buffer_Pool::acquire_direct ()
+{
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!direct_buffers_.empty ())
+        {
+            char *buffer = direct_buffers_.back ();
+            direct_buffers_.pop_back ();
+            return buffer;
+        }
+    }
+    void *buffer = nullptr;
+    if (posix_memalign (&buffer, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0)
+        return nullptr;
+    return (char *)buffer;
+}
+
+void Buffer_Pool::release_direct (char *buffer)
+{
+    if (buffer == nullptr)
+        return;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (direct_buffers_.size () < MAX_POOLED_DIRECT_BUFFERS)
+        {
+            direct_buffers_.push_back (buffer);
+            return;
+        }
+    }
+    free (buffer);
+}
+
+Buffer_Pool::~Buffer_Pool ()
+{
+    for (char *buffer : direct_buffers_)
+        free (buffer);
+}
@@ -0,0 +1,69 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define MAX_POOLED_BUFFERS 64
+#define MIN_POOLED_CAPACITY 4096            // smaller buffers are not worth keeping
+#define MAX_POOLED_CAPACITY (1024 * 1024)   // larger buffers are freed instead of kept
+#define DIRECT_IO_ALIGNMENT 4096            // offset, length and address alignment of O_DIRECT
+#define DIRECT_IO_BUFFER_SIZE (1024 * 1024) // bytes written by one O_DIRECT write
+#define MAX_POOLED_DIRECT_BUFFERS 16
+
+/**
+ * Transfer buffers kept with their capacity between transfers, so a busy
+ * server does not allocate and fault in a fresh buffer per transfer and an
+ * idle session holds none.
+ */
+class Buffer_Pool
+{
+public:
+    /**
+     * @brief Get the process-wide buffer pool
+     * 
+     * @return Buffer_Pool*
+     */
+    static Buffer_Pool *instance ();
+
+    /**
+     * @brief Swap a pooled buffer into an empty one, it comes back empty with its capacity,
+     *        or unchanged when the pool is empty
+     * 
+     * @param buffer
+     */
+    void acquire (std::string &buffer);
+
+    /**
+     * @brief Give the storage of a buffer back, the buffer is left empty without storage
+     * 
+     * @param buffer
+     */
+    void release (std::string &buffer);
+
+    /**
+     * @brief Get a buffer of DIRECT_IO_BUFFER_SIZE bytes aligned for O_DIRECT
+     * 
+     * @return char* , nullptr for out of memory
+     */
+    char *acquire_direct ();
+
+    /**
+     * @brief Give a buffer from acquire_direct () back
+     * 
+     * @param buffer
+     */
+    void release_direct (char *buffer);
+
+    ~Buffer_Pool ();
+
+private:
+    Buffer_Pool () {}
+
+    std::mutex lock_;                   // guards buffers_ and direct_buffers_
+    std::vector<std::string> buffers_;  // free buffers
+    std::vector<char *> direct_buffers_;    // free O_DIRECT buffers
+};
+
+#endif
@@ -1,17 +1,35 @@
 #include "command_handler.h"
+#include "admission_control.h"
+#include "async_log.h"
+#include "auth_pool.h"
+#include "bandwidth_shaper.h"
+#include "dedup_store.h"
+#include "file_hash.h"
+#include "metrics.h"
 #include "msg.h"
+#include "server_config.h"
+#include "tls_session.h"
+#include "tls_session_cache.h"
+#include "transfer_scheduler.h"
+#include "transfer_trace.h"
+#include "vfs.h"
 
-#include "ace/Log_Msg.h"
 #include "ace/FILE_Connector.h"
 #include "ace/Timer_Queue.h"
 #include "ace/Date_Time.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <dirent.h>
 #include <sstream>
 #include <sys/stat.h>
 #include <grp.h>
+#include <openssl/crypto.h>
+#include <vector>
 
 const std::unordered_map<std::string, int (Command_Handler::*) ()> Command_Handler::commands_
 (
@@ -19,6 +37,7 @@ const std::unordered_map<std::string, int (Command_Handler::*) ()> Command_Handl
         { "user", &Command_Handler::handle_user },
         { "pass", &Command_Handler::handle_pass },
         { "quit", &Command_Handler::handle_quit },
+        { "abor", &Command_Handler::handle_abor },
         { "pwd", &Command_Handler::handle_pwd },
         { "cwd", &Command_Handler::handle_cwd },
         { "cdup", &Command_Handler::handle_cdup },
@@ -27,22 +46,71 @@ const std::unordered_map<std::string, int (Command_Handler::*) ()> Command_Handl
         { "list", &Command_Handler::handle_list },
         { "type", &Command_Handler::handle_type },
         { "stor", &Command_Handler::handle_stor },
+        { "appe", &Command_Handler::handle_appe },
+        { "allo", &Command_Handler::handle_allo },
+        { "auth", &Command_Handler::handle_auth },
+        { "pbsz", &Command_Handler::handle_pbsz },
+        { "prot", &Command_Handler::handle_prot },
         { "pasv", &Command_Handler::handle_pasv },
         { "rnfr", &Command_Handler::handle_rnfr },
         { "rnto", &Command_Handler::handle_rnto },
         { "rmd", &Command_Handler::handle_rmd },
         { "dele", &Command_Handler::handle_dele },
         { "mkd", &Command_Handler::handle_mkd },    
+        { "site", &Command_Handler::handle_site },
+        { "mode", &Command_Handler::handle_mode },
+        { "rest", &Command_Handler::handle_rest },
+        { "opts", &Command_Handler::handle_opts },
+        { "feat", &Command_Handler::handle_feat },
+        { "hash", &Command_Handler::handle_hash },
+        { "rang", &Command_Handler::handle_rang },
+        { "xcrc", &Command_Handler::handle_xcrc },
+        { "xmd5", &Command_Handler::handle_xmd5 },
+        { "xsha1", &Command_Handler::handle_xsha1 },
+        { "xsha256", &Command_Handler::handle_xsha256 },
+    }
+);
+
+const std::unordered_map<std::string, int (Command_Handler::*) ()> Command_Handler::site_commands_
+(
+    {
+        { "rate", &Command_Handler::handle_site_rate },
+        { "stats", &Command_Handler::handle_site_stats },
+        { "reload", &Command_Handler::handle_site_reload },
+        { "checksum", &Command_Handler::handle_site_checksum },
+        { "segment", &Command_Handler::handle_site_segment },
     }
 );
 
 Command_Handler::Command_Handler (ACE_Reactor *reactor) : 
     ACE_Event_Handler (reactor), 
+    is_handshaking_ (false),
+    handshake_timer_ (-1),
+    is_pbsz_ (false),
+    is_data_private_ (false),
+    telnet_state_ (Telnet_States::TELNET_DATA),
     data_handler_ (nullptr),
+    data_type_ (Data_Types::IMAGE),
+    data_mode_ (Data_Modes::STREAM),
+    deflate_level_ (DEFAULT_DEFLATE_LEVEL),
+    restart_offset_ (0),
     is_pasv_ (false),
     pasv_port_ (0),
-    max_client_timeout_ (MAX_CLIENT_TIMEOUT)
+    is_user_admitted_ (false),
+    max_client_timeout_ (MAX_CLIENT_TIMEOUT),
+    is_closed_ (false),
+    is_authenticating_ (false),
+    auth_result_ (Auth_Results::AUTH_FAILED),
+    hash_algorithm_ (Hash_Algorithms::HASH_SHA256),
+    range_begin_ (0),
+    range_end_ (-1),
+    is_hashing_ (false),
+    expected_algorithm_ (-1),
+    segment_size_ (-1),
+    allocate_size_ (-1),
+    session_bucket_ (Bandwidth_Shaper::instance ()->new_session_bucket ())
 {
+    reference_counting_policy ().value (ACE_Event_Handler::Reference_Counting_Policy::ENABLED);
     ACE_OS::memset (recv_buffer_, 0 , sizeof(recv_buffer_));
 }
 
@@ -53,7 +121,7 @@ int Command_Handler::init ()
                                                 ACE_Event_Handler::READ_MASK);
     if (result == -1)
     {
-        ACE_DEBUG ( (LM_DEBUG, "register read event failed.\n"));
+        FTP_LOG (LOG_LEVEL_ERROR, "register read event failed.\n");
         return -1;
     }
 
@@ -61,9 +129,15 @@ int Command_Handler::init ()
     result = reactor ()->schedule_timer (this, 0, max_client_timeout_, reschedule);
     if (result == -1)
     {
-        ACE_DEBUG ( (LM_DEBUG, "register timeout event failed.\n"));
+        FTP_LOG (LOG_LEVEL_ERROR, "register timeout event failed.\n");
         return -1;
     }
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
+
+    // the urgent byte of a Synch stays in the stream, where strip_telnet () drops it
+    int is_inline = 1;
+    if (command_link_.set_option (SOL_SOCKET, SO_OOBINLINE, &is_inline, sizeof (is_inline)) == -1)
+        FTP_LOG (LOG_LEVEL_DEBUG, "set SO_OOBINLINE failed\n");
 
     time_of_last_command_ = 
         reactor ()->timer_queue ()->gettimeofday ();
@@ -73,30 +147,42 @@ int Command_Handler::init ()
 
 int Command_Handler::handle_input (ACE_HANDLE) 
 {
-    ssize_t recv_len = command_link_.recv (recv_buffer_, MAX_COMMAND_BUFFER_SIZE - 1);
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_)
+        return 0;
+    if (is_handshaking_)
+        return continue_handshake ();
+    ssize_t recv_len = tls_ ? tls_->recv (recv_buffer_, MAX_COMMAND_BUFFER_SIZE - 1) :
+                              command_link_.recv (recv_buffer_, MAX_COMMAND_BUFFER_SIZE - 1);
     if (recv_len < 0)
     {
+        // the socket is readable again when the rest of a TLS record arrives
         if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
-            return 1;
+            return 0;
         else
             return -1;
     }
     else if (recv_len == 0)
         return -1;
-    if (recv_buffer_[recv_len - 2] == '\r' && recv_buffer_[recv_len - 1] == '\n')
+    recv_len = strip_telnet (recv_len);
+    if (recv_len == 0)
+        return 0;
+    if (recv_len >= 2 && recv_buffer_[recv_len - 2] == '\r' && recv_buffer_[recv_len - 1] == '\n')
         recv_buffer_[recv_len - 2] = '\0';
     else
     {
-        ACE_DEBUG ( (LM_DEBUG, "command is incomplete\n"));
+        FTP_LOG (LOG_LEVEL_DEBUG, "command is incomplete\n");
         return Command_Consequences::COMMAND_CON_CLOSE;
     }
     int command_res = handle_command ();
     if (command_res == Command_Consequences::COMMAND_CON_CLOSE)
     {
-        ACE_DEBUG ( (LM_DEBUG, "command failed, command connection closing\n"));
+        FTP_LOG (LOG_LEVEL_INFO, "command failed, command connection closing\n");
         send_response (MSG_CLOSE);
         return -1;
     }
+    else if (command_res == Command_Consequences::COMMAND_CON_REJECT)
+        return -1;
     else if (command_res == Command_Consequences::DATA_CON_CLOSE && data_handler_)
     {   
         //data_handler_->close ();
@@ -106,47 +192,151 @@ int Command_Handler::handle_input (ACE_HANDLE)
     return 0;
 }
 
+int Command_Handler::handle_output (ACE_HANDLE)
+{
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_ || !is_handshaking_)
+        return 0;
+    return continue_handshake ();
+}
+
+int Command_Handler::continue_handshake ()
+{
+    if (tls_->handshake () == -1)
+    {
+        if (errno != EAGAIN)
+            return -1;
+        // a write OpenSSL wants is waited for besides the next read
+        if (tls_->is_want_write ())
+            reactor ()->register_handler (command_link_.get_handle (), this, ACE_Event_Handler::WRITE_MASK);
+        else
+            reactor ()->remove_handler (command_link_.get_handle (),
+                                        ACE_Event_Handler::WRITE_MASK | ACE_Event_Handler::DONT_CALL);
+        return 0;
+    }
+    is_handshaking_ = false;
+    reactor ()->remove_handler (command_link_.get_handle (),
+                                ACE_Event_Handler::WRITE_MASK | ACE_Event_Handler::DONT_CALL);
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (handshake_timer_));
+    handshake_timer_ = -1;
+    return 0;
+}
+
 int Command_Handler::handle_close (ACE_HANDLE, ACE_Reactor_Mask)
 {
-    ACE_DEBUG ((LM_DEBUG, ACE_TEXT("handle command close\n")));
-    delete this;
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_)
+        return 0;
+    is_closed_ = true;
+    FTP_LOG (LOG_LEVEL_DEBUG, "handle command close\n");
+    reactor ()->remove_handler (command_link_.get_handle (), 
+                                ACE_Event_Handler::ALL_EVENTS_MASK |
+                                ACE_Event_Handler::DONT_CALL);
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (this));
+    // release the data connection now, it references this object while transferring
+    if (data_handler_ && data_handler_->stop () == 0)
+        log_transfer (data_handler_.get (), false);
+    data_handler_.reset ();
     return 0;
 }
 
-int Command_Handler::handle_timeout (const ACE_Time_Value &now, const void *)
-{
-    ACE_Date_Time now_date(now);
-    ACE_DEBUG((LM_DEBUG,"now time %d-%d-%d %d:%d:%d:%d\n",
-		now_date.year(),
-		now_date.month(),
-		now_date.day(),
-		now_date.hour(),
-		now_date.minute(),
-		now_date.second(),
-		now_date.microsec()));
-
-    ACE_Date_Time date(time_of_last_command_);
-    ACE_DEBUG((LM_DEBUG,"last time %d-%d-%d %d:%d:%d:%d\n",
-		date.year(),
-		date.month(),
-		date.day(),
-		date.hour(),
-		date.minute(),
-		date.second(),
-		date.microsec()));    
-    if (now - time_of_last_command_ >= max_client_timeout_)
+int Command_Handler::handle_timeout (const ACE_Time_Value &now, const void *act)
+{
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_)
+        return 0;
+    if (act == &handshake_timer_)
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -1);
+        handshake_timer_ = -1;
+        if (is_handshaking_)
+        {
+            FTP_LOG (LOG_LEVEL_INFO, "TLS handshake timed out\n");
+            handle_close ();
+        }
+        return 0;
+    }
+    if (FTP_LOG_ENABLED (LOG_LEVEL_DEBUG))
+    {
+        ACE_Date_Time now_date(now);
+        FTP_LOG (LOG_LEVEL_DEBUG, "now time %d-%d-%d %d:%d:%d:%d\n",
+                 (int)now_date.year(),
+                 (int)now_date.month(),
+                 (int)now_date.day(),
+                 (int)now_date.hour(),
+                 (int)now_date.minute(),
+                 (int)now_date.second(),
+                 (int)now_date.microsec());
+
+        ACE_Date_Time date(time_of_last_command_);
+        FTP_LOG (LOG_LEVEL_DEBUG, "last time %d-%d-%d %d:%d:%d:%d\n",
+                 (int)date.year(),
+                 (int)date.month(),
+                 (int)date.day(),
+                 (int)date.hour(),
+                 (int)date.minute(),
+                 (int)date.second(),
+                 (int)date.microsec());
+    }
+    if (data_handler_ && data_handler_->is_busy ())
+        time_of_last_command_ = now;
+    else if (now - time_of_last_command_ >= max_client_timeout_)
         handle_close ();
     return 0;
 }
 
+int Command_Handler::handle_exception (ACE_HANDLE)
+{
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_)
+        return 0;
+    if (is_hashing_ && hash_request_.result != Hash_Results::HASH_PENDING)
+    {
+        is_hashing_ = false;
+        finish_hash ();
+    }
+    if (!is_authenticating_ || auth_result_ == Auth_Results::AUTH_PENDING)
+        return 0;
+    is_authenticating_ = false;
+    return finish_login (auth_result_) == Command_Consequences::COMMAND_CON_REJECT ? -1 : 0;
+}
+
+void Command_Handler::auth_complete (int result)
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard (lock_);
+        if (is_closed_)
+            return;
+        auth_result_ = result;
+    }
+    // reply from an event loop thread, or right here if the notify pipe is full
+    if (reactor ()->notify (this, ACE_Event_Handler::EXCEPT_MASK) == -1 &&
+        handle_exception () == -1)
+        handle_close ();
+}
+
+void Command_Handler::hash_complete (int result, const std::string &digest, off_t file_size)
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard (lock_);
+        if (is_closed_)
+            return;
+        hash_request_.result = result;
+        hash_request_.digest = digest;
+        hash_request_.file_size = file_size;
+    }
+    if (reactor ()->notify (this, ACE_Event_Handler::EXCEPT_MASK) == -1)
+        handle_exception ();
+}
+
 int Command_Handler::handle_command ()
 {
-    ACE_DEBUG ((LM_DEBUG, ACE_TEXT("handle command\n")));
+    FTP_LOG (LOG_LEVEL_DEBUG, "handle command\n");
     
     char *space_addr = strchr (recv_buffer_, ' ');
     space_addr = (space_addr == nullptr ? recv_buffer_ + strlen (recv_buffer_) : space_addr);
     std::string recv_command (recv_buffer_, space_addr);
-    ACE_DEBUG ( (LM_DEBUG, "%s\n", recv_command.c_str ()));
+    FTP_LOG (LOG_LEVEL_DEBUG, "%s\n", recv_command.c_str ());
     std::transform (recv_command.begin (),
                     recv_command.end (),
                     recv_command.begin (),
@@ -156,7 +346,13 @@ int Command_Handler::handle_command ()
     {
         time_of_last_command_ = 
             reactor ()->timer_queue ()->gettimeofday ();
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now ();
         int result = (this->*(command_ite->second)) ();
+        Metrics *metrics = Metrics::instance ();
+        metrics->add (Metric_Counters::METRIC_COMMANDS);
+        metrics->record_latency (metrics->command_id (recv_command),
+                                 std::chrono::duration_cast<std::chrono::microseconds> (
+                                    std::chrono::steady_clock::now () - begin).count ());
         return result;
     }
     else
@@ -168,20 +364,29 @@ int Command_Handler::handle_command ()
 
 int Command_Handler::send_response (const std::string &msg) 
 {
+    // a reply is never left half encrypted, the next one would break the stream
+    if (tls_)
+        return tls_->send_all (msg.c_str (), msg.length ());
     int send_len = command_link_.send (msg.c_str (), msg.length ());
     return (send_len == msg.length ()) ? 0 : -1;
 }
 
 int Command_Handler::send_response (const char *format, const char *detail)
 {
-    char send_buf[MAX_COMMAND_BUFFER_SIZE];
-    sprintf (send_buf, format, detail);
-    int send_len = command_link_.send (send_buf, strlen (send_buf));
-    return (send_len == strlen (send_buf)) ? 0 : -1;
+    // detail may be a client's path, size the buffer to fit
+    std::string send_buf (strlen (format) + strlen (detail), '\0');
+    int length = snprintf (&send_buf[0], send_buf.length () + 1, format, detail);
+    send_buf.resize (length < 0 ? 0 : length);
+    return send_response (send_buf);
 }
 
 int Command_Handler::handle_user () 
 {
+    if (is_authenticating_)
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
     if (user_.check_logged_in ()) 
     {
         send_response (MSG_LOGIN_SUCCESS);
@@ -207,6 +412,11 @@ int Command_Handler::handle_user ()
 
 int Command_Handler::handle_pass ()
 {
+    if (is_authenticating_)
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
     if( user_.get_user_name ().length () == 0)
     {
         send_response (MSG_REQUIRE_USER);
@@ -215,9 +425,39 @@ int Command_Handler::handle_pass ()
 
     CHECK_COMMAND_LENGTH(recv_buffer_, 6);
     std::string recv_password (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
-    int result = user_.check_password (recv_password);
-    if (result == 0)
+    int result = Auth_Pool::instance ()->verify (this, client_addr_, user_.get_user_name (), recv_password);
+    OPENSSL_cleanse (&recv_password[0], recv_password.length ());
+    OPENSSL_cleanse (recv_buffer_ + 5, recv_password.length ());
+    if (result == Auth_Results::AUTH_PENDING)
+    {
+        is_authenticating_ = true;
+        auth_result_ = Auth_Results::AUTH_PENDING;
+        return Command_Consequences::OK;
+    }
+    else if (result == Auth_Results::AUTH_BUSY)
+    {
+        send_response (MSG_SERVER_BUSY);
+        return Command_Consequences::COMMAND_CON_REJECT;
+    }
+    return finish_login (result);
+}
+
+int Command_Handler::finish_login (int result)
+{
+    if (result == Auth_Results::AUTH_OK && user_.log_in () == 0)
     {
+        if (!is_user_admitted_ &&
+            Admission_Control::instance ()->admit_user (user_.get_user_name ()) != 
+            Admission_Results::ADMITTED)
+        {
+            send_response (MSG_TOO_MANY_FOR_USER);
+            return Command_Consequences::COMMAND_CON_REJECT;
+        }
+        is_user_admitted_ = true;
+        user_bucket_ = Bandwidth_Shaper::instance ()->get_user_bucket (user_.get_user_name (), 
+                                                                        user_.get_rate_limit ());
+        if (data_handler_)
+            data_handler_->set_buckets (user_bucket_, session_bucket_);
         send_response (MSG_LOGIN_SUCCESS);
         return Command_Consequences::OK;
     }
@@ -245,7 +485,7 @@ int Command_Handler::handle_cwd ()
     std::string dir (recv_buffer_ + 4, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (dir);
     
-    ACE_DEBUG ( (LM_DEBUG, "dir:%s\n", dir.c_str ()));
+    FTP_LOG (LOG_LEVEL_DEBUG, "dir:%s\n", dir.c_str ());
     user_.set_cur_dir (dir);
     send_response (MSG_COMMON_SUCCESS);
     return Command_Consequences::OK;
@@ -284,14 +524,13 @@ int Command_Handler::handle_port ()
     ss << h1 << '.' << h2 << '.' << h3 << '.' << h4;
     std::string ip_addr = ss.str ();
 
+    CHECK_NO_TRANSFER();
     if (is_pasv_)
     {
         pasv_acceptor_.close ();
         is_pasv_ = false;
     }
-    if (data_handler_)
-        data_handler_.reset ();
-    data_handler_ = std::make_unique<Data_Handler> (ip_addr, port, data_type_);
+    set_data_handler (new Data_Handler (reactor (), ip_addr, port, data_type_));
     send_response (MSG_COMMON_SUCCESS);
     return Command_Consequences::OK;
 }
@@ -300,24 +539,24 @@ int Command_Handler::handle_pasv ()
 {
     CHECK_LOGIN();
 
+    CHECK_NO_TRANSFER();
+
     if (!is_pasv_)
     {
         ACE_INET_Addr local_addr;
         local_addr.set ((u_short)0, (ACE_UINT32) INADDR_ANY);
         if (pasv_acceptor_.open (local_addr) < 0)
         {
-            ACE_DEBUG ( (LM_DEBUG, "open pasv port failed\n"));
+            FTP_LOG (LOG_LEVEL_INFO, "open pasv port failed\n");
             send_response (MSG_FAILED);
             return Command_Consequences::CONTINUE;
         }
         pasv_acceptor_.get_local_addr (local_addr);
-        ACE_DEBUG ( (LM_DEBUG, "open port: %d\n", local_addr.get_port_number ()));
+        FTP_LOG (LOG_LEVEL_DEBUG, "open port: %d\n", local_addr.get_port_number ());
         pasv_port_ = local_addr.get_port_number ();
         is_pasv_ = true;
     }
-    if (data_handler_)
-        data_handler_.reset ();
-    data_handler_ = std::make_unique<Data_Handler> (data_type_);
+    set_data_handler (new Data_Handler (reactor (), data_type_));
     u_short high_byte = pasv_port_ >> 8;
     u_short low_byte = pasv_port_ & 0x00ff;
     std::stringstream pasv_address_ss;
@@ -333,14 +572,22 @@ int Command_Handler::handle_type ()
 
     CHECK_COMMAND_LENGTH(recv_buffer_, 6);
 
+    CHECK_NO_TRANSFER();
+
     char type = recv_buffer_[5];
-    ACE_DEBUG ( (LM_DEBUG, "type is %c\n",type));
+    FTP_LOG (LOG_LEVEL_DEBUG, "type is %c\n",type);
     switch (type)
     {
-    // case 'a':
-    // case 'A':
-    //     data_type_ = Data_Types::ASCII;
-    //     break;
+    case 'a':
+    case 'A':
+        // a compressed stream is not converted
+        if (data_mode_ == Data_Modes::COMPRESSED)
+        {
+            send_response (MSG_PARAM_NOT_IMPLEMENTED);
+            return Command_Consequences::CONTINUE;
+        }
+        data_type_ = Data_Types::ASCII;
+        break;
     
     // case 'E':
     // case 'e':
@@ -356,6 +603,8 @@ int Command_Handler::handle_type ()
         send_response (MSG_INVALID_PARAM);
         return Command_Consequences::CONTINUE;
     }
+    if (data_handler_)
+        data_handler_->set_type (data_type_);
     send_response (MSG_COMMON_SUCCESS);
     return Command_Consequences::OK;
 }
@@ -366,22 +615,45 @@ int Command_Handler::handle_quit ()
     return 0;
 }
 
+int Command_Handler::handle_abor ()
+{
+    // the buffers, the file and its lock go with the data connection
+    if (data_handler_ && data_handler_->abort () == 0)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "transfer aborted\n");
+        log_transfer (data_handler_.get (), false);
+        send_response (MSG_CONNECTION_CLOSED);
+    }
+    data_handler_.reset ();
+    send_response (MSG_ABORT_SUCCESS);
+    return Command_Consequences::OK;
+}
+
 int Command_Handler::make_data_connection ()
 {
+    // kept open by MODE B since the last transfer
+    if (data_handler_->is_connected ())
+        return 0;
     if(is_pasv_)
     {
         if (pasv_acceptor_.accept (data_handler_->get_data_link ()) < 0)
         {
-            ACE_DEBUG ( (LM_DEBUG, "pasv accept failed\n"));
+            FTP_LOG (LOG_LEVEL_INFO, "pasv accept failed\n");
             return -1;
         }
-        ACE_DEBUG ( (LM_DEBUG, "pasv connection succeed.\n"));
+        FTP_LOG (LOG_LEVEL_DEBUG, "pasv connection succeed.\n");
         return 0;
     }
     else
         return data_handler_->data_link_init ();
 }
 
+void Command_Handler::protect_data_connection ()
+{
+    if (is_data_private_ && !data_handler_->is_tls ())
+        data_handler_->start_tls (tls_session_context_);
+}
+
 int Command_Handler::handle_retr () 
 {
     CHECK_DATA_LINK_VALID();
@@ -390,32 +662,37 @@ int Command_Handler::handle_retr ()
 
     std::string file_path (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (file_path);
-    ACE_DEBUG( (LM_DEBUG, "file_path:%s\n", file_path.c_str ()));
+    FTP_LOG (LOG_LEVEL_DEBUG, "file_path:%s\n", file_path.c_str ());
     data_handler_->set_file_path (file_path);
+    data_handler_->set_restart (restart_offset_);
+    restart_offset_ = 0;
+    Transfer_Trace &trace = data_handler_->get_trace ();
+    trace.start (file_path, 'o');
     if (data_handler_->file_link_init (true) == -1)
     {  
         send_response (MSG_FAILED);
         return Command_Consequences::CONTINUE;
     }
+    trace.mark (Trace_Phases::TRACE_FILE_OPEN);
 
     if (make_data_connection () == -1)
     {
         send_response (MSG_DATA_LINK_FAIL);
         return Command_Consequences::DATA_CON_CLOSE;
     }
+    trace.mark (Trace_Phases::TRACE_CONNECTED);
     send_response (MSG_CONNECTION_READY);
+    protect_data_connection ();
 
-    if (data_handler_->send_file () == -1)
+    // the reply is sent by transfer_complete ()
+    int result = data_handler_->send_file (this);
+    if (result != 0)
     {
-        ACE_DEBUG ( (LM_DEBUG, "send file failed\n"));
-        send_response (MSG_FAILED);
+        FTP_LOG (LOG_LEVEL_INFO, "send file failed\n");
+        log_transfer (data_handler_.get (), false);
+        send_response (result == -2 ? MSG_FILE_BUSY : MSG_FAILED);
         return Command_Consequences::DATA_CON_CLOSE;
     }
-    //data_handler_->close ();
-    data_handler_.reset ();
-    time_of_last_command_ = 
-        reactor ()->timer_queue ()->gettimeofday ();
-    send_response (MSG_COMMON_SUCCESS);
     return Command_Consequences::OK;
 }
 
@@ -429,6 +706,7 @@ int Command_Handler::handle_list ()
         return Command_Consequences::DATA_CON_CLOSE;
     }
     send_response (MSG_CONNECTION_READY);
+    protect_data_connection ();
 
     std::string path = user_.get_cur_dir ();
     if (strlen (recv_buffer_) > 5)
@@ -448,54 +726,239 @@ int Command_Handler::handle_list ()
             send_response (MSG_FAILED);
             return Command_Consequences::DATA_CON_CLOSE;
         }
-        //data_handler_->close ();
-        data_handler_.reset ();
-        send_response (MSG_COMMON_SUCCESS);
-        return Command_Consequences::OK;
     }
     else if (list_dir_res == -2)
     {
         send_response (MSG_FAILED);
         return Command_Consequences::DATA_CON_CLOSE;
     }
-    //data_handler_->close ();
-    data_handler_.reset ();
-    send_response (MSG_COMMON_SUCCESS);
+
+    // the reply is sent by transfer_complete ()
+    if (data_handler_->send_list (this) == -1)
+    {
+        send_response (MSG_FAILED);
+        return Command_Consequences::DATA_CON_CLOSE;
+    }
     return Command_Consequences::OK;
 }
 
 int Command_Handler::handle_stor ()
+{
+    return start_upload (false);
+}
+
+int Command_Handler::handle_appe ()
+{
+    return start_upload (true);
+}
+
+int Command_Handler::handle_allo ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    // the record size of "R n" is meaningless for files
+    char *end = nullptr;
+    errno = 0;
+    long long size = strtoll (recv_buffer_ + 5, &end, 10);
+    if (end == recv_buffer_ + 5 || size < 0 || errno == ERANGE ||
+        (*end != '\0' && strncasecmp (end, " R ", 3) != 0))
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    allocate_size_ = (off_t)size;
+    send_response (MSG_COMMON_SUCCESS);
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_auth ()
+{
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    std::string mechanism (recv_buffer_ + 5);
+    std::transform (mechanism.begin (), mechanism.end (), mechanism.begin (), ::toupper);
+    if (mechanism != "TLS" && mechanism != "TLS-C" && mechanism != "SSL")
+    {
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
+    // a reply still to come would be sent in the middle of the handshake
+    if (tls_ || is_authenticating_ || is_hashing_ || (data_handler_ && data_handler_->is_busy ()))
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
+    if (!Tls_Context::instance ()->is_enabled ())
+    {
+        send_response (MSG_TLS_UNAVAILABLE);
+        return Command_Consequences::CONTINUE;
+    }
+    send_response (MSG_AUTH_TLS);
+    // urgent bytes would land inside TLS records, the kernel keeps them aside now
+    int is_inline = 0;
+    command_link_.set_option (SOL_SOCKET, SO_OOBINLINE, &is_inline, sizeof (is_inline));
+    // the client starts the handshake on the reply, handle_input () goes on with it;
+    // what fails it can't be answered in plain
+    tls_session_context_ = Tls_Session_Cache::new_context ();
+    tls_.reset (new Tls_Stream (command_link_.get_handle (), tls_session_context_));
+    // a record arriving in pieces must not hold the event loop thread
+    command_link_.enable (ACE_NONBLOCK);
+    handshake_timer_ = reactor ()->schedule_timer (this, &handshake_timer_,
+                                                   ACE_Time_Value (TLS_HANDSHAKE_TIMEOUT_MSEC / 1000,
+                                                                   TLS_HANDSHAKE_TIMEOUT_MSEC % 1000 * 1000));
+    if (handshake_timer_ == -1)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "register handshake timeout failed\n");
+        return Command_Consequences::COMMAND_CON_REJECT;
+    }
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
+    is_handshaking_ = true;
+    is_pbsz_ = false;
+    is_data_private_ = false;
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_pbsz ()
+{
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    if (!tls_)
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
+    // TLS frames the data itself, any size becomes 0
+    char *end = nullptr;
+    strtoul (recv_buffer_ + 5, &end, 10);
+    if (end == recv_buffer_ + 5 || *end != '\0')
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    is_pbsz_ = true;
+    send_response (MSG_PBSZ);
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_prot ()
+{
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    CHECK_NO_TRANSFER();
+
+    if (!is_pbsz_)
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
+    switch (recv_buffer_[5])
+    {
+    case 'P':
+    case 'p':
+        is_data_private_ = true;
+        break;
+
+    case 'C':
+    case 'c':
+        is_data_private_ = false;
+        break;
+
+    case 'S':
+    case 's':
+    case 'E':
+    case 'e':
+        send_response (MSG_PROT_UNSUPPORTED);
+        return Command_Consequences::CONTINUE;
+
+    default:
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    send_response (MSG_PROT, is_data_private_ ? "Private" : "Clear");
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::start_upload (bool is_append)
 {
     CHECK_DATA_LINK_VALID();
 
     CHECK_COMMAND_LENGTH(recv_buffer_, 6);
 
+    off_t segment_size = segment_size_;
+    segment_size_ = -1;
+    off_t declared_size = (segment_size >= 0 ? segment_size : allocate_size_);
+    allocate_size_ = -1;
+    // SITE CHECKSUM declares the next upload only, whether it starts or not
+    int expected_algorithm = expected_algorithm_;
+    std::string expected_digest;
+    expected_digest.swap (expected_digest_);
+    expected_algorithm_ = -1;
+    // only a whole file written from the beginning is hashed, TYPE A changes segment offsets
+    bool is_partial = (restart_offset_ > 0 || is_append || segment_size >= 0);
+    if ((expected_algorithm != -1 && is_partial) ||
+        (segment_size >= 0 && (is_append || data_type_ == Data_Types::ASCII)))
+    {
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
     std::string file_path (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (file_path);
+    // part files, staged files and their links live on the local filesystem
+    bool is_local = Vfs::instance ()->is_local (file_path);
+    if (segment_size >= 0 && !is_local)
+    {
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
+    // Dedup_Store finds the stored content by SHA-256
+    bool is_dedup = (!is_partial && is_local && Dedup_Store::instance ()->can_stage (file_path));
+    std::vector<int> algorithms;
+    if (segment_size < 0)
+        algorithms = Hash_Service::instance ()->upload_algorithms ();
+    for (int algorithm : { expected_algorithm, is_dedup ? (int)Hash_Algorithms::HASH_SHA256 : -1 })
+        if (algorithm != -1 && std::find (algorithms.begin (), algorithms.end (), algorithm) == algorithms.end ())
+            algorithms.push_back (algorithm);
+    data_handler_->set_digests (algorithms);
+    data_handler_->set_expected (expected_algorithm, expected_digest);
+    data_handler_->set_dedup (is_dedup);
+    data_handler_->set_append (is_append);
+    data_handler_->set_segment (segment_size);
+    // the part file of a segment is allocated as a whole
+    data_handler_->set_allocate (segment_size >= 0 ? -1 : declared_size);
+    // large declared uploads skip the page cache
+    long direct_min_mb = Server_Config::instance ()->get_int ("direct_io_min_mb", 0);
+    data_handler_->set_direct (direct_min_mb > 0 && declared_size >= direct_min_mb * 1024LL * 1024);
     data_handler_->set_file_path (file_path);
+    data_handler_->set_restart (restart_offset_);
+    restart_offset_ = 0;
+    Transfer_Trace &trace = data_handler_->get_trace ();
+    trace.start (file_path, 'i');
     if(data_handler_->file_link_init (false) == -1)
     {
         send_response (MSG_FAILED);
         return Command_Consequences::DATA_CON_CLOSE;
     }
+    trace.mark (Trace_Phases::TRACE_FILE_OPEN);
 
     if (make_data_connection () == -1)
     {
         send_response (MSG_DATA_LINK_FAIL);
         return Command_Consequences::DATA_CON_CLOSE;
     }
+    trace.mark (Trace_Phases::TRACE_CONNECTED);
     send_response (MSG_CONNECTION_READY);
+    protect_data_connection ();
 
-    if (data_handler_->recv_file () == -1)
+    // the reply is sent by transfer_complete ()
+    int result = data_handler_->recv_file (this);
+    if (result != 0)
     {
-        send_response (MSG_FAILED);
+        log_transfer (data_handler_.get (), false);
+        send_response (result == -2 ? MSG_FILE_BUSY : MSG_FAILED);
         return Command_Consequences::DATA_CON_CLOSE;
     }
-    //data_handler_->close ();
-    data_handler_.reset ();
-    time_of_last_command_ = 
-        reactor ()->timer_queue ()->gettimeofday ();
-    send_response (MSG_COMMON_SUCCESS);
     return Command_Consequences::OK;
 }
 
@@ -508,7 +971,7 @@ int Command_Handler::handle_rnfr ()
     std::string file_name (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
     std::string file_path = user_.get_cur_dir () + '/' + file_name;
     struct stat buffer;
-    if(ACE_OS::stat (file_path.c_str(), &buffer) != 0)
+    if(Vfs::instance ()->stat (file_path, buffer) != 0)
     {
         send_response (MSG_INVALID_PARAM);
         return Command_Consequences::CONTINUE;
@@ -536,8 +999,13 @@ int Command_Handler::handle_rnto ()
     std::string new_name (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
     std::string new_file_path = user_.get_cur_dir () + '/' + new_name;
     std::string old_file_path = user_.get_cur_dir () + '/' + user_.get_old_file_name ();
-    if (ACE_OS::rename (old_file_path.c_str (), new_file_path.c_str ()) == 0)
+    // a file replaced by the rename loses a name too
+    struct stat replaced_stat;
+    bool is_replacing = (Vfs::instance ()->lstat (new_file_path, replaced_stat) == 0);
+    if (Vfs::instance ()->rename (old_file_path, new_file_path) == 0)
     {
+        if (is_replacing)
+            Dedup_Store::instance ()->release (replaced_stat);
         send_response (MSG_COMMON_SUCCESS);
         user_.get_old_file_name ().clear ();
         return Command_Consequences::OK;
@@ -558,15 +1026,15 @@ int Command_Handler::handle_rmd ()
 
     std::string dir_path (recv_buffer_ + 4, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (dir_path);
-    ACE_DEBUG ( (LM_DEBUG, "RMD %s\n", dir_path.c_str ()));
+    FTP_LOG (LOG_LEVEL_DEBUG, "RMD %s\n", dir_path.c_str ());
     struct stat buffer;
-    if(ACE_OS::stat (dir_path.c_str(), &buffer) != 0 ||
+    if(Vfs::instance ()->stat (dir_path, buffer) != 0 ||
         (buffer.st_mode & S_IFMT) != S_IFDIR)
     {
         send_response (MSG_INVALID_PARAM);
         return Command_Consequences::CONTINUE;
     }
-    else if (ACE_OS::rmdir (dir_path.c_str ()) != 0)
+    else if (Vfs::instance ()->rmdir (dir_path) != 0)
     {
         send_response (MSG_FAILED);
         return Command_Consequences::CONTINUE;
@@ -587,18 +1055,20 @@ int Command_Handler::handle_dele ()
     std::string file_path (recv_buffer_ + 5, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (file_path);
     struct stat buffer;
-    if(ACE_OS::stat (file_path.c_str(), &buffer) != 0)
+    if(Vfs::instance ()->stat (file_path, buffer) != 0)
     {
         send_response (MSG_INVALID_PARAM);
         return Command_Consequences::CONTINUE;
     }
-    else if (std::remove (file_path.c_str ()) != 0)
+    else if (Vfs::instance ()->remove (file_path) != 0)
     {
         send_response (MSG_FAILED);
         return Command_Consequences::CONTINUE;
     }
     else
     {
+        // the stored content goes with its last name
+        Dedup_Store::instance ()->release (buffer);
         send_response (MSG_COMMON_SUCCESS);
         return Command_Consequences::OK;
     }
@@ -612,7 +1082,7 @@ int Command_Handler::handle_mkd ()
 
     std::string dir_path (recv_buffer_ + 4, recv_buffer_ + strlen (recv_buffer_));
     relative_to_absolute (dir_path);
-    if (ACE_OS::mkdir (dir_path.c_str ()) < 0)
+    if (Vfs::instance ()->mkdir (dir_path, ACE_DEFAULT_DIR_PERMS) < 0)
     {
         send_response (MSG_FAILED);
         return Command_Consequences::CONTINUE;
@@ -624,7 +1094,551 @@ int Command_Handler::handle_mkd ()
     }
 }
 
-inline void Command_Handler::relative_to_absolute (std::string &str)
+int Command_Handler::handle_mode ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    CHECK_NO_TRANSFER();
+
+    switch (recv_buffer_[5])
+    {
+    case 'S':
+    case 's':
+        data_mode_ = Data_Modes::STREAM;
+        break;
+
+    case 'B':
+    case 'b':
+        data_mode_ = Data_Modes::BLOCK;
+        break;
+
+    case 'Z':
+    case 'z':
+        if (data_type_ == Data_Types::ASCII)
+        {
+            send_response (MSG_PARAM_NOT_IMPLEMENTED);
+            return Command_Consequences::CONTINUE;
+        }
+        data_mode_ = Data_Modes::COMPRESSED;
+        restart_offset_ = 0;
+        break;
+
+    case 'C':
+    case 'c':
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+
+    default:
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    if (data_handler_)
+        data_handler_->set_mode (data_mode_, deflate_level_);
+    send_response (MSG_COMMON_SUCCESS);
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_rest ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    // a compressed stream can not start in the middle
+    if (data_mode_ == Data_Modes::COMPRESSED)
+    {
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
+    char *end = nullptr;
+    errno = 0;
+    long long offset = strtoll (recv_buffer_ + 5, &end, 10);
+    if (end == recv_buffer_ + 5 || *end != '\0' || offset < 0 || errno == ERANGE)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    restart_offset_ = (off_t)offset;
+    send_response (MSG_RESTART, std::to_string (offset).c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_opts ()
+{
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    std::string options (recv_buffer_ + 5);
+    std::transform (options.begin (), options.end (), options.begin (), ::tolower);
+    std::istringstream options_stream (options);
+    std::string command, mode, key;
+    long level = -1;
+    options_stream >> command >> mode >> key >> level;
+    if (command == "hash")
+    {
+        // mode holds the algorithm, none to show the current one
+        int algorithm = (mode.empty () ? hash_algorithm_ : Hash_Context::find (mode));
+        if (algorithm == -1 || !key.empty ())
+        {
+            send_response (MSG_INVALID_PARAM);
+            return Command_Consequences::CONTINUE;
+        }
+        hash_algorithm_ = algorithm;
+        send_response (MSG_HASH_ALGORITHM, Hash_Context::name (algorithm));
+        return Command_Consequences::OK;
+    }
+    if (command != "mode" || mode != "z")
+    {
+        send_response (MSG_PARAM_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
+    if (key != "level" || level < 1 || level > 9)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+
+    CHECK_NO_TRANSFER();
+
+    deflate_level_ = (int)level;
+    if (data_handler_)
+        data_handler_->set_mode (data_mode_, deflate_level_);
+    send_response (MSG_MODE_Z_LEVEL, std::to_string (level).c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_feat ()
+{
+    // the algorithm of this session is marked with '*'
+    std::string algorithms;
+    for (int algorithm = 0; algorithm < Hash_Algorithms::HASH_ALGORITHMS; ++algorithm)
+    {
+        if (algorithm > 0)
+            algorithms += ';';
+        algorithms += Hash_Context::name (algorithm);
+        if (algorithm == hash_algorithm_)
+            algorithms += '*';
+    }
+    send_response (MSG_FEATURES, algorithms.c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_hash ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    Hash_Request request;
+    request.is_hash_command = true;
+    request.path.assign (recv_buffer_ + 5);
+    request.algorithm = hash_algorithm_;
+    request.begin = range_begin_;
+    request.end = range_end_;
+    // RANG applies to the next HASH only
+    range_begin_ = 0;
+    range_end_ = -1;
+    return start_hash (request);
+}
+
+int Command_Handler::handle_rang ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    char *end = nullptr;
+    errno = 0;
+    long long first = strtoll (recv_buffer_ + 5, &end, 10);
+    char *last_begin = end;
+    long long last = strtoll (last_begin, &end, 10);
+    if (last_begin == recv_buffer_ + 5 || end == last_begin || *end != '\0' || errno == ERANGE ||
+        first < 0 || last < 0 || last == LLONG_MAX)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    // "RANG 1 0" resets to the whole file
+    if (first == 1 && last == 0)
+    {
+        range_begin_ = 0;
+        range_end_ = -1;
+        send_response (MSG_RESTART, "0. Ending byte at EOF");
+        return Command_Consequences::OK;
+    }
+    if (first > last)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    range_begin_ = (off_t)first;
+    range_end_ = (off_t)last + 1;
+    std::string range_str = std::to_string (first) + ". Ending byte at " + std::to_string (last);
+    send_response (MSG_RESTART, range_str.c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_xcrc ()
+{
+    return handle_x_hash (Hash_Algorithms::HASH_CRC32);
+}
+
+int Command_Handler::handle_xmd5 ()
+{
+    return handle_x_hash (Hash_Algorithms::HASH_MD5);
+}
+
+int Command_Handler::handle_xsha1 ()
+{
+    return handle_x_hash (Hash_Algorithms::HASH_SHA1);
+}
+
+int Command_Handler::handle_xsha256 ()
+{
+    return handle_x_hash (Hash_Algorithms::HASH_SHA256);
+}
+
+int Command_Handler::handle_x_hash (int algorithm)
+{
+    CHECK_LOGIN();
+
+    const char *space_addr = strchr (recv_buffer_, ' ');
+    if (space_addr == nullptr || space_addr[1] == '\0')
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    std::string argument (space_addr + 1);
+    Hash_Request request;
+    request.is_hash_command = false;
+    request.algorithm = algorithm;
+    std::vector<long long> offsets;
+    bool is_valid = true;
+    if (argument[0] == '"')
+    {
+        size_t quote = argument.find ('"', 1);
+        is_valid = (quote != std::string::npos);
+        if (is_valid)
+        {
+            request.path = argument.substr (1, quote - 1);
+            std::istringstream offsets_stream (argument.substr (quote + 1));
+            long long offset = 0;
+            while (offsets_stream >> offset)
+                offsets.push_back (offset);
+            is_valid = offsets_stream.eof ();
+        }
+    }
+    else
+    {
+        // trailing numbers are the range, a path ending with a number is quoted
+        request.path = argument;
+        while (offsets.size () < 2)
+        {
+            size_t space = request.path.rfind (' ');
+            if (space == std::string::npos || space + 1 == request.path.length () ||
+                request.path.find_first_not_of ("0123456789", space + 1) != std::string::npos)
+                break;
+            offsets.insert (offsets.begin (), strtoll (request.path.c_str () + space + 1, nullptr, 10));
+            request.path.erase (space);
+        }
+    }
+    request.begin = (offsets.size () > 0 ? offsets[0] : 0);
+    request.end = (offsets.size () > 1 ? offsets[1] : -1);
+    if (!is_valid || request.path.empty () || offsets.size () > 2 || request.begin < 0 ||
+        (offsets.size () > 1 && request.end < request.begin))
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    return start_hash (request);
+}
+
+int Command_Handler::start_hash (const Hash_Request &request)
+{
+    if (is_hashing_)
+    {
+        send_response (MSG_BAD_SEQUENCE);
+        return Command_Consequences::CONTINUE;
+    }
+    hash_request_ = request;
+    std::string file_path = request.path;
+    relative_to_absolute (file_path);
+    hash_request_.result = Hash_Service::instance ()->hash (this, file_path, request.algorithm,
+                                                            request.begin, request.end,
+                                                            hash_request_.digest,
+                                                            hash_request_.file_size);
+    // the reply is sent by handle_exception ()
+    if (hash_request_.result == Hash_Results::HASH_PENDING)
+    {
+        is_hashing_ = true;
+        return Command_Consequences::OK;
+    }
+    return finish_hash ();
+}
+
+int Command_Handler::finish_hash ()
+{
+    if (hash_request_.result == Hash_Results::HASH_BUSY)
+    {
+        send_response (MSG_FILE_BUSY);
+        return Command_Consequences::CONTINUE;
+    }
+    else if (hash_request_.result != Hash_Results::HASH_OK)
+    {
+        send_response (MSG_FILE_UNAVAILABLE);
+        return Command_Consequences::CONTINUE;
+    }
+    if (!hash_request_.is_hash_command)
+    {
+        send_response (MSG_X_HASH, hash_request_.digest.c_str ());
+        return Command_Consequences::OK;
+    }
+    // HASH replies the range with its last byte
+    off_t end = (hash_request_.end < 0 ? hash_request_.file_size :
+                 std::min (hash_request_.end, hash_request_.file_size));
+    std::string hash_str = std::string (Hash_Context::name (hash_request_.algorithm)) + ' ' +
+                           std::to_string (hash_request_.begin) + '-' +
+                           std::to_string (std::max (end - 1, hash_request_.begin)) + ' ' +
+                           hash_request_.digest + ' ' + hash_request_.path;
+    send_response (MSG_HASH, hash_str.c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_site ()
+{
+    CHECK_LOGIN();
+
+    CHECK_COMMAND_LENGTH(recv_buffer_, 6);
+
+    char *sub_command_begin = recv_buffer_ + 5;
+    char *space_addr = strchr (sub_command_begin, ' ');
+    space_addr = (space_addr == nullptr ? sub_command_begin + strlen (sub_command_begin) : space_addr);
+    std::string sub_command (sub_command_begin, space_addr);
+    std::transform (sub_command.begin (),
+                    sub_command.end (),
+                    sub_command.begin (),
+                    ::tolower);
+    auto command_ite = site_commands_.find (sub_command);
+    if (command_ite == site_commands_.end ())
+    {
+        send_response (MSG_NOT_IMPLEMENTED);
+        return Command_Consequences::CONTINUE;
+    }
+    return (this->*(command_ite->second)) ();
+}
+
+const char *Command_Handler::site_argument ()
+{
+    char *space_addr = strchr (recv_buffer_ + 5, ' ');
+    return space_addr == nullptr ? "" : space_addr + 1;
+}
+
+bool Command_Handler::is_admin ()
+{
+    std::string name;
+    std::istringstream user_stream (Server_Config::instance ()->get_string ("admin_users", ""));
+    while (user_stream >> name)
+        if (name == user_.get_user_name ())
+            return true;
+    std::istringstream class_stream (Server_Config::instance ()->get_string ("admin_classes", ""));
+    while (class_stream >> name)
+        if (name == user_.get_class_name ())
+            return true;
+    return false;
+}
+
+int Command_Handler::handle_site_rate ()
+{
+    const char *argument = site_argument ();
+    if (*argument != '\0')
+    {
+        char *end = nullptr;
+        long rate = strtol (argument, &end, 10);
+        if (end == argument || *end != '\0' || rate < 0)
+        {
+            send_response (MSG_INVALID_PARAM);
+            return Command_Consequences::CONTINUE;
+        }
+        // a session may lower its rate, never lift the configured one
+        long max_rate = Bandwidth_Shaper::instance ()->get_session_rate ();
+        if (max_rate > 0 && (rate == 0 || rate > max_rate))
+            rate = max_rate;
+        session_bucket_->set_rate (rate);
+    }
+    std::string rate_str = std::to_string (session_bucket_->get_rate ());
+    send_response (MSG_SITE_RATE, rate_str.c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_site_stats ()
+{
+    if (!is_admin ())
+    {
+        send_response (MSG_PERMISSION_DENIED);
+        return Command_Consequences::CONTINUE;
+    }
+    std::string stats = "211-Server statistics\r\n";
+    stats += Metrics::instance ()->summary ();
+    stats += "211 End\r\n";
+    send_response (stats);
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_site_reload ()
+{
+    if (!is_admin ())
+    {
+        send_response (MSG_PERMISSION_DENIED);
+        return Command_Consequences::CONTINUE;
+    }
+    int users = Credential_Store::instance ()->reload ();
+    if (users == -1)
+    {
+        send_response (MSG_FAILED);
+        return Command_Consequences::CONTINUE;
+    }
+    std::string users_str = std::to_string (users);
+    send_response (MSG_SITE_RELOAD, users_str.c_str ());
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_site_checksum ()
+{
+    std::istringstream argument_stream (site_argument ());
+    std::string name, digest;
+    argument_stream >> name >> digest;
+    int algorithm = Hash_Context::find (name);
+    if (algorithm == -1 || digest.empty () ||
+        digest.find_first_not_of ("0123456789abcdefABCDEF") != std::string::npos)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    std::transform (digest.begin (), digest.end (), digest.begin (), ::tolower);
+    expected_algorithm_ = algorithm;
+    expected_digest_ = digest;
+    send_response (MSG_SITE_CHECKSUM, Hash_Context::name (algorithm));
+    return Command_Consequences::OK;
+}
+
+int Command_Handler::handle_site_segment ()
+{
+    const char *argument = site_argument ();
+    char *end = nullptr;
+    errno = 0;
+    long long size = strtoll (argument, &end, 10);
+    if (end == argument || *end != '\0' || size < 0 || errno == ERANGE)
+    {
+        send_response (MSG_INVALID_PARAM);
+        return Command_Consequences::CONTINUE;
+    }
+    segment_size_ = (off_t)size;
+    send_response (MSG_SITE_SEGMENT, std::to_string (size).c_str ());
+    return Command_Consequences::OK;
+}
+
+void Command_Handler::register_metrics ()
+{
+    for (auto &command : commands_)
+        Metrics::instance ()->register_command (command.first);
+}
+
+void Command_Handler::transfer_complete (Data_Handler *data_handler, int result)
+{
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_ || data_handler_.get () != data_handler)
+        return;
+    // digests of an upload were computed as it was written
+    std::vector<std::string> digests;
+    int finish_res = (result == 0 ? data_handler->finish_file (digests) : 0);
+    if (finish_res == -1)
+        result = -1;
+    bool is_mismatch = (finish_res == -2);
+    log_transfer (data_handler, result == 0 && !is_mismatch);
+    if (is_mismatch)
+        send_response (MSG_CHECKSUM_MISMATCH);
+    else if (result == 0 && data_handler->is_segment ())
+    {
+        std::string received_str = std::to_string ((long long)data_handler->get_segment_received ()) + " of " +
+                                   std::to_string ((long long)data_handler->get_segment_size ());
+        send_response (MSG_SEGMENT_STORED, received_str.c_str ());
+    }
+    else if (result == 0)
+        send_response (MSG_COMMON_SUCCESS);
+    else
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "transfer failed\n");
+        send_response (data_handler->is_handshaking () ? MSG_TLS_DATA_FAIL : MSG_FAILED);
+    }
+    // MODE B keeps the data connection for the next transfer
+    if (result != 0 || data_handler_->reuse () == -1)
+        data_handler_.reset ();
+    time_of_last_command_ = 
+        reactor ()->timer_queue ()->gettimeofday ();
+}
+
+void Command_Handler::transfer_retry (Data_Handler *data_handler)
+{
+    std::lock_guard<std::recursive_mutex> guard (lock_);
+    if (is_closed_ || data_handler_.get () != data_handler)
+        return;
+    // 0 again while the file is still locked and the wait isn't over
+    int result = data_handler->retry_transfer (this);
+    if (result == 0)
+        return;
+    FTP_LOG (LOG_LEVEL_INFO, "retry transfer failed\n");
+    log_transfer (data_handler, false);
+    send_response (result == -2 ? MSG_FILE_BUSY : MSG_FAILED);
+    data_handler_.reset ();
+}
+
+void Command_Handler::set_data_handler (Data_Handler *data_handler)
+{
+    data_handler_.reset (data_handler);
+    data_handler_->set_mode (data_mode_, deflate_level_);
+    data_handler_->set_buckets (user_bucket_, session_bucket_);
+    long weight = user_.get_weight ();
+    if (weight <= 0)
+        weight = Transfer_Scheduler::instance ()->class_weight (user_.get_class_name ());
+    data_handler_->set_flow (user_.get_user_name (), user_.get_class_name (), weight);
+}
+
+int Command_Handler::strip_telnet (int length)
+{
+    int kept = 0;
+    for (int i = 0; i < length; ++i)
+    {
+        unsigned char byte = (unsigned char)recv_buffer_[i];
+        if (telnet_state_ == Telnet_States::TELNET_COMMAND)
+        {
+            if (byte == TELNET_IAC)
+                recv_buffer_[kept++] = recv_buffer_[i];
+            telnet_state_ = (byte >= TELNET_WILL && byte <= TELNET_DONT ?
+                             Telnet_States::TELNET_OPTION : Telnet_States::TELNET_DATA);
+        }
+        else if (telnet_state_ == Telnet_States::TELNET_OPTION)
+            telnet_state_ = Telnet_States::TELNET_DATA;
+        else if (byte == TELNET_IAC)
+            telnet_state_ = Telnet_States::TELNET_COMMAND;
+        else
+            recv_buffer_[kept++] = recv_buffer_[i];
+    }
+    return kept;
+}
+
+void Command_Handler::log_transfer (Data_Handler *data_handler, bool is_complete)
+{
+    Transfer_Trace &trace = data_handler->get_trace ();
+    trace.mark (Trace_Phases::TRACE_DONE);
+    Transfer_Log::instance ()->log (trace,
+                                    client_addr_,
+                                    user_.get_user_name (),
+                                    data_type_ == Data_Types::ASCII,
+                                    is_complete);
+}
+
+void Command_Handler::relative_to_absolute (std::string &str)
 {
     if (str[0] != '/')
     {
@@ -638,15 +1652,17 @@ inline void Command_Handler::relative_to_absolute (std::string &str)
 
 Command_Handler::~Command_Handler ()
 {
-    reactor ()->remove_handler (command_link_.get_handle (), 
-                                ACE_Event_Handler::READ_MASK |
-                                ACE_Event_Handler::DONT_CALL);
-    reactor ()->cancel_timer (this);
     if(data_handler_)
     {
         //data_handler_->close ();
         data_handler_.reset ();
     }
     pasv_acceptor_.close ();
+    // close_notify goes before the socket, whose number may be reused at once
+    tls_.reset ();
     command_link_.close();
+    if (is_user_admitted_)
+        Admission_Control::instance ()->release_user (user_.get_user_name ());
+    if (!client_addr_.empty ())
+        Admission_Control::instance ()->release_connection (client_addr_);
 }
\ No newline at end of file
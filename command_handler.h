@@ -4,6 +4,7 @@
 #include "user_inf.h"
 #include "data_handler.h"
 #include "ftp_server.h"
+#include "token_bucket.h"
 
 #include "ace/Event_Handler.h"
 #include "ace/Reactor.h"
@@ -12,12 +13,18 @@
 
 #include <string>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 
 #define MAX_COMMAND_BUFFER_SIZE 1024
 #define HOST_ADDRESS "127,0,0,1"
 #define MAX_CLIENT_TIMEOUT 1800
 
+// Telnet commands in the command stream, like the IP and Synch before ABOR, RFC 854
+#define TELNET_IAC 255          // interpret as command, doubled for a data byte
+#define TELNET_DONT 254         // DONT, DO, WONT and WILL are followed by an option byte
+#define TELNET_WILL 251
+
 #define CHECK_LOGIN() \
     if (!user_.check_logged_in ()) \
     { \
@@ -33,26 +40,43 @@
     } \
 
 #define CHECK_DATA_LINK_VALID() \
-    if (!data_handler_) \
+    if (!data_handler_ || data_handler_->is_busy ()) \
     { \
         ACE_DEBUG ((LM_DEBUG, "data link not set.\n")); \
         send_response (MSG_BAD_SEQUENCE); \
         return Command_Consequences::CONTINUE; \
     } \
 
+#define CHECK_NO_TRANSFER() \
+    if (data_handler_ && data_handler_->is_busy ()) \
+    { \
+        send_response (MSG_BAD_SEQUENCE); \
+        return Command_Consequences::CONTINUE; \
+    } \
+
+enum Telnet_States
+{
+    TELNET_DATA = 0,        // command text
+    TELNET_COMMAND = 1,     // after IAC
+    TELNET_OPTION = 2,      // after IAC and WILL, WONT, DO or DONT
+};
+
 enum Command_Consequences
 {
     OK = 0,
     COMMAND_CON_CLOSE = -1,
     DATA_CON_CLOSE = -2,
     CONTINUE = -3,
+    COMMAND_CON_REJECT = -4,
 };
 
 class Command_Handler : public ACE_Event_Handler 
 {
 public:
     /**
-     * @brief Construct a new Command_Handler object
+     * @brief Construct a new Command_Handler object.
+     *        Reference counting is enabled, the creator owns the first reference
+     *        and releases it by remove_reference () after init ().
      * 
      * @param reactor the reactor that manage this Command_Handler
      */
@@ -75,7 +99,16 @@ public:
     virtual int handle_input (ACE_HANDLE = ACE_INVALID_HANDLE);
 
     /**
-     * @brief Close command connection
+     * @brief The handler for output event, registered only while the TLS handshake
+     *        of AUTH waits for the socket to be writable
+     * 
+     * @return int , 0 for success, -1 for a failed handshake then trigger handle_close
+     */
+    virtual int handle_output (ACE_HANDLE = ACE_INVALID_HANDLE);
+
+    /**
+     * @brief Close command connection and data connection, unregister from reactor.
+     *        The object is destroyed when the last reference is released.
      * 
      * @return int , return value doesn't matter, it will be ignored by reactor
      */
@@ -84,13 +117,23 @@ public:
 
     /**
      * @brief The handler for timeout event, when last command is over [max_client_timeout_]
-     *        ago, close this command connection and data connection.
+     *        ago, or the TLS handshake of AUTH is not done in TLS_HANDSHAKE_TIMEOUT_MSEC,
+     *        close this command connection and data connection.
      * 
      * @param now current time
      * @param act Asynchronous Completion Token
      * @return int , 0 for success
      */
     virtual int handle_timeout (const ACE_Time_Value &now, const void *act);
+
+    /**
+     * @brief The handler for notifications, finish the login whose password
+     *        has been verified by Auth_Pool and reply the digest computed by Hash_Service
+     * 
+     * @return int , 0 for success, -1 for closing the command connection
+     */
+    virtual int handle_exception (ACE_HANDLE = ACE_INVALID_HANDLE);
+
     /**
      * @brief The handler for ftp commands
      * 
@@ -100,6 +143,7 @@ public:
      *               COMMAND_CON_CLOSE (-1) means something fatal and command connection need be closed
      *               DATA_CON_CLOSE (-2) means something wrong and data connetion need be closed
      *               CONTINUE (-3) means something wrong but the server can continue with nothing to do
+     *               COMMAND_CON_REJECT (-4) means the reply has been sent and command connection need be closed
      */
     virtual int handle_command ();
 
@@ -147,6 +191,14 @@ public:
      */
     virtual int handle_quit ();
 
+    /**
+     * @brief The handler for ftp ABOR command, stop the transfer in progress,
+     *        reply 426 for it and 226 once the data connection is closed
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_abor ();
+
     /**
      * @brief The handler for ftp PORT command,
      *        instantiate active data_handler with received address
@@ -167,7 +219,7 @@ public:
     /**
      * @brief The handler for TYPE command,
      *        change data type for transfer, RFC959 provides three types:
-     *        ASCII, EBCDIC and IMAGE, but this server only support IMAGE.
+     *        ASCII, EBCDIC and IMAGE, this server supports ASCII and IMAGE.
      * 
      * @return int , see the comment of handle_command ()
      */
@@ -204,6 +256,48 @@ public:
      */
     virtual int handle_stor ();
 
+    /**
+     * @brief The handler for APPE command,
+     *        as STOR but the received data is appended to the file if it exists.
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_appe ();
+
+    /**
+     * @brief The handler for ALLO command, "ALLO size [R record-size]" declares the
+     *        size of the next STOR or APPE, its space is allocated before the data
+     *        arrives and a large one is written with O_DIRECT
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_allo ();
+
+    /**
+     * @brief The handler for AUTH command, "AUTH TLS" replies 234 and starts the
+     *        TLS handshake on the command connection, handle_input () and handle_output ()
+     *        go on with it, the session is encrypted after it
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_auth ();
+
+    /**
+     * @brief The handler for PBSZ command, only "PBSZ 0" after AUTH TLS as TLS
+     *        needs no buffer size
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_pbsz ();
+
+    /**
+     * @brief The handler for PROT command, "PROT P" makes the TLS handshake on
+     *        every following data connection, "PROT C" leaves them plain
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_prot ();
+
     /**
      * @brief The handler for REFR command,
      *        check and record the file that client wants to rename.
@@ -242,6 +336,166 @@ public:
      */
     virtual int handle_mkd ();
 
+    /**
+     * @brief The handler for MODE command, change the transfer mode: S (stream),
+     *        B (block, the data connection is kept between transfers)
+     *        or Z (deflate, compressed with the level set by OPTS)
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_mode ();
+
+    /**
+     * @brief The handler for REST command, the next RETR or STOR starts at the offset,
+     *        not supported in MODE Z
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_rest ();
+
+    /**
+     * @brief The handler for OPTS command, "OPTS MODE Z LEVEL n" sets the deflate level
+     *        and "OPTS HASH [algorithm]" shows or sets the algorithm of HASH
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_opts ();
+
+    /**
+     * @brief The handler for FEAT command, list the extensions
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_feat ();
+
+    /**
+     * @brief The handler for HASH command, reply the digest of a file with the
+     *        algorithm chosen by OPTS HASH, over the range set by RANG
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_hash ();
+
+    /**
+     * @brief The handler for RANG command, set the first and the last byte of
+     *        the next HASH, "RANG 1 0" resets to the whole file
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_rang ();
+
+    /**
+     * @brief The handler for XCRC command, reply the CRC32 of a file,
+     *        optionally of the bytes from a start to an end offset
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_xcrc ();
+
+    /**
+     * @brief The handler for XMD5 command, as XCRC with MD5
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_xmd5 ();
+
+    /**
+     * @brief The handler for XSHA1 command, as XCRC with SHA-1
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_xsha1 ();
+
+    /**
+     * @brief The handler for XSHA256 command, as XCRC with SHA-256
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_xsha256 ();
+
+    /**
+     * @brief The handler for SITE command, dispatch to site_commands_
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site ();
+
+    /**
+     * @brief The handler for SITE RATE command, show or lower the transfer rate
+     *        of this session in bytes per second, 0 for no session limit
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site_rate ();
+
+    /**
+     * @brief The handler for SITE STATS command, reply server statistics,
+     *        administrators only
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site_stats ();
+
+    /**
+     * @brief The handler for SITE RELOAD command, reload the users file,
+     *        sessions already logged in keep their settings, administrators only
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site_reload ();
+
+    /**
+     * @brief The handler for SITE CHECKSUM command, "SITE CHECKSUM algorithm digest"
+     *        declares the digest of the next STOR, which is verified before the reply
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site_checksum ();
+
+    /**
+     * @brief The handler for SITE SEGMENT command, "SITE SEGMENT size" makes the
+     *        next STOR a segment of a file of the size, starting at the REST offset;
+     *        sessions store segments of a file at once and it appears when complete
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    virtual int handle_site_segment ();
+
+    /**
+     * @brief Called by an Auth_Pool worker when the password of PASS is verified,
+     *        the reply is sent from an event loop thread by handle_exception ()
+     * 
+     * @param result AUTH_OK or AUTH_FAILED
+     */
+    void auth_complete (int result);
+
+    /**
+     * @brief Called by a Hash_Service worker when the digest of HASH or an X command
+     *        is computed, the reply is sent from an event loop thread by handle_exception ()
+     * 
+     * @param result HASH_OK or HASH_FAILED
+     * @param digest the digest for HASH_OK
+     * @param file_size the file size for HASH_OK
+     */
+    void hash_complete (int result, const std::string &digest, off_t file_size);
+
+    /**
+     * @brief Called by data_handler when its transfer is over, reply the result
+     *        and close data connection
+     * 
+     * @param data_handler the data handler whose transfer is over
+     * @param result 0 for success, -1 for failure
+     */
+    void transfer_complete (Data_Handler *data_handler, int result);
+
+    /**
+     * @brief Called by data_handler when the file its transfer waits for may be
+     *        free, start the transfer again, reply when it fails
+     * 
+     * @param data_handler the data handler waiting for its file lock
+     */
+    void transfer_retry (Data_Handler *data_handler);
+
     /**
      * @brief Get the command link object
      * 
@@ -249,6 +503,19 @@ public:
      */
     ACE_SOCK_Stream &get_command_link () { return command_link_; }
 
+    /**
+     * @brief Register every command to Metrics, must be called before the event loop starts
+     */
+    static void register_metrics ();
+
+    /**
+     * @brief Set the client address, the session has been counted by
+     *        Admission_Control and is released when this object is destroyed
+     * 
+     * @param client_addr client's ip address
+     */
+    void set_client_addr (const std::string &client_addr) { client_addr_ = client_addr; }
+
     /**
      * @brief Destroy the Command_Handler object
      * 
@@ -256,20 +523,64 @@ public:
     ~Command_Handler ();
 
 private:
+    friend struct Bench_Access;                 // microbenchmarks reach the internals
+
+    struct Hash_Request
+    {
+        bool is_hash_command;   // HASH, or one of XCRC, XMD5, XSHA1 and XSHA256
+        std::string path;       // path as given by the client
+        int algorithm;          // enum Hash_Algorithms
+        off_t begin;            // first byte
+        off_t end;              // byte after the last one, -1 for the end of file
+        int result;             // see enum Hash_Results
+        std::string digest;     // the digest for HASH_OK
+        off_t file_size;        // the file size for HASH_OK
+    };
+
     ACE_SOCK_Stream command_link_;              // command connection with ftp client
+    std::unique_ptr<Tls_Stream> tls_;           // TLS over command_link_ after AUTH TLS, null for plain
+    std::string tls_session_context_;           // binds the data connections' TLS sessions to this session
+    bool is_handshaking_;                       // whether the TLS handshake of AUTH is unfinished
+    long handshake_timer_;                      // timer ending the handshake, its address is the act
+    bool is_pbsz_;                              // whether PBSZ was given after AUTH TLS
+    bool is_data_private_;                      // whether data connections use TLS, PROT P
     ACE_SOCK_Acceptor pasv_acceptor_;           // acceptor for passive mode
     char recv_buffer_[MAX_COMMAND_BUFFER_SIZE]; // buffer for received command
+    int telnet_state_;                          // where a Telnet command cut by the last recv was, enum Telnet_States
     User_Inf user_;                             // user information
-    std::unique_ptr<Data_Handler> data_handler_;// data connection with tp client
+    Data_Handler_Ptr data_handler_;             // data connection with tp client
     int data_type_;                             // ftp data type, only support IMAGE
+    int data_mode_;                             // ftp transfer mode, enum Data_Modes
+    int deflate_level_;                         // zlib compression level of MODE Z
+    off_t restart_offset_;                      // offset set by REST for the next RETR or STOR
     bool is_pasv_;                              // whether in passive mode 
     u_short pasv_port_;                         // port number for passive mode
+    std::string client_addr_;                   // client's ip address, counted by Admission_Control
+    bool is_user_admitted_;                     // whether the login is counted by Admission_Control
     ACE_Time_Value time_of_last_command_;       // time of last valid command
     const ACE_Time_Value max_client_timeout_;   // max interval for two commands
+    std::recursive_mutex lock_;                 // serializes upcalls and transfer_complete ()
+    bool is_closed_;                            // whether handle_close () has been done
+    bool is_authenticating_;                    // whether PASS waits for Auth_Pool
+    int auth_result_;                           // result from Auth_Pool, see enum Auth_Results
+    int hash_algorithm_;                        // algorithm of HASH, set by OPTS HASH
+    off_t range_begin_;                         // first byte of the next HASH, set by RANG
+    off_t range_end_;                           // byte after the last one of the next HASH, -1 for the end of file
+    bool is_hashing_;                           // whether HASH or an X command waits for Hash_Service
+    Hash_Request hash_request_;                 // the request waiting for Hash_Service
+    int expected_algorithm_;                    // algorithm declared by SITE CHECKSUM for the next STOR, -1 for none
+    std::string expected_digest_;               // digest declared by SITE CHECKSUM, lower case
+    off_t segment_size_;                        // file size declared by SITE SEGMENT for the next STOR, -1 for none
+    off_t allocate_size_;                       // file size declared by ALLO for the next STOR or APPE, -1 for none
+    std::shared_ptr<Token_Bucket> user_bucket_;     // shapes all sessions of the user
+    std::shared_ptr<Token_Bucket> session_bucket_;  // shapes this session
 
     // command to function map
     static const std::unordered_map<std::string, int (Command_Handler::*) ()> commands_;
 
+    // SITE sub-command to function map
+    static const std::unordered_map<std::string, int (Command_Handler::*) ()> site_commands_;
+
     /**
      * @brief send specified response to client, see detailed response in msg.h
      * 
@@ -287,6 +598,54 @@ private:
      */
     int send_response (const char *format, const char *detail);
 
+    /**
+     * @brief Reply PASS with the result of password verification, admit the
+     *        user and apply its rate limit on success
+     * 
+     * @param result see enum Auth_Results
+     * @return int , see the comment of handle_command ()
+     */
+    int finish_login (int result);
+
+    /**
+     * @brief Start HASH or an X command, reply now if the digest is known
+     * 
+     * @param request the command, its path and range
+     * @return int , see the comment of handle_command ()
+     */
+    int start_hash (const Hash_Request &request);
+
+    /**
+     * @brief Reply HASH or an X command with the result in hash_request_
+     * 
+     * @return int , see the comment of handle_command ()
+     */
+    int finish_hash ();
+
+    /**
+     * @brief Parse the argument of an X command: a path, optionally quoted,
+     *        and an optional start and end offset, the end is exclusive
+     * 
+     * @param algorithm enum Hash_Algorithms
+     * @return int , see the comment of handle_command ()
+     */
+    int handle_x_hash (int algorithm);
+
+    /**
+     * @brief Start STOR or APPE
+     * 
+     * @param is_append whether the data is appended to the file
+     * @return int , see the comment of handle_command ()
+     */
+    int start_upload (bool is_append);
+
+    /**
+     * @brief Go on with the TLS handshake of AUTH and listen to the event it waits for
+     * 
+     * @return int , 0 for done or waiting, -1 for failure
+     */
+    int continue_handshake ();
+
     /**
      * @brief establish passive or active data connection
      * 
@@ -294,13 +653,61 @@ private:
      */
     int make_data_connection ();
 
+    /**
+     * @brief Protect the data connection by TLS under PROT P, after the 150 reply as
+     *        clients start the handshake when they see the reply; it is made by the
+     *        transfer, which fails with 425 when it does
+     */
+    void protect_data_connection ();
+
+    /**
+     * @brief Replace data connection, the new one is shaped by the session's buckets
+     *        and scheduled in the flow of the user
+     * 
+     * @param data_handler new data connection
+     */
+    void set_data_handler (Data_Handler *data_handler);
+
+    /**
+     * @brief Drop Telnet commands from the received bytes, IP and the Synch of
+     *        an ABOR among them; a command cut by the end of the bytes is
+     *        dropped from the next ones
+     * 
+     * @param length bytes received in recv_buffer_
+     * @return int , bytes left
+     */
+    int strip_telnet (int length);
+
+    /**
+     * @brief Write the xferlog line of a transfer over or failed to start
+     * 
+     * @param data_handler data connection of the transfer
+     * @param is_complete whether the transfer completed
+     */
+    void log_transfer (Data_Handler *data_handler, bool is_complete);
+
+    /**
+     * @brief Get the argument of a SITE sub-command
+     * 
+     * @return const char* , the text after "SITE <sub-command> ", empty if none
+     */
+    const char *site_argument ();
+
+    /**
+     * @brief Whether the logged in user may run the administrative SITE commands,
+     *        listed in admin_users or of a class listed in admin_classes
+     * 
+     * @return true the user is an administrator
+     */
+    bool is_admin ();
+
     /**
      * @brief change param from relative path to absolute path, if param 
      *        is absolute path, do nothing.
      * 
      * @param str path
      */
-    inline void relative_to_absolute (std::string &str);
+    void relative_to_absolute (std::string &str);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include "credential_store.h"
+#include "async_log.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <system_error>
+
+Credential_Store::Reader::Reader ()
+{
+    Credential_Store *store = Credential_Store::instance ();
+    slot_ = store->epoch_.load () & 1;
+    store->readers_[slot_].fetch_add (1);
+    // loaded after entering, so a reload that missed this reader published first
+    snapshot_ = store->current_.load ();
+}
+
+Credential_Store::Reader::~Reader ()
+{
+    Credential_Store::instance ()->readers_[slot_].fetch_sub (1, std::memory_order_release);
+}
+
+const User_Entry *Credential_Store::Reader::find (const std::string &username) const
+{
+    auto ite = snapshot_->users.find (username);
+    return ite == snapshot_->users.end () ? nullptr : &ite->second;
+}
+
+Credential_Store::Credential_Store () :
+    current_ (new Credential_Snapshot),
+    epoch_ (0),
+    path_ ("./users.txt"),
+    file_mtime_ (0),
+    file_size_ (-1),
+    is_watching_ (false)
+{
+    readers_[0].store (0);
+    readers_[1].store (0);
+}
+
+Credential_Store::~Credential_Store ()
+{
+    stop_watch ();
+    delete current_.load ();
+}
+
+Credential_Store *Credential_Store::instance ()
+{
+    static Credential_Store store;
+    return &store;
+}
+
+int Credential_Store::reload ()
+{
+    std::lock_guard<std::mutex> guard (writer_lock_);
+    struct stat file_stat;
+    std::ifstream file_stream;
+    file_stream.open (path_);
+    if (!file_stream.is_open () || stat (path_.c_str (), &file_stat) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "read %s failed\n", path_.c_str ());
+        return -1;
+    }
+
+    Credential_Snapshot *snapshot = new Credential_Snapshot;
+    std::string str_line;
+    while (std::getline (file_stream, str_line))
+    {
+        if (str_line.empty ())
+            continue;
+        std::istringstream line_stream (str_line);
+        std::string user;
+        User_Entry entry;
+        entry.rate_limit = 0;
+        entry.class_name = DEFAULT_USER_CLASS;
+        entry.weight = 0;
+        line_stream >> user >> entry.password;
+        if (user.empty () || entry.password.empty ())
+            continue;
+        std::string option;
+        while (line_stream >> option)
+        {
+            size_t pos = option.find ('=');
+            std::string key = option.substr (0, pos);
+            std::string value = (pos == std::string::npos ? "" : option.substr (pos + 1));
+            if (key == "rate")
+                entry.rate_limit = std::strtol (value.c_str (), nullptr, 10);
+            else if (key == "class")
+                entry.class_name = value;
+            else if (key == "weight")
+                entry.weight = std::strtol (value.c_str (), nullptr, 10);
+            else
+                FTP_LOG (LOG_LEVEL_INFO, "unknown user option %s\n", key.c_str ());
+        }
+        snapshot->users[user] = entry;
+    }
+
+    file_mtime_ = (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+    file_size_ = file_stat.st_size;
+    const Credential_Snapshot *retired = current_.exchange (snapshot);
+    synchronize ();
+    delete retired;
+    FTP_LOG (LOG_LEVEL_INFO, "%d users loaded from %s\n", (int)snapshot->users.size (), path_.c_str ());
+    return (int)snapshot->users.size ();
+}
+
+void Credential_Store::synchronize ()
+{
+    // flip twice: a reader may have read the epoch before a flip and entered after it
+    for (int flip = 0; flip < 2; ++flip)
+    {
+        unsigned old_epoch = epoch_.fetch_add (1);
+        while (readers_[old_epoch & 1].load () != 0)
+            std::this_thread::yield ();
+    }
+}
+
+int Credential_Store::reload_if_changed ()
+{
+    struct stat file_stat;
+    if (stat (path_.c_str (), &file_stat) != 0)
+        return -1;
+    long long mtime = (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+    {
+        std::lock_guard<std::mutex> guard (writer_lock_);
+        if (mtime == file_mtime_ && file_stat.st_size == file_size_)
+            return 0;
+    }
+    return reload () == -1 ? -1 : 1;
+}
+
+int Credential_Store::watch (long interval_sec)
+{
+    if (interval_sec <= 0)
+        return 0;
+    std::lock_guard<std::mutex> guard (watch_lock_);
+    if (is_watching_)
+        return 0;
+    is_watching_ = true;
+    try
+    {
+        watcher_ = std::thread (&Credential_Store::watch_loop, this, interval_sec);
+    }
+    catch (const std::system_error &)
+    {
+        is_watching_ = false;
+        return -1;
+    }
+    return 0;
+}
+
+void Credential_Store::stop_watch ()
+{
+    {
+        std::lock_guard<std::mutex> guard (watch_lock_);
+        if (!is_watching_)
+            return;
+        is_watching_ = false;
+    }
+    watch_stop_.notify_all ();
+    if (watcher_.joinable ())
+        watcher_.join ();
+}
+
+void Credential_Store::watch_loop (long interval_sec)
+{
+    std::unique_lock<std::mutex> guard (watch_lock_);
+    while (is_watching_)
+    {
+        watch_stop_.wait_for (guard, std::chrono::seconds (interval_sec));
+        if (!is_watching_)
+            break;
+        guard.unlock ();
+        reload_if_changed ();
+        guard.lock ();
+    }
+}
+
+size_t Credential_Store::size ()
+{
+    // a snapshot is only retired under the writer lock
+    std::lock_guard<std::mutex> guard (writer_lock_);
+    return current_.load ()->users.size ();
+}
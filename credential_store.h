@@ -0,0 +1,150 @@
+#ifndef CREDENTIAL_STORE_H
+#define CREDENTIAL_STORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#define DEFAULT_USER_CLASS "default"
+#define DEFAULT_CREDENTIALS_CHECK_SEC 2
+
+struct User_Entry
+{
+    std::string password;   // sha256 of password with SALT
+    long rate_limit;        // transfer rate of the user in bytes per second, 0 for unlimited
+    std::string class_name; // scheduling class of the user
+    long weight;            // scheduling weight of the user, 0 for the weight of its class
+};
+
+/**
+ * Immutable set of users, replaced as a whole on reload.
+ */
+struct Credential_Snapshot
+{
+    std::unordered_map<std::string, User_Entry> users;  // entries by username
+};
+
+/**
+ * Users read from the password file, readable from every thread without locks.
+ * A reload parses the file into a new snapshot, publishes it with one atomic
+ * store, waits until no reader can still see the old one and frees it (RCU).
+ * Readers enter through Credential_Store::Reader, which costs two atomic
+ * increments and never waits or allocates.
+ */
+class Credential_Store
+{
+public:
+    /**
+     * Read-side critical section, the snapshot stays valid while it lives.
+     * Keep it short, a reload waits for it.
+     */
+    class Reader
+    {
+    public:
+        Reader ();
+        ~Reader ();
+
+        /**
+         * @brief Find a user in the snapshot
+         *
+         * @param username
+         * @return const User_Entry* , nullptr for no such user
+         */
+        const User_Entry *find (const std::string &username) const;
+
+    private:
+        Reader (const Reader &) = delete;
+        Reader &operator= (const Reader &) = delete;
+
+        int slot_;                              // reader counter entered
+        const Credential_Snapshot *snapshot_;   // snapshot seen on entering
+    };
+
+    /**
+     * @brief Get the process-wide credential store
+     *
+     * @return Credential_Store*
+     */
+    static Credential_Store *instance ();
+
+    /**
+     * @brief Read the password file and publish it as the current snapshot.
+     *        Each line is "username password [key=value ...]", supported keys:
+     *        rate, transfer rate limit of the user in bytes per second;
+     *        class, scheduling class of the user;
+     *        weight, scheduling weight of the user, overrides the class weight.
+     *
+     * @return int , number of users for success, -1 for failure and the
+     *               current snapshot is kept
+     */
+    int reload ();
+
+    /**
+     * @brief Reload when the modification time or size of the file changed
+     *
+     * @return int , 1 for reloaded, 0 for unchanged, -1 for failure
+     */
+    int reload_if_changed ();
+
+    /**
+     * @brief Start a thread that calls reload_if_changed () periodically
+     *
+     * @param interval_sec seconds between checks, 0 disables
+     * @return int , 0 for success, -1 for failure
+     */
+    int watch (long interval_sec);
+
+    /**
+     * @brief Stop the watching thread
+     */
+    void stop_watch ();
+
+    /**
+     * @brief Get the number of users of the current snapshot
+     *
+     * @return size_t
+     */
+    size_t size ();
+
+    /**
+     * @brief Set the path of the password file, used by tests
+     *
+     * @param path
+     */
+    void set_path (const std::string &path) { path_ = path; }
+
+    ~Credential_Store ();
+
+private:
+    Credential_Store ();
+
+    /**
+     * @brief Wait until every reader that may see the retired snapshot has left
+     */
+    void synchronize ();
+
+    /**
+     * @brief Body of the watching thread
+     *
+     * @param interval_sec seconds between checks
+     */
+    void watch_loop (long interval_sec);
+
+    std::atomic<const Credential_Snapshot *> current_;  // published snapshot
+    std::atomic<unsigned> epoch_;                       // low bit selects the counter new readers enter
+    std::atomic<long> readers_[2];                      // readers inside a critical section, by epoch
+    std::mutex writer_lock_;                            // serializes reloads
+    std::string path_;                                  // password file
+    long long file_mtime_;                              // modification time of the loaded file, nanoseconds
+    long long file_size_;                               // size of the loaded file
+
+    std::mutex watch_lock_;                             // guards is_watching_
+    std::condition_variable watch_stop_;                // wakes the watching thread to stop
+    bool is_watching_;                                  // whether the watching thread runs
+    std::thread watcher_;                               // watching thread
+};
+
+#endif
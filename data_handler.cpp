@@ -1,40 +1,170 @@
 #include "data_handler.h"
+#include "ascii_convert.h"
+#include "async_log.h"
+#include "bandwidth_shaper.h"
+#include "buffer_pool.h"
+#include "command_handler.h"
+#include "dedup_store.h"
+#include "segmented_upload.h"
+#include "small_file_cache.h"
+#include "metrics.h"
+#include "transform_cache.h"
+#include "vfs.h"
 
-#include "ace/Log_Msg.h"
-#include "ace/FILE_Connector.h"
-
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
 #include <grp.h>
-#include <sys/file.h>
+#include <pwd.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
 
-Data_Handler::Data_Handler (const std::string &ip_addr, const int &port, const int &type) :
+Data_Handler::Data_Handler (ACE_Reactor *reactor, const int &type) : 
+    ACE_Event_Handler (reactor),
+    mode_ (Data_Modes::STREAM),
+    deflate_level_ (DEFAULT_DEFLATE_LEVEL),
     type_ (type),
+    is_lock_ (false),
+    is_write_lock_ (false),
+    lock_key_ (),
+    lock_fd_ (-1),
+    state_ (Transfer_States::TRANSFER_IDLE),
+    owner_ (nullptr),
+    transfer_mask_ (ACE_Event_Handler::NULL_MASK),
+    file_offset_ (0),
+    lock_wait_state_ (Transfer_States::TRANSFER_IDLE),
+    list_sent_ (0),
+    flow_weight_ (1),
+    flow_ (nullptr),
+    send_sent_ (0),
+    is_inflating_ (false),
+    is_inflate_end_ (false),
+    cache_fd_ (-1),
+    cache_length_ (0),
+    restart_offset_ (0),
+    last_marker_ (0),
+    is_eof_sent_ (false),
+    block_header_length_ (0),
+    block_remaining_ (0),
+    is_cr_pending_ (false),
+    is_dedup_ (false),
+    is_append_ (false),
+    segment_size_ (-1),
+    segment_begin_ (0),
+    segment_received_ (0),
+    allocate_size_ (-1),
+    is_direct_ (false),
+    direct_buffer_ (nullptr),
+    direct_length_ (0),
+    expected_algorithm_ (-1)
+{
+    reference_counting_policy ().value (ACE_Event_Handler::Reference_Counting_Policy::ENABLED);
+    Metrics::instance ()->add (Metric_Counters::METRIC_DATA_CONNECTIONS);
+}
+
+Data_Handler::Data_Handler (ACE_Reactor *reactor, const std::string &ip_addr, const int &port, const int &type) :
+    ACE_Event_Handler (reactor),
     mode_ (Data_Modes::STREAM),
+    deflate_level_ (DEFAULT_DEFLATE_LEVEL),
+    type_ (type),
     is_lock_ (false),
-    wfile_try_connection_ (nullptr)
+    is_write_lock_ (false),
+    lock_key_ (),
+    lock_fd_ (-1),
+    state_ (Transfer_States::TRANSFER_IDLE),
+    owner_ (nullptr),
+    transfer_mask_ (ACE_Event_Handler::NULL_MASK),
+    file_offset_ (0),
+    lock_wait_state_ (Transfer_States::TRANSFER_IDLE),
+    list_sent_ (0),
+    flow_weight_ (1),
+    flow_ (nullptr),
+    send_sent_ (0),
+    is_inflating_ (false),
+    is_inflate_end_ (false),
+    cache_fd_ (-1),
+    cache_length_ (0),
+    restart_offset_ (0),
+    last_marker_ (0),
+    is_eof_sent_ (false),
+    block_header_length_ (0),
+    block_remaining_ (0),
+    is_cr_pending_ (false),
+    is_dedup_ (false),
+    is_append_ (false),
+    segment_size_ (-1),
+    segment_begin_ (0),
+    segment_received_ (0),
+    allocate_size_ (-1),
+    is_direct_ (false),
+    direct_buffer_ (nullptr),
+    direct_length_ (0),
+    expected_algorithm_ (-1)
 {
+    reference_counting_policy ().value (ACE_Event_Handler::Reference_Counting_Policy::ENABLED);
+    Metrics::instance ()->add (Metric_Counters::METRIC_DATA_CONNECTIONS);
     int set_addr_res = client_addr_.set (port, ip_addr.c_str ());
     if (set_addr_res == -1)
     {
-        ACE_DEBUG ((LM_DEBUG, "set client address failed\n"));
+        FTP_LOG (LOG_LEVEL_ERROR, "set client address failed\n");
     }
     memset (data_buffer_, 0, MAX_BUFFER_SIZE);
-    data_link_.enable (ACE_NONBLOCK);
-    file_link_.enable (ACE_NONBLOCK);
 }
 
 Data_Handler::~Data_Handler ()
 {
-    if (is_lock_ && flock (file_link_.get_handle(), LOCK_UN) != 0)
-        ACE_DEBUG ( (LM_DEBUG, "shared unlock file failed\n"));
-    if (is_lock_ && wfile_try_connection_ != nullptr && flock (fileno (wfile_try_connection_), LOCK_UN) != 0)
-        ACE_DEBUG ( (LM_DEBUG, "exclusive unlock file failed\n"));
-    is_lock_ = false;
-    if (wfile_try_connection_ != nullptr)
-        fclose (wfile_try_connection_);
+    release_file ();
+    if (is_inflating_)
+        inflateEnd (&inflate_stream_);
+    // close_notify goes before the socket, whose number may be reused at once
+    tls_.reset ();
     data_link_.close ();
+    Metrics::instance ()->add (Metric_Counters::METRIC_DATA_CONNECTIONS, -1);
+    FTP_LOG (LOG_LEVEL_DEBUG, "data connection destroyed.\n");
+}
+
+void Data_Handler::release_file ()
+{
+    // closing the files drops their flocks
     file_link_.close ();
-    ACE_DEBUG ( (LM_DEBUG, "data connection destroyed.\n"));
+    if (lock_fd_ != -1)
+        ::close (lock_fd_);
+    lock_fd_ = -1;
+    if (is_lock_)
+        File_Lock_Table::instance ()->unlock (lock_key_, is_write_lock_);
+    is_lock_ = false;
+    if (cache_fd_ != -1)
+        ::close (cache_fd_);
+    cache_fd_ = -1;
+    cached_.reset ();
+    digest_contexts_.clear ();
+    if (!staging_path_.empty ())
+        unlink (staging_path_.c_str ());
+    staging_path_.clear ();
+    // a segment cut short is sent again
+    if (!segment_path_.empty ())
+        Segmented_Upload::instance ()->end_segment (file_path_, segment_begin_, 0, false, segment_received_);
+    segment_path_.clear ();
+    Buffer_Pool::instance ()->release_direct (direct_buffer_);
+    direct_buffer_ = nullptr;
+    direct_length_ = 0;
+}
+
+int Data_Handler::reuse ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (mode_ != Data_Modes::BLOCK || state_ != Transfer_States::TRANSFER_DONE || !is_connected ())
+        return -1;
+    release_file ();
+    is_dedup_ = false;
+    is_append_ = false;
+    segment_size_ = -1;
+    allocate_size_ = -1;
+    is_direct_ = false;
+    expected_algorithm_ = -1;
+    expected_digest_.clear ();
+    state_ = Transfer_States::TRANSFER_IDLE;
+    return 0;
 }
 
 int Data_Handler::data_link_init ()
@@ -42,197 +172,1131 @@ int Data_Handler::data_link_init ()
     ACE_SOCK_Connector connector;
     if (connector.connect (data_link_, client_addr_) < 0)
     {
-        ACE_DEBUG ((LM_DEBUG, "connect client's data failed\n"));
+        FTP_LOG (LOG_LEVEL_INFO, "connect client's data failed\n");
         return -1;
     }
     return 0;
 }
 
+void Data_Handler::start_tls (const std::string &session_context)
+{
+    tls_.reset (new Tls_Stream (data_link_.get_handle (), session_context));
+}
+
 int Data_Handler::file_link_init (bool is_output)
 {
-    ACE_FILE_Connector connector;
-    int result = 0;
-    if (is_output)
-        result = connector.connect (file_link_,
-                                    ACE_FILE_Addr (file_path_.c_str ()),
-                                    0,
-                                    ACE_Addr::sap_any,
-                                    0,
-                                    O_RDONLY,
-                                    ACE_DEFAULT_FILE_PERMS);
-    else
+    // a segment opens its part file in recv_file ()
+    if (!is_output && segment_size_ >= 0)
+        return 0;
+    // a hit is sent as stored, from its start
+    if (is_output && type_ == Data_Types::IMAGE && mode_ == Data_Modes::STREAM && restart_offset_ == 0)
+    {
+        cached_ = Small_File_Cache::instance ()->lookup (file_path_);
+        if (cached_)
+            return 0;
+    }
+    int fd = Vfs::instance ()->open (file_path_, is_output ? O_RDONLY : O_RDWR | O_CREAT,
+                                     ACE_DEFAULT_FILE_PERMS);
+    if (fd == -1)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "open file failed.\n");
+        return -1;
+    }
+    file_link_.set_handle (fd);
+    return 0;
+}
+
+void Data_Handler::set_buckets (const std::shared_ptr<Token_Bucket> &user_bucket,
+                                const std::shared_ptr<Token_Bucket> &session_bucket)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    user_bucket_ = user_bucket;
+    session_bucket_ = session_bucket;
+}
+
+void Data_Handler::set_flow (const std::string &user, const std::string &class_name, long weight)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    flow_user_ = user;
+    flow_class_ = class_name;
+    flow_weight_ = weight;
+}
+
+int Data_Handler::send_file (Command_Handler *owner)
+{
+    // a compressed stream is not converted
+    if (type_ == Data_Types::ASCII && mode_ == Data_Modes::COMPRESSED)
+        return -1;
+    if (cached_)
+    {
+        // the content is a whole version of the file, no writer can change it
+        trace_.mark (Trace_Phases::TRACE_LOCKED);
+        file_offset_ = 0;
+        restart_offset_ = 0;
+        return start_transfer (owner, Transfer_States::TRANSFER_SEND_CACHED, ACE_Event_Handler::WRITE_MASK);
+    }
+    
+    if (!is_lock_ && File_Lock_Table::instance ()->lock (file_link_.get_handle (), false, lock_key_) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "shared lock file failed\n");
+        return wait_lock (owner, Transfer_States::TRANSFER_SEND_FILE);
+    }
+    is_lock_ = true;
+    is_write_lock_ = false;
+    lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+    trace_.mark (Trace_Phases::TRACE_LOCKED);
+    FTP_LOG (LOG_LEVEL_DEBUG, "lock done\n");
+    file_offset_ = restart_offset_;
+    last_marker_ = restart_offset_;
+    restart_offset_ = 0;
+    // read while the shared lock keeps writers out
+    if (type_ == Data_Types::IMAGE && mode_ == Data_Modes::STREAM && file_offset_ == 0)
+        Small_File_Cache::instance ()->fill (file_path_, file_link_.get_handle ());
+    is_eof_sent_ = false;
+    send_buffer_.clear ();
+    send_sent_ = 0;
+    if (mode_ == Data_Modes::COMPRESSED)
+    {
+        int level = deflate_level_;
+        cache_fd_ = Transform_Cache::instance ()->lookup (file_path_, file_link_.get_handle (),
+                                                          "deflate-" + std::to_string (level),
+                                                          [level] (int src_fd, int des_fd) {
+                                                              return deflate_file (src_fd, level, des_fd);
+                                                          },
+                                                          cache_length_);
+    }
+    else if (type_ == Data_Types::ASCII && mode_ == Data_Modes::STREAM && file_offset_ == 0)
+    {
+        // the converted file is sent as stored, a restart offset counts file bytes instead
+        cache_fd_ = Transform_Cache::instance ()->lookup (file_path_, file_link_.get_handle (),
+                                                          "ascii-crlf", lf_to_crlf_file, cache_length_);
+    }
+    if (mode_ == Data_Modes::COMPRESSED && cache_fd_ == -1)
     {
-        wfile_try_connection_ = ACE_OS::fopen (file_path_.c_str (), "a");
-        if (wfile_try_connection_ == nullptr)
+        // the worker only wakes the handler, it never takes lock_
+        deflate_ = std::make_shared<Parallel_Deflate> (file_link_.get_handle (), deflate_level_, 
+                                                       [this] { resume (); });
+        if (deflate_->start () == -1)
         {
-            ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("connect file failed.\n")));
+            deflate_.reset ();
             return -1;
         }
     }
-    if (result < 0)
+    // user space TLS encrypts from a buffer, kernel TLS keeps sendfile; before the
+    // handshake it isn't known yet, the buffer is taken in case
+    bool is_converted = (type_ == Data_Types::ASCII && cache_fd_ == -1);
+    if (deflate_ || mode_ == Data_Modes::BLOCK || is_converted ||
+        (tls_ && !tls_->is_kernel_send ()))
+        Buffer_Pool::instance ()->acquire (send_buffer_);
+    if (is_converted)
+        Buffer_Pool::instance ()->acquire (ascii_buffer_);
+    if (start_transfer (owner, Transfer_States::TRANSFER_SEND_FILE, ACE_Event_Handler::WRITE_MASK) == -1)
     {
-        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("connect file failed.\n")));
+        if (deflate_)
+            deflate_->cancel ();
+        deflate_.reset ();
         return -1;
     }
-
     return 0;
 }
 
-int Data_Handler::send_file ()
+int Data_Handler::send_list (Command_Handler *owner)
 {
-    if (type_ != Data_Types::IMAGE)
-        return -1;
-    
-    if (!is_lock_ && flock (file_link_.get_handle (), LOCK_SH | LOCK_NB) != 0)
+    list_sent_ = 0;
+    if (mode_ == Data_Modes::COMPRESSED)
     {
-        ACE_DEBUG ( (LM_DEBUG, "shared lock file failed\n"));
+        std::string compressed;
+        if (deflate_buffer (list_buffer_, deflate_level_, compressed) == -1)
+            return -1;
+        list_buffer_.swap (compressed);
+    }
+    else if (mode_ == Data_Modes::BLOCK)
+    {
+        std::string blocks;
+        for (size_t pos = 0; pos < list_buffer_.size (); pos += BLOCK_MAX_DATA)
+            append_block (0, list_buffer_.data () + pos, 
+                          std::min ((size_t)BLOCK_MAX_DATA, list_buffer_.size () - pos), blocks);
+        append_block (Block_Descriptors::BLOCK_EOF, nullptr, 0, blocks);
+        list_buffer_.swap (blocks);
+    }
+    return start_transfer (owner, Transfer_States::TRANSFER_SEND_LIST, ACE_Event_Handler::WRITE_MASK);
+}
+
+int Data_Handler::recv_file (Command_Handler *owner)
+{
+    if (type_ == Data_Types::ASCII && mode_ == Data_Modes::COMPRESSED)
         return -1;
+    // locked before anything is consumed, so a retry starts over;
+    // segments of the file are written by other sessions at the same time, nothing is locked
+    if (segment_size_ < 0 && !is_lock_)
+    {
+        if (File_Lock_Table::instance ()->lock (file_link_.get_handle (), true, lock_key_) != 0)
+        {
+            FTP_LOG (LOG_LEVEL_INFO, "lock file failed\n");
+            return wait_lock (owner, Transfer_States::TRANSFER_RECV_FILE);
+        }
+        is_lock_ = true;
+        is_write_lock_ = true;
+        lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+        trace_.mark (Trace_Phases::TRACE_LOCKED);
     }
-    is_lock_ = true;
-    ACE_DEBUG ( (LM_DEBUG, "lock done\n"));
-    int send_count = 0;
-    long offset = 0;
-    while (1)
+    // REST keeps the first bytes and writes from the offset
+    off_t offset = restart_offset_;
+    restart_offset_ = 0;
+    std::string write_path = file_path_;
+    staging_path_.clear ();
+    if (segment_size_ >= 0)
     {
-        send_count = sendfile (data_link_.get_handle (), file_link_.get_handle (), &offset, 512);
-        //ACE_DEBUG ( (LM_DEBUG, "offset: %d\n", offset));
-        if (send_count < 0)
+        if (type_ == Data_Types::ASCII ||
+            Segmented_Upload::instance ()->begin_segment (file_path_, segment_size_, offset, segment_path_) == -1)
+            return -1;
+        write_path = segment_path_;
+        segment_begin_ = offset;
+    }
+    else
+    {
+        // the file opened by file_link_init () is written unless it is staged or replaced;
+        // APPE writes after the bytes the locked file has
+        struct stat file_stat;
+        if (is_append_)
+            offset = (fstat (file_link_.get_handle (), &file_stat) == 0 ? file_stat.st_size : 0);
+        // a staged file takes its name when complete, one written in place must own its content
+        int unshared = 0;
+        if (is_dedup_ && offset == 0 && Dedup_Store::instance ()->create_staging (staging_path_) == 0)
         {
-            if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
-                continue;
+            write_path = staging_path_;
+            // other processes see the flock of the target until the staged file replaces it
+            if (File_Lock_Table::instance ()->is_cross_process ())
+                lock_fd_ = file_link_.get_handle ();
             else
+                file_link_.close ();
+            file_link_.set_handle (ACE_INVALID_HANDLE);
+        }
+        else if (Vfs::instance ()->is_local (file_path_) &&
+                 (unshared = Dedup_Store::instance ()->unshare (file_path_, offset)) == -1)
+            return -1;
+        else if (unshared == 1)
+        {
+            // the name has a file of its own now, the lock moves to it
+            file_link_.close ();
+            File_Lock_Table::instance ()->unlock (lock_key_, true);
+            is_lock_ = false;
+            if (file_link_init (false) == -1 ||
+                File_Lock_Table::instance ()->lock (file_link_.get_handle (), true, lock_key_) != 0)
                 return -1;
-        } 
-        else if (send_count == 0)
-            return 0;
+            is_lock_ = true;
+        }
+    }
+    if (file_link_.get_handle () == ACE_INVALID_HANDLE)
+    {
+        int fd = Vfs::instance ()->open (write_path, O_RDWR | O_CREAT, ACE_DEFAULT_FILE_PERMS);
+        if (fd == -1)
+        {
+            FTP_LOG (LOG_LEVEL_INFO, "open file failed.\n");
+            return -1;
+        }
+        file_link_.set_handle (fd);
+    }
+    // STOR and REST drop what follows the offset, a segment leaves the others alone
+    if (!is_append_ && segment_size_ < 0 && staging_path_.empty () &&
+        ftruncate (file_link_.get_handle (), offset) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "truncate file failed.\n");
+        return -1;
+    }
+    file_offset_ = offset;
+    // the declared size is allocated at once, so the file gets contiguous extents
+    if (segment_size_ < 0 && allocate_size_ > offset)
+        fallocate (file_link_.get_handle (), FALLOC_FL_KEEP_SIZE, offset, allocate_size_ - offset);
+    // writes of O_DIRECT start at an aligned offset, a filesystem without it stays buffered
+    direct_length_ = 0;
+    int flags = fcntl (file_link_.get_handle (), F_GETFL);
+    if (is_direct_ && offset % DIRECT_IO_ALIGNMENT == 0 && flags != -1 &&
+        (direct_buffer_ = Buffer_Pool::instance ()->acquire_direct ()) != nullptr &&
+        fcntl (file_link_.get_handle (), F_SETFL, flags | O_DIRECT) != 0)
+    {
+        Buffer_Pool::instance ()->release_direct (direct_buffer_);
+        direct_buffer_ = nullptr;
+    }
+    block_header_length_ = 0;
+    block_remaining_ = 0;
+    is_cr_pending_ = false;
+    // the bytes kept by REST are not hashed, the digests would be wrong
+    digest_contexts_.clear ();
+    if (offset == 0)
+        for (int algorithm : digest_algorithms_)
+            digest_contexts_.emplace_back (new Hash_Context (algorithm));
+    if (type_ == Data_Types::ASCII)
+        Buffer_Pool::instance ()->acquire (ascii_buffer_);
+    if (mode_ == Data_Modes::COMPRESSED && !is_inflating_)
+    {
+        inflate_stream_.zalloc = Z_NULL;
+        inflate_stream_.zfree = Z_NULL;
+        inflate_stream_.opaque = Z_NULL;
+        inflate_stream_.next_in = Z_NULL;
+        inflate_stream_.avail_in = 0;
+        if (inflateInit (&inflate_stream_) != Z_OK)
+            return -1;
+        is_inflating_ = true;
+        is_inflate_end_ = false;
+    }
+    return start_transfer (owner, Transfer_States::TRANSFER_RECV_FILE, ACE_Event_Handler::READ_MASK);
+}
+
+int Data_Handler::wait_lock (Command_Handler *owner, int state)
+{
+    long wait_msec = File_Lock_Table::instance ()->get_wait_msec ();
+    ACE_Time_Value now = reactor ()->timer_queue ()->gettimeofday ();
+    std::lock_guard<std::mutex> guard (lock_);
+    if (wait_msec <= 0 || state_ != Transfer_States::TRANSFER_IDLE)
+    {
+        lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+        return -2;
+    }
+    if (lock_wait_state_ == Transfer_States::TRANSFER_IDLE)
+        lock_deadline_ = now + ACE_Time_Value (wait_msec / 1000, (wait_msec % 1000) * 1000);
+    else if (now >= lock_deadline_)
+    {
+        lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+        return -2;
+    }
+    // the event loop keeps driving the holder meanwhile
+    if (reactor ()->schedule_timer (this, 0, ACE_Time_Value (0, LOCK_RETRY_USEC)) == -1)
+    {
+        lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+        return -2;
     }
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
+    owner->add_reference ();
+    owner_ = owner;
+    state_ = Transfer_States::TRANSFER_WAIT_LOCK;
+    lock_wait_state_ = state;
     return 0;
 }
 
-int Data_Handler::list_dir (const std::string &dir_path)
+int Data_Handler::retry_transfer (Command_Handler *owner)
+{
+    return lock_wait_state_ == Transfer_States::TRANSFER_RECV_FILE ? recv_file (owner) : send_file (owner);
+}
+
+int Data_Handler::start_transfer (Command_Handler *owner, int state, ACE_Reactor_Mask mask)
 {
-    std::string path = dir_path;
-    if (path.back () != '/')
-        path.push_back ('/');
-    DIR *dir = opendir (path.c_str ());
-    if (dir == nullptr)
+    std::lock_guard<std::mutex> guard (lock_);
+    if (state_ != Transfer_States::TRANSFER_IDLE)
     {
+        FTP_LOG (LOG_LEVEL_DEBUG, "data connection is busy\n");
         return -1;
     }
-    
-    struct dirent *content;
-    struct stat content_stat;
-    while ( (content = readdir (dir)) != nullptr)
-    {
-        std::string content_path = path + content->d_name;
-        ACE_OS::stat (content_path.c_str (), &content_stat);
-
-        char mode[10] = {0};
-        mode_to_letters (content_stat.st_mode, mode);
-
-        char owner[8] = {0};
-        uid_to_name (content_stat.st_uid, owner);
-
-        char group[8]= {0};
-        gid_to_name (content_stat.st_gid, group);
-
-        int n = snprintf(data_buffer_,MAX_BUFFER_SIZE,"%s %4d %-8s %-8s %8d %.12s ",
-                        mode,
-                        (int)content_stat.st_nlink,
-                        owner,
-                        group,
-                        (int)content_stat.st_size,
-                        4+ctime(&content_stat.st_mtime));
-
-        int name_len = snprintf (data_buffer_ + n, MAX_BUFFER_SIZE - n, "%s", content->d_name);
-        data_buffer_[n + name_len] = '\r';
-        data_buffer_[n + name_len + 1] = '\n';
-        if (data_link_.send (data_buffer_, n + name_len + 2) < 0)
+    data_link_.enable (ACE_NONBLOCK);
+    // the client speaks first in a handshake, the timer ends one that stalls
+    bool is_handshake = is_handshaking ();
+    if (is_handshake)
+    {
+        if (reactor ()->schedule_timer (this, 0, ACE_Time_Value (TLS_HANDSHAKE_TIMEOUT_MSEC / 1000,
+                                                                 TLS_HANDSHAKE_TIMEOUT_MSEC % 1000 * 1000)) == -1)
         {
-            ACE_DEBUG ( (LM_DEBUG, "send list dir failed\n"));
-            return -2;
+            FTP_LOG (LOG_LEVEL_ERROR, "register handshake timeout failed\n");
+            return -1;
         }
+        Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
+    }
+    owner->add_reference ();
+    owner_ = owner;
+    state_ = state;
+    transfer_mask_ = mask;
+    if (!flow_user_.empty ())
+        flow_ = Transfer_Scheduler::instance ()->attach (flow_user_, flow_class_, flow_weight_);
+    if (reactor ()->register_handler (this, is_handshake ? (ACE_Reactor_Mask)ACE_Event_Handler::READ_MASK : mask) == -1)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "register transfer event failed\n");
+        Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (this));
+        if (flow_ != nullptr)
+            Transfer_Scheduler::instance ()->detach (flow_, this);
+        flow_ = nullptr;
+        owner_ = nullptr;
+        state_ = Transfer_States::TRANSFER_IDLE;
+        owner->remove_reference ();
+        return -1;
     }
-    closedir (dir);
+    Metrics::instance ()->add (Metric_Counters::METRIC_ACTIVE_TRANSFERS);
     return 0;
 }
 
-int Data_Handler::list_file (const std::string &file_path)
+int Data_Handler::stop ()
 {
-    struct stat file_stat;
-    if (ACE_OS::stat (file_path.c_str (), &file_stat) == -1)
+    Command_Handler *owner = nullptr;
     {
-        return -1;
+        std::lock_guard<std::mutex> guard (lock_);
+        if (state_ == Transfer_States::TRANSFER_IDLE || state_ == Transfer_States::TRANSFER_DONE)
+            return -1;
+        owner = detach ();
     }
+    owner->remove_reference ();
+    return 0;
+}
 
-    char mode[10] = {0};
-    mode_to_letters (file_stat.st_mode, mode);
+int Data_Handler::abort ()
+{
+    int result = stop ();
+    // closed gracefully the socket would still send its whole buffer
+    struct linger no_linger;
+    no_linger.l_onoff = 1;
+    no_linger.l_linger = 0;
+    if (is_connected ())
+        data_link_.set_option (SOL_SOCKET, SO_LINGER, &no_linger, sizeof (no_linger));
+    return result;
+}
 
-    char owner[8] = {0};
-    uid_to_name (file_stat.st_uid, owner);
+bool Data_Handler::is_busy ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    return state_ != Transfer_States::TRANSFER_IDLE && state_ != Transfer_States::TRANSFER_DONE;
+}
 
-    char group[8]= {0};
-    gid_to_name (file_stat.st_gid, group);
+Command_Handler *Data_Handler::detach ()
+{
+    Metrics *metrics = Metrics::instance ();
+    metrics->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (this));
+    // a transfer waiting for its file lock only has its timer
+    if (state_ != Transfer_States::TRANSFER_WAIT_LOCK)
+    {
+        metrics->add (Metric_Counters::METRIC_ACTIVE_TRANSFERS, -1);
+        reactor ()->remove_handler (this, ACE_Event_Handler::ALL_EVENTS_MASK | 
+                                          ACE_Event_Handler::DONT_CALL);
+    }
+    lock_wait_state_ = Transfer_States::TRANSFER_IDLE;
+    if (flow_ != nullptr)
+        Transfer_Scheduler::instance ()->detach (flow_, this);
+    flow_ = nullptr;
+    if (deflate_)
+        deflate_->cancel ();
+    deflate_.reset ();
+    Buffer_Pool::instance ()->release (send_buffer_);
+    Buffer_Pool::instance ()->release (ascii_buffer_);
+    send_sent_ = 0;
+    state_ = Transfer_States::TRANSFER_DONE;
+    trace_.wait_end ();
+    trace_.mark (Trace_Phases::TRACE_DONE);
+    Command_Handler *owner = owner_;
+    owner_ = nullptr;
+    return owner;
+}
 
-    int n = snprintf(data_buffer_,MAX_BUFFER_SIZE,"%s %4d %-8s %-8s %8d %.12s ",
-                    mode,
-                    (int)file_stat.st_nlink,
-                    owner,
-                    group,
-                    (int)file_stat.st_size,
-                    4+ctime(&file_stat.st_mtime));
-    int pos = file_path.rfind ('/');
-    int name_len = snprintf (data_buffer_ + n, MAX_BUFFER_SIZE - n, "%s", file_path.c_str () + pos + 1);
-    data_buffer_[n + name_len] = '\r';
-    data_buffer_[n + name_len + 1] = '\n';
-    if (data_link_.send (data_buffer_, n + name_len + 2) < 0)
+int Data_Handler::handle_output (ACE_HANDLE)
+{
+    return run_quantum ();
+}
+
+int Data_Handler::handle_input (ACE_HANDLE)
+{
+    return run_quantum ();
+}
+
+int Data_Handler::handle_timeout (const ACE_Time_Value &, const void *)
+{
+    Command_Handler *owner = nullptr;
+    bool is_expired = false;
     {
-        ACE_DEBUG ( (LM_DEBUG, "send list file failed\n"));
-        return -2;
+        std::lock_guard<std::mutex> guard (lock_);
+        Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -1);
+        if (state_ == Transfer_States::TRANSFER_IDLE || state_ == Transfer_States::TRANSFER_DONE)
+            return 0;
+        if (state_ == Transfer_States::TRANSFER_WAIT_LOCK)
+        {
+            // the owner starts the transfer again under its own lock, its reference moves here
+            owner = owner_;
+            owner_ = nullptr;
+            state_ = Transfer_States::TRANSFER_IDLE;
+        }
+        else if (is_handshaking ())
+        {
+            // no quantum ran yet, so no throttle timer either, this is the handshake's
+            FTP_LOG (LOG_LEVEL_INFO, "TLS handshake on the data connection timed out\n");
+            Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFER_FAILURES);
+            owner = detach ();
+            is_expired = true;
+        }
+        else
+        {
+            reactor ()->schedule_wakeup (this, transfer_mask_);
+            return 0;
+        }
     }
+    if (is_expired)
+        owner->transfer_complete (this, -1);
+    else
+        owner->transfer_retry (this);
+    owner->remove_reference ();
     return 0;
 }
 
-int Data_Handler::recv_file ()
+int Data_Handler::run_quantum ()
 {
-    if (type_ != Data_Types::IMAGE)
-        return -1;
-    if (!is_lock_ && flock (fileno (wfile_try_connection_), LOCK_EX | LOCK_NB) != 0)
+    Command_Handler *owner = nullptr;
+    int result = 0;
     {
-        ACE_DEBUG ( (LM_DEBUG, "lock file failed\n"));
-        return -1;
+        std::lock_guard<std::mutex> guard (lock_);
+        trace_.wait_end ();
+        int quantum_res;
+        // the TLS handshake comes before the transfer
+        if (is_handshaking () && state_ != Transfer_States::TRANSFER_IDLE &&
+            state_ != Transfer_States::TRANSFER_DONE && state_ != Transfer_States::TRANSFER_WAIT_LOCK)
+            quantum_res = handshake_quantum ();
+        else
+        {
+            switch (state_)
+            {
+            case Transfer_States::TRANSFER_SEND_FILE:
+                quantum_res = send_file_quantum ();
+                break;
+            case Transfer_States::TRANSFER_SEND_CACHED:
+                quantum_res = send_cached_quantum ();
+                break;
+            case Transfer_States::TRANSFER_SEND_LIST:
+                quantum_res = send_list_quantum ();
+                break;
+            case Transfer_States::TRANSFER_RECV_FILE:
+                quantum_res = recv_file_quantum ();
+                break;
+            default:
+                // stopped while the event was pending
+                return 0;
+            }
+        }
+        // records OpenSSL already decrypted don't make the socket readable
+        if (quantum_res == Quantum_Results::QUANTUM_AGAIN && tls_ && tls_->pending () > 0)
+            reactor ()->notify (this, transfer_mask_);
+        if (quantum_res == Quantum_Results::QUANTUM_AGAIN || 
+            quantum_res == Quantum_Results::QUANTUM_THROTTLED)
+            return 0;
+        result = (quantum_res == Quantum_Results::QUANTUM_DONE ? 0 : -1);
+        Metrics::instance ()->add (result == 0 ? Metric_Counters::METRIC_TRANSFERS :
+                                                 Metric_Counters::METRIC_TRANSFER_FAILURES);
+        owner = detach ();
     }
-    is_lock_ = true;
+    // lock_ is released, the owner may stop and release this handler
+    owner->transfer_complete (this, result);
+    owner->remove_reference ();
+    return 0;
+}
 
-    ACE_FILE_Connector connector;
-    connector.connect (file_link_,
-                        ACE_FILE_Addr (file_path_.c_str ()),
-                        0,
-                        ACE_Addr::sap_any,
-                        0,
-                        O_RDWR | O_CREAT | O_TRUNC,
-                        ACE_DEFAULT_FILE_PERMS);
+int Data_Handler::handshake_quantum ()
+{
+    const ACE_Reactor_Mask both_mask = ACE_Event_Handler::READ_MASK | ACE_Event_Handler::WRITE_MASK;
+    if (tls_->handshake () == -1)
+    {
+        if (errno != EAGAIN)
+            return Quantum_Results::QUANTUM_FAILED;
+        reactor ()->cancel_wakeup (this, both_mask);
+        reactor ()->schedule_wakeup (this, tls_->is_want_write () ? ACE_Event_Handler::WRITE_MASK :
+                                                                    ACE_Event_Handler::READ_MASK);
+        return Quantum_Results::QUANTUM_AGAIN;
+    }
+    // only the handshake timer runs now
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (this));
+    reactor ()->cancel_wakeup (this, both_mask);
+    reactor ()->schedule_wakeup (this, transfer_mask_);
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+size_t Data_Handler::allowance (size_t wanted)
+{
+    long wait_usec = 0;
+    size_t allowed = Bandwidth_Shaper::instance ()->allowance (user_bucket_.get (),
+                                                               session_bucket_.get (),
+                                                               wanted,
+                                                               wait_usec);
+    if (allowed == 0)
+    {
+        // sleep instead of spinning on a writable socket
+        trace_.wait_begin (Trace_Waits::TRACE_WAIT_THROTTLE);
+        reactor ()->cancel_wakeup (this, transfer_mask_);
+        schedule_wakeup_timer (wait_usec);
+        return 0;
+    }
+    if (flow_ == nullptr)
+        return allowed;
 
-    int recv_count = 0;
-    while(1)
+    allowed = Transfer_Scheduler::instance ()->acquire (flow_, this, allowed);
+    if (allowed == 0)
     {
-        recv_count = data_link_.recv (data_buffer_, MAX_BUFFER_SIZE);
+        // parked until next round, the timer covers a round nobody closes
+        trace_.wait_begin (Trace_Waits::TRACE_WAIT_THROTTLE);
+        reactor ()->cancel_wakeup (this, transfer_mask_);
+        schedule_wakeup_timer (SCHED_IDLE_USEC);
+    }
+    return allowed;
+}
+
+void Data_Handler::schedule_wakeup_timer (long wait_usec)
+{
+    if (reactor ()->schedule_timer (this, 0, ACE_Time_Value (0, wait_usec)) != -1)
+        Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
+}
+
+void Data_Handler::charge (size_t bytes)
+{
+    trace_.add_bytes (bytes);
+    Bandwidth_Shaper::instance ()->charge (user_bucket_.get (), session_bucket_.get (), bytes);
+    if (flow_ != nullptr)
+        Transfer_Scheduler::instance ()->charge (flow_, bytes);
+}
+
+int Data_Handler::send_file_quantum ()
+{
+    // TYPE A from cache_fd_ is converted already
+    if (deflate_ || mode_ == Data_Modes::BLOCK || (type_ == Data_Types::ASCII && cache_fd_ == -1) ||
+        (tls_ && !tls_->is_kernel_send ()))
+        return send_buffer_quantum ();
+    size_t budget = TRANSFER_QUANTUM;
+    while (budget > 0)
+    {
+        size_t chunk = allowance (budget);
+        if (chunk == 0)
+            return Quantum_Results::QUANTUM_THROTTLED;
+        int file_fd = (cache_fd_ != -1 ? cache_fd_ : file_link_.get_handle ());
+        ssize_t send_count = tls_ ? tls_->send_file (file_fd, file_offset_, chunk) :
+                                    sendfile (data_link_.get_handle (), file_fd, &file_offset_, chunk);
+        if (send_count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
+                continue;
+            else
+                return Quantum_Results::QUANTUM_FAILED;
+        } 
+        else if (send_count == 0)
+            return Quantum_Results::QUANTUM_DONE;
+        charge (send_count);
+        Metrics::instance ()->add (Metric_Counters::METRIC_BYTES_SENT, send_count);
+        budget -= send_count;
+    }
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+int Data_Handler::send_cached_quantum ()
+{
+    size_t budget = TRANSFER_QUANTUM;
+    while (budget > 0)
+    {
+        if ((size_t)file_offset_ == cached_->size ())
+            return Quantum_Results::QUANTUM_DONE;
+        size_t chunk = allowance (std::min (budget, cached_->size () - (size_t)file_offset_));
+        if (chunk == 0)
+            return Quantum_Results::QUANTUM_THROTTLED;
+        ssize_t send_count = send_data (cached_->data () + file_offset_, chunk);
+        if (send_count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
+                continue;
+            else
+                return Quantum_Results::QUANTUM_FAILED;
+        }
+        charge (send_count);
+        Metrics::instance ()->add (Metric_Counters::METRIC_BYTES_SENT, send_count);
+        file_offset_ += send_count;
+        budget -= send_count;
+    }
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+int Data_Handler::fill_send_buffer ()
+{
+    if (deflate_)
+    {
+        int deflate_res = deflate_->next (send_buffer_);
+        if (deflate_res == Deflate_Results::DEFLATE_FAILED)
+            FTP_LOG (LOG_LEVEL_ERROR, "compress file failed\n");
+        return deflate_res == Deflate_Results::DEFLATE_READY ? Fill_Results::FILL_READY :
+               deflate_res == Deflate_Results::DEFLATE_PENDING ? Fill_Results::FILL_PENDING :
+               deflate_res == Deflate_Results::DEFLATE_END ? Fill_Results::FILL_END :
+                                                             Fill_Results::FILL_FAILED;
+    }
+    if (cache_fd_ != -1)
+        return fill_cached ();
+
+    // MODE B or TYPE A
+    bool is_block = (mode_ == Data_Modes::BLOCK);
+    if (is_eof_sent_)
+        return Fill_Results::FILL_END;
+    if (is_block && file_offset_ - last_marker_ >= BLOCK_RESTART_INTERVAL)
+    {
+        // the marker is the offset, the client restarts with "REST offset"
+        std::string marker = std::to_string ((long long)file_offset_);
+        append_block (Block_Descriptors::BLOCK_RESTART, marker.data (), marker.length (), send_buffer_);
+        last_marker_ = file_offset_;
+    }
+    size_t header_pos = send_buffer_.size ();
+    size_t data_pos = header_pos + (is_block ? BLOCK_HEADER_SIZE : 0);
+    bool is_ascii = (type_ == Data_Types::ASCII);
+    // converted data doubles at most and a block holds BLOCK_MAX_DATA
+    size_t read_max = !is_ascii ? BLOCK_MAX_DATA : (is_block ? BLOCK_MAX_DATA / 2 : ASCII_CHUNK_SIZE);
+    char *read_buffer;
+    if (is_ascii)
+    {
+        ascii_buffer_.resize (read_max);
+        read_buffer = &ascii_buffer_[0];
+    }
+    else
+    {
+        send_buffer_.resize (data_pos + read_max);
+        read_buffer = &send_buffer_[data_pos];
+    }
+    ssize_t read_count;
+    do
+        read_count = pread (file_link_.get_handle (), read_buffer, read_max, file_offset_);
+    while (read_count < 0 && errno == EINTR);
+    if (read_count < 0)
+        return Fill_Results::FILL_FAILED;
+    size_t data_length = read_count;
+    if (is_ascii)
+    {
+        send_buffer_.resize (data_pos + 2 * read_count);
+        data_length = lf_to_crlf (read_buffer, read_count, &send_buffer_[data_pos]);
+    }
+    send_buffer_.resize (data_pos + data_length);
+    if (is_block)
+    {
+        send_buffer_[header_pos] = (char)(read_count == 0 ? Block_Descriptors::BLOCK_EOF : 0);
+        send_buffer_[header_pos + 1] = (char)(data_length >> 8);
+        send_buffer_[header_pos + 2] = (char)data_length;
+    }
+    file_offset_ += read_count;
+    is_eof_sent_ = (read_count == 0);
+    if (!is_block && read_count == 0)
+        return Fill_Results::FILL_END;
+    return Fill_Results::FILL_READY;
+}
+
+int Data_Handler::fill_cached ()
+{
+    // user space TLS encrypts from a buffer what sendfile would send as stored
+    if (file_offset_ >= cache_length_)
+        return Fill_Results::FILL_END;
+    size_t read_max = (size_t)std::min ((off_t)TRANSFER_QUANTUM, cache_length_ - file_offset_);
+    send_buffer_.resize (read_max);
+    ssize_t read_count;
+    do
+        read_count = pread (cache_fd_, &send_buffer_[0], read_max, file_offset_);
+    while (read_count < 0 && errno == EINTR);
+    if (read_count <= 0)
+    {
+        send_buffer_.clear ();
+        return read_count == 0 ? Fill_Results::FILL_END : Fill_Results::FILL_FAILED;
+    }
+    send_buffer_.resize (read_count);
+    file_offset_ += read_count;
+    return Fill_Results::FILL_READY;
+}
+
+void Data_Handler::append_block (int descriptor, const char *data, size_t length, std::string &des)
+{
+    des.push_back ((char)descriptor);
+    des.push_back ((char)(length >> 8));
+    des.push_back ((char)length);
+    if (length > 0)
+        des.append (data, length);
+}
+
+int Data_Handler::send_buffer_quantum ()
+{
+    size_t budget = TRANSFER_QUANTUM;
+    while (budget > 0)
+    {
+        if (send_sent_ == send_buffer_.size ())
+        {
+            send_buffer_.clear ();
+            send_sent_ = 0;
+            int fill_res = fill_send_buffer ();
+            if (fill_res == Fill_Results::FILL_END)
+                return Quantum_Results::QUANTUM_DONE;
+            else if (fill_res == Fill_Results::FILL_FAILED)
+                return Quantum_Results::QUANTUM_FAILED;
+            else if (fill_res == Fill_Results::FILL_PENDING)
+            {
+                // sleep until a worker compresses the block, it may have done so meanwhile
+                reactor ()->cancel_wakeup (this, transfer_mask_);
+                if (deflate_->is_ready ())
+                    reactor ()->schedule_wakeup (this, transfer_mask_);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            continue;
+        }
+        size_t chunk = allowance (std::min (budget, send_buffer_.size () - send_sent_));
+        if (chunk == 0)
+            return Quantum_Results::QUANTUM_THROTTLED;
+        ssize_t send_count = send_data (send_buffer_.data () + send_sent_, chunk);
+        if (send_count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
+                continue;
+            else
+                return Quantum_Results::QUANTUM_FAILED;
+        }
+        charge (send_count);
+        Metrics::instance ()->add (Metric_Counters::METRIC_BYTES_SENT, send_count);
+        send_sent_ += send_count;
+        // TLS may finish a record of an earlier, larger chunk
+        budget -= std::min (budget, (size_t)send_count);
+    }
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+ssize_t Data_Handler::send_data (const void *buf, size_t length)
+{
+    return tls_ ? tls_->send (buf, length) : data_link_.send (buf, length);
+}
+
+ssize_t Data_Handler::recv_data (void *buf, size_t length)
+{
+    return tls_ ? tls_->recv (buf, length) : data_link_.recv (buf, length);
+}
+
+int Data_Handler::send_list_quantum ()
+{
+    while (list_sent_ < list_buffer_.size ())
+    {
+        ssize_t send_count = send_data (list_buffer_.data () + list_sent_, 
+                                        list_buffer_.size () - list_sent_);
+        if (send_count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
+                continue;
+            FTP_LOG (LOG_LEVEL_INFO, "send list failed\n");
+            return Quantum_Results::QUANTUM_FAILED;
+        }
+        list_sent_ += send_count;
+    }
+    return Quantum_Results::QUANTUM_DONE;
+}
+
+int Data_Handler::recv_file_quantum ()
+{
+    if (mode_ == Data_Modes::BLOCK)
+        return recv_block_quantum ();
+    size_t budget = TRANSFER_QUANTUM;
+    while (budget > 0)
+    {
+        size_t chunk = allowance (std::min (budget, (size_t)MAX_BUFFER_SIZE));
+        if (chunk == 0)
+            return Quantum_Results::QUANTUM_THROTTLED;
+        ssize_t recv_count = recv_data (data_buffer_, chunk);
         if (recv_count < 0)
         {
-            if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
                 continue;
             else
-                return -1;
+                return Quantum_Results::QUANTUM_FAILED;
         } 
         else if (recv_count == 0)
-            return 0;
+        {
+            // a compressed stream cut short is a failed transfer
+            if (is_inflating_ && !is_inflate_end_)
+                return Quantum_Results::QUANTUM_FAILED;
+            return end_file () == 0 ? Quantum_Results::QUANTUM_DONE : Quantum_Results::QUANTUM_FAILED;
+        }
+        charge (recv_count);
+        Metrics::instance ()->add (Metric_Counters::METRIC_BYTES_RECEIVED, recv_count);
+        if (is_inflating_)
+        {
+            if (write_inflated (recv_count) == -1)
+                return Quantum_Results::QUANTUM_FAILED;
+        }
+        else if (write_file (data_buffer_, recv_count) == -1)
+            return Quantum_Results::QUANTUM_FAILED;
+        budget -= recv_count;
+    }
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+int Data_Handler::recv_block_quantum ()
+{
+    size_t budget = TRANSFER_QUANTUM;
+    while (budget > 0)
+    {
+        // never read past the EOF block, the connection carries the next transfer
+        bool is_header = (block_header_length_ < BLOCK_HEADER_SIZE);
+        size_t wanted = is_header ? BLOCK_HEADER_SIZE - block_header_length_ :
+                                    std::min (std::min (budget, block_remaining_), (size_t)MAX_BUFFER_SIZE);
+        size_t chunk = is_header ? wanted : allowance (wanted);
+        if (chunk == 0)
+            return Quantum_Results::QUANTUM_THROTTLED;
+        char *buf = is_header ? (char *)block_header_ + block_header_length_ : data_buffer_;
+        ssize_t recv_count = recv_data (buf, chunk);
+        if (recv_count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                trace_.wait_begin (Trace_Waits::TRACE_WAIT_STALL);
+                return Quantum_Results::QUANTUM_AGAIN;
+            }
+            else if (errno == EINTR)
+                continue;
+            else
+                return Quantum_Results::QUANTUM_FAILED;
+        }
+        else if (recv_count == 0)
+        {
+            FTP_LOG (LOG_LEVEL_INFO, "data connection closed before EOF block\n");
+            return Quantum_Results::QUANTUM_FAILED;
+        }
+
+        if (is_header)
+        {
+            block_header_length_ += recv_count;
+            if (block_header_length_ < BLOCK_HEADER_SIZE)
+                continue;
+            block_remaining_ = (block_header_[1] << 8) | block_header_[2];
+        }
         else
         {
-            int write_count = file_link_.send (data_buffer_, recv_count);
-            if (write_count <= 0)
-                return -1;
+            charge (recv_count);
+            Metrics::instance ()->add (Metric_Counters::METRIC_BYTES_RECEIVED, recv_count);
+            budget -= recv_count;
+            block_remaining_ -= recv_count;
+            // restart markers of the client are not data
+            if (!(block_header_[0] & Block_Descriptors::BLOCK_RESTART) &&
+                write_file (data_buffer_, recv_count) == -1)
+                return Quantum_Results::QUANTUM_FAILED;
+        }
+        if (block_remaining_ == 0)
+        {
+            block_header_length_ = 0;
+            if (block_header_[0] & Block_Descriptors::BLOCK_EOF)
+                return end_file () == 0 ? Quantum_Results::QUANTUM_DONE : Quantum_Results::QUANTUM_FAILED;
         }
     }
+    return Quantum_Results::QUANTUM_AGAIN;
+}
+
+int Data_Handler::write_file (const char *data, size_t length)
+{
+    if (type_ != Data_Types::ASCII)
+        return write_disk (data, length);
+    ascii_buffer_.resize (length + 1);
+    size_t converted = crlf_to_lf (data, length, &ascii_buffer_[0], is_cr_pending_);
+    return write_disk (ascii_buffer_.data (), converted);
+}
+
+int Data_Handler::write_disk (const char *data, size_t length)
+{
+    // a segment never writes past the size of the whole file
+    if (segment_size_ >= 0 && file_offset_ + (off_t)length > segment_size_)
+        return -1;
+    for (std::unique_ptr<Hash_Context> &context : digest_contexts_)
+        context->update (data, length);
+    if (direct_buffer_ == nullptr)
+        return pwrite_file (data, length);
+    while (length > 0)
+    {
+        size_t copied = std::min (length, (size_t)DIRECT_IO_BUFFER_SIZE - direct_length_);
+        memcpy (direct_buffer_ + direct_length_, data, copied);
+        direct_length_ += copied;
+        data += copied;
+        length -= copied;
+        if (direct_length_ == DIRECT_IO_BUFFER_SIZE && flush_direct (false) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int Data_Handler::pwrite_file (const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = pwrite (file_link_.get_handle (), data, length, file_offset_);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+        file_offset_ += written;
+    }
+    return 0;
+}
+
+int Data_Handler::finish_file (std::vector<std::string> &digests)
+{
+    digests.assign (Hash_Algorithms::HASH_ALGORITHMS, std::string ());
+    if (!segment_path_.empty ())
+    {
+        // the last segment gives the file its name
+        int result = Segmented_Upload::instance ()->end_segment (file_path_, segment_begin_,
+                                                                 file_offset_ - segment_begin_,
+                                                                 true, segment_received_);
+        segment_path_.clear ();
+        return result == Segment_Results::SEGMENT_FAILED ? -1 : 0;
+    }
+    if (digest_contexts_.empty ())
+        return 0;
+    for (std::unique_ptr<Hash_Context> &context : digest_contexts_)
+        digests[context->algorithm ()] = context->final_hex ();
+    digest_contexts_.clear ();
+
+    // content differing from SITE CHECKSUM takes no name and leaves no digest
+    if (expected_algorithm_ != -1 && !digests[expected_algorithm_].empty () &&
+        digests[expected_algorithm_] != expected_digest_)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "checksum of %s mismatched\n", file_path_.c_str ());
+        if (!staging_path_.empty ())
+            unlink (staging_path_.c_str ());
+        else
+            Vfs::instance ()->remove (file_path_);
+        staging_path_.clear ();
+        return -2;
+    }
+
+    struct stat file_stat;
+    if (!staging_path_.empty ())
+    {
+        int result = Dedup_Store::instance ()->commit (staging_path_, digests[Hash_Algorithms::HASH_SHA256],
+                                                       file_path_, file_stat);
+        staging_path_.clear ();
+        if (result == -1)
+            return -1;
+    }
+    else if (fstat (file_link_.get_handle (), &file_stat) != 0)
+        return 0;
+    // remembered for the file as named, so HASH answers without reading it
+    for (int algorithm = 0; algorithm < Hash_Algorithms::HASH_ALGORITHMS; ++algorithm)
+        if (!digests[algorithm].empty ())
+            Hash_Service::instance ()->store (file_stat, algorithm, digests[algorithm]);
+    return 0;
+}
+
+int Data_Handler::end_file ()
+{
+    // a CR ending the file is data
+    if (is_cr_pending_)
+    {
+        is_cr_pending_ = false;
+        if (write_disk ("\r", 1) == -1)
+            return -1;
+    }
+    return direct_buffer_ == nullptr ? 0 : flush_direct (true);
+}
+
+int Data_Handler::flush_direct (bool is_end)
+{
+    size_t aligned = direct_length_ / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    if (pwrite_file (direct_buffer_, aligned) == -1)
+        return -1;
+    size_t tail = direct_length_ - aligned;
+    direct_length_ = 0;
+    if (!is_end || tail == 0)
+        return 0;
+    int flags = fcntl (file_link_.get_handle (), F_GETFL);
+    if (flags == -1 || fcntl (file_link_.get_handle (), F_SETFL, flags & ~O_DIRECT) != 0)
+        return -1;
+    return pwrite_file (direct_buffer_ + aligned, tail);
+}
+
+int Data_Handler::write_inflated (size_t length)
+{
+    if (is_inflate_end_)
+        return 0;   // bytes after the end of the stream are ignored
+    char out[INFLATE_BUFFER_SIZE];
+    inflate_stream_.next_in = (Bytef *)data_buffer_;
+    inflate_stream_.avail_in = length;
+    while (inflate_stream_.avail_in > 0)
+    {
+        inflate_stream_.next_out = (Bytef *)out;
+        inflate_stream_.avail_out = sizeof (out);
+        int result = inflate (&inflate_stream_, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+        {
+            FTP_LOG (LOG_LEVEL_INFO, "decompress received data failed\n");
+            return -1;
+        }
+        size_t produced = sizeof (out) - inflate_stream_.avail_out;
+        if (produced > 0 && write_disk (out, produced) == -1)
+            return -1;
+        if (result == Z_STREAM_END)
+        {
+            is_inflate_end_ = true;
+            break;
+        }
+        if (result == Z_BUF_ERROR && produced == 0)
+            return -1;
+    }
+    return 0;
+}
+
+int Data_Handler::list_dir (const std::string &dir_path)
+{
+    std::vector<Vfs_Entry> entries;
+    if (Vfs::instance ()->list (dir_path, entries) == -1)
+    {
+        return -1;
+    }
+    
+    list_buffer_.clear ();
+    for (const Vfs_Entry &entry : entries)
+        if (append_list_line (entry.file_stat, entry.name.c_str ()) == -1)
+            return -2;
+    return 0;
+}
+
+int Data_Handler::list_file (const std::string &file_path)
+{
+    struct stat file_stat;
+    if (Vfs::instance ()->stat (file_path, file_stat) == -1)
+    {
+        return -1;
+    }
+
+    list_buffer_.clear ();
+    int pos = file_path.rfind ('/');
+    return append_list_line (file_stat, file_path.c_str () + pos + 1) == 0 ? 0 : -2;
+}
+
+int Data_Handler::append_list_line (const struct stat &file_stat, const char *name)
+{
+    char mode[11] = {0};
+    mode_to_letters (file_stat.st_mode, mode);
+
+    char owner[9] = {0};
+    uid_to_name (file_stat.st_uid, owner);
+
+    char group[9]= {0};
+    gid_to_name (file_stat.st_gid, group);
+
+    int n = snprintf(data_buffer_,MAX_BUFFER_SIZE,"%s %4d %-8s %-8s %8lld %.12s %s\r\n",
+                    mode,
+                    (int)file_stat.st_nlink,
+                    owner,
+                    group,
+                    (long long)file_stat.st_size,
+                    4+ctime(&file_stat.st_mtime),
+                    name);
+    if (n < 0 || n >= MAX_BUFFER_SIZE)
+        return -1;
+    list_buffer_.append (data_buffer_, n);
     return 0;
 }
 
@@ -283,4 +1347,4 @@ void Data_Handler::gid_to_name (gid_t gid, char *buf)
     }
     else
         ACE_OS::strncpy (buf, grp_ptr->gr_name, 8);
-}
\ No newline at end of file
+}
@@ -1,14 +1,35 @@
 #ifndef DATA_HANDLER_H
 #define DATA_HANDLER_H
 
+#include "file_hash.h"
+#include "file_lock_table.h"
+#include "tls_session.h"
+#include "parallel_deflate.h"
+#include "small_file_cache.h"
+#include "token_bucket.h"
+#include "transfer_scheduler.h"
+#include "transfer_trace.h"
+
+#include "ace/Event_Handler.h"
+#include "ace/Reactor.h"
 #include "ace/SOCK_Acceptor.h"
 #include "ace/SOCK_Connector.h"
 #include "ace/SOCK_Stream.h"
 #include "ace/FILE_IO.h"
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+#include <zlib.h>
 
 #define MAX_BUFFER_SIZE 2048
+#define INFLATE_BUFFER_SIZE 16384
+#define BLOCK_HEADER_SIZE 3                     // MODE B descriptor and 16 bit byte count
+#define BLOCK_MAX_DATA 65535                    // MODE B bytes of one block
+#define BLOCK_RESTART_INTERVAL (1024 * 1024)    // bytes between MODE B restart markers
+#define TRANSFER_QUANTUM 65536
+#define LOCK_RETRY_USEC 10000                   // interval of retrying a file locked by another transfer
 
 enum Data_Modes 
 {
@@ -17,6 +38,14 @@ enum Data_Modes
     COMPRESSED = 3,
 };
 
+enum Block_Descriptors
+{
+    BLOCK_EOR = 128,        // end of record
+    BLOCK_EOF = 64,         // end of file
+    BLOCK_ERRORS = 32,      // suspected errors in the block
+    BLOCK_RESTART = 16,     // the block is a restart marker
+};
+
 enum Data_Types 
 {
     ASCII = 1,
@@ -24,29 +53,83 @@ enum Data_Types
     IMAGE = 3,
 };
 
-class Data_Handler{
+enum Transfer_States
+{
+    TRANSFER_IDLE = 0,
+    TRANSFER_SEND_FILE = 1,
+    TRANSFER_SEND_LIST = 2,
+    TRANSFER_RECV_FILE = 3,
+    TRANSFER_DONE = 4,
+    TRANSFER_SEND_CACHED = 5,
+    TRANSFER_WAIT_LOCK = 6,     // the file is locked by another transfer, retried from a timer
+};
+
+enum Fill_Results
+{
+    FILL_READY = 0,         // bytes appended to send_buffer_
+    FILL_FAILED = -1,       // reading or transforming failed
+    FILL_PENDING = -2,      // nothing yet, a worker wakes the handler
+    FILL_END = -3,          // the whole transfer is in send_buffer_
+};
+
+enum Quantum_Results
+{
+    QUANTUM_DONE = 0,
+    QUANTUM_FAILED = -1,
+    QUANTUM_AGAIN = -2,
+    QUANTUM_THROTTLED = -3,
+};
+
+class Command_Handler;
+
+/**
+ * Data connection of a Command_Handler.
+ * A transfer is started by send_file (), send_list () or recv_file () and then
+ * driven by the reactor: every READ/WRITE event moves at most TRANSFER_QUANTUM
+ * bytes, so the control connection keeps being served while data flows.
+ * When the shapers run out of tokens the handler stops listening to its socket
+ * and sleeps on a reactor timer. A file locked by another transfer is retried
+ * from a reactor timer too, the owner starts it again by transfer_retry ().
+ * The owner is told by transfer_complete ().
+ * In MODE Z a file is compressed by Parallel_Deflate and sent from send_buffer_,
+ * the handler sleeps until a worker wakes it when the next block is not ready,
+ * or sent with sendfile from Transform_Cache when another transfer compressed it.
+ * A TYPE A file in MODE S is sent from Transform_Cache the same way once
+ * another transfer converted its line endings.
+ * Under PROT P the TLS handshake runs as the first quanta of the transfer,
+ * waiting for the socket event OpenSSL asks for, and fails the transfer when
+ * a reactor timer finds it unfinished after TLS_HANDSHAKE_TIMEOUT_MSEC.
+ * A small file in TYPE I and MODE S is sent from Small_File_Cache when it is
+ * there, without opening, locking or sendfile of the file.
+ * In TYPE A the file is read in chunks and its LFs sent as CRLF, received
+ * CRLFs are stored as LF, both converted by ascii_convert.h into pooled buffers.
+ * In MODE B files are framed into blocks ended by an EOF block, so the data
+ * connection survives the transfer and reuse () prepares it for the next one.
+ * 
+ * Reference counting is enabled, the reactor keeps the handler alive during
+ * upcalls, so never delete it, release it by Data_Handler_Ptr.
+ */
+class Data_Handler : public ACE_Event_Handler
+{
 public:
     /**
      * @brief Construct a new Data_Handler object, used by passive mode.
      * 
+     * @param reactor the reactor that drives transfers
      * @param type data type for transfer
      */
-    Data_Handler (const int &type) : 
-        mode_ (Data_Modes::STREAM),
-        type_ (type),
-        is_lock_ (false),
-        wfile_try_connection_ (nullptr)
-    {}
-    
+    Data_Handler (ACE_Reactor *reactor, const int &type);
+
     /**
      * @brief Construct a new Data_Handler object, used by active mode.
      * 
+     * @param reactor the reactor that drives transfers
      * @param ip_addr client's address for data connection
      * @param port client's port for data connection
      * @param type data type for transfer
      */
-    Data_Handler (const std::string &ip_addr, const int &port, const int &type);
-    
+    Data_Handler (ACE_Reactor *reactor, const std::string &ip_addr, const int &port, const int &type);
+
     /**
      * @brief Establish active data connection
      * 
@@ -55,7 +138,9 @@ public:
     virtual int data_link_init ();
 
     /**
-     * @brief Establish local file connection
+     * @brief Establish local file connection, a file to receive is created if missing
+     *        and truncated by recv_file () once it is locked, a file to send is
+     *        not opened when Small_File_Cache has it
      * 
      * @param is_output whether this file connetion is for sending this file to client
      * @return int , 0 for success, -1 for failure
@@ -63,49 +148,310 @@ public:
     virtual int file_link_init (bool is_output);
 
     /**
-     * @brief Send the linked file to client
+     * @brief Start sending the linked file to client
      * 
-     * @return int , 0 for success, -1 for failure
+     * @param owner told by transfer_complete () when the transfer is over
+     * @return int , 0 for started or waiting for the file, -1 for failure, -2 for
+     *               the file written by another transfer past file_lock_wait_ms,
+     *               owner won't be told of failures
      */
-    virtual int send_file ();
+    virtual int send_file (Command_Handler *owner);
 
     /**
-     * @brief Send the information of a list of files in specified directory to client
+     * @brief Format the information of a list of files in specified directory,
+     *        send_list () sends it to client
      * 
      * @param dir_path desired directory's path
-     * @return int , 0 for success, -1 for failure
+     * @return int , 0 for success, -1 for not a directory, -2 for failure
      */
     virtual int list_dir (const std::string &dir_path);
 
     /**
-     * @brief Send specified file's information to client
+     * @brief Format specified file's information, send_list () sends it to client
      * 
      * @param file_path desired file's path
-     * @return int , 0 for success, -1 for failure
+     * @return int , 0 for success, -1 for no such file, -2 for failure
      */
     virtual int list_file (const std::string &file_path);
 
     /**
-     * @brief Receive file from client and store on server
+     * @brief Start sending the formatted list to client
      * 
-     * @return int , 0 for success, -1 for failure
+     * @param owner told by transfer_complete () when the transfer is over
+     * @return int , 0 for started, -1 for failure and owner won't be told
+     */
+    virtual int send_list (Command_Handler *owner);
+
+    /**
+     * @brief Start receiving file from client and store on server
+     * 
+     * @param owner told by transfer_complete () when the transfer is over
+     * @return int , 0 for started or waiting for the file, -1 for failure, -2 for
+     *               the file used by another transfer past file_lock_wait_ms,
+     *               owner won't be told of failures
+     */
+    virtual int recv_file (Command_Handler *owner);
+
+    /**
+     * @brief Try the transfer waiting for its file lock again, called by the owner
+     *        from transfer_retry ()
+     * 
+     * @param owner
+     * @return int , the same as send_file () or recv_file ()
+     */
+    int retry_transfer (Command_Handler *owner);
+
+    /**
+     * @brief Stop the transfer in progress, the owner won't be told
+     * 
+     * @return int , 0 for stopped, -1 for no transfer in progress
+     */
+    int stop ();
+
+    /**
+     * @brief Stop the transfer in progress for ABOR and reset the data connection
+     *        when it is closed, dropping what its socket still queues for the client
+     * 
+     * @return int , 0 for stopped, -1 for no transfer in progress
+     */
+    int abort ();
+
+    /**
+     * @brief Keep the data connection for the next transfer, only in MODE B,
+     *        the file of the finished transfer is unlocked and closed
+     * 
+     * @return int , 0 for reusable, -1 for not
+     */
+    int reuse ();
+
+    /**
+     * @brief Protect the established data connection by TLS, PROT P; the handshake
+     *        is made when the next transfer starts, a connection kept by MODE B
+     *        stays protected
+     * 
+     * @param session_context session id context of the control session, its TLS
+     *                        session is resumed
+     */
+    void start_tls (const std::string &session_context);
+
+    /**
+     * @brief Check whether the data connection is protected by TLS
+     * 
+     * @return true , TLS
+     * @return false , plain
+     */
+    bool is_tls () const { return tls_ != nullptr; }
+
+    /**
+     * @brief Check whether the TLS handshake of the data connection is unfinished,
+     *        a transfer failing meanwhile failed it
+     * 
+     * @return true , TLS without a completed handshake
+     * @return false , plain or established
+     */
+    bool is_handshaking () const { return tls_ && !tls_->is_established (); }
+
+    /**
+     * @brief Check whether the data connection is established
+     * 
+     * @return true , connected
+     * @return false , not connected yet
+     */
+    bool is_connected () const { return data_link_.get_handle () != ACE_INVALID_HANDLE; }
+
+    /**
+     * @brief Set the offset the next RETR or STOR starts at, set by REST
+     * 
+     * @param offset
+     */
+    void set_restart (off_t offset) { restart_offset_ = offset; }
+
+    /**
+     * @brief Set the digests computed over the next received file as it is written,
+     *        a STOR restarted by REST computes none
+     * 
+     * @param algorithms enum Hash_Algorithms
+     */
+    void set_digests (const std::vector<int> &algorithms) { digest_algorithms_ = algorithms; }
+
+    /**
+     * @brief Finish the received file: move a staged one to its name by Dedup_Store
+     *        and remember the digests in Hash_Service, called when the transfer
+     *        is over and before the file is released; a file differing from the
+     *        digest of set_expected () is dropped instead, a staged one leaves
+     *        the existing file alone and one written in place is removed
+     * 
+     * @param digests set to HASH_ALGORITHMS entries, the digest of each computed algorithm
+     * @return int , 0 for success, -1 for failure, -2 for a checksum mismatch
+     */
+    int finish_file (std::vector<std::string> &digests);
+
+    /**
+     * @brief Set whether the next received file is staged for Dedup_Store,
+     *        SHA-256 must be among the digests
+     * 
+     * @param is_dedup
+     */
+    void set_dedup (bool is_dedup) { is_dedup_ = is_dedup; }
+
+    /**
+     * @brief Set whether the next received file is appended to the existing one, APPE
+     * 
+     * @param is_append
+     */
+    void set_append (bool is_append) { is_append_ = is_append; }
+
+    /**
+     * @brief Set the next received file as a segment of a Segmented_Upload, it starts
+     *        at the offset set by set_restart () and the file is not locked
+     * 
+     * @param total_size size of the whole file, -1 for a whole file upload
+     */
+    void set_segment (off_t total_size) { segment_size_ = total_size; }
+
+    /**
+     * @brief Set the size declared by ALLO for the next received file, its extents
+     *        are allocated before the data arrives
+     * 
+     * @param size bytes of the whole file, -1 for none
+     */
+    void set_allocate (off_t size) { allocate_size_ = size; }
+
+    /**
+     * @brief Set whether the next received file is written with O_DIRECT from
+     *        DIRECT_IO_BUFFER_SIZE buffers, bypassing the page cache
+     * 
+     * @param is_direct
+     */
+    void set_direct (bool is_direct) { is_direct_ = is_direct; }
+
+    /**
+     * @brief Set the digest declared by SITE CHECKSUM for the next received file,
+     *        its algorithm must be among the digests
+     * 
+     * @param algorithm enum Hash_Algorithms, -1 for none
+     * @param digest lower case
+     */
+    void set_expected (int algorithm, const std::string &digest)
+    {
+        expected_algorithm_ = algorithm;
+        expected_digest_ = digest;
+    }
+
+    /**
+     * @brief Check whether the received file is a segment
+     * 
+     * @return true , a segment
+     * @return false , a whole file
+     */
+    bool is_segment () const { return segment_size_ >= 0; }
+
+    /**
+     * @brief Get the size of the whole file of a segment
+     * 
+     * @return off_t
+     */
+    off_t get_segment_size () const { return segment_size_; }
+
+    /**
+     * @brief Get the bytes of the whole file received when the segment was finished
+     * 
+     * @return off_t
+     */
+    off_t get_segment_received () const { return segment_received_; }
+
+    /**
+     * @brief Check whether a transfer is in progress
+     * 
+     * @return true , a transfer is in progress
+     * @return false , no transfer is in progress
+     */
+    bool is_busy ();
+
+    /**
+     * @brief Set the token buckets that shape the transfers besides the global one
+     * 
+     * @param user_bucket bucket of the logged in user, may be null
+     * @param session_bucket bucket of the command connection, may be null
+     */
+    void set_buckets (const std::shared_ptr<Token_Bucket> &user_bucket,
+                      const std::shared_ptr<Token_Bucket> &session_bucket);
+
+    /**
+     * @brief Set the flow of Transfer_Scheduler this handler's transfers belong to
+     * 
+     * @param user the logged in user
+     * @param class_name class of the user
+     * @param weight weight of the user
+     */
+    void set_flow (const std::string &user, const std::string &class_name, long weight);
+
+    /**
+     * @brief Listen to the transfer event again, called by Transfer_Scheduler
+     *        when next round starts for a parked handler
+     */
+    void resume () { reactor ()->schedule_wakeup (this, transfer_mask_); }
+
+    /**
+     * @brief The handler for WRITE event, send next quantum
+     * 
+     * @return int , always 0, the handler removes itself when the transfer is over
+     */
+    virtual int handle_output (ACE_HANDLE = ACE_INVALID_HANDLE);
+
+    /**
+     * @brief The handler for READ event, receive next quantum
+     * 
+     * @return int , always 0, the handler removes itself when the transfer is over
+     */
+    virtual int handle_input (ACE_HANDLE = ACE_INVALID_HANDLE);
+
+    /**
+     * @brief The handler for timeout event, a throttled transfer wakes up, a file
+     *        lock is tried again or an unfinished TLS handshake fails the transfer
+     * 
+     * @param now current time
+     * @param act Asynchronous Completion Token
+     * @return int , 0 for success
+     */
+    virtual int handle_timeout (const ACE_Time_Value &now, const void *act);
+
+    /**
+     * @brief Get the underlying handle/fd of the data connection
+     * 
+     * @return ACE_HANDLE underlying handle/fd
      */
-    virtual int recv_file ();
+    virtual ACE_HANDLE get_handle () const { return data_link_.get_handle (); }
 
     /**
      * @brief Get the data link object
      * 
-     * @return ACE_SOCK_Stream& 
+     * @return ACE_SOCK_Stream&
      */
     ACE_SOCK_Stream &get_data_link () { return data_link_; }
 
     /**
      * @brief Get the beginning of data buffer
      * 
-     * @return char* 
+     * @return char*
      */
     char *get_data_buffer () { return data_buffer_; }
 
+    /**
+     * @brief Set the transfer mode of the next transfers
+     * 
+     * @param mode enum Data_Modes
+     * @param level zlib compression level for COMPRESSED
+     */
+    void set_mode (int mode, int level) { mode_ = mode; deflate_level_ = level; }
+
+    /**
+     * @brief Set the data type of the next transfers
+     * 
+     * @param type enum Data_Types, IMAGE or ASCII
+     */
+    void set_type (int type) { type_ = type; }
+
     /**
      * @brief Set the file path
      * 
@@ -113,19 +459,300 @@ public:
      */
     void set_file_path (const std::string &file_path) { file_path_ = file_path; }
 
+    /**
+     * @brief Get the trace of the transfer, only touch it while no transfer is in progress
+     * 
+     * @return Transfer_Trace&
+     */
+    Transfer_Trace &get_trace () { return trace_; }
+
     virtual ~Data_Handler();
 
 private:
+    friend struct Bench_Access;         // microbenchmarks reach the internals
+
     ACE_SOCK_Stream data_link_;         // data connection with ftp client
+    std::unique_ptr<Tls_Stream> tls_;   // TLS over data_link_ under PROT P, null for plain
     ACE_INET_Addr client_addr_;         // client address
     ACE_FILE_IO file_link_;             // file connection
     char data_buffer_[MAX_BUFFER_SIZE]; // buffer for send or receive
-    int mode_;                          // transfer mode, only support STREAM
-    int type_;                          // transfer data type, only support IMAGE
+    int mode_;                          // transfer mode, enum Data_Modes
+    int deflate_level_;                 // zlib compression level in COMPRESSED mode
+    int type_;                          // transfer data type, IMAGE or ASCII
     std::string file_path_;             // file path for file connection
-    bool is_lock_;                      // whether lock a file
-    FILE *wfile_try_connection_;        // When client wants to upload a file,
-                                        // use it to make a write lock
+    bool is_lock_;                      // whether the file is locked in File_Lock_Table
+    bool is_write_lock_;                // whether the lock is exclusive
+    File_Lock_Key lock_key_;            // key of the locked file
+    int lock_fd_;                       // target of a staged upload, held open for its flock, -1 for none
+
+    std::mutex lock_;                   // serializes quanta with stop ()
+    int state_;                         // enum Transfer_States
+    Command_Handler *owner_;            // told when the transfer is over, referenced meanwhile
+    ACE_Reactor_Mask transfer_mask_;    // event that drives the transfer
+    off_t file_offset_;                 // sendfile offset, or pwrite offset of a received file
+    int lock_wait_state_;               // transfer waiting for its file lock, TRANSFER_IDLE for none
+    ACE_Time_Value lock_deadline_;      // the file lock is given up after it
+    std::string list_buffer_;           // formatted LIST output
+    size_t list_sent_;                  // bytes of list_buffer_ already sent
+    std::shared_ptr<Token_Bucket> user_bucket_;     // shapes all sessions of the user
+    std::shared_ptr<Token_Bucket> session_bucket_;  // shapes this command connection
+    std::string flow_user_;             // user of the scheduler flow
+    std::string flow_class_;            // class of the scheduler flow
+    long flow_weight_;                  // weight of the scheduler flow
+    Transfer_Flow *flow_;               // scheduler flow while transferring
+    Transfer_Trace trace_;              // phases of the transfer
+    std::shared_ptr<Parallel_Deflate> deflate_; // compresses the file in COMPRESSED mode
+    std::string send_buffer_;           // transformed output waiting to be sent
+    size_t send_sent_;                  // bytes of send_buffer_ already sent
+    z_stream inflate_stream_;           // decompresses a received file in COMPRESSED mode
+    bool is_inflating_;                 // whether inflate_stream_ is initialized
+    bool is_inflate_end_;               // whether the compressed stream has ended
+    int cache_fd_;                      // transformed file from Transform_Cache, sent instead of file_link_
+    off_t cache_length_;                // length of the content of cache_fd_
+    Small_File_Content cached_;         // content from Small_File_Cache, sent instead of file_link_
+    off_t restart_offset_;              // offset the next transfer starts at
+    off_t last_marker_;                 // file offset of the last MODE B restart marker
+    bool is_eof_sent_;                  // whether the MODE B EOF block was queued
+    unsigned char block_header_[BLOCK_HEADER_SIZE]; // MODE B header being received
+    size_t block_header_length_;        // bytes of block_header_ received
+    size_t block_remaining_;            // MODE B data bytes of the block left to receive
+    std::string ascii_buffer_;          // TYPE A conversion buffer, from Buffer_Pool while transferring
+    bool is_cr_pending_;                // whether a received CR waits for the next byte in TYPE A
+    std::vector<int> digest_algorithms_;    // digests of the next received file
+    std::vector<std::unique_ptr<Hash_Context>> digest_contexts_;   // digests of the file being received
+    bool is_dedup_;                     // whether the next received file is staged for Dedup_Store
+    std::string staging_path_;          // staging file of the received file, empty if written in place
+    bool is_append_;                    // whether the next received file is appended
+    off_t segment_size_;                // size of the whole file of a segment, -1 for none
+    std::string segment_path_;          // part file the segment is written to while receiving
+    off_t segment_begin_;               // first byte of the segment
+    off_t segment_received_;            // bytes of the whole file received when the segment finished
+    off_t allocate_size_;               // size declared by ALLO for the next received file, -1 for none
+    bool is_direct_;                    // whether the next received file is written with O_DIRECT
+    char *direct_buffer_;               // O_DIRECT buffer from Buffer_Pool while receiving with O_DIRECT
+    size_t direct_length_;              // bytes of direct_buffer_ not written yet
+    int expected_algorithm_;            // algorithm declared by SITE CHECKSUM for the received file, -1 for none
+    std::string expected_digest_;       // digest declared by SITE CHECKSUM, lower case
+
+    /**
+     * @brief Register the transfer event to reactor
+     * 
+     * @param owner told by transfer_complete () when the transfer is over
+     * @param state enum Transfer_States
+     * @param mask event that drives the transfer
+     * @return int , 0 for success, -1 for failure
+     */
+    int start_transfer (Command_Handler *owner, int state, ACE_Reactor_Mask mask);
+
+    /**
+     * @brief Retry a file locked by another transfer from a timer, until file_lock_wait_ms
+     *        passes since the first try
+     * 
+     * @param owner referenced while waiting
+     * @param state TRANSFER_SEND_FILE or TRANSFER_RECV_FILE, the transfer to retry
+     * @return int , 0 for waiting, -2 for giving up
+     */
+    int wait_lock (Command_Handler *owner, int state);
+
+    /**
+     * @brief Move next quantum, tell the owner when the transfer is over
+     * 
+     * @return int , always 0
+     */
+    int run_quantum ();
+
+    /**
+     * @brief Go on with the TLS handshake before the transfer and listen to the
+     *        event it waits for, the transfer event once it is done, lock_ must be held
+     * 
+     * @return int , QUANTUM_AGAIN or QUANTUM_FAILED
+     */
+    int handshake_quantum ();
+
+    /**
+     * @brief Send at most TRANSFER_QUANTUM bytes of the file, lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int send_file_quantum ();
+
+    /**
+     * @brief Send at most TRANSFER_QUANTUM bytes of cached_, lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int send_cached_quantum ();
+
+    /**
+     * @brief Send at most TRANSFER_QUANTUM bytes of send_buffer_, refill it by
+     *        fill_send_buffer (), lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int send_buffer_quantum ();
+
+    /**
+     * @brief Append the next piece of the transformed file to send_buffer_:
+     *        compressed by deflate_ in MODE Z, converted in TYPE A and framed
+     *        into blocks in MODE B, or read from cache_fd_ as transformed
+     * 
+     * @return int , enum Fill_Results
+     */
+    int fill_send_buffer ();
+
+    /**
+     * @brief Put the next piece of the Transform_Cache output into send_buffer_,
+     *        when the output can't go by sendfile
+     * 
+     * @return int , enum Fill_Results
+     */
+    int fill_cached ();
+
+    /**
+     * @brief Append one MODE B block to a buffer
+     * 
+     * @param descriptor enum Block_Descriptors, or'ed
+     * @param data
+     * @param length at most BLOCK_MAX_DATA
+     * @param des
+     */
+    static void append_block (int descriptor, const char *data, size_t length, std::string &des);
+
+    /**
+     * @brief Receive at most TRANSFER_QUANTUM bytes of MODE B blocks into the file,
+     *        lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int recv_block_quantum ();
+
+    /**
+     * @brief Unlock and close the file of the transfer
+     */
+    void release_file ();
+
+    /**
+     * @brief Write received data to the file, converted in TYPE A
+     * 
+     * @param data
+     * @param length
+     * @return int , 0 for success, -1 for failure
+     */
+    int write_file (const char *data, size_t length);
+
+    /**
+     * @brief Write bytes of the received file as stored and add them to the digests
+     * 
+     * @param data
+     * @param length
+     * @return int , 0 for success, -1 for failure
+     */
+    int write_disk (const char *data, size_t length);
+
+    /**
+     * @brief Write bytes at file_offset_ and advance it
+     * 
+     * @param data
+     * @param length
+     * @return int , 0 for success, -1 for failure
+     */
+    int pwrite_file (const char *data, size_t length);
+
+    /**
+     * @brief Write direct_buffer_, at the end of the file the tail shorter than
+     *        DIRECT_IO_ALIGNMENT is written without O_DIRECT
+     * 
+     * @param is_end whether the file ends with the buffer
+     * @return int , 0 for success, -1 for failure
+     */
+    int flush_direct (bool is_end);
+
+    /**
+     * @brief Finish the received file, write the CR held back by TYPE A
+     *        and the bytes left in direct_buffer_
+     * 
+     * @return int , 0 for success, -1 for failure
+     */
+    int end_file ();
+
+    /**
+     * @brief Decompress received bytes into the file, lock_ must be held
+     * 
+     * @param length bytes received in data_buffer_
+     * @return int , 0 for success, -1 for failure
+     */
+    int write_inflated (size_t length);
+
+    /**
+     * @brief Send on the data connection, through tls_ when protected
+     * 
+     * @param buf
+     * @param length
+     * @return ssize_t bytes sent, -1 for failure or EAGAIN
+     */
+    ssize_t send_data (const void *buf, size_t length);
+
+    /**
+     * @brief Receive from the data connection, through tls_ when protected
+     * 
+     * @param buf
+     * @param length
+     * @return ssize_t bytes received, 0 for closed, -1 for failure or EAGAIN
+     */
+    ssize_t recv_data (void *buf, size_t length);
+
+    /**
+     * @brief Send the rest of the formatted list, lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int send_list_quantum ();
+
+    /**
+     * @brief Receive at most TRANSFER_QUANTUM bytes into the file, lock_ must be held
+     * 
+     * @return int , enum Quantum_Results
+     */
+    int recv_file_quantum ();
+
+    /**
+     * @brief Ask the shapers and the scheduler how many bytes may be moved now,
+     *        when none, stop listening to the socket and sleep on a timer
+     * 
+     * @param wanted bytes to move
+     * @return size_t allowed bytes, 0 when throttled
+     */
+    size_t allowance (size_t wanted);
+
+    /**
+     * @brief Take moved bytes from the shapers and the scheduler
+     * 
+     * @param bytes moved bytes
+     */
+    void charge (size_t bytes);
+
+    /**
+     * @brief Schedule the timer that listens to the transfer event again
+     * 
+     * @param wait_usec microseconds to sleep
+     */
+    void schedule_wakeup_timer (long wait_usec);
+
+    /**
+     * @brief Unregister from reactor and forget the owner, lock_ must be held
+     * 
+     * @return Command_Handler* the owner, whose reference the caller must release
+     */
+    Command_Handler *detach ();
+
+    /**
+     * @brief Format one line of LIST output and append it to list_buffer_
+     * 
+     * @param file_stat information of the file
+     * @param name name of the file
+     * @return int , 0 for success, -1 for failure
+     */
+    int append_list_line (const struct stat &file_stat, const char *name);
 
     /**
      * @brief Change a file's type and mode to readable string, stored in buf
@@ -151,4 +778,20 @@ private:
      */
     void gid_to_name (gid_t gid, char *buf);
 };
-#endif
\ No newline at end of file
+
+/**
+ * @brief Deleter of Data_Handler_Ptr, stop the transfer and release the owner's
+ *        reference, the reactor may still hold its own during an upcall
+ */
+struct Data_Handler_Release
+{
+    void operator() (Data_Handler *data_handler) const
+    {
+        data_handler->stop ();
+        data_handler->remove_reference ();
+    }
+};
+
+typedef std::unique_ptr<Data_Handler, Data_Handler_Release> Data_Handler_Ptr;
+
+#endif
@@ -0,0 +1,234 @@
+#include "dedup_store.h"
+#include "async_log.h"
+#include "metrics.h"
+#include "server_config.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Dedup_Store *Dedup_Store::instance ()
+{
+    static Dedup_Store store;
+    return &store;
+}
+
+int Dedup_Store::open ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    dir_ = Server_Config::instance ()->get_string ("dedup_dir", "");
+    objects_.clear ();
+    if (dir_.empty ())
+        return 0;
+    std::string staging_dir = dir_ + '/' + DEDUP_STAGING_DIR;
+    struct stat dir_stat;
+    if ((mkdir (dir_.c_str (), 0700) != 0 && errno != EEXIST) ||
+        (mkdir (staging_dir.c_str (), 0700) != 0 && errno != EEXIST) ||
+        stat (dir_.c_str (), &dir_stat) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "create dedup directory %s failed\n", dir_.c_str ());
+        dir_.clear ();
+        return -1;
+    }
+    dev_ = dir_stat.st_dev;
+
+    DIR *dir = opendir (dir_.c_str ());
+    if (dir == nullptr)
+        return -1;
+    while (struct dirent *prefix = readdir (dir))
+    {
+        if (prefix->d_name[0] == '.')
+            continue;
+        std::string prefix_path = dir_ + '/' + prefix->d_name;
+        bool is_staging = (prefix_path == staging_dir);
+        DIR *objects = opendir (prefix_path.c_str ());
+        if (objects == nullptr)
+            continue;
+        while (struct dirent *object = readdir (objects))
+        {
+            if (object->d_name[0] == '.')
+                continue;
+            std::string path = prefix_path + '/' + object->d_name;
+            struct stat file_stat;
+            if (lstat (path.c_str (), &file_stat) != 0 || !S_ISREG (file_stat.st_mode))
+                continue;
+            // uploads cut by a restart, and objects whose names were removed meanwhile
+            if (is_staging || file_stat.st_nlink <= 1)
+                unlink (path.c_str ());
+            else
+                objects_[file_stat.st_ino] = path;
+        }
+        closedir (objects);
+    }
+    closedir (dir);
+    FTP_LOG (LOG_LEVEL_INFO, "dedup store %s holds %zu objects\n", dir_.c_str (), objects_.size ());
+    return 0;
+}
+
+bool Dedup_Store::can_stage (const std::string &path)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (dir_.empty ())
+        return false;
+    // links never cross filesystems
+    size_t slash = path.rfind ('/');
+    std::string parent = (slash == 0 || slash == std::string::npos) ? "/" : path.substr (0, slash);
+    struct stat parent_stat;
+    return stat (parent.c_str (), &parent_stat) == 0 && parent_stat.st_dev == dev_;
+}
+
+int Dedup_Store::create_staging (std::string &staging_path)
+{
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (dir_.empty ())
+            return -1;
+        staging_path = dir_ + '/' + DEDUP_STAGING_DIR + "/upload-XXXXXX";
+    }
+    int fd = mkostemp (&staging_path[0], O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    // an upload written in place gets the same mode
+    fchmod (fd, 0644);
+    ::close (fd);
+    return 0;
+}
+
+std::string Dedup_Store::object_path (const std::string &digest) const
+{
+    return dir_ + '/' + digest.substr (0, 2) + '/' + digest.substr (2);
+}
+
+int Dedup_Store::commit (const std::string &staging_path, const std::string &digest,
+                         const std::string &path, struct stat &file_stat)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    struct stat old_stat;
+    bool has_old = (lstat (path.c_str (), &old_stat) == 0);
+    struct stat staging_stat, object_stat;
+    if (dir_.empty () || digest.length () < 3 || stat (staging_path.c_str (), &staging_stat) != 0)
+    {
+        unlink (staging_path.c_str ());
+        return -1;
+    }
+    std::string object = object_path (digest);
+    mkdir (object.substr (0, object.rfind ('/')).c_str (), 0700);
+
+    bool is_linked = false;
+    if (link (staging_path.c_str (), object.c_str ()) == 0)
+    {
+        // new content, the staging file is the object and the upload
+        objects_[staging_stat.st_ino] = object;
+    }
+    else if (errno == EEXIST && stat (object.c_str (), &object_stat) == 0 &&
+             object_stat.st_size == staging_stat.st_size)
+    {
+        if (has_old && old_stat.st_ino == object_stat.st_ino && old_stat.st_dev == object_stat.st_dev)
+            is_linked = true;   // the same content again under the same name
+        else
+        {
+            // swap the name to a link of the object in one step
+            std::string temp_path = path + ".dedup";
+            unlink (temp_path.c_str ());
+            if (link (object.c_str (), temp_path.c_str ()) == 0 &&
+                rename (temp_path.c_str (), path.c_str ()) == 0)
+                is_linked = true;
+            else
+                unlink (temp_path.c_str ());
+        }
+    }
+    // otherwise the upload is kept as a plain file
+
+    if (is_linked)
+    {
+        unlink (staging_path.c_str ());
+        objects_[object_stat.st_ino] = object;
+        Metrics::instance ()->add (Metric_Counters::METRIC_DEDUP_HITS);
+        Metrics::instance ()->add (Metric_Counters::METRIC_DEDUP_SAVED_BYTES, staging_stat.st_size);
+    }
+    else if (rename (staging_path.c_str (), path.c_str ()) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "move upload to %s failed\n", path.c_str ());
+        unlink (staging_path.c_str ());
+        if (objects_.count (staging_stat.st_ino) != 0)
+        {
+            unlink (object.c_str ());
+            objects_.erase (staging_stat.st_ino);
+        }
+        return -1;
+    }
+    if (lstat (path.c_str (), &file_stat) != 0)
+        return -1;
+    if (has_old && old_stat.st_ino != file_stat.st_ino)
+        release_locked (old_stat);
+    return 0;
+}
+
+int Dedup_Store::unshare (const std::string &path, off_t keep)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    struct stat file_stat;
+    if (dir_.empty () || lstat (path.c_str (), &file_stat) != 0 || file_stat.st_nlink < 2 ||
+        file_stat.st_dev != dev_ || objects_.count (file_stat.st_ino) == 0)
+        return 0;
+    if (keep == 0)
+    {
+        if (unlink (path.c_str ()) != 0)
+            return -1;
+        release_locked (file_stat);
+        return 1;
+    }
+
+    // REST keeps the first bytes, they are copied to a file of its own
+    std::string temp_path = path + ".dedup";
+    int src_fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    int des_fd = ::open (temp_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    off_t offset = 0;
+    while (src_fd != -1 && des_fd != -1 && offset < keep)
+    {
+        ssize_t sent = sendfile (des_fd, src_fd, &offset, keep - offset);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            break;
+    }
+    if (src_fd != -1)
+        ::close (src_fd);
+    if ((des_fd != -1 && ::close (des_fd) != 0) || des_fd == -1 || offset < keep ||
+        rename (temp_path.c_str (), path.c_str ()) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "unshare %s failed\n", path.c_str ());
+        unlink (temp_path.c_str ());
+        return -1;
+    }
+    release_locked (file_stat);
+    return 1;
+}
+
+void Dedup_Store::release (const struct stat &file_stat)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    release_locked (file_stat);
+}
+
+void Dedup_Store::release_locked (const struct stat &file_stat)
+{
+    if (file_stat.st_dev != dev_)
+        return;
+    auto ite = objects_.find (file_stat.st_ino);
+    if (ite == objects_.end ())
+        return;
+    struct stat object_stat;
+    if (lstat (ite->second.c_str (), &object_stat) != 0 || object_stat.st_ino != file_stat.st_ino)
+        objects_.erase (ite);
+    else if (object_stat.st_nlink <= 1)
+    {
+        unlink (ite->second.c_str ());
+        objects_.erase (ite);
+    }
+}
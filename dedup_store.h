@@ -0,0 +1,116 @@
+#ifndef DEDUP_STORE_H
+#define DEDUP_STORE_H
+
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+#define DEDUP_STAGING_DIR "staging"     // uploads in progress, under the store directory
+
+struct stat;
+
+/**
+ * Content-addressed store of uploaded files. A STOR is written to a staging
+ * file while its SHA-256 is computed; when it completes, an upload whose
+ * content is already stored becomes a hardlink of the stored object and the
+ * staging copy is dropped, new content becomes an object itself.
+ *
+ * The link count of an object is its reference count: the store holds one
+ * link and every file name another. DELE and RNTO report the names they
+ * remove by release (), the object goes with its last name. A file name
+ * sharing an object is never written in place, unshare () gives it its own
+ * copy first.
+ */
+class Dedup_Store
+{
+public:
+    /**
+     * @brief Get the process-wide store
+     *
+     * @return Dedup_Store*
+     */
+    static Dedup_Store *instance ();
+
+    /**
+     * @brief Read dedup_dir from Server_Config, create the directories, index the
+     *        objects of earlier runs and drop those no file name references
+     *
+     * @return int , 0 for success, -1 for failure
+     */
+    int open ();
+
+    /**
+     * @brief Check whether an upload to path can be staged, the store must be
+     *        enabled and on the same filesystem as the directory of path
+     *
+     * @param path absolute path of the upload
+     * @return true , stage it
+     * @return false , write it in place
+     */
+    bool can_stage (const std::string &path);
+
+    /**
+     * @brief Create an empty staging file
+     *
+     * @param staging_path set to the path of the file
+     * @return int , 0 for success, -1 for failure
+     */
+    int create_staging (std::string &staging_path);
+
+    /**
+     * @brief Give a completed upload its name, as a link of the object with the
+     *        same content or as a new object; the staging file is gone afterwards
+     *
+     * @param staging_path
+     * @param digest SHA-256 of the content, lower case hex
+     * @param path name of the upload, replaced if it exists
+     * @param file_stat set to the file now named by path
+     * @return int , 0 for success, -1 for failure
+     */
+    int commit (const std::string &staging_path, const std::string &digest,
+                const std::string &path, struct stat &file_stat);
+
+    /**
+     * @brief Prepare a file name to be written in place: a name sharing an object
+     *        is removed, or replaced by a copy of its first keep bytes
+     *
+     * @param path
+     * @param keep bytes kept by REST, 0 to write from the beginning
+     * @return int , 0 for the name written in place as it is, 1 for the name removed
+     *               or replaced and an open file of it stale, -1 for failure
+     */
+    int unshare (const std::string &path, off_t keep);
+
+    /**
+     * @brief Report a removed file name, the object goes with its last name
+     *
+     * @param file_stat the file before the name was removed
+     */
+    void release (const struct stat &file_stat);
+
+private:
+    Dedup_Store () : dev_ (0) {}
+
+    /**
+     * @brief Get the path of the object of a digest, the first two digits are a directory
+     *
+     * @param digest
+     * @return std::string
+     */
+    std::string object_path (const std::string &digest) const;
+
+    /**
+     * @brief release () with lock_ held
+     *
+     * @param file_stat
+     */
+    void release_locked (const struct stat &file_stat);
+
+    std::mutex lock_;                       // guards everything below and serializes link changes
+    std::string dir_;                       // store directory, empty for disabled
+    dev_t dev_;                             // filesystem of dir_
+    std::unordered_map<ino_t, std::string> objects_;    // object path by inode
+};
+
+#endif
@@ -0,0 +1,452 @@
+#include "file_hash.h"
+#include "async_log.h"
+#include "command_handler.h"
+#include "server_config.h"
+#include "vfs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <openssl/evp.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define FILE_HASH_X86
+#endif
+
+static const char *hash_names[HASH_ALGORITHMS] = { "CRC32", "CRC32C", "MD5", "SHA-1", "SHA-256" };
+
+/**
+ * @brief Table driven CRC32C, reflected polynomial 0x82f63b78
+ */
+static uint32_t crc32c_table (uint32_t crc, const unsigned char *data, size_t length)
+{
+    static uint32_t table[256];
+    static bool is_built = [] {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+                value = (value & 1) ? (value >> 1) ^ 0x82f63b78 : value >> 1;
+            table[i] = value;
+        }
+        return true;
+    } ();
+    (void)is_built;
+    crc = ~crc;
+    while (length-- > 0)
+        crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef FILE_HASH_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t value = ~crc & 0xffffffffu;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy (&word, data, 8);
+        value = _mm_crc32_u64 (value, word);
+        data += 8;
+        length -= 8;
+    }
+    uint32_t value32 = (uint32_t)value;
+    while (length-- > 0)
+        value32 = _mm_crc32_u8 (value32, *data++);
+    return ~value32;
+}
+#endif
+
+uint32_t crc32c (uint32_t crc, const void *data, size_t length)
+{
+#ifdef FILE_HASH_X86
+    static bool has_sse42 = __builtin_cpu_supports ("sse4.2");
+    if (has_sse42)
+        return crc32c_sse42 (crc, (const unsigned char *)data, length);
+#endif
+    return crc32c_table (crc, (const unsigned char *)data, length);
+}
+
+Hash_Context::Hash_Context (int algorithm) :
+    algorithm_ (algorithm),
+    crc_ (0),
+    md_ (nullptr)
+{
+    const EVP_MD *md = (algorithm == HASH_MD5 ? EVP_md5 () :
+                        algorithm == HASH_SHA1 ? EVP_sha1 () :
+                        algorithm == HASH_SHA256 ? EVP_sha256 () : nullptr);
+    if (md != nullptr)
+    {
+        md_ = EVP_MD_CTX_new ();
+        if (md_ != nullptr)
+            EVP_DigestInit_ex (md_, md, nullptr);
+    }
+}
+
+Hash_Context::~Hash_Context ()
+{
+    if (md_ != nullptr)
+        EVP_MD_CTX_free (md_);
+}
+
+void Hash_Context::update (const void *data, size_t length)
+{
+    if (algorithm_ == Hash_Algorithms::HASH_CRC32)
+    {
+        // zlib takes at most 4 GiB a call
+        const unsigned char *bytes = (const unsigned char *)data;
+        while (length > 0)
+        {
+            uInt chunk = (uInt)std::min (length, (size_t)1 << 30);
+            crc_ = crc32 (crc_, bytes, chunk);
+            bytes += chunk;
+            length -= chunk;
+        }
+    }
+    else if (algorithm_ == Hash_Algorithms::HASH_CRC32C)
+        crc_ = crc32c (crc_, data, length);
+    else if (md_ != nullptr)
+        EVP_DigestUpdate (md_, data, length);
+}
+
+std::string Hash_Context::final_hex ()
+{
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    if (algorithm_ == Hash_Algorithms::HASH_CRC32 || algorithm_ == Hash_Algorithms::HASH_CRC32C)
+    {
+        snprintf (hex, sizeof (hex), "%08x", crc_);
+        return hex;
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (md_ == nullptr || EVP_DigestFinal_ex (md_, digest, &length) != 1)
+        return "";
+    for (unsigned int i = 0; i < length; ++i)
+        snprintf (hex + 2 * i, 3, "%02x", digest[i]);
+    return std::string (hex, 2 * length);
+}
+
+const char *Hash_Context::name (int algorithm)
+{
+    return (algorithm >= 0 && algorithm < HASH_ALGORITHMS) ? hash_names[algorithm] : "";
+}
+
+int Hash_Context::find (const std::string &name)
+{
+    for (int algorithm = 0; algorithm < HASH_ALGORITHMS; ++algorithm)
+        if (strcasecmp (name.c_str (), hash_names[algorithm]) == 0)
+            return algorithm;
+    return -1;
+}
+
+Hash_Service *Hash_Service::instance ()
+{
+    static Hash_Service service;
+    return &service;
+}
+
+int Hash_Service::open ()
+{
+    Server_Config *config = Server_Config::instance ();
+    {
+        std::lock_guard<std::mutex> guard (index_lock_);
+        index_path_ = config->get_string ("hash_index_path", "./hash_index");
+        digests_.clear ();
+        index_lines_ = 0;
+        index_pending_.clear ();
+        is_compact_pending_ = false;
+        if (!index_path_.empty ())
+        {
+            std::ifstream index_stream (index_path_);
+            std::string key, digest;
+            while (index_stream >> key >> digest)
+            {
+                digests_[key] = digest;
+                ++index_lines_;
+            }
+            // drop duplicates and stale lines left by earlier runs
+            if (index_lines_ > digests_.size () + digests_.size () / 2 || digests_.size () > MAX_HASH_INDEX)
+                is_compact_pending_ = true;
+        }
+    }
+    // before the event loop starts
+    persist ();
+    upload_algorithms_.clear ();
+    std::istringstream upload_stream (config->get_string ("upload_digests", DEFAULT_UPLOAD_DIGESTS));
+    std::string name;
+    while (upload_stream >> name)
+    {
+        int algorithm = Hash_Context::find (name);
+        if (name == "none")
+            continue;
+        else if (algorithm == -1)
+            FTP_LOG (LOG_LEVEL_ERROR, "unknown upload digest %s\n", name.c_str ());
+        else if (std::find (upload_algorithms_.begin (), upload_algorithms_.end (), algorithm) ==
+                 upload_algorithms_.end ())
+            upload_algorithms_.push_back (algorithm);
+    }
+    long threads = config->get_int ("hash_threads", DEFAULT_HASH_THREADS);
+
+    std::lock_guard<std::mutex> guard (lock_);
+    if (!workers_.empty ())
+        return 0;
+    is_stopping_ = false;
+    try
+    {
+        for (long i = 0; i < threads; ++i)
+            workers_.emplace_back (&Hash_Service::work_loop, this);
+    }
+    catch (const std::system_error &)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "start hash worker failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+std::string Hash_Service::make_key (const struct stat &file_stat, int algorithm, off_t begin, off_t end)
+{
+    char key[160];
+    snprintf (key, sizeof (key), "%llx:%llx:%lld.%09ld:%lld:%s:%lld-%lld",
+              (unsigned long long)file_stat.st_dev, (unsigned long long)file_stat.st_ino,
+              (long long)file_stat.st_mtim.tv_sec, (long)file_stat.st_mtim.tv_nsec,
+              (long long)file_stat.st_size, Hash_Context::name (algorithm),
+              (long long)begin, (long long)end);
+    return key;
+}
+
+int Hash_Service::hash (Command_Handler *handler, const std::string &path, int algorithm,
+                        off_t begin, off_t end, std::string &digest, off_t &file_size)
+{
+    Hash_Job job;
+    job.handler = handler;
+    job.path = path;
+    job.algorithm = algorithm;
+    job.begin = begin;
+    job.end = end;
+
+    // answered from the index without waking a worker
+    struct stat file_stat;
+    if (Vfs::instance ()->stat (path, file_stat) != 0 || !S_ISREG (file_stat.st_mode))
+        return Hash_Results::HASH_FAILED;
+    off_t clipped = (end < 0 ? file_stat.st_size : std::min (end, file_stat.st_size));
+    if (begin > clipped)
+        return Hash_Results::HASH_FAILED;
+    {
+        std::lock_guard<std::mutex> guard (index_lock_);
+        auto ite = digests_.find (make_key (file_stat, algorithm, begin, clipped));
+        if (ite != digests_.end ())
+        {
+            digest = ite->second;
+            file_size = file_stat.st_size;
+            return Hash_Results::HASH_OK;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!workers_.empty ())
+        {
+            if (queue_.size () >= MAX_HASH_QUEUE)
+                return Hash_Results::HASH_BUSY;
+            handler->add_reference ();
+            queue_.push_back (std::move (job));
+            ready_.notify_one ();
+            return Hash_Results::HASH_PENDING;
+        }
+    }
+    // no workers, as in tests and benchmarks
+    return compute (job, digest, file_size);
+}
+
+int Hash_Service::compute (const Hash_Job &job, std::string &digest, off_t &file_size)
+{
+    int fd = Vfs::instance ()->open (job.path, O_RDONLY, 0);
+    if (fd == -1)
+        return Hash_Results::HASH_FAILED;
+    struct stat file_stat;
+    if (fstat (fd, &file_stat) != 0 || !S_ISREG (file_stat.st_mode))
+    {
+        ::close (fd);
+        return Hash_Results::HASH_FAILED;
+    }
+    off_t end = (job.end < 0 ? file_stat.st_size : std::min (job.end, file_stat.st_size));
+    if (job.begin > end)
+    {
+        ::close (fd);
+        return Hash_Results::HASH_FAILED;
+    }
+    std::string key = make_key (file_stat, job.algorithm, job.begin, end);
+    {
+        std::lock_guard<std::mutex> guard (index_lock_);
+        auto ite = digests_.find (key);
+        if (ite != digests_.end ())
+        {
+            ::close (fd);
+            digest = ite->second;
+            file_size = file_stat.st_size;
+            return Hash_Results::HASH_OK;
+        }
+    }
+
+    posix_fadvise (fd, job.begin, end - job.begin, POSIX_FADV_SEQUENTIAL);
+    Hash_Context context (job.algorithm);
+    std::string buffer (HASH_READ_SIZE, '\0');
+    bool is_failed = false;
+    for (off_t offset = job.begin; offset < end; )
+    {
+        ssize_t read_count = pread (fd, &buffer[0], std::min ((off_t)buffer.size (), end - offset), offset);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count <= 0)
+        {
+            is_failed = true;
+            break;
+        }
+        context.update (buffer.data (), read_count);
+        offset += read_count;
+    }
+    struct stat after_stat;
+    // a file changed while hashing is not remembered
+    bool is_same = (fstat (fd, &after_stat) == 0 && after_stat.st_mtim.tv_sec == file_stat.st_mtim.tv_sec &&
+                    after_stat.st_mtim.tv_nsec == file_stat.st_mtim.tv_nsec && after_stat.st_size == file_stat.st_size);
+    ::close (fd);
+    if (is_failed)
+        return Hash_Results::HASH_FAILED;
+    digest = context.final_hex ();
+    file_size = file_stat.st_size;
+    if (is_same)
+        remember (key, digest);
+    return Hash_Results::HASH_OK;
+}
+
+void Hash_Service::store (const struct stat &file_stat, int algorithm, const std::string &digest)
+{
+    remember (make_key (file_stat, algorithm, 0, file_stat.st_size), digest);
+}
+
+void Hash_Service::remember (const std::string &key, const std::string &digest)
+{
+    {
+        std::lock_guard<std::mutex> guard (index_lock_);
+        if (digests_.size () >= MAX_HASH_INDEX)
+        {
+            // keys of changed files are never asked again, forget a quarter
+            for (auto ite = digests_.begin (); ite != digests_.end () && digests_.size () > MAX_HASH_INDEX * 3 / 4; )
+                ite = digests_.erase (ite);
+            is_compact_pending_ = true;
+        }
+        digests_[key] = digest;
+        if (index_path_.empty ())
+            return;
+        // a rewrite holds every digest, lines queued before it are dropped by persist ()
+        index_pending_ += key + ' ' + digest + '\n';
+        ++index_lines_;
+    }
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!workers_.empty ())
+        {
+            is_index_dirty_ = true;
+            ready_.notify_one ();
+            return;
+        }
+    }
+    // no workers, as in tests and benchmarks
+    persist ();
+}
+
+void Hash_Service::persist ()
+{
+    std::lock_guard<std::mutex> file_guard (file_lock_);
+    std::string index_path, lines;
+    bool is_compact;
+    {
+        // only the copy is made under index_lock_, the file is written without it
+        std::lock_guard<std::mutex> guard (index_lock_);
+        index_path = index_path_;
+        is_compact = is_compact_pending_;
+        if (is_compact)
+        {
+            for (auto &entry : digests_)
+                lines += entry.first + ' ' + entry.second + '\n';
+            index_lines_ = digests_.size ();
+            index_pending_.clear ();
+        }
+        else
+            lines.swap (index_pending_);
+        is_compact_pending_ = false;
+    }
+    if (index_path.empty () || (!is_compact && lines.empty ()))
+        return;
+    std::string write_path = is_compact ? index_path + ".tmp" : index_path;
+    FILE *index_file = fopen (write_path.c_str (), is_compact ? "w" : "a");
+    if (index_file == nullptr)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "open %s failed\n", write_path.c_str ());
+        return;
+    }
+    fwrite (lines.data (), 1, lines.size (), index_file);
+    if (fclose (index_file) != 0 || (is_compact && rename (write_path.c_str (), index_path.c_str ()) != 0))
+        FTP_LOG (LOG_LEVEL_ERROR, "write %s failed\n", index_path.c_str ());
+}
+
+void Hash_Service::work_loop ()
+{
+    std::unique_lock<std::mutex> guard (lock_);
+    while (true)
+    {
+        ready_.wait (guard, [this] { return is_stopping_ || !queue_.empty () || is_index_dirty_; });
+        if (is_stopping_)
+            break;
+        if (is_index_dirty_)
+        {
+            is_index_dirty_ = false;
+            guard.unlock ();
+            persist ();
+            guard.lock ();
+            continue;
+        }
+        Hash_Job job = std::move (queue_.front ());
+        queue_.pop_front ();
+        guard.unlock ();
+
+        std::string digest;
+        off_t file_size = 0;
+        int result = compute (job, digest, file_size);
+        job.handler->hash_complete (result, digest, file_size);
+        job.handler->remove_reference ();
+
+        guard.lock ();
+    }
+}
+
+void Hash_Service::close ()
+{
+    std::vector<std::thread> workers;
+    std::deque<Hash_Job> queue;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        is_stopping_ = true;
+        workers.swap (workers_);
+        queue.swap (queue_);
+    }
+    ready_.notify_all ();
+    for (std::thread &worker : workers)
+        worker.join ();
+    for (Hash_Job &job : queue)
+        job.handler->remove_reference ();
+    // lines the workers didn't write yet
+    persist ();
+}
@@ -0,0 +1,254 @@
+#ifndef FILE_HASH_H
+#define FILE_HASH_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define DEFAULT_HASH_THREADS 2
+#define MAX_HASH_QUEUE 256
+#define MAX_HASH_INDEX 65536                // digests kept, the index is compacted beyond
+#define HASH_READ_SIZE (256 * 1024)         // file bytes hashed at a time
+#define DEFAULT_UPLOAD_DIGESTS "CRC32C SHA-256"
+
+struct stat;
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+class Command_Handler;
+
+enum Hash_Algorithms
+{
+    HASH_CRC32 = 0,
+    HASH_CRC32C = 1,
+    HASH_MD5 = 2,
+    HASH_SHA1 = 3,
+    HASH_SHA256 = 4,
+    HASH_ALGORITHMS = 5,
+};
+
+enum Hash_Results
+{
+    HASH_OK = 0,        // digest returned
+    HASH_FAILED = -1,   // file missing or unreadable
+    HASH_PENDING = 1,   // queued, Command_Handler::hash_complete () is called later
+    HASH_BUSY = 2,      // queue full
+};
+
+/**
+ * @brief CRC32C (Castagnoli) of a buffer, with the SSE4.2 crc32 instruction
+ *        when the CPU has it
+ *
+ * @param crc CRC of the preceding bytes, 0 to start
+ * @param data
+ * @param length
+ * @return uint32_t
+ */
+uint32_t crc32c (uint32_t crc, const void *data, size_t length);
+
+/**
+ * Incremental digest of one algorithm, the digests are OpenSSL's, which use
+ * the SHA extensions and vector units of the CPU.
+ */
+class Hash_Context
+{
+public:
+    /**
+     * @brief Construct a new Hash_Context object
+     *
+     * @param algorithm enum Hash_Algorithms
+     */
+    explicit Hash_Context (int algorithm);
+
+    ~Hash_Context ();
+
+    Hash_Context (const Hash_Context &) = delete;
+    Hash_Context &operator= (const Hash_Context &) = delete;
+
+    /**
+     * @brief Hash more bytes
+     *
+     * @param data
+     * @param length
+     */
+    void update (const void *data, size_t length);
+
+    /**
+     * @brief Finish the digest
+     *
+     * @return std::string , lower case hex
+     */
+    std::string final_hex ();
+
+    /**
+     * @brief Get the algorithm
+     *
+     * @return int , enum Hash_Algorithms
+     */
+    int algorithm () const { return algorithm_; }
+
+    /**
+     * @brief Get the name of an algorithm as used by HASH, such as "SHA-256"
+     *
+     * @param algorithm enum Hash_Algorithms
+     * @return const char*
+     */
+    static const char *name (int algorithm);
+
+    /**
+     * @brief Find an algorithm by name, case insensitive
+     *
+     * @param name
+     * @return int , enum Hash_Algorithms, -1 for unknown
+     */
+    static int find (const std::string &name);
+
+private:
+    int algorithm_;         // enum Hash_Algorithms
+    uint32_t crc_;          // running CRC32 or CRC32C
+    EVP_MD_CTX *md_;        // running MD5 or SHA
+};
+
+/**
+ * Digests of file ranges for HASH and XCRC/XMD5/XSHA1/XSHA256, computed by
+ * worker threads so a large file never stalls the event loop. A digest is
+ * remembered by the device, inode, mtime and size of the file, the range and
+ * the algorithm, and the index is appended to a file so unchanged files
+ * hash for free across restarts. A digest is only added to memory by the
+ * caller, the workers append it to the index file and compact it, so no
+ * disk I/O is done under index_lock_ or on the event loop.
+ */
+class Hash_Service
+{
+public:
+    /**
+     * @brief Get the process-wide hash service
+     *
+     * @return Hash_Service*
+     */
+    static Hash_Service *instance ();
+
+    /**
+     * @brief Read the settings from Server_Config, load the index and start the
+     *        workers, files are hashed inline until then
+     *
+     * @return int , 0 for success, -1 for failure
+     */
+    int open ();
+
+    /**
+     * @brief Get the digest of a file range
+     *
+     * @param handler the session, referenced until hash_complete () returns
+     * @param path
+     * @param algorithm enum Hash_Algorithms
+     * @param begin first byte
+     * @param end byte after the last one, clipped to the file size, -1 for the end of file
+     * @param digest the digest for HASH_OK
+     * @param file_size the file size for HASH_OK
+     * @return int , see enum Hash_Results
+     */
+    int hash (Command_Handler *handler, const std::string &path, int algorithm,
+              off_t begin, off_t end, std::string &digest, off_t &file_size);
+
+    /**
+     * @brief Remember the digest of a whole file computed elsewhere
+     *
+     * @param file_stat the file when the digest was finished
+     * @param algorithm enum Hash_Algorithms
+     * @param digest
+     */
+    void store (const struct stat &file_stat, int algorithm, const std::string &digest);
+
+    /**
+     * @brief Get the algorithms computed over uploads while they are received,
+     *        read from Server_Config by open ()
+     *
+     * @return const std::vector<int>& , enum Hash_Algorithms
+     */
+    const std::vector<int> &upload_algorithms () const { return upload_algorithms_; }
+
+    /**
+     * @brief Stop the workers, queued requests are dropped
+     */
+    void close ();
+
+    ~Hash_Service () { close (); }
+
+private:
+    struct Hash_Job
+    {
+        Command_Handler *handler;   // session waiting for the digest
+        std::string path;           // file to hash
+        int algorithm;              // enum Hash_Algorithms
+        off_t begin;                // first byte
+        off_t end;                  // byte after the last one, -1 for the end of file
+    };
+
+    Hash_Service () : is_stopping_ (false), is_index_dirty_ (false), index_lines_ (0), is_compact_pending_ (false) {}
+
+    /**
+     * @brief Body of a worker thread
+     */
+    void work_loop ();
+
+    /**
+     * @brief Hash a file range, or find it in the index
+     *
+     * @param job
+     * @param digest
+     * @param file_size
+     * @return int , HASH_OK or HASH_FAILED
+     */
+    int compute (const Hash_Job &job, std::string &digest, off_t &file_size);
+
+    /**
+     * @brief Build the index key of a file version, a range and an algorithm
+     *
+     * @param file_stat
+     * @param algorithm
+     * @param begin
+     * @param end clipped to the file size
+     * @return std::string
+     */
+    static std::string make_key (const struct stat &file_stat, int algorithm, off_t begin, off_t end);
+
+    /**
+     * @brief Remember a digest and queue it for the index file, written by
+     *        a worker, or inline when there are no workers
+     *
+     * @param key
+     * @param digest
+     */
+    void remember (const std::string &key, const std::string &digest);
+
+    /**
+     * @brief Append the queued lines to the index file, or rewrite it from
+     *        digests_ when a compaction is pending, index_lock_ must not be held
+     */
+    void persist ();
+
+    std::mutex lock_;                       // guards queue_ and is_stopping_
+    std::condition_variable ready_;         // signaled when a job is queued or on close
+    std::deque<Hash_Job> queue_;            // requests waiting for a worker
+    bool is_stopping_;                      // workers exit when set
+    bool is_index_dirty_;                   // whether a worker must call persist ()
+    std::vector<std::thread> workers_;      // worker threads
+
+    std::mutex index_lock_;                 // guards the members below
+    std::unordered_map<std::string, std::string> digests_;     // digests by make_key ()
+    std::string index_path_;                // file the digests are appended to, empty for none
+    size_t index_lines_;                    // lines in the index file, counting index_pending_
+    std::string index_pending_;             // lines not appended to the index file yet
+    bool is_compact_pending_;               // whether the index file must be rewritten from digests_
+
+    std::mutex file_lock_;                  // serializes persist ()
+
+    std::vector<int> upload_algorithms_;    // digests computed by STOR, set by open () only
+};
+
+#endif
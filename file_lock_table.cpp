@@ -0,0 +1,61 @@
+#include "file_lock_table.h"
+#include "server_config.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+File_Lock_Table *File_Lock_Table::instance ()
+{
+    static File_Lock_Table table;
+    return &table;
+}
+
+void File_Lock_Table::configure ()
+{
+    Server_Config *config = Server_Config::instance ();
+    wait_msec_ = config->get_int ("file_lock_wait_ms", 0);
+    is_cross_process_ = (config->get_int ("file_lock_cross_process", 0) != 0);
+}
+
+int File_Lock_Table::lock (int fd, bool is_exclusive, File_Lock_Key &key)
+{
+    struct stat file_stat;
+    if (fstat (fd, &file_stat) != 0)
+        return -1;
+    key.dev = file_stat.st_dev;
+    key.ino = file_stat.st_ino;
+
+    Shard &shard = shard_of (key);
+    {
+        std::lock_guard<std::mutex> guard (shard.lock);
+        Holders &holders = shard.files.emplace (key, Holders { 0, false }).first->second;
+        if (holders.is_writing || (is_exclusive && holders.readers > 0))
+            return -1;
+        if (is_exclusive)
+            holders.is_writing = true;
+        else
+            ++holders.readers;
+    }
+
+    if (is_cross_process_ && flock (fd, (is_exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0)
+    {
+        unlock (key, is_exclusive);
+        return -1;
+    }
+    return 0;
+}
+
+void File_Lock_Table::unlock (const File_Lock_Key &key, bool is_exclusive)
+{
+    Shard &shard = shard_of (key);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    auto ite = shard.files.find (key);
+    if (ite == shard.files.end ())
+        return;
+    if (is_exclusive)
+        ite->second.is_writing = false;
+    else if (ite->second.readers > 0)
+        --ite->second.readers;
+    if (ite->second.readers == 0 && !ite->second.is_writing)
+        shard.files.erase (ite);
+}
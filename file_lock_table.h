@@ -0,0 +1,110 @@
+#ifndef FILE_LOCK_TABLE_H
+#define FILE_LOCK_TABLE_H
+
+#include <cstddef>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+
+#define FILE_LOCK_SHARDS 64
+
+struct File_Lock_Key
+{
+    dev_t dev;
+    ino_t ino;
+
+    bool operator== (const File_Lock_Key &other) const { return dev == other.dev && ino == other.ino; }
+};
+
+/**
+ * Reader/writer locks of the files being transferred, keyed by device and
+ * inode, so a RETR shares its file with other RETRs and a STOR or APPE
+ * writes it alone. The table is split into shards with a mutex each, a
+ * transfer only touches the shard of its file. lock () never blocks, a
+ * transfer finding its file held retries from a reactor timer for up to
+ * file_lock_wait_ms, so the holder keeps being driven meanwhile. Other
+ * processes are only kept out by flock when file_lock_cross_process is set.
+ */
+class File_Lock_Table
+{
+public:
+    /**
+     * @brief Get the process-wide table
+     *
+     * @return File_Lock_Table*
+     */
+    static File_Lock_Table *instance ();
+
+    /**
+     * @brief Read file_lock_wait_ms and file_lock_cross_process from Server_Config
+     */
+    void configure ();
+
+    /**
+     * @brief Lock an open file
+     *
+     * @param fd the file, also flocked when cross-process locking is set
+     * @param is_exclusive true for writing, false for reading
+     * @param key set to the key to unlock with
+     * @return int , 0 for locked, -1 for held by another transfer or process
+     */
+    int lock (int fd, bool is_exclusive, File_Lock_Key &key);
+
+    /**
+     * @brief Unlock a file locked by lock (), its flock goes when the fd is closed
+     *
+     * @param key
+     * @param is_exclusive the same as given to lock ()
+     */
+    void unlock (const File_Lock_Key &key, bool is_exclusive);
+
+    /**
+     * @brief Check whether the locks are also flocks, the fd given to lock ()
+     *        must then stay open while the file is locked
+     *
+     * @return true , flocked
+     * @return false , only locked in the table
+     */
+    bool is_cross_process () const { return is_cross_process_; }
+
+    /**
+     * @brief Get how long a transfer retries a file held by another one
+     *
+     * @return long , milliseconds, 0 for failing at once
+     */
+    long get_wait_msec () const { return wait_msec_; }
+
+private:
+    struct Key_Hash
+    {
+        size_t operator() (const File_Lock_Key &key) const { return key.ino * 31 + key.dev; }
+    };
+
+    struct Holders
+    {
+        int readers;            // RETRs reading the file
+        bool is_writing;        // whether a STOR or APPE writes it
+    };
+
+    struct Shard
+    {
+        std::mutex lock;                    // guards files
+        std::unordered_map<File_Lock_Key, Holders, Key_Hash> files;    // locked files
+    };
+
+    File_Lock_Table () : wait_msec_ (0), is_cross_process_ (false) {}
+
+    /**
+     * @brief Get the shard of a file
+     *
+     * @param key
+     * @return Shard&
+     */
+    Shard &shard_of (const File_Lock_Key &key) { return shards_[Key_Hash () (key) % FILE_LOCK_SHARDS]; }
+
+    Shard shards_[FILE_LOCK_SHARDS];
+    long wait_msec_;                        // how long a lock is retried for
+    bool is_cross_process_;                 // whether locks are also flocks
+};
+
+#endif
@@ -1,7 +1,23 @@
 #include "ftp_server.h"
+#include "async_log.h"
+#include "auth_pool.h"
 #include "command_handler.h"
+#include "dedup_store.h"
+#include "admission_control.h"
+#include "bandwidth_shaper.h"
+#include "file_hash.h"
+#include "file_lock_table.h"
+#include "metrics.h"
+#include "msg.h"
+#include "parallel_deflate.h"
+#include "segmented_upload.h"
+#include "server_config.h"
+#include "small_file_cache.h"
+#include "tls_session.h"
+#include "transform_cache.h"
+#include "vfs.h"
 
-#include "ace/Log_Msg.h"
+#include "ace/Timer_Queue.h"
 
 #include "user_inf.h"
 
@@ -11,25 +27,123 @@ int Ftp_Server::open (const ACE_INET_Addr &local_addr)
         return -1;
     if ( User_Inf::read_passwords () == -1)
         return -1;
+    if (acceptor_.enable (ACE_NONBLOCK) == -1)
+        return -1;
+    reserve_handle_ = ACE_OS::open ("/dev/null", O_RDONLY);
+    Admission_Control::instance ()->configure ();
+    Bandwidth_Shaper::instance ()->configure ();
+    File_Lock_Table::instance ()->configure ();
+    Vfs::instance ()->configure ();
+    Segmented_Upload::instance ()->configure ();
+    Small_File_Cache::instance ()->configure ();
+    if (Auth_Pool::instance ()->open () == -1)
+        return -1;
+    if (Compress_Pool::instance ()->open (Server_Config::instance ()->get_int ("compress_threads",
+                                                                              DEFAULT_COMPRESS_THREADS)) == -1)
+        return -1;
+    if (Hash_Service::instance ()->open () == -1)
+        return -1;
+    if (Dedup_Store::instance ()->open () == -1)
+        return -1;
+    if (Tls_Context::instance ()->open () == -1)
+        return -1;
+    Transform_Cache::instance ()->configure (Server_Config::instance ()->get_string ("transform_cache_dir", ""),
+                                             Server_Config::instance ()->get_int ("transform_cache_mb",
+                                                                                  DEFAULT_TRANSFORM_CACHE_MB) * 1024LL * 1024);
+    Command_Handler::register_metrics ();
+
+    last_probe_ = reactor ()->timer_queue ()->gettimeofday ();
+    if (reactor ()->schedule_timer (this, 0, probe_interval_, probe_interval_) == -1)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "register lag probe failed\n");
+        return -1;
+    }
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS);
     return reactor ()->register_handler (this, ACE_Event_Handler::ACCEPT_MASK);
 }
 
 int Ftp_Server::handle_input (ACE_HANDLE) 
 {
-    Command_Handler *command_handler = 0;
-    ACE_NEW_RETURN (command_handler,
-                    Command_Handler (reactor ()),
-                    -1);
+    for (size_t i = 0; i < MAX_ACCEPT_BATCH; ++i)
+    {
+        ACE_SOCK_Stream client;
+        ACE_INET_Addr client_addr;
+        if (acceptor_.accept (client, &client_addr) == -1)
+        {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                break;
+            else if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            else if (errno == EMFILE || errno == ENFILE)
+            {
+                reject_with_reserve ();
+                continue;
+            }
+            FTP_LOG (LOG_LEVEL_ERROR, "accept failed\n");
+            break;
+        }
+        Metrics::instance ()->add (Metric_Counters::METRIC_ACCEPTS);
+        serve_connection (client, client_addr);
+    }
+    return 0;
+}
+
+void Ftp_Server::serve_connection (ACE_SOCK_Stream &client, const ACE_INET_Addr &client_addr)
+{
+    std::string ip_addr = client_addr.get_host_addr ();
+    int admission = Admission_Control::instance ()->admit_connection (ip_addr);
+    if (admission != Admission_Results::ADMITTED)
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_REJECTS);
+        const char *msg = Admission_Control::reject_message (admission);
+        client.send (msg, strlen (msg), MSG_DONTWAIT);
+        client.close ();
+        return;
+    }
 
-    if (acceptor_.accept (command_handler->get_command_link ()) == -1) {
-        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("accept failed\n")));
+    Command_Handler *command_handler = 0;
+    ACE_NEW_NORETURN (command_handler, Command_Handler (reactor ()));
+    if (command_handler == nullptr)
+    {
+        Admission_Control::instance ()->release_connection (ip_addr);
+        client.send (MSG_CLOSE, strlen (MSG_CLOSE), MSG_DONTWAIT);
+        client.close ();
+        return;
+    }
+    command_handler->get_command_link ().set_handle (client.get_handle ());
+    command_handler->set_client_addr (ip_addr);
+    if (command_handler->init () == -1) 
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "command_handler init failed\n");
         command_handler->handle_close ();
-        return -1;
-    } else if (command_handler->init () == -1) {
-        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("command_handler init failed\n")));
-        command_handler->handle_close();
-        return -1;
     }
+    // from now on the reactor owns the command handler
+    command_handler->remove_reference ();
+}
+
+void Ftp_Server::reject_with_reserve ()
+{
+    if (reserve_handle_ == ACE_INVALID_HANDLE)
+        return;
+    ACE_OS::close (reserve_handle_);
+    reserve_handle_ = ACE_INVALID_HANDLE;
+    ACE_SOCK_Stream client;
+    if (acceptor_.accept (client) != -1)
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_REJECTS);
+        client.send (MSG_SERVER_BUSY, strlen (MSG_SERVER_BUSY), MSG_DONTWAIT);
+        client.close ();
+    }
+    reserve_handle_ = ACE_OS::open ("/dev/null", O_RDONLY);
+    FTP_LOG (LOG_LEVEL_ERROR, "out of descriptors, connection rejected\n");
+}
+
+int Ftp_Server::handle_timeout (const ACE_Time_Value &, const void *)
+{
+    ACE_Time_Value now = reactor ()->timer_queue ()->gettimeofday ();
+    Admission_Control::instance ()->update_loop_lag (now - last_probe_ - probe_interval_);
+    last_probe_ = now;
+    Segmented_Upload::instance ()->expire ();
     return 0;
 }
 
@@ -46,8 +160,11 @@ int Ftp_Server::handle_close (ACE_HANDLE, ACE_Reactor_Mask)
 
 Ftp_Server::~Ftp_Server ()
 {
+    Metrics::instance ()->add (Metric_Counters::METRIC_TIMERS, -reactor ()->cancel_timer (this));
     reactor ()->remove_handler (acceptor_.get_handle (),
                                 ACE_Event_Handler::ACCEPT_MASK |
                                 ACE_Event_Handler::DONT_CALL);
     acceptor_.close();
-}
\ No newline at end of file
+    if (reserve_handle_ != ACE_INVALID_HANDLE)
+        ACE_OS::close (reserve_handle_);
+}
@@ -4,6 +4,10 @@
 #include "ace/Event_Handler.h"
 #include "ace/Reactor.h"
 #include "ace/SOCK_Acceptor.h"
+#include "ace/Time_Value.h"
+
+#define MAX_ACCEPT_BATCH 128
+#define LOOP_LAG_PROBE_MSEC 100
 
 class Command_Handler;
 
@@ -15,11 +19,15 @@ public:
      * 
      * @param reactor the reactor that manage this Ftp_Server
      */
-    Ftp_Server (ACE_Reactor *reactor): ACE_Event_Handler (reactor) {}
+    Ftp_Server (ACE_Reactor *reactor): 
+        ACE_Event_Handler (reactor),
+        reserve_handle_ (ACE_INVALID_HANDLE),
+        probe_interval_ (0, LOOP_LAG_PROBE_MSEC * 1000)
+    {}
 
     /**
-     * @brief Open ACE_SOCK_Acceptor with a specified address including port and
-     *        register accept event to reactor
+     * @brief Open ACE_SOCK_Acceptor with a specified address including port,
+     *        register accept event to reactor and start the event loop lag probe
      * 
      * @param local_addr address for listening
      * @return int , 0 for success, -1 for failure
@@ -27,13 +35,24 @@ public:
     virtual int open (const ACE_INET_Addr &local_addr);
 
     /**
-     * @brief The handler for accept event, establish command connection for new ftp client
+     * @brief The handler for accept event, drain pending connections until EAGAIN
+     *        (at most MAX_ACCEPT_BATCH per event). Connections rejected by
+     *        Admission_Control get a 421 reply before any Command_Handler is allocated.
      * 
-     * @return int , 0 for success, 
-     *               -1 for failure then trigger handle_close ()
+     * @return int , always 0, a failed accept must not unregister the acceptor
      */
     virtual int handle_input (ACE_HANDLE = ACE_INVALID_HANDLE);
 
+    /**
+     * @brief The handler for the lag probe timer, report how late it fired
+     *        to Admission_Control
+     * 
+     * @param now current time
+     * @param act Asynchronous Completion Token
+     * @return int , 0 for success
+     */
+    virtual int handle_timeout (const ACE_Time_Value &now, const void *act);
+
     /**
      * @brief Close the ftp server
      * 
@@ -72,6 +91,23 @@ public:
 
 private:
     ACE_SOCK_Acceptor acceptor_;
+    ACE_HANDLE reserve_handle_;         // spare descriptor, released to reject clients on EMFILE
+    ACE_Time_Value last_probe_;         // when the lag probe timer fired last time
+    const ACE_Time_Value probe_interval_;   // interval of the lag probe timer
+
+    /**
+     * @brief Admit or reject an accepted connection, then set up its Command_Handler
+     * 
+     * @param client accepted connection
+     * @param client_addr address of the client
+     */
+    void serve_connection (ACE_SOCK_Stream &client, const ACE_INET_Addr &client_addr);
+
+    /**
+     * @brief Out of descriptors: use the spare descriptor to accept one client,
+     *        tell it to come back later, then take the spare descriptor back.
+     */
+    void reject_with_reserve ();
 };
 
 #endif
\ No newline at end of file
@@ -1,4 +1,16 @@
+#include "async_log.h"
+#include "auth_pool.h"
+#include "bandwidth_shaper.h"
+#include "credential_store.h"
+#include "file_hash.h"
 #include "ftp_server.h"
+#include "metrics_exporter.h"
+#include "parallel_deflate.h"
+#include "server_config.h"
+#include "tls_session.h"
+#include "transfer_scheduler.h"
+#include "transfer_trace.h"
+#include "user_inf.h"
 
 #include "ace/Log_Msg.h"
 #include "ace/Reactor.h"
@@ -7,6 +19,7 @@
 
 #include <iostream>
 #include <memory>
+#include <sstream>
 
 static const size_t N_THREADS = 4;
 
@@ -23,6 +36,51 @@ static void *event_loop (void *arg)
     return 0;
 }
 
+/**
+ * @brief Console command "rate global BYTES" or "rate user NAME BYTES",
+ *        change a rate limit at runtime, 0 for unlimited
+ * 
+ * @param args arguments after "rate"
+ */
+static void console_rate (std::istringstream &args)
+{
+    std::string scope, username;
+    long rate = -1;
+    args >> scope;
+    if (scope == "user")
+        args >> username;
+    args >> rate;
+    if (rate < 0 || (scope != "global" && scope != "user"))
+    {
+        ACE_DEBUG ( (LM_DEBUG, "usage: rate global BYTES | rate user NAME BYTES\n"));
+        return;
+    }
+    if (scope == "global")
+        Bandwidth_Shaper::instance ()->set_global_rate (rate);
+    else
+        Bandwidth_Shaper::instance ()->set_user_rate (username, rate);
+    ACE_DEBUG ( (LM_DEBUG, "rate limit changed.\n"));
+}
+
+/**
+ * @brief Console command "log LEVEL", change the lowest logged level at runtime
+ * 
+ * @param args arguments after "log"
+ */
+static void console_log (std::istringstream &args)
+{
+    std::string name;
+    args >> name;
+    int level = Async_Log::parse_level (name);
+    if (level == -1)
+    {
+        ACE_DEBUG ( (LM_DEBUG, "usage: log debug|info|error|off\n"));
+        return;
+    }
+    Async_Log::instance ()->set_level (level);
+    ACE_DEBUG ( (LM_DEBUG, "log level changed.\n"));
+}
+
 static void *quit_controller (void *arg)
 {
     ACE_Reactor *reactor = static_cast<ACE_Reactor *> (arg);
@@ -30,24 +88,73 @@ static void *quit_controller (void *arg)
     while(1)
     {
         std::string input;
-        std::getline (std::cin, input, '\n');
-        if (input == "quit")
+        if (!std::getline (std::cin, input, '\n'))
+            break;
+        std::istringstream args (input);
+        std::string command;
+        args >> command;
+        if (command == "quit")
         {
             ACE_DEBUG ( (LM_DEBUG, "recv quit.\n"));
             reactor->end_reactor_event_loop ();
             break;
         }
+        else if (command == "rate")
+            console_rate (args);
+        else if (command == "log")
+            console_log (args);
+        else if (command == "reload")
+        {
+            if (Credential_Store::instance ()->reload () == -1)
+                ACE_DEBUG ( (LM_DEBUG, "reload users failed.\n"));
+            else
+                ACE_DEBUG ( (LM_DEBUG, "users reloaded.\n"));
+        }
+        else if (command == "sched")
+        {
+            std::string report = Transfer_Scheduler::instance ()->report ();
+            ACE_DEBUG ( (LM_DEBUG, "class bytes bytes/s users\n%s", report.c_str ()));
+        }
     }
     return 0;
 }
 
 int main (int argc, char *argv[])
 {
+    if (argc == 2 && std::string (argv[1]) == "--hash")
+    {
+        // password from stdin, kept out of the process list
+        std::string password, hash;
+        if (!std::getline (std::cin, password) || User_Inf::hash_password (password, hash) == -1)
+            return 1;
+        std::cout << hash << std::endl;
+        return 0;
+    }
+
     if (argc == 1) {
         ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("input port number")));
         return 0;
     }
 
+    if (Server_Config::instance ()->load () == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("load config failed.\n")));
+        return 0;
+    }
+
+    int log_level = Async_Log::parse_level (Server_Config::instance ()->get_string ("log_level", "debug"));
+    if (log_level == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("unknown log_level, using debug.\n")));
+        log_level = Log_Levels::LOG_LEVEL_DEBUG;
+    }
+    Async_Log::instance ()->set_level (log_level);
+    if (Async_Log::instance ()->open () == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("start log drainer failed.\n")));
+        return 0;
+    }
+
     // choose TP_Reactor(Thread Pool Reactor)
     ACE_TP_Reactor tp_reactor;
     ACE_Reactor reactor (&tp_reactor);
@@ -70,8 +177,46 @@ int main (int argc, char *argv[])
         return 0;
     }
 
+    std::unique_ptr<Metrics_Exporter> exporter;
+    long metrics_port = Server_Config::instance ()->get_int ("metrics_port", 0);
+    if (metrics_port > 0)
+    {
+        ACE_INET_Addr metrics_addr;
+        metrics_addr.set ((u_short)metrics_port, (ACE_UINT32) INADDR_LOOPBACK);
+        exporter = std::make_unique<Metrics_Exporter> (&reactor);
+        if (exporter->open (metrics_addr) == -1)
+        {
+            ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("open metrics exporter failed.\n")));
+            return 0;
+        }
+    }
+
+    std::string xferlog_path = Server_Config::instance ()->get_string ("xferlog_path", "");
+    if (!xferlog_path.empty () &&
+        Transfer_Log::instance ()->open (xferlog_path, 
+                                         Server_Config::instance ()->get_int ("xferlog_phases", 0) != 0) == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("open xferlog failed.\n")));
+        return 0;
+    }
+
+    long check_sec = Server_Config::instance ()->get_int ("credentials_check_sec", DEFAULT_CREDENTIALS_CHECK_SEC);
+    if (Credential_Store::instance ()->watch (check_sec) == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("start users watcher failed.\n")));
+        return 0;
+    }
+
     ACE_Thread_Manager::instance ()->spawn_n (N_THREADS, event_loop, &reactor);
     ACE_Thread_Manager::instance ()->spawn (quit_controller, &reactor);
 
-    return ACE_Thread_Manager::instance ()->wait ();
+    result = ACE_Thread_Manager::instance ()->wait ();
+    Auth_Pool::instance ()->close ();
+    Hash_Service::instance ()->close ();
+    Tls_Context::instance ()->close ();
+    Compress_Pool::instance ()->close ();
+    Credential_Store::instance ()->stop_watch ();
+    Transfer_Log::instance ()->close ();
+    Async_Log::instance ()->close ();
+    return result;
 }
\ No newline at end of file
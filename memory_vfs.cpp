@@ -0,0 +1,407 @@
+#include "memory_vfs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Locks the shards of two directories without deadlocking against another
+ * pair taken in the other order, a shared shard once.
+ */
+struct Shard_Pair_Lock
+{
+    std::unique_lock<std::mutex> first;
+    std::unique_lock<std::mutex> second;
+
+    Shard_Pair_Lock (std::mutex &first_lock, std::mutex &second_lock) :
+        first (first_lock, std::defer_lock),
+        second (second_lock, std::defer_lock)
+    {
+        if (&first_lock == &second_lock)
+            first.lock ();
+        else
+            std::lock (first, second);
+    }
+};
+
+/**
+ * @brief Split a path into its components, empty ones and "." dropped
+ *
+ * @param path
+ * @return std::vector<std::string>
+ */
+static std::vector<std::string> split_path (const std::string &path)
+{
+    std::vector<std::string> components;
+    std::string component;
+    std::istringstream path_stream (path);
+    while (std::getline (path_stream, component, '/'))
+        if (!component.empty () && component != ".")
+            components.push_back (component);
+    return components;
+}
+
+Memory_Vfs::Memory_Vfs () : next_id_ (1)
+{
+    root_.is_dir = true;
+    root_.id = 0;
+    root_.fd = -1;
+    root_.mode = 0755;
+    root_.mtime = time (nullptr);
+    shard_of (0).dirs[0];
+}
+
+Memory_Vfs::~Memory_Vfs ()
+{
+    for (Shard &shard : shards_)
+        for (auto &dir : shard.dirs)
+            for (auto &item : dir.second)
+                if (item.second.fd != -1)
+                    ::close (item.second.fd);
+}
+
+std::map<std::string, Memory_Vfs::Entry> *Memory_Vfs::find_dir (Shard &shard, unsigned long long dir_id)
+{
+    auto ite = shard.dirs.find (dir_id);
+    if (ite == shard.dirs.end ())
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+    return &ite->second;
+}
+
+int Memory_Vfs::lookup_parent (const std::string &path, unsigned long long &dir_id, std::string &name)
+{
+    std::vector<std::string> components = split_path (path);
+    dir_id = 0;
+    name.clear ();
+    if (components.empty ())
+        return 0;
+    for (size_t i = 0; i + 1 < components.size (); ++i)
+    {
+        Shard &shard = shard_of (dir_id);
+        std::lock_guard<std::mutex> guard (shard.lock);
+        std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+        if (dir == nullptr)
+            return -1;
+        auto ite = dir->find (components[i]);
+        if (ite == dir->end () || !ite->second.is_dir)
+        {
+            errno = (ite == dir->end () ? ENOENT : ENOTDIR);
+            return -1;
+        }
+        dir_id = ite->second.id;
+    }
+    name = components.back ();
+    return 0;
+}
+
+int Memory_Vfs::lookup_dir (const std::string &path, unsigned long long &dir_id)
+{
+    unsigned long long parent_id = 0;
+    std::string name;
+    if (lookup_parent (path, parent_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        dir_id = 0;
+        return 0;
+    }
+    Shard &shard = shard_of (parent_id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, parent_id);
+    if (dir == nullptr)
+        return -1;
+    auto ite = dir->find (name);
+    if (ite == dir->end () || !ite->second.is_dir)
+    {
+        errno = (ite == dir->end () ? ENOENT : ENOTDIR);
+        return -1;
+    }
+    dir_id = ite->second.id;
+    return 0;
+}
+
+void Memory_Vfs::fill_stat (const Entry &entry, struct stat &file_stat) const
+{
+    // a file's size, times and inode are those of its memfd
+    if (entry.is_dir || fstat (entry.fd, &file_stat) != 0)
+    {
+        memset (&file_stat, 0, sizeof (file_stat));
+        file_stat.st_ino = entry.id + 1;
+        file_stat.st_uid = getuid ();
+        file_stat.st_gid = getgid ();
+        file_stat.st_atime = entry.mtime;
+        file_stat.st_mtime = entry.mtime;
+        file_stat.st_ctime = entry.mtime;
+    }
+    file_stat.st_mode = (entry.is_dir ? S_IFDIR : S_IFREG) | entry.mode;
+    file_stat.st_nlink = (entry.is_dir ? 2 : 1);
+}
+
+int Memory_Vfs::open (const std::string &path, int flags, mode_t mode)
+{
+    unsigned long long dir_id = 0;
+    std::string name;
+    if (lookup_parent (path, dir_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        errno = EISDIR;
+        return -1;
+    }
+    Shard &shard = shard_of (dir_id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+    if (dir == nullptr)
+        return -1;
+    auto ite = dir->find (name);
+    if (ite == dir->end ())
+    {
+        if ((flags & O_CREAT) == 0)
+        {
+            errno = ENOENT;
+            return -1;
+        }
+        int memfd = memfd_create (name.c_str (), MFD_CLOEXEC);
+        if (memfd == -1)
+            return -1;
+        Entry entry;
+        entry.is_dir = false;
+        entry.id = 0;
+        entry.fd = memfd;
+        entry.mode = mode & 0777;
+        entry.mtime = 0;
+        ite = dir->emplace (name, entry).first;
+    }
+    else if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL) || ite->second.is_dir)
+    {
+        errno = (ite->second.is_dir ? EISDIR : EEXIST);
+        return -1;
+    }
+    // reopened, the descriptor has an offset and access mode of its own
+    char fd_path[32];
+    snprintf (fd_path, sizeof (fd_path), "/proc/self/fd/%d", ite->second.fd);
+    int fd = ::open (fd_path, (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_CLOEXEC);
+    if (fd == -1)
+        fd = fcntl (ite->second.fd, F_DUPFD_CLOEXEC, 0);
+    if (fd != -1 && (flags & O_TRUNC) != 0 && ftruncate (fd, 0) != 0)
+    {
+        ::close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Memory_Vfs::stat (const std::string &path, struct stat &file_stat)
+{
+    unsigned long long dir_id = 0;
+    std::string name;
+    if (lookup_parent (path, dir_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        fill_stat (root_, file_stat);
+        return 0;
+    }
+    Shard &shard = shard_of (dir_id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+    if (dir == nullptr)
+        return -1;
+    auto ite = dir->find (name);
+    if (ite == dir->end ())
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    fill_stat (ite->second, file_stat);
+    return 0;
+}
+
+int Memory_Vfs::rename (const std::string &old_path, const std::string &new_path)
+{
+    // a directory can't move into itself
+    std::vector<std::string> old_components = split_path (old_path);
+    std::vector<std::string> new_components = split_path (new_path);
+    if (new_components.size () > old_components.size () &&
+        std::equal (old_components.begin (), old_components.end (), new_components.begin ()))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned long long old_dir_id = 0, new_dir_id = 0;
+    std::string old_name, new_name;
+    if (lookup_parent (old_path, old_dir_id, old_name) == -1 ||
+        lookup_parent (new_path, new_dir_id, new_name) == -1)
+        return -1;
+    if (old_name.empty () || new_name.empty ())
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    Shard &old_shard = shard_of (old_dir_id);
+    Shard &new_shard = shard_of (new_dir_id);
+    Shard_Pair_Lock guard (old_shard.lock, new_shard.lock);
+    std::map<std::string, Entry> *old_dir = find_dir (old_shard, old_dir_id);
+    std::map<std::string, Entry> *new_dir = find_dir (new_shard, new_dir_id);
+    if (old_dir == nullptr || new_dir == nullptr)
+        return -1;
+    auto old_ite = old_dir->find (old_name);
+    if (old_ite == old_dir->end ())
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (old_dir == new_dir && old_name == new_name)
+        return 0;
+    auto new_ite = new_dir->find (new_name);
+    if (new_ite == new_dir->end ())
+        new_dir->emplace (new_name, old_ite->second);
+    else if (new_ite->second.is_dir || old_ite->second.is_dir)
+    {
+        // only a file is replaced
+        errno = (new_ite->second.is_dir ? EISDIR : ENOTDIR);
+        return -1;
+    }
+    else
+    {
+        ::close (new_ite->second.fd);
+        new_ite->second = old_ite->second;
+    }
+    old_dir->erase (old_ite);
+    return 0;
+}
+
+int Memory_Vfs::remove (const std::string &path)
+{
+    unsigned long long dir_id = 0;
+    std::string name;
+    if (lookup_parent (path, dir_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    {
+        Shard &shard = shard_of (dir_id);
+        std::lock_guard<std::mutex> guard (shard.lock);
+        std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+        if (dir == nullptr)
+            return -1;
+        auto ite = dir->find (name);
+        if (ite == dir->end ())
+        {
+            errno = ENOENT;
+            return -1;
+        }
+        if (!ite->second.is_dir)
+        {
+            // descriptors still open keep the content
+            ::close (ite->second.fd);
+            dir->erase (ite);
+            return 0;
+        }
+    }
+    return rmdir (path);
+}
+
+int Memory_Vfs::mkdir (const std::string &path, mode_t mode)
+{
+    unsigned long long dir_id = 0;
+    std::string name;
+    if (lookup_parent (path, dir_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    unsigned long long id = next_id_++;
+    Shard &shard = shard_of (dir_id);
+    Shard &child_shard = shard_of (id);
+    Shard_Pair_Lock guard (shard.lock, child_shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+    if (dir == nullptr)
+        return -1;
+    Entry entry;
+    entry.is_dir = true;
+    entry.id = id;
+    entry.fd = -1;
+    entry.mode = mode & 0777;
+    entry.mtime = time (nullptr);
+    if (!dir->emplace (name, entry).second)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    child_shard.dirs[id];
+    return 0;
+}
+
+int Memory_Vfs::rmdir (const std::string &path)
+{
+    unsigned long long dir_id = 0;
+    std::string name;
+    if (lookup_parent (path, dir_id, name) == -1)
+        return -1;
+    if (name.empty ())
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    unsigned long long id = 0;
+    if (lookup_dir (path, id) == -1)
+        return -1;
+    Shard &shard = shard_of (dir_id);
+    Shard &child_shard = shard_of (id);
+    Shard_Pair_Lock guard (shard.lock, child_shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+    if (dir == nullptr)
+        return -1;
+    // it may have been replaced since the lookup
+    auto ite = dir->find (name);
+    if (ite == dir->end () || !ite->second.is_dir || ite->second.id != id)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    std::map<std::string, Entry> *child = find_dir (child_shard, id);
+    if (child != nullptr && !child->empty ())
+    {
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    child_shard.dirs.erase (id);
+    dir->erase (ite);
+    return 0;
+}
+
+int Memory_Vfs::list (const std::string &path, std::vector<Vfs_Entry> &entries)
+{
+    unsigned long long dir_id = 0;
+    if (lookup_dir (path, dir_id) == -1)
+        return -1;
+    Shard &shard = shard_of (dir_id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    std::map<std::string, Entry> *dir = find_dir (shard, dir_id);
+    if (dir == nullptr)
+        return -1;
+    entries.clear ();
+    entries.reserve (dir->size ());
+    Vfs_Entry vfs_entry;
+    for (const auto &item : *dir)
+    {
+        vfs_entry.name = item.first;
+        fill_stat (item.second, vfs_entry.file_stat);
+        entries.push_back (vfs_entry);
+    }
+    return 0;
+}
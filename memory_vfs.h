@@ -0,0 +1,107 @@
+#ifndef MEMORY_VFS_H
+#define MEMORY_VFS_H
+
+#include "vfs.h"
+
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#define MEMORY_VFS_SHARDS 16
+
+/**
+ * A namespace kept in memory, for scratch space and for benchmarks that
+ * must not depend on a disk. Every file is a memfd, so a descriptor of it
+ * works like one of a local file and its pages are only in RAM; a file
+ * removed while open lives until it is closed. Directories are kept by
+ * id in shards with a mutex each, a lookup walks the path one shard at a
+ * time and an operation locks the shards of the directories it changes.
+ * Nothing survives a restart.
+ */
+class Memory_Vfs : public Vfs_Backend
+{
+public:
+    Memory_Vfs ();
+
+    /**
+     * @brief Destroy the Memory_Vfs object, closing the memfds of its files
+     */
+    virtual ~Memory_Vfs ();
+
+    virtual int open (const std::string &path, int flags, mode_t mode);
+    virtual int stat (const std::string &path, struct stat &file_stat);
+    virtual int lstat (const std::string &path, struct stat &file_stat) { return stat (path, file_stat); }
+    virtual int rename (const std::string &old_path, const std::string &new_path);
+    virtual int remove (const std::string &path);
+    virtual int mkdir (const std::string &path, mode_t mode);
+    virtual int rmdir (const std::string &path);
+    virtual int list (const std::string &path, std::vector<Vfs_Entry> &entries);
+
+private:
+    struct Entry
+    {
+        bool is_dir;
+        unsigned long long id;  // the directory's id
+        int fd;                 // the file's memfd, -1 for a directory
+        mode_t mode;            // permissions
+        time_t mtime;           // creation time of a directory, a file's is its memfd's
+    };
+
+    struct Shard
+    {
+        std::mutex lock;                                                            // guards dirs
+        std::unordered_map<unsigned long long, std::map<std::string, Entry>> dirs;  // entries by directory id
+    };
+
+    /**
+     * @brief Get the shard of a directory
+     *
+     * @param id
+     * @return Shard&
+     */
+    Shard &shard_of (unsigned long long id) { return shards_[id % MEMORY_VFS_SHARDS]; }
+
+    /**
+     * @brief Find the entries of a directory, its shard must be locked
+     *
+     * @param shard
+     * @param dir_id
+     * @return std::map<std::string, Entry>* , null with errno ENOENT for a removed directory
+     */
+    std::map<std::string, Entry> *find_dir (Shard &shard, unsigned long long dir_id);
+
+    /**
+     * @brief Walk to the directory holding the last component of a path
+     *
+     * @param path
+     * @param dir_id set to the directory's id
+     * @param name set to the last component, empty for the root
+     * @return int , 0 for success, -1 with errno ENOENT or ENOTDIR
+     */
+    int lookup_parent (const std::string &path, unsigned long long &dir_id, std::string &name);
+
+    /**
+     * @brief Walk to a directory
+     *
+     * @param path
+     * @param dir_id set to its id
+     * @return int , 0 for success, -1 with errno ENOENT or ENOTDIR
+     */
+    int lookup_dir (const std::string &path, unsigned long long &dir_id);
+
+    /**
+     * @brief Fill the status of an entry, the shard of its directory must be locked
+     *
+     * @param entry
+     * @param file_stat
+     */
+    void fill_stat (const Entry &entry, struct stat &file_stat) const;
+
+    Shard shards_[MEMORY_VFS_SHARDS];
+    std::atomic<unsigned long long> next_id_;   // id of the next directory, the root is 0
+    Entry root_;                                // entry of the root directory
+};
+
+#endif
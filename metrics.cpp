@@ -0,0 +1,239 @@
+#include "metrics.h"
+#include "admission_control.h"
+
+#include <cstdio>
+
+static const char *counter_names[METRIC_COUNTERS] =
+{
+    "ftpd_accepts_total",
+    "ftpd_rejected_connections_total",
+    "ftpd_commands_total",
+    "ftpd_retr_bytes_total",
+    "ftpd_stor_bytes_total",
+    "ftpd_transfers_total",
+    "ftpd_transfer_failures_total",
+    "ftpd_data_connections",
+    "ftpd_active_transfers",
+    "ftpd_timer_queue_depth",
+    "ftpd_auth_verifications_total",
+    "ftpd_auth_cache_hits_total",
+    "ftpd_auth_backoffs_total",
+    "ftpd_transform_cache_hits_total",
+    "ftpd_transform_cache_misses_total",
+    "ftpd_transform_cache_bytes",
+    "ftpd_dedup_hits_total",
+    "ftpd_dedup_saved_bytes_total",
+    "ftpd_tls_handshakes_total",
+    "ftpd_tls_resumed_handshakes_total",
+    "ftpd_tls_session_cache_hits_total",
+    "ftpd_tls_session_cache_misses_total",
+    "ftpd_tls_session_cache_entries",
+    "ftpd_small_file_cache_hits_total",
+    "ftpd_small_file_cache_misses_total",
+    "ftpd_small_file_cache_bytes",
+};
+
+static bool is_gauge (int counter)
+{
+    return counter == Metric_Counters::METRIC_DATA_CONNECTIONS ||
+           counter == Metric_Counters::METRIC_ACTIVE_TRANSFERS ||
+           counter == Metric_Counters::METRIC_TIMERS ||
+           counter == Metric_Counters::METRIC_TRANSFORM_CACHE_BYTES ||
+           counter == Metric_Counters::METRIC_TLS_SESSIONS_CACHED ||
+           counter == Metric_Counters::METRIC_SMALL_FILE_CACHE_BYTES;
+}
+
+int histogram_bucket (unsigned long long value)
+{
+    const unsigned long long sub_buckets = 1ULL << HISTOGRAM_SUB_BUCKET_BITS;
+    if (value < sub_buckets)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll (value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+    int sub_bucket = (int)((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (sub_buckets - 1));
+    return ((exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+unsigned long long histogram_bucket_floor (int bucket)
+{
+    const int sub_buckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    if (bucket < sub_buckets)
+        return bucket;
+    int shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    return (unsigned long long)(sub_buckets + (bucket & (sub_buckets - 1))) << shift;
+}
+
+Metrics::Metrics () : start_time_ (Clock::now ())
+{
+    register_command ("unknown");
+}
+
+Metrics *Metrics::instance ()
+{
+    static Metrics metrics;
+    return &metrics;
+}
+
+void Metrics::register_command (const std::string &command)
+{
+    if (command_ids_.count (command) != 0 || command_names_.size () >= MAX_METRIC_COMMANDS)
+        return;
+    command_ids_[command] = (int)command_names_.size ();
+    command_names_.push_back (command);
+}
+
+int Metrics::command_id (const std::string &command) const
+{
+    auto ite = command_ids_.find (command);
+    return ite == command_ids_.end () ? 0 : ite->second;
+}
+
+Metrics_Shard *Metrics::shard ()
+{
+    static thread_local Metrics_Shard *thread_shard = nullptr;
+    if (thread_shard == nullptr)
+    {
+        // shards live as long as the process, counters survive their threads
+        thread_shard = new Metrics_Shard ();
+        std::lock_guard<std::mutex> guard (shards_lock_);
+        shards_.push_back (thread_shard);
+    }
+    return thread_shard;
+}
+
+void Metrics::record_latency (int command_id, unsigned long long usec)
+{
+    Metrics_Shard *thread_shard = shard ();
+    thread_shard->latency[command_id][histogram_bucket (usec)].fetch_add (1, std::memory_order_relaxed);
+    thread_shard->latency_sum[command_id].fetch_add (usec, std::memory_order_relaxed);
+}
+
+long long Metrics::total (int counter)
+{
+    std::lock_guard<std::mutex> guard (shards_lock_);
+    long long sum = 0;
+    for (Metrics_Shard *thread_shard : shards_)
+        sum += thread_shard->counters[counter].load (std::memory_order_relaxed);
+    return sum;
+}
+
+unsigned long long Metrics::merge_latency (int command_id, std::vector<unsigned long long> &buckets,
+                                           unsigned long long &sum)
+{
+    buckets.assign (HISTOGRAM_BUCKETS, 0);
+    sum = 0;
+    unsigned long long count = 0;
+    std::lock_guard<std::mutex> guard (shards_lock_);
+    for (Metrics_Shard *thread_shard : shards_)
+    {
+        sum += thread_shard->latency_sum[command_id].load (std::memory_order_relaxed);
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        {
+            unsigned long long n = thread_shard->latency[command_id][i].load (std::memory_order_relaxed);
+            buckets[i] += n;
+            count += n;
+        }
+    }
+    return count;
+}
+
+unsigned long long Metrics::percentile (const std::vector<unsigned long long> &buckets,
+                                        unsigned long long count, double quantile)
+{
+    unsigned long long rank = (unsigned long long)(quantile * count);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen > rank)
+            return i + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_floor (i + 1) : histogram_bucket_floor (i);
+    }
+    return 0;
+}
+
+std::string Metrics::prometheus ()
+{
+    std::string result;
+    char line[256];
+    for (int counter = 0; counter < Metric_Counters::METRIC_COUNTERS; ++counter)
+    {
+        snprintf (line, sizeof (line), "# TYPE %s %s\n%s %lld\n",
+                  counter_names[counter], is_gauge (counter) ? "gauge" : "counter",
+                  counter_names[counter], total (counter));
+        result += line;
+    }
+    snprintf (line, sizeof (line), "# TYPE ftpd_sessions gauge\nftpd_sessions %zu\n",
+              Admission_Control::instance ()->get_sessions ());
+    result += line;
+    snprintf (line, sizeof (line), "# TYPE ftpd_uptime_seconds gauge\nftpd_uptime_seconds %.0f\n",
+              std::chrono::duration<double> (Clock::now () - start_time_).count ());
+    result += line;
+
+    // only power of two boundaries are exported, they fall on bucket edges
+    result += "# TYPE ftpd_command_latency_seconds histogram\n";
+    std::vector<unsigned long long> buckets;
+    for (size_t id = 0; id < command_names_.size (); ++id)
+    {
+        unsigned long long sum = 0;
+        unsigned long long count = merge_latency ((int)id, buckets, sum);
+        if (count == 0)
+            continue;
+        const char *name = command_names_[id].c_str ();
+        unsigned long long cumulative = 0;
+        int bucket = 0;
+        for (int exponent = HISTOGRAM_SUB_BUCKET_BITS; exponent < HISTOGRAM_MAX_EXPONENT; ++exponent)
+        {
+            int edge = histogram_bucket (1ULL << exponent);
+            for (; bucket < edge; ++bucket)
+                cumulative += buckets[bucket];
+            snprintf (line, sizeof (line), "ftpd_command_latency_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n",
+                      name, (double)(1ULL << exponent) / 1e6, cumulative);
+            result += line;
+        }
+        snprintf (line, sizeof (line),
+                  "ftpd_command_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n"
+                  "ftpd_command_latency_seconds_sum{command=\"%s\"} %g\n"
+                  "ftpd_command_latency_seconds_count{command=\"%s\"} %llu\n",
+                  name, count, name, (double)sum / 1e6, name, count);
+        result += line;
+    }
+    return result;
+}
+
+std::string Metrics::summary ()
+{
+    std::string result;
+    char line[256];
+    double uptime = std::chrono::duration<double> (Clock::now () - start_time_).count ();
+    snprintf (line, sizeof (line), " uptime %.0f s\r\n sessions %zu\r\n", 
+              uptime, Admission_Control::instance ()->get_sessions ());
+    result += line;
+    for (int counter = 0; counter < Metric_Counters::METRIC_COUNTERS; ++counter)
+    {
+        snprintf (line, sizeof (line), " %s %lld\r\n", counter_names[counter] + 5, total (counter));
+        result += line;
+    }
+    if (uptime > 0)
+    {
+        snprintf (line, sizeof (line), " retr_bytes_per_second %.0f\r\n stor_bytes_per_second %.0f\r\n",
+                  total (Metric_Counters::METRIC_BYTES_SENT) / uptime,
+                  total (Metric_Counters::METRIC_BYTES_RECEIVED) / uptime);
+        result += line;
+    }
+    std::vector<unsigned long long> buckets;
+    for (size_t id = 0; id < command_names_.size (); ++id)
+    {
+        unsigned long long sum = 0;
+        unsigned long long count = merge_latency ((int)id, buckets, sum);
+        if (count == 0)
+            continue;
+        snprintf (line, sizeof (line), " %s count %llu p50 %lluus p99 %lluus p999 %lluus\r\n",
+                  command_names_[id].c_str (), count,
+                  percentile (buckets, count, 0.5),
+                  percentile (buckets, count, 0.99),
+                  percentile (buckets, count, 0.999));
+        result += line;
+    }
+    return result;
+}
@@ -0,0 +1,185 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define MAX_METRIC_COMMANDS 64
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_MAX_EXPONENT 35
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS)
+
+enum Metric_Counters
+{
+    METRIC_ACCEPTS = 0,             // accepted connections
+    METRIC_REJECTS = 1,             // connections rejected by admission control
+    METRIC_COMMANDS = 2,            // handled commands
+    METRIC_BYTES_SENT = 3,          // bytes sent by RETR
+    METRIC_BYTES_RECEIVED = 4,      // bytes received by STOR
+    METRIC_TRANSFERS = 5,           // finished transfers
+    METRIC_TRANSFER_FAILURES = 6,   // failed transfers
+    METRIC_DATA_CONNECTIONS = 7,    // gauge, existing data connections
+    METRIC_ACTIVE_TRANSFERS = 8,    // gauge, transfers in progress
+    METRIC_TIMERS = 9,              // gauge, timers scheduled on the reactor
+    METRIC_AUTH_VERIFICATIONS = 10, // password hashes computed by the auth pool
+    METRIC_AUTH_CACHE_HITS = 11,    // logins verified from the cache
+    METRIC_AUTH_BACKOFFS = 12,      // logins refused while the address backs off
+    METRIC_TRANSFORM_CACHE_HITS = 13,   // transfers sent from the transform cache
+    METRIC_TRANSFORM_CACHE_MISSES = 14, // transfers transformed by themselves
+    METRIC_TRANSFORM_CACHE_BYTES = 15,  // gauge, bytes kept by the transform cache
+    METRIC_DEDUP_HITS = 16,             // uploads linked to stored content
+    METRIC_DEDUP_SAVED_BYTES = 17,      // bytes of uploads linked to stored content
+    METRIC_TLS_HANDSHAKES = 18,         // completed TLS handshakes, full or resumed
+    METRIC_TLS_RESUMPTIONS = 19,        // TLS handshakes that resumed a session
+    METRIC_TLS_SESSION_CACHE_HITS = 20,     // session ids found in Tls_Session_Cache
+    METRIC_TLS_SESSION_CACHE_MISSES = 21,   // session ids not found or expired
+    METRIC_TLS_SESSIONS_CACHED = 22,        // gauge, sessions kept by Tls_Session_Cache
+    METRIC_SMALL_FILE_CACHE_HITS = 23,      // RETRs sent from Small_File_Cache
+    METRIC_SMALL_FILE_CACHE_MISSES = 24,    // RETRs that opened the file
+    METRIC_SMALL_FILE_CACHE_BYTES = 25,     // gauge, bytes kept by Small_File_Cache
+    METRIC_COUNTERS = 26,
+};
+
+/**
+ * Counters of one thread, only written by their thread,
+ * so updates are uncontended relaxed atomics.
+ */
+struct Metrics_Shard
+{
+    std::atomic<long long> counters[METRIC_COUNTERS];
+    std::atomic<unsigned long long> latency[MAX_METRIC_COMMANDS][HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long long> latency_sum[MAX_METRIC_COMMANDS];
+};
+
+class Metrics
+{
+public:
+    /**
+     * @brief Get the process-wide metrics
+     * 
+     * @return Metrics* 
+     */
+    static Metrics *instance ();
+
+    /**
+     * @brief Register a command whose latency is recorded, must be called
+     *        before the event loop starts, later lookups take no lock
+     * 
+     * @param command command name
+     */
+    void register_command (const std::string &command);
+
+    /**
+     * @brief Get the id of a registered command
+     * 
+     * @param command command name
+     * @return int , id for record_latency (), 0 ("unknown") if not registered
+     */
+    int command_id (const std::string &command) const;
+
+    /**
+     * @brief Add to a counter or gauge of the calling thread
+     * 
+     * @param counter enum Metric_Counters
+     * @param value 
+     */
+    void add (int counter, long long value = 1)
+    {
+        shard ()->counters[counter].fetch_add (value, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Record the latency of a command
+     * 
+     * @param command_id returned by command_id ()
+     * @param usec latency in microseconds
+     */
+    void record_latency (int command_id, unsigned long long usec);
+
+    /**
+     * @brief Sum a counter or gauge over all threads
+     * 
+     * @param counter enum Metric_Counters
+     * @return long long 
+     */
+    long long total (int counter);
+
+    /**
+     * @brief Format all metrics in Prometheus text format
+     * 
+     * @return std::string 
+     */
+    std::string prometheus ();
+
+    /**
+     * @brief Format a short summary for SITE STATS, one statistic per line,
+     *        each line begins with a space and ends with CRLF
+     * 
+     * @return std::string 
+     */
+    std::string summary ();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    Metrics ();
+
+    /**
+     * @brief Get the shard of the calling thread, create it on first use
+     * 
+     * @return Metrics_Shard* 
+     */
+    Metrics_Shard *shard ();
+
+    /**
+     * @brief Sum the latency histogram of a command over all threads
+     * 
+     * @param command_id 
+     * @param buckets result, HISTOGRAM_BUCKETS counts
+     * @param sum result, sum of latencies in microseconds
+     * @return unsigned long long number of samples
+     */
+    unsigned long long merge_latency (int command_id, std::vector<unsigned long long> &buckets,
+                                      unsigned long long &sum);
+
+    /**
+     * @brief Estimate a percentile from a merged histogram
+     * 
+     * @param buckets merged histogram
+     * @param count number of samples
+     * @param quantile between 0 and 1
+     * @return unsigned long long microseconds
+     */
+    static unsigned long long percentile (const std::vector<unsigned long long> &buckets,
+                                          unsigned long long count, double quantile);
+
+    std::mutex shards_lock_;                            // protects shards_
+    std::vector<Metrics_Shard *> shards_;               // one shard per thread
+    std::vector<std::string> command_names_;            // command name by id
+    std::unordered_map<std::string, int> command_ids_;  // command id by name
+    Clock::time_point start_time_;                      // time the process started
+};
+
+/**
+ * @brief Index of the histogram bucket for a value: values below 8 have their own
+ *        bucket, above that every power of two is split into 8 sub-buckets,
+ *        so the relative error stays below 12.5%
+ * 
+ * @param value 
+ * @return int bucket index
+ */
+int histogram_bucket (unsigned long long value);
+
+/**
+ * @brief Smallest value falling into a histogram bucket
+ * 
+ * @param bucket bucket index
+ * @return unsigned long long 
+ */
+unsigned long long histogram_bucket_floor (int bucket);
+
+#endif
@@ -0,0 +1,45 @@
+#include "metrics_exporter.h"
+#include "async_log.h"
+#include "metrics.h"
+
+#include <string>
+
+int Metrics_Exporter::open (const ACE_INET_Addr &local_addr)
+{
+    if (acceptor_.open (local_addr, 1) == -1)
+        return -1;
+    if (acceptor_.enable (ACE_NONBLOCK) == -1)
+        return -1;
+    return reactor ()->register_handler (this, ACE_Event_Handler::ACCEPT_MASK);
+}
+
+int Metrics_Exporter::handle_input (ACE_HANDLE)
+{
+    ACE_SOCK_Stream client;
+    if (acceptor_.accept (client) == -1)
+        return 0;
+
+    // the request itself doesn't matter, every path gets the metrics,
+    // but read it so closing doesn't reset the connection
+    char request[1024];
+    ACE_Time_Value timeout (0, METRICS_IO_TIMEOUT_MSEC * 1000);
+    client.recv (request, sizeof (request), &timeout);
+
+    std::string body = Metrics::instance ()->prometheus ();
+    std::string response = "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string (body.size ()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    if (client.send_n (response.data (), response.size (), 0, &timeout) != (ssize_t)response.size ())
+        FTP_LOG (LOG_LEVEL_INFO, "send metrics failed\n");
+    client.close ();
+    return 0;
+}
+
+Metrics_Exporter::~Metrics_Exporter ()
+{
+    reactor ()->remove_handler (acceptor_.get_handle (),
+                                ACE_Event_Handler::ACCEPT_MASK |
+                                ACE_Event_Handler::DONT_CALL);
+    acceptor_.close ();
+}
@@ -0,0 +1,52 @@
+#ifndef METRICS_EXPORTER_H
+#define METRICS_EXPORTER_H
+
+#include "ace/Event_Handler.h"
+#include "ace/Reactor.h"
+#include "ace/SOCK_Acceptor.h"
+
+#define METRICS_IO_TIMEOUT_MSEC 200
+
+class Metrics_Exporter : public ACE_Event_Handler
+{
+public:
+    /**
+     * @brief Construct a new Metrics_Exporter
+     * 
+     * @param reactor the reactor that manage this Metrics_Exporter
+     */
+    Metrics_Exporter (ACE_Reactor *reactor): ACE_Event_Handler (reactor) {}
+
+    /**
+     * @brief Listen on the admin address and register accept event to reactor
+     * 
+     * @param local_addr admin address, should be a loopback address
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int open (const ACE_INET_Addr &local_addr);
+
+    /**
+     * @brief The handler for accept event, answer one HTTP request with
+     *        Metrics::prometheus () and close the connection
+     * 
+     * @return int , always 0
+     */
+    virtual int handle_input (ACE_HANDLE = ACE_INVALID_HANDLE);
+
+    /**
+     * @brief Get the underlying handle/fd
+     * 
+     * @return ACE_HANDLE underlying handle/fd
+     */
+    virtual ACE_HANDLE get_handle () const { return acceptor_.get_handle (); }
+
+    /**
+     * @brief Destroy the Metrics_Exporter object
+     */
+    virtual ~Metrics_Exporter ();
+
+private:
+    ACE_SOCK_Acceptor acceptor_;
+};
+
+#endif
@@ -9,25 +9,53 @@
 #define MSG_CONNECTION_READY "150 Data connection already open; transfer starting\r\n"
 
 #define MSG_COMMON_SUCCESS "200 Command okay\r\n"
+#define MSG_SITE_RATE "200 Session rate limit %s bytes/s\r\n"
+#define MSG_MODE_Z_LEVEL "200 MODE Z LEVEL set to %s\r\n"
+#define MSG_SITE_RELOAD "200 %s users loaded\r\n"
+#define MSG_SITE_CHECKSUM "200 %s checksum expected for the next STOR\r\n"
+#define MSG_SITE_SEGMENT "200 Next STOR is a segment of a %s byte file\r\n"
+#define MSG_SEGMENT_STORED "200 Segment stored, %s bytes received\r\n"
+#define MSG_HASH_ALGORITHM "200 %s\r\n"
+#define MSG_PBSZ "200 PBSZ=0\r\n"
+#define MSG_PROT "200 Protection level set to %s\r\n"
+#define MSG_FEATURES "211-Features:\r\n AUTH TLS\r\n HASH %s\r\n MODE B\r\n MODE Z\r\n PBSZ\r\n PROT\r\n RANG STREAM\r\n REST STREAM\r\n XCRC\r\n XMD5\r\n XSHA1\r\n XSHA256\r\n211 End\r\n"
+#define MSG_HASH "213 %s\r\n"
 #define MSG_NEW_USER "220 Service ready for new user\r\n"
 #define MSG_PASV_SUCCESS "227 Entering Passive Mode. (%s)\r\n"
 #define MSG_LOGIN_SUCCESS "230 User logged in, proceed\r\n"
+#define MSG_AUTH_TLS "234 AUTH TLS successful\r\n"
+#define MSG_ABORT_SUCCESS "226 Closing data connection; abort successful\r\n"
 #define MSG_FILE_SUCCESS "250 Requested file action okay, completed\r\n"
+#define MSG_X_HASH "250 %s\r\n"
 #define MSG_CUR_PATH "257 \"%s\" is your working directory\r\n"
 #define MSG_MKD_SUCCESS "257 making directory OK\r\n"
 
 #define MSG_REQUIRE_PASS "331 User name okay, need password\r\n"
+#define MSG_RESTART "350 Restarting at %s\r\n"
 #define MSG_REQUIRE_USER "332 Need account for login\r\n"
 
 #define MSG_CLOSE "421 Service not available, closing control connection\r\n"
+#define MSG_TOO_MANY_USERS "421 Too many users, try again later\r\n"
+#define MSG_TOO_MANY_FROM_IP "421 Too many connections from your address\r\n"
+#define MSG_TOO_MANY_FOR_USER "421 Too many sessions for this user\r\n"
+#define MSG_SERVER_BUSY "421 Server busy, try again later\r\n"
 #define MSG_DATA_LINK_FAIL "425 Can't open data connection\r\n"
+#define MSG_TLS_DATA_FAIL "425 TLS negotiation on the data connection failed\r\n"
 #define MSG_CONNECTION_CLOSED "426 Connection closed; transfer aborted\r\n"
 #define MSG_LOGIN_FAIL "430 Invalid username or password\r\n"
+#define MSG_TLS_UNAVAILABLE "431 TLS is not configured\r\n"
+#define MSG_FILE_BUSY "450 Requested file action not taken, try again later\r\n"
 
 #define MSG_INVALID_COMMAND "500 Syntax error, command unrecognized\r\n"
 #define MSG_FAILED "500 Command failed\r\n"
 #define MSG_INVALID_PARAM "501 Syntax error in parameters or argument\r\n"
+#define MSG_NOT_IMPLEMENTED "502 Command not implemented\r\n"
 #define MSG_BAD_SEQUENCE "503 Bad sequence of commands\r\n"
+#define MSG_PARAM_NOT_IMPLEMENTED "504 Command not implemented for that parameter\r\n"
 #define MSG_NOT_LOGIN "530 Not logged in\r\n"
+#define MSG_PROT_UNSUPPORTED "536 Requested PROT level not supported by mechanism\r\n"
+#define MSG_FILE_UNAVAILABLE "550 Requested action not taken, file unavailable\r\n"
+#define MSG_PERMISSION_DENIED "550 Permission denied\r\n"
+#define MSG_CHECKSUM_MISMATCH "550 Checksum mismatch, the file was not stored\r\n"
 
 #endif
\ No newline at end of file
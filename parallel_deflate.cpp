@@ -0,0 +1,338 @@
+#include "parallel_deflate.h"
+#include "async_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <zlib.h>
+
+Compress_Pool *Compress_Pool::instance ()
+{
+    static Compress_Pool pool;
+    return &pool;
+}
+
+int Compress_Pool::open (long threads)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (!workers_.empty ())
+        return 0;
+    is_stopping_ = false;
+    try
+    {
+        for (long i = 0; i < threads; ++i)
+            workers_.emplace_back (&Compress_Pool::work_loop, this);
+    }
+    catch (const std::system_error &)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "start compress worker failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+void Compress_Pool::submit (std::function<void ()> task)
+{
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!workers_.empty ())
+        {
+            tasks_.push_back (std::move (task));
+            ready_.notify_one ();
+            return;
+        }
+    }
+    // no workers, as in tests and benchmarks
+    task ();
+}
+
+void Compress_Pool::work_loop ()
+{
+    std::unique_lock<std::mutex> guard (lock_);
+    while (true)
+    {
+        ready_.wait (guard, [this] { return is_stopping_ || !tasks_.empty (); });
+        if (is_stopping_)
+            break;
+        std::function<void ()> task = std::move (tasks_.front ());
+        tasks_.pop_front ();
+        guard.unlock ();
+        task ();
+        guard.lock ();
+    }
+}
+
+void Compress_Pool::close ()
+{
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        is_stopping_ = true;
+        workers.swap (workers_);
+        tasks_.clear ();
+    }
+    ready_.notify_all ();
+    for (std::thread &worker : workers)
+        worker.join ();
+}
+
+Parallel_Deflate::Parallel_Deflate (int fd, int level, const std::function<void ()> &wakeup) :
+    fd_ (dup (fd)),
+    level_ (std::max (1, std::min (level, 9))),
+    file_size_ (0),
+    block_count_ (1),
+    wakeup_ (wakeup),
+    is_waiting_ (false),
+    blocks_begin_ (0),
+    blocks_end_ (0),
+    is_header_sent_ (false),
+    adler_ (adler32 (0, Z_NULL, 0))
+{
+    struct stat file_stat;
+    if (fd_ != -1 && fstat (fd_, &file_stat) == 0)
+        file_size_ = file_stat.st_size;
+    if (file_size_ > 0)
+        block_count_ = (file_size_ + DEFLATE_BLOCK_SIZE - 1) / DEFLATE_BLOCK_SIZE;
+}
+
+Parallel_Deflate::~Parallel_Deflate ()
+{
+    if (fd_ != -1)
+        close (fd_);
+}
+
+int Parallel_Deflate::start ()
+{
+    if (fd_ == -1)
+        return -1;
+    std::vector<size_t> submitted;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        while (blocks_end_ < block_count_ && blocks_end_ - blocks_begin_ < DEFLATE_AHEAD_BLOCKS)
+            submitted.push_back (take_block ());
+    }
+    submit_blocks (submitted);
+    return 0;
+}
+
+size_t Parallel_Deflate::take_block ()
+{
+    Block block;
+    block.is_done = false;
+    block.is_failed = false;
+    block.is_last = (blocks_end_ + 1 == block_count_);
+    block.length = 0;
+    block.adler = 0;
+    blocks_.push_back (std::move (block));
+    return blocks_end_++;
+}
+
+void Parallel_Deflate::submit_blocks (const std::vector<size_t> &indexes)
+{
+    // outside lock_, the pool may run the task inline
+    std::shared_ptr<Parallel_Deflate> self = shared_from_this ();
+    for (size_t index : indexes)
+        Compress_Pool::instance ()->submit ([self, index] { self->compress (index); });
+}
+
+int Parallel_Deflate::next (std::string &out)
+{
+    std::vector<size_t> submitted;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (!is_header_sent_)
+        {
+            // CMF: deflate with 32K window, FLG: level hint and check bits
+            static const unsigned char level_flags[] = { 0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda };
+            out.push_back ((char)0x78);
+            out.push_back ((char)level_flags[level_]);
+            is_header_sent_ = true;
+            return Deflate_Results::DEFLATE_READY;
+        }
+        if (blocks_.empty ())
+            return Deflate_Results::DEFLATE_END;
+        Block &block = blocks_.front ();
+        if (!block.is_done)
+        {
+            is_waiting_ = true;
+            return Deflate_Results::DEFLATE_PENDING;
+        }
+        if (block.is_failed)
+            return Deflate_Results::DEFLATE_FAILED;
+
+        adler_ = adler32_combine (adler_, block.adler, block.length);
+        out.append (block.output);
+        if (block.is_last)
+        {
+            out.push_back ((char)(adler_ >> 24));
+            out.push_back ((char)(adler_ >> 16));
+            out.push_back ((char)(adler_ >> 8));
+            out.push_back ((char)adler_);
+        }
+        blocks_.pop_front ();
+        ++blocks_begin_;
+        while (blocks_end_ < block_count_ && blocks_end_ - blocks_begin_ < DEFLATE_AHEAD_BLOCKS)
+            submitted.push_back (take_block ());
+    }
+    submit_blocks (submitted);
+    return Deflate_Results::DEFLATE_READY;
+}
+
+bool Parallel_Deflate::is_ready ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    return !is_header_sent_ || blocks_.empty () || blocks_.front ().is_done;
+}
+
+void Parallel_Deflate::cancel ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    wakeup_ = nullptr;
+    is_waiting_ = false;
+}
+
+void Parallel_Deflate::compress (size_t index)
+{
+    off_t offset = (off_t)index * DEFLATE_BLOCK_SIZE;
+    size_t length = (size_t)std::min ((off_t)DEFLATE_BLOCK_SIZE, std::max ((off_t)0, file_size_ - offset));
+    size_t dict_length = (size_t)std::min ((off_t)DEFLATE_DICT_SIZE, offset);
+    bool is_last = (index + 1 == block_count_);
+
+    // the block and the tail of the previous one
+    std::string input (dict_length + length, '\0');
+    bool is_failed = false;
+    size_t read_total = 0;
+    while (read_total < input.size ())
+    {
+        ssize_t read_count = pread (fd_, &input[read_total], input.size () - read_total,
+                                    offset - dict_length + read_total);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count <= 0)
+        {
+            is_failed = true;
+            break;
+        }
+        read_total += read_count;
+    }
+
+    std::string output;
+    unsigned long adler = adler32 (0, Z_NULL, 0);
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (!is_failed && deflateInit2 (&stream, level_, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+        if (dict_length > 0)
+            deflateSetDictionary (&stream, (const Bytef *)input.data (), dict_length);
+        stream.next_in = (Bytef *)&input[dict_length];
+        stream.avail_in = length;
+        output.resize (deflateBound (&stream, length) + 16);
+        // a sync flush ends the block on a byte boundary, the last block ends the stream
+        int flush = is_last ? Z_FINISH : Z_SYNC_FLUSH;
+        int result;
+        do
+        {
+            if (stream.total_out == output.size ())
+                output.resize (output.size () * 2);
+            stream.next_out = (Bytef *)&output[stream.total_out];
+            stream.avail_out = output.size () - stream.total_out;
+            result = deflate (&stream, flush);
+        } while (result == Z_OK && (stream.avail_out == 0 || flush == Z_FINISH));
+        is_failed = !(result == Z_STREAM_END || (flush == Z_SYNC_FLUSH && result == Z_OK));
+        output.resize (stream.total_out);
+        deflateEnd (&stream);
+        adler = adler32 (adler, (const Bytef *)&input[dict_length], length);
+    }
+    else
+        is_failed = true;
+
+    std::lock_guard<std::mutex> guard (lock_);
+    Block &block = blocks_[index - blocks_begin_];
+    block.is_done = true;
+    block.is_failed = is_failed;
+    block.length = length;
+    block.adler = adler;
+    block.output.swap (output);
+    if (is_waiting_ && index == blocks_begin_ && wakeup_)
+    {
+        is_waiting_ = false;
+        wakeup_ ();
+    }
+}
+
+int deflate_buffer (const std::string &src, int level, std::string &des)
+{
+    uLongf length = compressBound (src.size ());
+    des.resize (length);
+    if (compress2 ((Bytef *)&des[0], &length, (const Bytef *)src.data (), src.size (),
+                   std::max (1, std::min (level, 9))) != Z_OK)
+        return -1;
+    des.resize (length);
+    return 0;
+}
+
+/**
+ * @brief Write a whole buffer, retrying short writes
+ */
+static int write_all (int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t write_count = write (fd, data, length);
+        if (write_count < 0 && errno == EINTR)
+            continue;
+        if (write_count <= 0)
+            return -1;
+        data += write_count;
+        length -= write_count;
+    }
+    return 0;
+}
+
+int deflate_file (int src_fd, int level, int des_fd)
+{
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (deflateInit (&stream, std::max (1, std::min (level, 9))) != Z_OK)
+        return -1;
+    std::string input (DEFLATE_BLOCK_SIZE, '\0');
+    std::string output (DEFLATE_BLOCK_SIZE, '\0');
+    off_t offset = 0;
+    int result = Z_OK;
+    while (result == Z_OK)
+    {
+        ssize_t read_count = pread (src_fd, &input[0], input.size (), offset);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count < 0)
+            break;
+        offset += read_count;
+        int flush = (read_count == 0 ? Z_FINISH : Z_NO_FLUSH);
+        stream.next_in = (Bytef *)input.data ();
+        stream.avail_in = read_count;
+        do
+        {
+            stream.next_out = (Bytef *)&output[0];
+            stream.avail_out = output.size ();
+            result = deflate (&stream, flush);
+            // no progress possible is not an error, more input follows
+            if (result == Z_BUF_ERROR)
+                result = Z_OK;
+            if (result == Z_STREAM_ERROR ||
+                write_all (des_fd, output.data (), output.size () - stream.avail_out) == -1)
+            {
+                result = Z_STREAM_ERROR;
+                break;
+            }
+        } while (stream.avail_out == 0);
+    }
+    deflateEnd (&stream);
+    return result == Z_STREAM_END ? 0 : -1;
+}
@@ -0,0 +1,198 @@
+#ifndef PARALLEL_DEFLATE_H
+#define PARALLEL_DEFLATE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#define DEFLATE_BLOCK_SIZE (128 * 1024)    // input bytes compressed by one task
+#define DEFLATE_DICT_SIZE 32768             // deflate window, primed from the previous block
+#define DEFLATE_AHEAD_BLOCKS 8              // blocks compressed ahead of the sender per transfer
+#define DEFAULT_DEFLATE_LEVEL 6
+#define DEFAULT_COMPRESS_THREADS 4
+
+enum Deflate_Results
+{
+    DEFLATE_READY = 0,      // output returned
+    DEFLATE_FAILED = -1,    // reading or compressing failed
+    DEFLATE_PENDING = -2,   // next block not compressed yet, the wakeup is called when it is
+    DEFLATE_END = -3,       // whole stream returned
+};
+
+/**
+ * Worker threads compressing deflate blocks for every transfer.
+ */
+class Compress_Pool
+{
+public:
+    /**
+     * @brief Get the process-wide compress pool
+     *
+     * @return Compress_Pool*
+     */
+    static Compress_Pool *instance ();
+
+    /**
+     * @brief Start the workers, tasks run inline on the submitting thread until then
+     *
+     * @param threads number of workers
+     * @return int , 0 for success, -1 for failure
+     */
+    int open (long threads);
+
+    /**
+     * @brief Run a task on a worker
+     *
+     * @param task
+     */
+    void submit (std::function<void ()> task);
+
+    /**
+     * @brief Stop the workers, queued tasks are dropped
+     */
+    void close ();
+
+    ~Compress_Pool () { close (); }
+
+private:
+    Compress_Pool () : is_stopping_ (false) {}
+
+    /**
+     * @brief Body of a worker thread
+     */
+    void work_loop ();
+
+    std::mutex lock_;                               // guards tasks_ and is_stopping_
+    std::condition_variable ready_;                 // signaled when a task is queued or on close
+    std::deque<std::function<void ()> > tasks_;     // tasks waiting for a worker
+    bool is_stopping_;                              // workers exit when set
+    std::vector<std::thread> workers_;              // worker threads
+};
+
+/**
+ * A file compressed into one zlib stream (RFC 1950) by Compress_Pool, pigz style:
+ * the file is cut into DEFLATE_BLOCK_SIZE blocks, each compressed independently
+ * with the tail of the previous block as dictionary and ended by a sync flush,
+ * so the outputs concatenate into a single valid deflate stream. The adler32 of
+ * the blocks is combined in order for the trailer.
+ *
+ * At most DEFLATE_AHEAD_BLOCKS blocks are in flight, the consumer takes the
+ * outputs in order with next ().
+ */
+class Parallel_Deflate : public std::enable_shared_from_this<Parallel_Deflate>
+{
+public:
+    /**
+     * @brief Construct a new Parallel_Deflate object
+     *
+     * @param fd file to compress, duplicated so it outlives the caller's descriptor
+     * @param level zlib compression level, 1 to 9
+     * @param wakeup called from a worker when next () returned DEFLATE_PENDING
+     *               and the next block is ready, never after cancel (); it runs
+     *               under the internal lock and must not call back into this object
+     */
+    Parallel_Deflate (int fd, int level, const std::function<void ()> &wakeup);
+
+    ~Parallel_Deflate ();
+
+    /**
+     * @brief Submit the first blocks
+     *
+     * @return int , 0 for success, -1 for failure
+     */
+    int start ();
+
+    /**
+     * @brief Take the next piece of the stream, appended to out
+     *
+     * @param out
+     * @return int , enum Deflate_Results
+     */
+    int next (std::string &out);
+
+    /**
+     * @brief Check whether next () would return without DEFLATE_PENDING
+     *
+     * @return true , ready
+     * @return false , still compressing
+     */
+    bool is_ready ();
+
+    /**
+     * @brief Drop the wakeup, blocks in flight finish unseen
+     */
+    void cancel ();
+
+private:
+    struct Block
+    {
+        bool is_done;           // compressed or failed
+        bool is_failed;         // reading or compressing failed
+        bool is_last;           // last block of the file
+        size_t length;          // input bytes
+        unsigned long adler;    // adler32 of the input
+        std::string output;     // compressed bytes
+    };
+
+    /**
+     * @brief Append the next block to blocks_, lock_ must be held
+     *
+     * @return size_t index of the block
+     */
+    size_t take_block ();
+
+    /**
+     * @brief Hand blocks taken by take_block () to Compress_Pool, lock_ must not be held
+     *
+     * @param indexes
+     */
+    void submit_blocks (const std::vector<size_t> &indexes);
+
+    /**
+     * @brief Compress one block, run by a worker
+     *
+     * @param index block index
+     */
+    void compress (size_t index);
+
+    int fd_;                            // duplicated file descriptor
+    int level_;                         // zlib compression level
+    off_t file_size_;                   // bytes to compress
+    size_t block_count_;                // blocks of the file, at least one
+    std::mutex lock_;                   // guards everything below
+    std::function<void ()> wakeup_;     // tells the consumer a block is ready
+    bool is_waiting_;                   // whether the consumer waits for wakeup_
+    std::deque<Block> blocks_;          // in flight, front is blocks_begin_
+    size_t blocks_begin_;               // index of blocks_.front ()
+    size_t blocks_end_;                 // index of the next block to submit
+    bool is_header_sent_;               // whether the zlib header was returned
+    unsigned long adler_;               // adler32 of the blocks returned so far
+};
+
+/**
+ * @brief Compress a buffer into a zlib stream in one call, for small outputs like LIST
+ *
+ * @param src
+ * @param level zlib compression level
+ * @param des
+ * @return int , 0 for success, -1 for failure
+ */
+int deflate_buffer (const std::string &src, int level, std::string &des);
+
+/**
+ * @brief Compress a whole file into a zlib stream on the calling thread, for Transform_Cache
+ *
+ * @param src_fd
+ * @param level zlib compression level
+ * @param des_fd
+ * @return int , 0 for success, -1 for failure
+ */
+int deflate_file (int src_fd, int level, int des_fd);
+
+#endif
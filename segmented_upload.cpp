@@ -0,0 +1,161 @@
+#include "segmented_upload.h"
+#include "async_log.h"
+#include "dedup_store.h"
+#include "server_config.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Segmented_Upload *Segmented_Upload::instance ()
+{
+    static Segmented_Upload registry;
+    return &registry;
+}
+
+void Segmented_Upload::configure ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    idle_sec_ = Server_Config::instance ()->get_int ("segment_idle_sec", DEFAULT_SEGMENT_IDLE_SEC);
+}
+
+void Segmented_Upload::expire ()
+{
+    std::vector<int> part_fds;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (idle_sec_ <= 0 || uploads_.empty ())
+            return;
+        auto deadline = std::chrono::steady_clock::now () - std::chrono::seconds (idle_sec_);
+        for (auto ite = uploads_.begin (); ite != uploads_.end (); )
+        {
+            if (ite->second.writers == 0 && ite->second.active < deadline)
+            {
+                FTP_LOG (LOG_LEVEL_INFO, "segmented upload of %s abandoned\n", ite->first.c_str ());
+                // the name goes now, a new upload may create it again at once
+                int fd = ::open (ite->second.part_path.c_str (), O_RDONLY | O_CLOEXEC);
+                unlink (ite->second.part_path.c_str ());
+                if (fd != -1)
+                    part_fds.push_back (fd);
+                ite = uploads_.erase (ite);
+            }
+            else
+                ++ite;
+        }
+    }
+    // the extents of a large file are freed by the last close, slowly, the registry isn't held
+    for (int fd : part_fds)
+        ::close (fd);
+}
+
+std::string Segmented_Upload::make_part_path (const std::string &path)
+{
+    size_t slash = path.rfind ('/');
+    size_t name_begin = (slash == std::string::npos ? 0 : slash + 1);
+    return path.substr (0, name_begin) + '.' + path.substr (name_begin) + ".part";
+}
+
+int Segmented_Upload::begin_segment (const std::string &path, off_t total_size, off_t offset,
+                                     std::string &part_path)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (total_size < 0 || offset < 0 || offset > total_size)
+        return -1;
+    auto ite = uploads_.find (path);
+    // another size while nobody writes starts the upload over, the part file is truncated
+    if (ite != uploads_.end () && ite->second.total_size != total_size && ite->second.writers == 0)
+    {
+        FTP_LOG (LOG_LEVEL_INFO, "segmented upload of %s restarted\n", path.c_str ());
+        uploads_.erase (ite);
+        ite = uploads_.end ();
+    }
+    if (ite == uploads_.end ())
+    {
+        Upload upload;
+        upload.total_size = total_size;
+        upload.part_path = make_part_path (path);
+        upload.received = 0;
+        upload.writers = 0;
+        // allocated now in contiguous extents, the segments fill it in any order;
+        // a part file left by an earlier upload or run holds no received range
+        int fd = ::open (upload.part_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || ((total_size == 0 || fallocate (fd, 0, 0, total_size) != 0) &&
+                         ftruncate (fd, total_size) != 0))
+        {
+            FTP_LOG (LOG_LEVEL_ERROR, "create %s failed\n", upload.part_path.c_str ());
+            if (fd != -1)
+                ::close (fd);
+            return -1;
+        }
+        ::close (fd);
+        ite = uploads_.emplace (path, upload).first;
+    }
+    else if (ite->second.total_size != total_size)
+        return -1;
+    ++ite->second.writers;
+    ite->second.active = std::chrono::steady_clock::now ();
+    part_path = ite->second.part_path;
+    return 0;
+}
+
+void Segmented_Upload::add_range (Upload &upload, off_t begin, off_t end)
+{
+    if (begin >= end)
+        return;
+    // merge the ranges touching [begin, end)
+    auto ite = upload.ranges.upper_bound (begin);
+    if (ite != upload.ranges.begin () && std::prev (ite)->second >= begin)
+        --ite;
+    while (ite != upload.ranges.end () && ite->first <= end)
+    {
+        begin = std::min (begin, ite->first);
+        end = std::max (end, ite->second);
+        upload.received -= ite->second - ite->first;
+        ite = upload.ranges.erase (ite);
+    }
+    upload.ranges[begin] = end;
+    upload.received += end - begin;
+}
+
+int Segmented_Upload::end_segment (const std::string &path, off_t offset, off_t length, bool is_complete,
+                                   off_t &received)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    auto ite = uploads_.find (path);
+    if (ite == uploads_.end ())
+        return Segment_Results::SEGMENT_FAILED;
+    Upload &upload = ite->second;
+    --upload.writers;
+    upload.active = std::chrono::steady_clock::now ();
+    if (is_complete)
+        add_range (upload, offset, std::min (offset + length, upload.total_size));
+    received = upload.received;
+    if (upload.writers > 0 || upload.received < upload.total_size)
+    {
+        // nothing arrived and nobody writes, the client gave up
+        if (upload.writers == 0 && upload.received == 0)
+        {
+            unlink (upload.part_path.c_str ());
+            uploads_.erase (ite);
+        }
+        return is_complete ? Segment_Results::SEGMENT_STORED : Segment_Results::SEGMENT_FAILED;
+    }
+
+    int result = Segment_Results::SEGMENT_COMPLETE;
+    // a file replaced by the part file loses a name, as with RNTO
+    struct stat replaced_stat;
+    bool is_replacing = (lstat (path.c_str (), &replaced_stat) == 0);
+    if (rename (upload.part_path.c_str (), path.c_str ()) != 0)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "finalize %s failed\n", path.c_str ());
+        unlink (upload.part_path.c_str ());
+        result = Segment_Results::SEGMENT_FAILED;
+    }
+    else if (is_replacing)
+        Dedup_Store::instance ()->release (replaced_stat);
+    uploads_.erase (ite);
+    return result;
+}
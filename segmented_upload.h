@@ -0,0 +1,113 @@
+#ifndef SEGMENTED_UPLOAD_H
+#define SEGMENTED_UPLOAD_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#define DEFAULT_SEGMENT_IDLE_SEC 86400
+
+enum Segment_Results
+{
+    SEGMENT_STORED = 0,     // the segment is written, others are missing
+    SEGMENT_FAILED = -1,    // the segment or the finalizing failed
+    SEGMENT_COMPLETE = 1,   // every byte arrived, the file has its name
+};
+
+/**
+ * Uploads of one file in segments by several sessions at once, each a STOR
+ * after "SITE SEGMENT size" and REST. The segments are written with pwrite
+ * to a hidden part file next to the target without locking it, the received
+ * ranges are merged, and the part file is renamed to the target when they
+ * cover the whole file and no segment is still being written, so the file
+ * appears complete or not at all. Ranges are kept in memory, segments in
+ * flight across a restart are sent again. An upload nobody writes for
+ * segment_idle_sec is dropped with its part file, and a SITE SEGMENT with
+ * another size starts it over when no segment is being written.
+ */
+class Segmented_Upload
+{
+public:
+    /**
+     * @brief Get the process-wide registry of segmented uploads
+     *
+     * @return Segmented_Upload*
+     */
+    static Segmented_Upload *instance ();
+
+    /**
+     * @brief Read segment_idle_sec from Server_Config
+     */
+    void configure ();
+
+    /**
+     * @brief Drop the uploads nobody wrote for segment_idle_sec and unlink
+     *        their part files, called periodically
+     */
+    void expire ();
+
+    /**
+     * @brief Start writing a segment, the first one creates the part file
+     *
+     * @param path target of the upload
+     * @param total_size size of the whole file
+     * @param offset first byte of the segment
+     * @param part_path set to the file the segment is written to
+     * @return int , 0 for success, -1 for a size differing from the segments
+     *               being written, an offset beyond the file or a file error
+     */
+    int begin_segment (const std::string &path, off_t total_size, off_t offset, std::string &part_path);
+
+    /**
+     * @brief Finish writing a segment, the last one renames the part file to the target
+     *
+     * @param path target of the upload
+     * @param offset first byte of the segment
+     * @param length bytes written
+     * @param is_complete whether the segment was received completely, bytes of a
+     *                    failed one are not counted
+     * @param received set to the bytes of the file received so far
+     * @return int , see enum Segment_Results
+     */
+    int end_segment (const std::string &path, off_t offset, off_t length, bool is_complete, off_t &received);
+
+private:
+    struct Upload
+    {
+        off_t total_size;               // size of the whole file
+        std::string part_path;          // file the segments are written to
+        std::map<off_t, off_t> ranges;  // received byte ranges, end by begin, disjoint
+        off_t received;                 // bytes in ranges
+        int writers;                    // segments being written
+        std::chrono::steady_clock::time_point active;  // when a segment began or ended last
+    };
+
+    Segmented_Upload () : idle_sec_ (DEFAULT_SEGMENT_IDLE_SEC) {}
+
+    /**
+     * @brief Build the part file path of a target: ".<name>.part" in its directory
+     *
+     * @param path
+     * @return std::string
+     */
+    static std::string make_part_path (const std::string &path);
+
+    /**
+     * @brief Add a byte range to the received ones, merging neighbours
+     *
+     * @param upload
+     * @param begin
+     * @param end byte after the last one
+     */
+    static void add_range (Upload &upload, off_t begin, off_t end);
+
+    std::mutex lock_;                                   // guards the members below
+    std::unordered_map<std::string, Upload> uploads_;   // uploads by target path
+    long idle_sec_;                                     // an upload nobody writes is dropped after it, 0 never
+};
+
+#endif
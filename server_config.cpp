@@ -0,0 +1,67 @@
+#include "server_config.h"
+
+#include "ace/Log_Msg.h"
+
+#include <cstdlib>
+#include <fstream>
+
+const std::string Server_Config::config_file_path_ = "./ftpd.conf";
+
+Server_Config *Server_Config::instance ()
+{
+    static Server_Config config;
+    return &config;
+}
+
+int Server_Config::load (const std::string &path)
+{
+    std::ifstream file_stream;
+    file_stream.open (path);
+    if (!file_stream.is_open ())
+    {
+        ACE_DEBUG ( (LM_DEBUG, "no config file %s, using defaults.\n", path.c_str ()));
+        return 0;
+    }
+
+    std::string str_line;
+    while (std::getline (file_stream, str_line))
+    {
+        size_t begin = str_line.find_first_not_of (" \t");
+        if (begin == std::string::npos || str_line[begin] == '#')
+            continue;
+        size_t pos = str_line.find_first_of (" \t", begin);
+        if (pos == std::string::npos)
+        {
+            ACE_DEBUG ( (LM_DEBUG, "config line without value: %s\n", str_line.c_str ()));
+            continue;
+        }
+        size_t value_begin = str_line.find_first_not_of (" \t", pos);
+        size_t value_end = str_line.find_last_not_of (" \t\r");
+        if (value_begin == std::string::npos || value_end < value_begin)
+            continue;
+        options_[str_line.substr (begin, pos - begin)] = 
+            str_line.substr (value_begin, value_end - value_begin + 1);
+    }
+    return 0;
+}
+
+long Server_Config::get_int (const std::string &key, long default_value) const
+{
+    auto ite = options_.find (key);
+    if (ite == options_.end ())
+        return default_value;
+    char *end = nullptr;
+    long value = std::strtol (ite->second.c_str (), &end, 10);
+    if (end == ite->second.c_str () || *end != '\0')
+    {
+        ACE_DEBUG ( (LM_DEBUG, "config %s is not a number\n", key.c_str ()));
+        return default_value;
+    }
+    return value;
+}
+
+std::string Server_Config::get_string (const std::string &key, const std::string &default_value) const
+{
+    auto ite = options_.find (key);
+    return ite == options_.end () ? default_value : ite->second;
+}
@@ -0,0 +1,58 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <string>
+#include <unordered_map>
+
+class Server_Config
+{
+public:
+    /**
+     * @brief Get the process-wide configuration
+     * 
+     * @return Server_Config* 
+     */
+    static Server_Config *instance ();
+
+    /**
+     * @brief Read "key value" lines from the configuration file.
+     *        Empty lines and lines beginning with '#' are ignored.
+     *        A missing file is not an error, every key keeps its default.
+     * 
+     * @param path path of the configuration file
+     * @return int , 0 for success, -1 for failure
+     */
+    int load (const std::string &path = config_file_path_);
+
+    /**
+     * @brief Get an integer option
+     * 
+     * @param key option name
+     * @param default_value returned when the option is not set or malformed
+     * @return long option value
+     */
+    long get_int (const std::string &key, long default_value) const;
+
+    /**
+     * @brief Get a string option
+     * 
+     * @param key option name
+     * @param default_value returned when the option is not set
+     * @return std::string option value
+     */
+    std::string get_string (const std::string &key, const std::string &default_value) const;
+
+    /**
+     * @brief Set an option, used by the console and tests
+     * 
+     * @param key option name
+     * @param value option value
+     */
+    void set (const std::string &key, const std::string &value) { options_[key] = value; }
+
+private:
+    std::unordered_map<std::string, std::string> options_;  // options read from the file
+    static const std::string config_file_path_;             // path of the default configuration file
+};
+
+#endif
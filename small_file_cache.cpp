@@ -0,0 +1,126 @@
+#include "small_file_cache.h"
+#include "metrics.h"
+#include "server_config.h"
+#include "vfs.h"
+
+#include <cerrno>
+#include <functional>
+#include <unistd.h>
+
+Small_File_Cache *Small_File_Cache::instance ()
+{
+    static Small_File_Cache cache;
+    return &cache;
+}
+
+void Small_File_Cache::configure ()
+{
+    clear ();
+    Server_Config *config = Server_Config::instance ();
+    max_bytes_ = config->get_int ("small_file_cache_mb", DEFAULT_SMALL_FILE_CACHE_MB) * 1024LL * 1024;
+    max_file_bytes_ = config->get_int ("small_file_max_kb", DEFAULT_SMALL_FILE_MAX_KB) * 1024LL;
+}
+
+Small_File_Cache::Shard &Small_File_Cache::shard_of (const std::string &path)
+{
+    return shards_[std::hash<std::string> () (path) % SMALL_FILE_CACHE_SHARDS];
+}
+
+bool Small_File_Cache::is_same (const struct stat &left, const struct stat &right)
+{
+    return left.st_dev == right.st_dev && left.st_ino == right.st_ino &&
+           left.st_size == right.st_size &&
+           left.st_mtim.tv_sec == right.st_mtim.tv_sec && left.st_mtim.tv_nsec == right.st_mtim.tv_nsec &&
+           left.st_ctim.tv_sec == right.st_ctim.tv_sec && left.st_ctim.tv_nsec == right.st_ctim.tv_nsec;
+}
+
+void Small_File_Cache::erase (Shard &shard, Entry_List::iterator entry)
+{
+    shard.bytes -= entry->content->size ();
+    Metrics::instance ()->add (Metric_Counters::METRIC_SMALL_FILE_CACHE_BYTES, -(long long)entry->content->size ());
+    shard.entries.erase (entry->path);
+    shard.lru.erase (entry);
+}
+
+Small_File_Content Small_File_Cache::lookup (const std::string &path)
+{
+    if (max_bytes_ <= 0)
+        return nullptr;
+    Shard &shard = shard_of (path);
+    struct stat cached_stat;
+    Small_File_Content content;
+    {
+        std::lock_guard<std::mutex> guard (shard.lock);
+        auto ite = shard.entries.find (path);
+        if (ite == shard.entries.end ())
+        {
+            Metrics::instance ()->add (Metric_Counters::METRIC_SMALL_FILE_CACHE_MISSES);
+            return nullptr;
+        }
+        cached_stat = ite->second->file_stat;
+        content = ite->second->content;
+    }
+    // the stat is made unlocked, the entry is checked again before it is used or dropped
+    struct stat file_stat;
+    bool is_valid = (Vfs::instance ()->stat (path, file_stat) == 0 && is_same (file_stat, cached_stat));
+    std::lock_guard<std::mutex> guard (shard.lock);
+    auto ite = shard.entries.find (path);
+    if (ite != shard.entries.end () && ite->second->content == content)
+    {
+        if (is_valid)
+        {
+            shard.lru.splice (shard.lru.begin (), shard.lru, ite->second);
+            Metrics::instance ()->add (Metric_Counters::METRIC_SMALL_FILE_CACHE_HITS);
+            return content;
+        }
+        erase (shard, ite->second);
+    }
+    Metrics::instance ()->add (Metric_Counters::METRIC_SMALL_FILE_CACHE_MISSES);
+    return nullptr;
+}
+
+void Small_File_Cache::fill (const std::string &path, int fd)
+{
+    long long shard_max_bytes = max_bytes_ / SMALL_FILE_CACHE_SHARDS;
+    struct stat file_stat;
+    if (fstat (fd, &file_stat) != 0 || !S_ISREG (file_stat.st_mode) ||
+        file_stat.st_size > max_file_bytes_ || file_stat.st_size > shard_max_bytes)
+        return;
+    std::shared_ptr<std::string> content = std::make_shared<std::string> (file_stat.st_size, '\0');
+    size_t read_total = 0;
+    while (read_total < content->size ())
+    {
+        ssize_t read_count = pread (fd, &(*content)[read_total], content->size () - read_total, read_total);
+        if (read_count < 0 && errno == EINTR)
+            continue;
+        if (read_count <= 0)
+            return;
+        read_total += read_count;
+    }
+    // another process may write without the lock, a content it changed isn't kept
+    struct stat after_stat;
+    if (fstat (fd, &after_stat) != 0 || !is_same (file_stat, after_stat))
+        return;
+
+    Shard &shard = shard_of (path);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    auto ite = shard.entries.find (path);
+    if (ite != shard.entries.end ())
+        erase (shard, ite->second);
+    while (!shard.lru.empty () && shard.bytes + (long long)content->size () > shard_max_bytes)
+        erase (shard, std::prev (shard.lru.end ()));
+    shard.lru.push_front (Entry { path, file_stat, content });
+    shard.entries[path] = shard.lru.begin ();
+    shard.bytes += content->size ();
+    Metrics::instance ()->add (Metric_Counters::METRIC_SMALL_FILE_CACHE_BYTES, content->size ());
+}
+
+void Small_File_Cache::clear ()
+{
+    for (Shard &shard : shards_)
+    {
+        std::lock_guard<std::mutex> guard (shard.lock);
+        while (!shard.lru.empty ())
+            erase (shard, shard.lru.begin ());
+    }
+}
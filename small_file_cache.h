@@ -0,0 +1,118 @@
+#ifndef SMALL_FILE_CACHE_H
+#define SMALL_FILE_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#define DEFAULT_SMALL_FILE_CACHE_MB 64
+#define DEFAULT_SMALL_FILE_MAX_KB 64
+#define SMALL_FILE_CACHE_SHARDS 16
+
+typedef std::shared_ptr<const std::string> Small_File_Content;
+
+/**
+ * Contents of small files kept in memory, so a RETR of a hot manifest or
+ * configuration bundle is sent from them with one send, without opening,
+ * locking and sendfile of the file. A file is read whole while a RETR holds
+ * its shared lock, so the content is never half written, and a hit checks
+ * the path's device, inode, size, mtime and ctime by stat, so a replaced,
+ * rewritten or removed file misses and leaves the cache. Entries are kept
+ * in shards by hash of the path, each with its own mutex and least
+ * recently used list within its part of small_file_cache_mb. A transfer
+ * holds a reference of its content, evicting never disturbs it.
+ */
+class Small_File_Cache
+{
+public:
+    /**
+     * @brief Get the process-wide cache
+     *
+     * @return Small_File_Cache*
+     */
+    static Small_File_Cache *instance ();
+
+    /**
+     * @brief Read small_file_cache_mb and small_file_max_kb from Server_Config,
+     *        dropping every entry
+     */
+    void configure ();
+
+    /**
+     * @brief Find the content of a file, the path is only stat'ed when an entry exists
+     *
+     * @param path
+     * @return Small_File_Content , null for a miss
+     */
+    Small_File_Content lookup (const std::string &path);
+
+    /**
+     * @brief Keep the content of a file being sent, when it is small enough
+     *
+     * @param path the name it was opened by
+     * @param fd the file, locked against writers by the caller
+     */
+    void fill (const std::string &path, int fd);
+
+    /**
+     * @brief Drop every entry
+     */
+    void clear ();
+
+private:
+    struct Entry
+    {
+        std::string path;           // key of the entry
+        struct stat file_stat;      // the version the content is of
+        Small_File_Content content; // the whole file
+    };
+
+    typedef std::list<Entry> Entry_List;
+
+    struct Shard
+    {
+        std::mutex lock;                                                // guards everything below
+        long long bytes;                                                // length of the contents kept
+        Entry_List lru;                                                 // most recently used first
+        std::unordered_map<std::string, Entry_List::iterator> entries;  // lru by path
+
+        Shard () : bytes (0) {}
+    };
+
+    Small_File_Cache () : max_bytes_ (0), max_file_bytes_ (DEFAULT_SMALL_FILE_MAX_KB * 1024LL) {}
+
+    /**
+     * @brief Get the shard of a path
+     *
+     * @param path
+     * @return Shard&
+     */
+    Shard &shard_of (const std::string &path);
+
+    /**
+     * @brief Check whether two stats are of the same version of a file
+     *
+     * @param left
+     * @param right
+     * @return true , unchanged
+     * @return false , changed or replaced
+     */
+    static bool is_same (const struct stat &left, const struct stat &right);
+
+    /**
+     * @brief Drop an entry, shard.lock must be held
+     *
+     * @param shard
+     * @param entry
+     */
+    void erase (Shard &shard, Entry_List::iterator entry);
+
+    Shard shards_[SMALL_FILE_CACHE_SHARDS];
+    long long max_bytes_;           // size limit of the contents, 0 disables the cache
+    long long max_file_bytes_;      // larger files are not kept
+};
+
+#endif
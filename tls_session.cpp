@@ -0,0 +1,218 @@
+#include "tls_session.h"
+#include "async_log.h"
+#include "metrics.h"
+#include "server_config.h"
+#include "tls_session_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+
+Tls_Context *Tls_Context::instance ()
+{
+    static Tls_Context context;
+    return &context;
+}
+
+int Tls_Context::open ()
+{
+    Server_Config *config = Server_Config::instance ();
+    std::string cert_file = config->get_string ("tls_cert_file", "");
+    std::string key_file = config->get_string ("tls_key_file", cert_file);
+    if (cert_file.empty ())
+        return 0;
+    SSL_CTX *ctx = SSL_CTX_new (TLS_server_method ());
+    if (ctx == nullptr ||
+        SSL_CTX_set_min_proto_version (ctx, TLS1_2_VERSION) != 1 ||
+        SSL_CTX_use_certificate_chain_file (ctx, cert_file.c_str ()) != 1 ||
+        SSL_CTX_use_PrivateKey_file (ctx, key_file.c_str (), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key (ctx) != 1)
+    {
+        FTP_LOG (LOG_LEVEL_ERROR, "load TLS certificate %s failed: %s\n", cert_file.c_str (),
+                 ERR_error_string (ERR_get_error (), nullptr));
+        SSL_CTX_free (ctx);
+        return -1;
+    }
+    // the kernel offloads AES-GCM and ChaCha20-Poly1305, they come first
+    SSL_CTX_set_cipher_list (ctx, "ECDHE+AESGCM:ECDHE+CHACHA20:HIGH:!aNULL:!MD5:!RC4");
+    SSL_CTX_set_mode (ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // an upload ends with the client's close_notify, a bare FIN may be forged to cut the file
+    // short (RFC 4217 section 12.6), so it fails the transfer unless clients are trusted
+    if (config->get_int ("tls_ignore_unexpected_eof", 0) != 0)
+        SSL_CTX_set_options (ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config->get_int ("tls_ktls", 1) != 0)
+        SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    Tls_Session_Cache::instance ()->attach (ctx);
+    ctx_ = ctx;
+    FTP_LOG (LOG_LEVEL_INFO, "TLS enabled with %s\n", cert_file.c_str ());
+    return 0;
+}
+
+void Tls_Context::close ()
+{
+    Tls_Session_Cache::instance ()->clear ();
+    SSL_CTX_free (ctx_);
+    ctx_ = nullptr;
+}
+
+Tls_Stream::Tls_Stream (int fd, const std::string &session_context) :
+    fd_ (fd),
+    ssl_ (nullptr),
+    is_established_ (false),
+    is_want_write_ (false),
+    is_kernel_send_ (false),
+    is_kernel_recv_ (false),
+    retry_length_ (0)
+{
+    SSL_CTX *ctx = Tls_Context::instance ()->get_ctx ();
+    if (ctx == nullptr)
+        return;
+    ssl_ = SSL_new (ctx);
+    if (ssl_ != nullptr &&
+        (SSL_set_fd (ssl_, fd) != 1 ||
+         SSL_set_session_id_context (ssl_, (const unsigned char *)session_context.data (),
+                                     session_context.length ()) != 1))
+    {
+        SSL_free (ssl_);
+        ssl_ = nullptr;
+    }
+}
+
+Tls_Stream::~Tls_Stream ()
+{
+    // close_notify tells the peer the data is complete, its answer isn't waited for
+    if (is_established_)
+        SSL_shutdown (ssl_);
+    SSL_free (ssl_);
+}
+
+int Tls_Stream::set_errno (int result)
+{
+    int ssl_error = SSL_get_error (ssl_, result);
+    if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+        errno = EAGAIN;
+    else if (ssl_error != SSL_ERROR_SYSCALL || errno == 0)
+        errno = EIO;
+    ERR_clear_error ();
+    return ssl_error;
+}
+
+int Tls_Stream::wait (int ssl_error)
+{
+    if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE)
+        return -1;
+    struct pollfd poll_fd;
+    poll_fd.fd = fd_;
+    poll_fd.events = (ssl_error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT);
+    poll_fd.revents = 0;
+    int result;
+    do
+        result = poll (&poll_fd, 1, TLS_HANDSHAKE_TIMEOUT_MSEC);
+    while (result < 0 && errno == EINTR);
+    return result > 0 ? 0 : -1;
+}
+
+int Tls_Stream::handshake ()
+{
+    if (ssl_ == nullptr)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (is_established_)
+        return 0;
+    int result = SSL_accept (ssl_);
+    if (result != 1)
+    {
+        int ssl_error = set_errno (result);
+        is_want_write_ = (ssl_error == SSL_ERROR_WANT_WRITE);
+        if (errno != EAGAIN)
+            FTP_LOG (LOG_LEVEL_INFO, "TLS handshake failed\n");
+        return -1;
+    }
+    is_established_ = true;
+    Metrics::instance ()->add (Metric_Counters::METRIC_TLS_HANDSHAKES);
+    if (SSL_session_reused (ssl_))
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_RESUMPTIONS);
+    is_kernel_send_ = (BIO_get_ktls_send (SSL_get_wbio (ssl_)) != 0);
+    is_kernel_recv_ = (BIO_get_ktls_recv (SSL_get_rbio (ssl_)) != 0);
+    FTP_LOG (LOG_LEVEL_DEBUG, "%s, kernel send %d, kernel receive %d\n", SSL_get_cipher_name (ssl_),
+             (int)is_kernel_send_, (int)is_kernel_recv_);
+    return 0;
+}
+
+ssize_t Tls_Stream::recv (void *buf, size_t length)
+{
+    size_t received = 0;
+    int result = SSL_read_ex (ssl_, buf, length, &received);
+    if (result == 1)
+        return received;
+    int ssl_error = set_errno (result);
+    if (ssl_error == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    // the stream ended without close_notify, or broke
+    if (ssl_error == SSL_ERROR_SSL || ssl_error == SSL_ERROR_SYSCALL)
+        FTP_LOG (LOG_LEVEL_DEBUG, "TLS stream closed without close_notify\n");
+    return -1;
+}
+
+ssize_t Tls_Stream::send (const void *buf, size_t length)
+{
+    // a record half written is finished with the same bytes
+    length = std::max (length, retry_length_);
+    size_t sent = 0;
+    int result = SSL_write_ex (ssl_, buf, length, &sent);
+    if (result == 1)
+    {
+        retry_length_ = 0;
+        return sent;
+    }
+    if (set_errno (result) == SSL_ERROR_WANT_WRITE)
+        retry_length_ = length;
+    return -1;
+}
+
+int Tls_Stream::send_all (const void *buf, size_t length)
+{
+    const char *data = (const char *)buf;
+    while (length > 0)
+    {
+        size_t sent = 0;
+        int result = SSL_write_ex (ssl_, data, length, &sent);
+        if (result != 1)
+        {
+            if (wait (set_errno (result)) == -1)
+                return -1;
+            continue;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+ssize_t Tls_Stream::send_file (int fd, off_t &offset, size_t length)
+{
+    if (!is_kernel_send_)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ossl_ssize_t sent = SSL_sendfile (ssl_, fd, offset, length, 0);
+    if (sent < 0)
+    {
+        set_errno ((int)sent);
+        return -1;
+    }
+    offset += sent;
+    return sent;
+}
+
+int Tls_Stream::pending () const
+{
+    return SSL_pending (ssl_);
+}
@@ -0,0 +1,205 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include <string>
+#include <sys/types.h>
+
+#define TLS_HANDSHAKE_TIMEOUT_MSEC 10000    // a handshake taking longer or a control reply stalled longer fails
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/**
+ * The server's TLS configuration for AUTH TLS, built from tls_cert_file and
+ * tls_key_file. Sessions ask OpenSSL for kernel TLS: once a handshake is
+ * done the record keys are installed in the socket (TCP_ULP "tls"), so
+ * sendfile keeps sending files without copying them and received records
+ * are decrypted by the kernel. Without kTLS (module missing, cipher not
+ * offloaded, tls_ktls 0) the records are handled by OpenSSL in user space.
+ */
+class Tls_Context
+{
+public:
+    /**
+     * @brief Get the process-wide context
+     *
+     * @return Tls_Context*
+     */
+    static Tls_Context *instance ();
+
+    /**
+     * @brief Read tls_cert_file, tls_key_file, tls_ktls and tls_ignore_unexpected_eof
+     *        from Server_Config and load the certificate, TLS stays disabled without
+     *        a certificate
+     *
+     * @return int , 0 for success, -1 for an unusable certificate or key
+     */
+    int open ();
+
+    /**
+     * @brief Release the SSL_CTX
+     */
+    void close ();
+
+    /**
+     * @brief Check whether AUTH TLS is offered
+     *
+     * @return true , a certificate is loaded
+     * @return false , TLS is disabled
+     */
+    bool is_enabled () const { return ctx_ != nullptr; }
+
+    /**
+     * @brief Get the SSL_CTX the sessions are created from
+     *
+     * @return SSL_CTX*
+     */
+    SSL_CTX *get_ctx () const { return ctx_; }
+
+private:
+    Tls_Context () : ctx_ (nullptr) {}
+
+    SSL_CTX *ctx_;                      // shared by all sessions, null for disabled
+};
+
+/**
+ * One server side TLS connection over a socket it doesn't own. recv () and
+ * send () behave like those of the socket: -1 with errno EAGAIN when the
+ * socket would block, 0 from recv () when the peer closed the stream with
+ * close_notify; a close without it fails like a broken connection.
+ */
+class Tls_Stream
+{
+public:
+    /**
+     * @brief Construct a new Tls_Stream object, handshake () makes the handshake
+     *
+     * @param fd connected socket
+     * @param session_context session id context of the control session, from
+     *                        Tls_Session_Cache::new_context (); only sessions with
+     *                        the same context are resumed
+     */
+    Tls_Stream (int fd, const std::string &session_context);
+
+    /**
+     * @brief Send close_notify if the stream is established and free it, the
+     *        socket is left open
+     */
+    ~Tls_Stream ();
+
+    /**
+     * @brief Make the next steps of the server handshake without waiting for the
+     *        socket, called again when it is ready; a client offering a session
+     *        of the same context resumes it
+     *
+     * @return int , 0 for established, -1 for failure or EAGAIN, is_want_write ()
+     *               tells what the socket must be ready for then
+     */
+    int handshake ();
+
+    /**
+     * @brief Check whether the handshake completed
+     *
+     * @return true , established
+     * @return false , handshake () must go on
+     */
+    bool is_established () const { return is_established_; }
+
+    /**
+     * @brief Check what the handshake waits for after handshake () would block
+     *
+     * @return true , the socket to be writable
+     * @return false , the socket to be readable
+     */
+    bool is_want_write () const { return is_want_write_; }
+
+    /**
+     * @brief Receive decrypted data
+     *
+     * @param buf
+     * @param length
+     * @return ssize_t bytes received, 0 for closed by close_notify, -1 for failure,
+     *                 a close without close_notify, or EAGAIN
+     */
+    ssize_t recv (void *buf, size_t length);
+
+    /**
+     * @brief Send data, a send that would block must be repeated with at least
+     *        the same bytes at the same address
+     *
+     * @param buf
+     * @param length
+     * @return ssize_t bytes sent, -1 for failure or EAGAIN
+     */
+    ssize_t send (const void *buf, size_t length);
+
+    /**
+     * @brief Send all of the data, waiting for the socket up to TLS_HANDSHAKE_TIMEOUT_MSEC
+     *        each time it would block, for replies
+     *
+     * @param buf
+     * @param length
+     * @return int , 0 for success, -1 for failure
+     */
+    int send_all (const void *buf, size_t length);
+
+    /**
+     * @brief Send a part of a file by sendfile, only with kernel TLS for sending
+     *
+     * @param fd the file
+     * @param offset where to start, advanced by the bytes sent
+     * @param length
+     * @return ssize_t bytes sent, 0 for the end of the file, -1 for failure or EAGAIN
+     */
+    ssize_t send_file (int fd, off_t &offset, size_t length);
+
+    /**
+     * @brief Get the decrypted bytes OpenSSL holds, the socket may not be readable for them
+     *
+     * @return int
+     */
+    int pending () const;
+
+    /**
+     * @brief Check whether records are encrypted by the kernel, send_file () works then
+     *
+     * @return true , kernel TLS for sending
+     * @return false , OpenSSL encrypts
+     */
+    bool is_kernel_send () const { return is_kernel_send_; }
+
+    /**
+     * @brief Check whether records are decrypted by the kernel
+     *
+     * @return true , kernel TLS for receiving
+     * @return false , OpenSSL decrypts
+     */
+    bool is_kernel_recv () const { return is_kernel_recv_; }
+
+private:
+    /**
+     * @brief Map the result of an SSL call to errno, EAGAIN for the retryable ones
+     *
+     * @param result what the call returned
+     * @return int , the SSL error
+     */
+    int set_errno (int result);
+
+    /**
+     * @brief Wait until the socket is ready for what the last SSL call wanted
+     *
+     * @param ssl_error SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE
+     * @return int , 0 for ready, -1 for timeout or another error
+     */
+    int wait (int ssl_error);
+
+    int fd_;                            // the socket
+    SSL *ssl_;                          // null if the SSL_CTX is gone
+    bool is_established_;               // whether the handshake completed
+    bool is_want_write_;                // whether the handshake waits for a writable socket
+    bool is_kernel_send_;               // whether kTLS sends
+    bool is_kernel_recv_;               // whether kTLS receives
+    size_t retry_length_;               // length of a send that would block, repeated by the next one
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include "tls_session_cache.h"
+#include "metrics.h"
+#include "server_config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+Tls_Session_Cache *Tls_Session_Cache::instance ()
+{
+    static Tls_Session_Cache cache;
+    return &cache;
+}
+
+void Tls_Session_Cache::attach (SSL_CTX *ctx)
+{
+    Server_Config *config = Server_Config::instance ();
+    ttl_ = config->get_int ("tls_session_ttl", DEFAULT_TLS_SESSION_TTL);
+    SSL_CTX_set_timeout (ctx, ttl_);
+    // OpenSSL's own cache is one list under one lock, this one replaces it
+    SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb (ctx, add_session);
+    SSL_CTX_sess_set_get_cb (ctx, get_session);
+    SSL_CTX_sess_set_remove_cb (ctx, remove_session);
+    // without tickets TLS 1.3 resumes by id from the cache as well
+    if (config->get_int ("tls_session_tickets", 1) == 0)
+        SSL_CTX_set_options (ctx, SSL_OP_NO_TICKET);
+}
+
+void Tls_Session_Cache::clear ()
+{
+    for (Shard &shard : shards_)
+    {
+        std::lock_guard<std::mutex> guard (shard.lock);
+        for (auto &item : shard.sessions)
+            SSL_SESSION_free (item.second.session);
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED, -(long long)shard.sessions.size ());
+        shard.sessions.clear ();
+    }
+}
+
+std::string Tls_Session_Cache::new_context ()
+{
+    // unique within the process, random across restarts
+    static std::atomic<unsigned long long> next (0);
+    unsigned char context[16];
+    unsigned long long serial = next++;
+    if (RAND_bytes (context, 8) != 1)
+        std::fill (context, context + 8, 0);
+    for (int i = 0; i < 8; ++i)
+        context[8 + i] = (unsigned char)(serial >> (i * 8));
+    return std::string ((char *)context, sizeof (context));
+}
+
+Tls_Session_Cache::Shard &Tls_Session_Cache::shard_of (const std::string &id)
+{
+    return shards_[std::hash<std::string> () (id) % TLS_SESSION_SHARDS];
+}
+
+int Tls_Session_Cache::add_session (SSL *, SSL_SESSION *session)
+{
+    Tls_Session_Cache *cache = instance ();
+    unsigned int length = 0;
+    const unsigned char *id_data = SSL_SESSION_get_id (session, &length);
+    std::string id ((const char *)id_data, length);
+    Time_Point now = std::chrono::steady_clock::now ();
+    Shard &shard = cache->shard_of (id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    if (shard.sessions.size () >= TLS_SESSION_SHARD_MAX)
+        cache->evict (shard, now);
+    Entry &entry = shard.sessions.emplace (id, Entry { nullptr, now }).first->second;
+    if (entry.session != nullptr)
+        SSL_SESSION_free (entry.session);
+    else
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED);
+    entry.session = session;
+    entry.expire = now + std::chrono::seconds (cache->ttl_);
+    return 1;
+}
+
+SSL_SESSION *Tls_Session_Cache::get_session (SSL *, const unsigned char *id_data, int length, int *copy)
+{
+    Tls_Session_Cache *cache = instance ();
+    *copy = 1;
+    std::string id ((const char *)id_data, length);
+    Shard &shard = cache->shard_of (id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    auto ite = shard.sessions.find (id);
+    if (ite != shard.sessions.end () && ite->second.expire <= std::chrono::steady_clock::now ())
+    {
+        SSL_SESSION_free (ite->second.session);
+        shard.sessions.erase (ite);
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED, -1);
+        ite = shard.sessions.end ();
+    }
+    if (ite == shard.sessions.end ())
+    {
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSION_CACHE_MISSES);
+        return nullptr;
+    }
+    Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSION_CACHE_HITS);
+    return ite->second.session;
+}
+
+void Tls_Session_Cache::remove_session (SSL_CTX *, SSL_SESSION *session)
+{
+    Tls_Session_Cache *cache = instance ();
+    unsigned int length = 0;
+    const unsigned char *id_data = SSL_SESSION_get_id (session, &length);
+    std::string id ((const char *)id_data, length);
+    Shard &shard = cache->shard_of (id);
+    std::lock_guard<std::mutex> guard (shard.lock);
+    auto ite = shard.sessions.find (id);
+    if (ite == shard.sessions.end () || ite->second.session != session)
+        return;
+    SSL_SESSION_free (ite->second.session);
+    shard.sessions.erase (ite);
+    Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED, -1);
+}
+
+void Tls_Session_Cache::evict (Shard &shard, Time_Point now)
+{
+    auto next = shard.sessions.end ();
+    for (auto ite = shard.sessions.begin (); ite != shard.sessions.end ();)
+    {
+        if (ite->second.expire <= now)
+        {
+            SSL_SESSION_free (ite->second.session);
+            ite = shard.sessions.erase (ite);
+            Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED, -1);
+            continue;
+        }
+        if (next == shard.sessions.end () || ite->second.expire < next->second.expire)
+            next = ite;
+        ++ite;
+    }
+    if (shard.sessions.size () >= TLS_SESSION_SHARD_MAX && next != shard.sessions.end ())
+    {
+        SSL_SESSION_free (next->second.session);
+        shard.sessions.erase (next);
+        Metrics::instance ()->add (Metric_Counters::METRIC_TLS_SESSIONS_CACHED, -1);
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef TLS_SESSION_CACHE_H
+#define TLS_SESSION_CACHE_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define TLS_SESSION_SHARDS 16
+#define TLS_SESSION_SHARD_MAX 2048          // sessions a shard keeps, expired ones go first
+#define DEFAULT_TLS_SESSION_TTL 300         // seconds
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+typedef struct ssl_st SSL;
+
+/**
+ * Server side cache of TLS sessions by session id, so the data connections
+ * of a control session resume its TLS session with an abbreviated
+ * handshake instead of a full one. Every control session has a session id
+ * context of its own, given to its data connections as well, so a session
+ * only resumes on connections of the control session that created it.
+ * Sessions are kept in shards by hash of the id, each with its own mutex,
+ * as the reactor threads accepting data connections take turns, and expire
+ * tls_session_ttl seconds after their handshake. Session tickets carry the
+ * same context and lifetime, clients that send one skip the cache.
+ */
+class Tls_Session_Cache
+{
+public:
+    /**
+     * @brief Get the process-wide cache
+     *
+     * @return Tls_Session_Cache*
+     */
+    static Tls_Session_Cache *instance ();
+
+    /**
+     * @brief Hook the cache into an SSL_CTX, read tls_session_ttl and tls_session_tickets
+     *        from Server_Config
+     *
+     * @param ctx
+     */
+    void attach (SSL_CTX *ctx);
+
+    /**
+     * @brief Drop every cached session, before the SSL_CTX is freed
+     */
+    void clear ();
+
+    /**
+     * @brief Make a session id context for a new control session
+     *
+     * @return std::string
+     */
+    static std::string new_context ();
+
+private:
+    typedef std::chrono::steady_clock::time_point Time_Point;
+
+    struct Entry
+    {
+        SSL_SESSION *session;   // one reference held by the cache
+        Time_Point expire;      // when the session is dropped
+    };
+
+    struct Shard
+    {
+        std::mutex lock;                                    // guards sessions
+        std::unordered_map<std::string, Entry> sessions;    // sessions by id
+    };
+
+    Tls_Session_Cache () : ttl_ (DEFAULT_TLS_SESSION_TTL) {}
+
+    /**
+     * @brief Get the shard of a session id
+     *
+     * @param id
+     * @return Shard&
+     */
+    Shard &shard_of (const std::string &id);
+
+    /**
+     * @brief Keep a new session, OpenSSL's new session callback
+     *
+     * @param ssl
+     * @param session
+     * @return int , 1 for a reference taken
+     */
+    static int add_session (SSL *ssl, SSL_SESSION *session);
+
+    /**
+     * @brief Find a session to resume, OpenSSL's get session callback
+     *
+     * @param ssl
+     * @param id
+     * @param length
+     * @param copy set to 1, OpenSSL takes a reference of its own
+     * @return SSL_SESSION* , null for a miss
+     */
+    static SSL_SESSION *get_session (SSL *ssl, const unsigned char *id, int length, int *copy);
+
+    /**
+     * @brief Drop a session OpenSSL found unusable, its remove session callback
+     *
+     * @param ctx
+     * @param session
+     */
+    static void remove_session (SSL_CTX *ctx, SSL_SESSION *session);
+
+    /**
+     * @brief Drop the expired sessions of a full shard, then the next to expire
+     *        while it is still full, shard.lock must be held
+     *
+     * @param shard
+     * @param now
+     */
+    void evict (Shard &shard, Time_Point now);
+
+    Shard shards_[TLS_SESSION_SHARDS];
+    long ttl_;                          // seconds a session may be resumed
+};
+
+#endif
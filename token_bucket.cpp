@@ -0,0 +1,73 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <climits>
+
+// smallest burst, otherwise a low rate could never grant a useful chunk
+static const long MIN_BURST = 16 * 1024;
+
+static long default_burst (long rate, long burst)
+{
+    if (burst > 0)
+        return burst;
+    return std::max (rate / 5, MIN_BURST);
+}
+
+Token_Bucket::Token_Bucket (long rate, long burst) :
+    rate_ (rate),
+    burst_ (default_burst (rate, burst)),
+    tokens_ (burst_),
+    last_ (Clock::now ())
+{}
+
+void Token_Bucket::set_rate (long rate, long burst)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    refill ();
+    rate_ = rate;
+    burst_ = default_burst (rate, burst);
+    tokens_ = std::min (tokens_, (double)burst_);
+}
+
+long Token_Bucket::get_rate ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    return rate_;
+}
+
+long Token_Bucket::available ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (rate_ <= 0)
+        return LONG_MAX;
+    refill ();
+    return (long)tokens_;
+}
+
+void Token_Bucket::take (long tokens)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (rate_ <= 0)
+        return;
+    refill ();
+    tokens_ -= tokens;
+}
+
+long Token_Bucket::usec_until (long tokens)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    if (rate_ <= 0)
+        return 0;
+    refill ();
+    if (tokens_ >= tokens)
+        return 0;
+    return (long)((tokens - tokens_) * 1000000.0 / rate_) + 1;
+}
+
+void Token_Bucket::refill ()
+{
+    Clock::time_point now = Clock::now ();
+    double elapsed = std::chrono::duration<double> (now - last_).count ();
+    last_ = now;
+    tokens_ = std::min (tokens_ + elapsed * rate_, (double)burst_);
+}
@@ -0,0 +1,73 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <chrono>
+#include <mutex>
+
+class Token_Bucket
+{
+public:
+    /**
+     * @brief Construct a new Token_Bucket object
+     * 
+     * @param rate bytes per second, 0 for unlimited
+     * @param burst max tokens the bucket holds, 0 for a default derived from rate
+     */
+    Token_Bucket (long rate = 0, long burst = 0);
+
+    /**
+     * @brief Change the rate at runtime, tokens already in the bucket are kept
+     *        up to the new burst size
+     * 
+     * @param rate bytes per second, 0 for unlimited
+     * @param burst max tokens the bucket holds, 0 for a default derived from rate
+     */
+    void set_rate (long rate, long burst = 0);
+
+    /**
+     * @brief Get the rate
+     * 
+     * @return long bytes per second, 0 for unlimited
+     */
+    long get_rate ();
+
+    /**
+     * @brief Refill the bucket and get the tokens in it
+     * 
+     * @return long available tokens, may be negative after an overdraft,
+     *              LONG_MAX for an unlimited bucket
+     */
+    long available ();
+
+    /**
+     * @brief Take tokens, the bucket may go negative when several consumers
+     *        race for the last tokens, later consumers wait for the debt
+     * 
+     * @param tokens 
+     */
+    void take (long tokens);
+
+    /**
+     * @brief How long until the bucket holds the given tokens
+     * 
+     * @param tokens 
+     * @return long microseconds, 0 when they are already available
+     */
+    long usec_until (long tokens);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::mutex lock_;           // protects all members
+    long rate_;                 // bytes per second, 0 for unlimited
+    long burst_;                // max tokens
+    double tokens_;             // current tokens
+    Clock::time_point last_;    // last refill
+
+    /**
+     * @brief Add tokens for the time passed since last refill, lock_ must be held
+     */
+    void refill ();
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include "transfer_scheduler.h"
+#include "data_handler.h"
+#include "server_config.h"
+
+#include <algorithm>
+#include <cstdio>
+
+Transfer_Scheduler *Transfer_Scheduler::instance ()
+{
+    static Transfer_Scheduler scheduler;
+    return &scheduler;
+}
+
+long Transfer_Scheduler::class_weight (const std::string &class_name)
+{
+    long weight = Server_Config::instance ()->get_int ("class_weight_" + class_name, 1);
+    return weight > 0 ? weight : 1;
+}
+
+Transfer_Flow *Transfer_Scheduler::attach (const std::string &user, const std::string &class_name, long weight)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    auto ite = flows_.find (user);
+    if (ite == flows_.end ())
+    {
+        Transfer_Flow &flow = flows_[user];
+        flow.user = user;
+        flow.class_name = class_name;
+        flow.weight = weight > 0 ? weight : 1;
+        flow.deficit = flow.weight * SCHED_QUANTUM;
+        flow.handlers = 0;
+        flow.last_active = Clock::now ();
+        ++counters_[class_name].flows;
+        ite = flows_.find (user);
+    }
+    ++ite->second.handlers;
+    return &ite->second;
+}
+
+void Transfer_Scheduler::detach (Transfer_Flow *flow, Data_Handler *handler)
+{
+    bool was_parked = false;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        auto parked_ite = std::find (flow->parked.begin (), flow->parked.end (), handler);
+        if (parked_ite != flow->parked.end ())
+        {
+            flow->parked.erase (parked_ite);
+            was_parked = true;
+        }
+        if (--flow->handlers == 0)
+        {
+            --counters_[flow->class_name].flows;
+            flows_.erase (flow->user);
+        }
+    }
+    if (was_parked)
+        handler->remove_reference ();
+}
+
+size_t Transfer_Scheduler::acquire (Transfer_Flow *flow, Data_Handler *handler, size_t wanted)
+{
+    std::vector<Data_Handler *> wake;
+    size_t allowed = 0;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        Clock::time_point now = Clock::now ();
+        flow->last_active = now;
+        if (flow->deficit <= 0)
+        {
+            // the round is over when no other flow is still busy spending its deficit,
+            // flows waiting on a slow socket do not hold the others back
+            bool others_entitled = false;
+            for (auto &item : flows_)
+            {
+                Transfer_Flow &other = item.second;
+                if (&other != flow && other.deficit > 0 &&
+                    now - other.last_active < std::chrono::microseconds (SCHED_IDLE_USEC))
+                {
+                    others_entitled = true;
+                    break;
+                }
+            }
+            if (others_entitled)
+            {
+                if (std::find (flow->parked.begin (), flow->parked.end (), handler) == flow->parked.end ())
+                {
+                    handler->add_reference ();
+                    flow->parked.push_back (handler);
+                }
+                return 0;
+            }
+            new_round (wake);
+        }
+        allowed = std::min ((long)wanted, flow->deficit);
+    }
+    for (Data_Handler *parked : wake)
+    {
+        if (parked != handler)
+            parked->resume ();
+        parked->remove_reference ();
+    }
+    return allowed;
+}
+
+void Transfer_Scheduler::new_round (std::vector<Data_Handler *> &wake)
+{
+    for (auto &item : flows_)
+    {
+        Transfer_Flow &flow = item.second;
+        long quantum = flow.weight * SCHED_QUANTUM;
+        // an idle flow keeps at most one round of credit
+        flow.deficit = std::min (flow.deficit + quantum, quantum);
+        wake.insert (wake.end (), flow.parked.begin (), flow.parked.end ());
+        flow.parked.clear ();
+    }
+}
+
+void Transfer_Scheduler::charge (Transfer_Flow *flow, size_t bytes)
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    flow->deficit -= (long)bytes;
+    counters_[flow->class_name].bytes += bytes;
+}
+
+std::string Transfer_Scheduler::report ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    Clock::time_point now = Clock::now ();
+    double elapsed = std::chrono::duration<double> (now - last_report_).count ();
+    last_report_ = now;
+    std::string result;
+    for (auto &item : counters_)
+    {
+        Class_Counter &counter = item.second;
+        double rate = elapsed > 0 ? (counter.bytes - counter.last_bytes) / elapsed : 0;
+        counter.last_bytes = counter.bytes;
+        char line[256];
+        snprintf (line, sizeof (line), "%s %llu %.0f %zu\n",
+                  item.first.c_str (), counter.bytes, rate, counter.flows);
+        result += line;
+    }
+    return result;
+}
@@ -0,0 +1,120 @@
+#ifndef TRANSFER_SCHEDULER_H
+#define TRANSFER_SCHEDULER_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define SCHED_QUANTUM 65536
+#define SCHED_IDLE_USEC 10000
+
+class Data_Handler;
+
+/**
+ * A flow is all active transfers of one user, they share one deficit counter,
+ * so a user running many sessions gets the share of one weighted user.
+ */
+struct Transfer_Flow
+{
+    std::string user;               // owner of the transfers
+    std::string class_name;         // class for the counters
+    long weight;                    // quanta per round
+    long deficit;                   // bytes the flow may still move this round
+    size_t handlers;                // attached data handlers
+    std::chrono::steady_clock::time_point last_active;  // last time it asked for bytes
+    std::vector<Data_Handler *> parked;                 // handlers waiting for next round
+};
+
+class Transfer_Scheduler
+{
+public:
+    /**
+     * @brief Get the process-wide scheduler
+     * 
+     * @return Transfer_Scheduler* 
+     */
+    static Transfer_Scheduler *instance ();
+
+    /**
+     * @brief Get the weight of a class, key "class_weight_NAME" in Server_Config
+     * 
+     * @param class_name 
+     * @return long weight, 1 when not configured
+     */
+    long class_weight (const std::string &class_name);
+
+    /**
+     * @brief Attach a starting transfer to the flow of its user
+     * 
+     * @param user 
+     * @param class_name class of the user
+     * @param weight weight of the user
+     * @return Transfer_Flow* , valid until detach ()
+     */
+    Transfer_Flow *attach (const std::string &user, const std::string &class_name, long weight);
+
+    /**
+     * @brief Detach a finished transfer, the flow is removed with its last transfer
+     * 
+     * @param flow returned by attach ()
+     * @param handler the finished transfer
+     */
+    void detach (Transfer_Flow *flow, Data_Handler *handler);
+
+    /**
+     * @brief Deficit round robin: how many bytes the transfer may move now.
+     *        When the flow has spent its deficit and other flows are still
+     *        entitled in this round, the handler is parked and resumed when
+     *        next round starts.
+     * 
+     * @param flow returned by attach ()
+     * @param handler the transfer asking for bytes
+     * @param wanted bytes to move
+     * @return size_t allowed bytes, 0 when parked
+     */
+    size_t acquire (Transfer_Flow *flow, Data_Handler *handler, size_t wanted);
+
+    /**
+     * @brief Take moved bytes from the deficit of the flow and count them for its class
+     * 
+     * @param flow returned by attach ()
+     * @param bytes moved bytes
+     */
+    void charge (Transfer_Flow *flow, size_t bytes);
+
+    /**
+     * @brief Format throughput counters of every class,
+     *        one line "class bytes bytes/s active-users" each
+     * 
+     * @return std::string 
+     */
+    std::string report ();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Class_Counter
+    {
+        unsigned long long bytes;       // bytes moved since start
+        unsigned long long last_bytes;  // bytes at last report
+        size_t flows;                   // active flows
+    };
+
+    Transfer_Scheduler () : last_report_ (Clock::now ()) {}
+
+    /**
+     * @brief Start a new round, every flow gets weight quanta, lock_ must be held
+     * 
+     * @param wake parked handlers to resume after lock_ is released
+     */
+    void new_round (std::vector<Data_Handler *> &wake);
+
+    std::mutex lock_;                                           // protects all members
+    std::unordered_map<std::string, Transfer_Flow> flows_;      // active flows by user
+    std::unordered_map<std::string, Class_Counter> counters_;   // counters by class
+    Clock::time_point last_report_;                             // time of last report ()
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "transfer_trace.h"
+
+#include "ace/Log_Msg.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+void Transfer_Trace::start (const std::string &file_path, char direction)
+{
+    std::fill (is_marked_, is_marked_ + Trace_Phases::TRACE_PHASES, false);
+    wait_ = Trace_Waits::TRACE_WAIT_NONE;
+    stall_usec_ = 0;
+    throttle_usec_ = 0;
+    bytes_ = 0;
+    file_path_ = file_path;
+    direction_ = direction;
+    mark (Trace_Phases::TRACE_COMMAND);
+}
+
+void Transfer_Trace::wait_begin (int wait)
+{
+    if (wait_ != Trace_Waits::TRACE_WAIT_NONE)
+        return;
+    wait_ = wait;
+    wait_since_ = std::chrono::steady_clock::now ();
+}
+
+void Transfer_Trace::wait_end ()
+{
+    if (wait_ == Trace_Waits::TRACE_WAIT_NONE)
+        return;
+    long usec = std::chrono::duration_cast<std::chrono::microseconds> (
+        std::chrono::steady_clock::now () - wait_since_).count ();
+    if (wait_ == Trace_Waits::TRACE_WAIT_STALL)
+        stall_usec_ += usec;
+    else
+        throttle_usec_ += usec;
+    wait_ = Trace_Waits::TRACE_WAIT_NONE;
+}
+
+long Transfer_Trace::phase_usec (int phase) const
+{
+    if (!is_marked_[phase])
+        return -1;
+    int prev = phase - 1;
+    while (prev > Trace_Phases::TRACE_COMMAND && !is_marked_[prev])
+        --prev;
+    if (prev < Trace_Phases::TRACE_COMMAND)
+        return 0;
+    return std::chrono::duration_cast<std::chrono::microseconds> (stamps_[phase] - stamps_[prev]).count ();
+}
+
+long Transfer_Trace::total_usec () const
+{
+    if (!is_marked_[Trace_Phases::TRACE_DONE])
+        return 0;
+    return std::chrono::duration_cast<std::chrono::microseconds> (
+        stamps_[Trace_Phases::TRACE_DONE] - stamps_[Trace_Phases::TRACE_COMMAND]).count ();
+}
+
+Transfer_Log *Transfer_Log::instance ()
+{
+    static Transfer_Log transfer_log;
+    return &transfer_log;
+}
+
+int Transfer_Log::open (const std::string &path, bool with_phases)
+{
+    fd_ = ::open (path.c_str (), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ == -1)
+    {
+        ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("open xferlog %s failed\n"), path.c_str ()));
+        return -1;
+    }
+    with_phases_ = with_phases;
+    is_stopping_ = false;
+    writer_ = std::thread (&Transfer_Log::write_loop, this);
+    return 0;
+}
+
+void Transfer_Log::log (const Transfer_Trace &trace, const std::string &remote_host,
+                        const std::string &user, bool is_ascii, bool is_complete)
+{
+    if (fd_ == -1 || trace.get_direction () == 0)
+        return;
+
+    // xferlog(5): current-time transfer-time remote-host file-size filename
+    // transfer-type special-action-flag direction access-mode username
+    // service-name authentication-method authenticated-user-id completion-status
+    char time_buf[32];
+    time_t now = time (nullptr);
+    struct tm now_tm;
+    localtime_r (&now, &now_tm);
+    strftime (time_buf, sizeof (time_buf), "%a %b %e %H:%M:%S %Y", &now_tm);
+
+    std::string file_path = trace.get_file_path ();
+    std::replace (file_path.begin (), file_path.end (), ' ', '_');
+    long total_usec = trace.total_usec ();
+
+    char buf[512];
+    int n = snprintf (buf, sizeof (buf), "%s %ld %s %lld %s %c _ %c r %s ftp 0 * %c",
+                      time_buf,
+                      (total_usec + 500000) / 1000000,
+                      remote_host.c_str (),
+                      trace.get_bytes (),
+                      file_path.c_str (),
+                      is_ascii ? 'a' : 'b',
+                      trace.get_direction (),
+                      user.c_str (),
+                      is_complete ? 'c' : 'i');
+    if (n < 0)
+        return;
+    std::string line (buf, std::min ((size_t)n, sizeof (buf) - 1));
+    if (with_phases_)
+    {
+        long long rate = total_usec > 0 ? trace.get_bytes () * 1000000 / total_usec : 0;
+        n = snprintf (buf, sizeof (buf),
+                      " open=%ld connect=%ld lock=%ld ttfb=%ld xfer=%ld stall=%ld throttle=%ld rate=%lld",
+                      trace.phase_usec (Trace_Phases::TRACE_FILE_OPEN),
+                      trace.phase_usec (Trace_Phases::TRACE_CONNECTED),
+                      trace.phase_usec (Trace_Phases::TRACE_LOCKED),
+                      trace.phase_usec (Trace_Phases::TRACE_FIRST_BYTE),
+                      trace.phase_usec (Trace_Phases::TRACE_DONE),
+                      trace.get_stall_usec (),
+                      trace.get_throttle_usec (),
+                      rate);
+        if (n > 0)
+            line.append (buf, std::min ((size_t)n, sizeof (buf) - 1));
+    }
+    line.push_back ('\n');
+
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (queue_.size () >= MAX_XFERLOG_QUEUE)
+        {
+            ++dropped_;
+            return;
+        }
+        queue_.push_back (std::move (line));
+    }
+    ready_.notify_one ();
+}
+
+void Transfer_Log::write_loop ()
+{
+    std::deque<std::string> lines;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard (lock_);
+            ready_.wait (guard, [this] { return is_stopping_ || !queue_.empty (); });
+            if (queue_.empty ())
+                return;
+            lines.swap (queue_);
+        }
+        std::string batch;
+        for (auto &line : lines)
+            batch += line;
+        lines.clear ();
+        if (::write (fd_, batch.data (), batch.size ()) != (ssize_t)batch.size ())
+            ACE_DEBUG ((LM_DEBUG, ACE_TEXT ("write xferlog failed\n")));
+    }
+}
+
+void Transfer_Log::close ()
+{
+    if (fd_ == -1)
+        return;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        is_stopping_ = true;
+    }
+    ready_.notify_one ();
+    if (writer_.joinable ())
+        writer_.join ();
+    ::close (fd_);
+    fd_ = -1;
+}
+
+long long Transfer_Log::get_dropped ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    return dropped_;
+}
@@ -0,0 +1,188 @@
+#ifndef TRANSFER_TRACE_H
+#define TRANSFER_TRACE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define MAX_XFERLOG_QUEUE 4096
+
+enum Trace_Phases
+{
+    TRACE_COMMAND = 0,      // RETR/STOR received
+    TRACE_FILE_OPEN = 1,    // local file opened
+    TRACE_CONNECTED = 2,    // data connection accepted or connected
+    TRACE_LOCKED = 3,       // file lock acquired
+    TRACE_FIRST_BYTE = 4,   // first byte moved
+    TRACE_DONE = 5,         // transfer over
+    TRACE_PHASES = 6,
+};
+
+enum Trace_Waits
+{
+    TRACE_WAIT_NONE = 0,
+    TRACE_WAIT_STALL = 1,       // socket returned EAGAIN
+    TRACE_WAIT_THROTTLE = 2,    // shapers or scheduler gave no bytes
+};
+
+/**
+ * Timestamps of the phases of one transfer, the bytes moved and the time
+ * spent waiting on the socket or on the shapers.
+ * Not thread safe, it is written under the lock of its Data_Handler.
+ */
+class Transfer_Trace
+{
+public:
+    Transfer_Trace () { start ("", 0); }
+
+    /**
+     * @brief Forget the last transfer and stamp TRACE_COMMAND
+     * 
+     * @param file_path transferred file
+     * @param direction 'o' for RETR, 'i' for STOR
+     */
+    void start (const std::string &file_path, char direction);
+
+    /**
+     * @brief Stamp a phase, only the first stamp of a phase counts
+     * 
+     * @param phase enum Trace_Phases
+     */
+    void mark (int phase)
+    {
+        if (!is_marked_[phase])
+        {
+            stamps_[phase] = std::chrono::steady_clock::now ();
+            is_marked_[phase] = true;
+        }
+    }
+
+    /**
+     * @brief Begin waiting, the wait lasts until the next wait_end ()
+     * 
+     * @param wait enum Trace_Waits
+     */
+    void wait_begin (int wait);
+
+    /**
+     * @brief End the current wait, if any
+     */
+    void wait_end ();
+
+    /**
+     * @brief Count moved bytes, stamp TRACE_FIRST_BYTE for the first ones
+     * 
+     * @param bytes moved bytes
+     */
+    void add_bytes (size_t bytes)
+    {
+        mark (Trace_Phases::TRACE_FIRST_BYTE);
+        bytes_ += bytes;
+    }
+
+    /**
+     * @brief Get the duration of a phase, from the previous stamped phase to it
+     * 
+     * @param phase enum Trace_Phases
+     * @return long microseconds, -1 if the phase is not stamped
+     */
+    long phase_usec (int phase) const;
+
+    /**
+     * @brief Get the duration from TRACE_COMMAND to TRACE_DONE
+     * 
+     * @return long microseconds
+     */
+    long total_usec () const;
+
+    const std::string &get_file_path () const { return file_path_; }
+    char get_direction () const { return direction_; }
+    long long get_bytes () const { return bytes_; }
+    long get_stall_usec () const { return stall_usec_; }
+    long get_throttle_usec () const { return throttle_usec_; }
+
+private:
+    std::chrono::steady_clock::time_point stamps_[TRACE_PHASES];    // time of each phase
+    bool is_marked_[TRACE_PHASES];                                  // whether a phase is stamped
+    std::chrono::steady_clock::time_point wait_since_;              // beginning of the current wait
+    int wait_;                                                      // enum Trace_Waits
+    long stall_usec_;                                               // time waiting on EAGAIN
+    long throttle_usec_;                                            // time waiting for tokens
+    long long bytes_;                                               // moved bytes
+    std::string file_path_;                                         // transferred file
+    char direction_;                                                // 'o', 'i' or 0 for untraced
+};
+
+/**
+ * Writer of the xferlog. Lines are formatted by the caller and queued,
+ * a background thread writes them, so the event loop never waits on disk.
+ * When the queue is full the line is dropped and counted.
+ */
+class Transfer_Log
+{
+public:
+    /**
+     * @brief Get the process-wide transfer log
+     * 
+     * @return Transfer_Log*
+     */
+    static Transfer_Log *instance ();
+
+    /**
+     * @brief Open the log file and start the writer thread
+     * 
+     * @param path path of the log file, appended
+     * @param with_phases whether to extend each line with phase timings
+     * @return int , 0 for success, -1 for failure
+     */
+    int open (const std::string &path, bool with_phases);
+
+    /**
+     * @brief Queue the xferlog line of a transfer, nothing is done if the log is not open
+     * 
+     * @param trace the transfer
+     * @param remote_host client's address
+     * @param user logged in user
+     * @param is_ascii whether the transfer type is ASCII
+     * @param is_complete whether the transfer completed
+     */
+    void log (const Transfer_Trace &trace, const std::string &remote_host,
+              const std::string &user, bool is_ascii, bool is_complete);
+
+    /**
+     * @brief Write the queued lines and stop the writer thread
+     */
+    void close ();
+
+    /**
+     * @brief Get the number of dropped lines
+     * 
+     * @return long long
+     */
+    long long get_dropped ();
+
+    ~Transfer_Log () { close (); }
+
+private:
+    Transfer_Log () : fd_ (-1), with_phases_ (false), is_stopping_ (false), dropped_ (0) {}
+
+    /**
+     * @brief Body of the writer thread
+     */
+    void write_loop ();
+
+    int fd_;                            // log file
+    bool with_phases_;                  // whether to extend lines with phase timings
+    std::mutex lock_;                   // guards queue_, is_stopping_ and dropped_
+    std::condition_variable ready_;     // signaled when a line is queued or on close
+    std::deque<std::string> queue_;     // formatted lines waiting for the writer
+    bool is_stopping_;                  // the writer exits when queue_ is empty
+    long long dropped_;                 // lines dropped because queue_ was full
+    std::thread writer_;                // writer thread
+};
+
+#endif
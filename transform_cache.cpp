@@ -0,0 +1,194 @@
+#include "transform_cache.h"
+#include "async_log.h"
+#include "metrics.h"
+#include "parallel_deflate.h"
+#include "vfs.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Transform_Cache *Transform_Cache::instance ()
+{
+    static Transform_Cache cache;
+    return &cache;
+}
+
+void Transform_Cache::configure (const std::string &dir, long long max_bytes)
+{
+    clear ();
+    std::lock_guard<std::mutex> guard (lock_);
+    dir_ = dir;
+    max_bytes_ = max_bytes;
+}
+
+std::string Transform_Cache::make_key (const struct stat &file_stat, const std::string &transform)
+{
+    char key[128];
+    snprintf (key, sizeof (key), "%llx:%llx:%lld.%09ld:%lld:",
+              (unsigned long long)file_stat.st_dev, (unsigned long long)file_stat.st_ino,
+              (long long)file_stat.st_mtim.tv_sec, (long)file_stat.st_mtim.tv_nsec,
+              (long long)file_stat.st_size);
+    return key + transform;
+}
+
+int Transform_Cache::lookup (const std::string &path, int fd, const std::string &transform,
+                             const Transform_Function &generate, off_t &length)
+{
+    struct stat file_stat;
+    if (fstat (fd, &file_stat) != 0 || !S_ISREG (file_stat.st_mode) ||
+        file_stat.st_size < TRANSFORM_CACHE_MIN_FILE)
+        return -1;
+    std::string file_key = make_key (file_stat, "");
+    std::string key = file_key + transform;
+    unsigned generation;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        if (max_bytes_ <= 0)
+            return -1;
+        auto ite = entries_.find (key);
+        if (ite != entries_.end ())
+        {
+            Entry_List::iterator entry = ite->second;
+            if (entry->fd == -1)
+            {
+                // still generating, this transfer transforms by itself
+                Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_MISSES);
+                return -1;
+            }
+            lru_.splice (lru_.begin (), lru_, entry);
+            int cached_fd = dup (entry->fd);
+            if (cached_fd == -1)
+                return -1;
+            length = entry->length;
+            Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_HITS);
+            return cached_fd;
+        }
+        Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_MISSES);
+        if (generating_ >= MAX_TRANSFORM_GENERATING)
+            return -1;
+        ++generating_;
+        generation = generation_;
+        lru_.push_front (Entry { key, -1, 0, generation });
+        entries_[key] = lru_.begin ();
+    }
+    Compress_Pool::instance ()->submit ([this, path, file_key, key, generate, generation] {
+        generate_entry (path, file_key, key, generate, generation);
+    });
+    return -1;
+}
+
+void Transform_Cache::generate_entry (const std::string &path, const std::string &file_key,
+                                      const std::string &key, const Transform_Function &generate,
+                                      unsigned generation)
+{
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> guard (lock_);
+        dir = dir_;
+    }
+    int des_fd = -1;
+    off_t length = 0;
+    // a file of a memory mount is reached through Vfs as the transfers reach it
+    int src_fd = Vfs::instance ()->open (path, O_RDONLY, 0);
+    if (src_fd != -1)
+    {
+        struct stat file_stat;
+        // the file must be the version the key names, before and after the transform
+        if (fstat (src_fd, &file_stat) == 0 && make_key (file_stat, "") == file_key)
+            des_fd = create_output (dir);
+        if (des_fd != -1 && generate (src_fd, des_fd) == 0 && 
+            fstat (src_fd, &file_stat) == 0 && make_key (file_stat, "") == file_key)
+            length = lseek (des_fd, 0, SEEK_END);
+        else if (des_fd != -1)
+        {
+            close (des_fd);
+            des_fd = -1;
+        }
+        close (src_fd);
+    }
+
+    std::lock_guard<std::mutex> guard (lock_);
+    --generating_;
+    auto ite = entries_.find (key);
+    if (generation != generation_ || ite == entries_.end () || des_fd == -1 || length <= 0 ||
+        length > max_bytes_)
+    {
+        if (ite != entries_.end () && ite->second->generation == generation && ite->second->fd == -1)
+        {
+            lru_.erase (ite->second);
+            entries_.erase (ite);
+        }
+        if (des_fd != -1)
+            close (des_fd);
+        if (des_fd == -1)
+            FTP_LOG (LOG_LEVEL_INFO, "transform %s failed\n", path.c_str ());
+        return;
+    }
+    ite->second->fd = des_fd;
+    ite->second->length = length;
+    total_bytes_ += length;
+    Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_BYTES, length);
+    evict ();
+}
+
+int Transform_Cache::create_output (const std::string &dir)
+{
+    if (dir.empty ())
+        return memfd_create ("ftpd-transform", MFD_CLOEXEC);
+    int fd = open (dir.c_str (), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+        return fd;
+    // file systems without O_TMPFILE
+    std::string name = dir + "/ftpd-transform-XXXXXX";
+    fd = mkostemp (&name[0], O_CLOEXEC);
+    if (fd != -1)
+        unlink (name.c_str ());
+    return fd;
+}
+
+void Transform_Cache::evict ()
+{
+    for (auto entry = lru_.end (); total_bytes_ > max_bytes_ && entry != lru_.begin (); )
+    {
+        --entry;
+        if (entry->fd == -1)
+            continue;
+        total_bytes_ -= entry->length;
+        Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_BYTES, -entry->length);
+        close (entry->fd);
+        entries_.erase (entry->key);
+        entry = lru_.erase (entry);
+    }
+}
+
+void Transform_Cache::clear ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    for (Entry &entry : lru_)
+        if (entry.fd != -1)
+            close (entry.fd);
+    Metrics::instance ()->add (Metric_Counters::METRIC_TRANSFORM_CACHE_BYTES, -total_bytes_);
+    lru_.clear ();
+    entries_.clear ();
+    total_bytes_ = 0;
+    ++generation_;
+}
+
+Transform_Cache::~Transform_Cache ()
+{
+    // Metrics may be gone at exit, only the descriptors are released
+    for (Entry &entry : lru_)
+        if (entry.fd != -1)
+            close (entry.fd);
+}
+
+long long Transform_Cache::size ()
+{
+    std::lock_guard<std::mutex> guard (lock_);
+    return total_bytes_;
+}
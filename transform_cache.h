@@ -0,0 +1,139 @@
+#ifndef TRANSFORM_CACHE_H
+#define TRANSFORM_CACHE_H
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+#define DEFAULT_TRANSFORM_CACHE_MB 64
+#define TRANSFORM_CACHE_MIN_FILE (64 * 1024)    // smaller files are transformed per transfer
+#define MAX_TRANSFORM_GENERATING 2              // outputs generated at once, the other compress workers serve transfers
+
+/**
+ * Writes the transformed content of src_fd to des_fd, returns 0 for success, -1 for failure
+ */
+typedef std::function<int (int src_fd, int des_fd)> Transform_Function;
+
+/**
+ * Transformed file contents, such as the MODE Z stream of a file, kept so a
+ * popular file is transformed once and then sent with sendfile like a plain
+ * RETR. An entry is keyed by the device, inode, mtime and size of the file and
+ * the transform name, so a changed file misses and its old entries age out.
+ *
+ * The first request of a file misses and schedules the transform on
+ * Compress_Pool, the transfer itself transforms as without the cache. Outputs
+ * live in unlinked files of the scratch directory, or in memory when it is not
+ * set, and the least recently used ones are dropped beyond the size limit. A
+ * hit hands out a duplicated descriptor, so dropping an entry never disturbs
+ * a transfer reading it.
+ */
+class Transform_Cache
+{
+public:
+    /**
+     * @brief Get the process-wide transform cache
+     *
+     * @return Transform_Cache*
+     */
+    static Transform_Cache *instance ();
+
+    /**
+     * @brief Set the scratch directory and the size limit
+     *
+     * @param dir directory of the outputs, empty for memory
+     * @param max_bytes size limit of the outputs, 0 disables the cache
+     */
+    void configure (const std::string &dir, long long max_bytes);
+
+    /**
+     * @brief Find the transformed content of an open file, a miss schedules
+     *        generating it in the background
+     *
+     * @param path path of the file, reopened through Vfs by the generation so it holds no
+     *             lock of the caller
+     * @param fd the open file
+     * @param transform name of the transform and its parameters, such as "deflate-6" or "ascii-crlf"
+     * @param generate the transform, called on a worker on a miss
+     * @param length length of the transformed content on a hit
+     * @return int , a descriptor of the content owned by the caller, -1 for a miss
+     */
+    int lookup (const std::string &path, int fd, const std::string &transform,
+                const Transform_Function &generate, off_t &length);
+
+    /**
+     * @brief Drop every entry, generations in flight are discarded when they finish
+     */
+    void clear ();
+
+    /**
+     * @brief Get the total length of the outputs kept
+     *
+     * @return long long
+     */
+    long long size ();
+
+    ~Transform_Cache ();
+
+private:
+    struct Entry
+    {
+        std::string key;        // make_key () of the source and the transform
+        int fd;                 // the output, -1 while generating
+        off_t length;           // length of the output
+        unsigned generation;    // generation_ when it was scheduled
+    };
+
+    Transform_Cache () : max_bytes_ (DEFAULT_TRANSFORM_CACHE_MB * 1024LL * 1024), total_bytes_ (0),
+                         generating_ (0), generation_ (0) {}
+
+    /**
+     * @brief Build the key of a file version and a transform
+     *
+     * @param file_stat
+     * @param transform
+     * @return std::string
+     */
+    static std::string make_key (const struct stat &file_stat, const std::string &transform);
+
+    /**
+     * @brief Run a transform into a new output and publish it, run by a worker
+     *
+     * @param path
+     * @param file_key make_key () of the source without the transform
+     * @param key
+     * @param generate
+     * @param generation generation_ when scheduled
+     */
+    void generate_entry (const std::string &path, const std::string &file_key,
+                         const std::string &key, const Transform_Function &generate,
+                         unsigned generation);
+
+    /**
+     * @brief Create an empty output in the scratch directory or in memory
+     *
+     * @param dir
+     * @return int , the descriptor, -1 for failure
+     */
+    static int create_output (const std::string &dir);
+
+    /**
+     * @brief Drop the least recently used outputs beyond max_bytes_, lock_ must be held
+     */
+    void evict ();
+
+    typedef std::list<Entry> Entry_List;
+
+    std::mutex lock_;                       // guards everything below
+    std::string dir_;                       // scratch directory, empty for memory
+    long long max_bytes_;                   // size limit of the outputs
+    long long total_bytes_;                 // length of the outputs kept
+    int generating_;                        // generations in flight
+    unsigned generation_;                   // bumped by clear (), older generations are discarded
+    Entry_List lru_;                        // most recently used first
+    std::unordered_map<std::string, Entry_List::iterator> entries_; // lru_ by key
+};
+
+#endif
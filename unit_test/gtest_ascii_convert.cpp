@@ -0,0 +1,95 @@
+#include "../ascii_convert.h"
+
+#include "gtest/gtest.h"
+
+#include <random>
+#include <string>
+
+static std::string reference_lf_to_crlf (const std::string &src)
+{
+    std::string des;
+    for (char c : src)
+    {
+        if (c == '\n')
+            des.push_back ('\r');
+        des.push_back (c);
+    }
+    return des;
+}
+
+static std::string reference_crlf_to_lf (const std::string &src)
+{
+    std::string des;
+    for (size_t i = 0; i < src.size (); ++i)
+        if (src[i] != '\r' || i + 1 == src.size () || src[i + 1] != '\n')
+            des.push_back (src[i]);
+    return des;
+}
+
+/**
+ * @brief Convert src in pieces of random length, as received from the network
+ */
+static std::string convert_pieces (const std::string &src, std::mt19937 &random)
+{
+    std::string des;
+    bool is_cr_pending = false;
+    for (size_t pos = 0; pos < src.size (); )
+    {
+        size_t length = std::min ((size_t)(random () % 70 + 1), src.size () - pos);
+        std::string piece (length + 1, '\0');
+        piece.resize (crlf_to_lf (src.data () + pos, length, &piece[0], is_cr_pending));
+        des += piece;
+        pos += length;
+    }
+    if (is_cr_pending)
+        des.push_back ('\r');
+    return des;
+}
+
+TEST(ascii_convert_test, simple)
+{
+    std::string src = "a\nbc\n\nd";
+    std::string des (src.size () * 2, '\0');
+    des.resize (lf_to_crlf (src.data (), src.size (), &des[0]));
+    EXPECT_EQ ("a\r\nbc\r\n\r\nd", des);
+
+    // 单独的 CR 保留, 跨越两次调用的 CRLF 也被转换
+    bool is_cr_pending = false;
+    std::string back (des.size () + 1, '\0');
+    back.resize (crlf_to_lf ("x\ry\r", 4, &back[0], is_cr_pending));
+    EXPECT_EQ ("x\ry", back);
+    EXPECT_TRUE (is_cr_pending);
+    back.resize (3);
+    back.resize (crlf_to_lf ("\nz", 2, &back[0], is_cr_pending));
+    EXPECT_EQ ("\nz", back);
+    EXPECT_FALSE (is_cr_pending);
+}
+
+TEST(ascii_convert_test, every_isa_matches_reference)
+{
+    // 随机内容覆盖向量边界上的换行和 CR
+    std::mt19937 random (1);
+    const char alphabet[] = { 'a', 'b', '\r', '\n' };
+    for (const char *isa : { "scalar", "sse2", "avx2" })
+    {
+        if (ascii_convert_select (isa) == -1)
+            continue;
+        for (int round = 0; round < 500; ++round)
+        {
+            std::string src (random () % 300, '\0');
+            for (char &c : src)
+                c = alphabet[random () % 4];
+            std::string des (src.size () * 2, '\0');
+            des.resize (lf_to_crlf (src.data (), src.size (), &des[0]));
+            EXPECT_EQ (reference_lf_to_crlf (src), des) << isa;
+            EXPECT_EQ (reference_crlf_to_lf (src), convert_pieces (src, random)) << isa;
+        }
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+// g++ ../ascii_convert.cpp gtest_ascii_convert.cpp -o test_ascii_convert -lgtest -lpthread
@@ -0,0 +1,216 @@
+#include "../command_handler.h"
+#include "../data_handler.h"
+#include "../server_config.h"
+#include "../tls_session.h"
+#include "../transform_cache.h"
+
+#include "ace/Reactor.h"
+
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+
+#define TEST_FILE_SIZE 300000      // beyond TRANSFORM_CACHE_MIN_FILE and several deflate blocks
+
+/**
+ * @brief Write a self-signed certificate and its key into dir and load them into Tls_Context,
+ *        records stay in user space
+ */
+static bool open_tls_context (const std::string &dir)
+{
+    EVP_PKEY *key = EVP_EC_gen ("prime256v1");
+    X509 *cert = X509_new ();
+    if (key == nullptr || cert == nullptr)
+        return false;
+    ASN1_INTEGER_set (X509_get_serialNumber (cert), 1);
+    X509_gmtime_adj (X509_getm_notBefore (cert), 0);
+    X509_gmtime_adj (X509_getm_notAfter (cert), 3600);
+    X509_set_pubkey (cert, key);
+    X509_NAME_add_entry_by_txt (X509_get_subject_name (cert), "CN", MBSTRING_ASC,
+                                (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name (cert, X509_get_subject_name (cert));
+    X509_sign (cert, key, EVP_sha256 ());
+
+    std::string cert_file = dir + "/cert.pem";
+    FILE *file = fopen (cert_file.c_str (), "w");
+    PEM_write_X509 (file, cert);
+    PEM_write_PrivateKey (file, key, nullptr, nullptr, 0, nullptr, nullptr);
+    fclose (file);
+    X509_free (cert);
+    EVP_PKEY_free (key);
+
+    Server_Config::instance ()->set ("tls_cert_file", cert_file);
+    Server_Config::instance ()->set ("tls_ktls", "0");
+    return Tls_Context::instance ()->open () == 0;
+}
+
+/**
+ * @brief Read the whole data connection as an FTPS client does
+ */
+static std::string tls_client_read (int fd)
+{
+    SSL_CTX *ctx = SSL_CTX_new (TLS_client_method ());
+    SSL *ssl = SSL_new (ctx);
+    SSL_set_fd (ssl, fd);
+    std::string received;
+    if (SSL_connect (ssl) == 1)
+    {
+        char buf[16384];
+        size_t length = 0;
+        while (SSL_read_ex (ssl, buf, sizeof (buf), &length) == 1)
+            received.append (buf, length);
+    }
+    SSL_free (ssl);
+    SSL_CTX_free (ctx);
+    return received;
+}
+
+static std::string inflate_all (const std::string &src)
+{
+    z_stream stream = {};
+    std::string des;
+    if (inflateInit (&stream) != Z_OK)
+        return des;
+    stream.next_in = (Bytef *)src.data ();
+    stream.avail_in = src.size ();
+    char buf[16384];
+    int result;
+    do
+    {
+        stream.next_out = (Bytef *)buf;
+        stream.avail_out = sizeof (buf);
+        result = inflate (&stream, Z_NO_FLUSH);
+        des.append (buf, sizeof (buf) - stream.avail_out);
+    }
+    while (result == Z_OK);
+    inflateEnd (&stream);
+    return result == Z_STREAM_END ? des : "inflate failed";
+}
+
+/**
+ * @brief RETR a file under PROT P, the handler driven by hand instead of the reactor
+ */
+static std::string retrieve (const std::string &path, int type, int mode)
+{
+    int fds[2];
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return "";
+    ACE_Reactor reactor;
+    Command_Handler *owner = new Command_Handler (&reactor);
+    Data_Handler *data_handler = new Data_Handler (&reactor, type);
+    data_handler->get_data_link ().set_handle (fds[0]);
+    data_handler->set_mode (mode, DEFAULT_DEFLATE_LEVEL);
+    data_handler->set_file_path (path);
+    std::string received;
+    std::thread client ([&received, &fds] { received = tls_client_read (fds[1]); });
+
+    data_handler->start_tls ("test");
+    EXPECT_EQ (0, data_handler->file_link_init (true));
+    EXPECT_EQ (0, data_handler->send_file (owner));
+    while (data_handler->is_busy ())
+    {
+        struct pollfd poll_fd = { fds[0], POLLIN | POLLOUT, 0 };
+        poll (&poll_fd, 1, 100);
+        data_handler->handle_output ();
+    }
+    // close_notify ends the client's stream
+    data_handler->remove_reference ();
+    client.join ();
+    close (fds[1]);
+    owner->remove_reference ();
+    return mode == Data_Modes::COMPRESSED ? inflate_all (received) : received;
+}
+
+static std::string retrieve_compressed (const std::string &path)
+{
+    return retrieve (path, Data_Types::IMAGE, Data_Modes::COMPRESSED);
+}
+
+static std::string retrieve_ascii (const std::string &path)
+{
+    return retrieve (path, Data_Types::ASCII, Data_Modes::STREAM);
+}
+
+class data_handler_test : public ::testing::Test
+{
+protected:
+    static void SetUpTestCase ()
+    {
+        char dir[] = "/tmp/gtest_data_handler_XXXXXX";
+        dir_ = mkdtemp (dir);
+        ASSERT_TRUE (open_tls_context (dir_));
+        path_ = dir_ + "/file.txt";
+        for (int i = 0; content_.size () < TEST_FILE_SIZE; ++i)
+            content_ += "line " + std::to_string (i * 7919 % 10007) + " of the file\n";
+        FILE *file = fopen (path_.c_str (), "w");
+        fwrite (content_.data (), 1, content_.size (), file);
+        fclose (file);
+        for (char c : content_)
+        {
+            if (c == '\n')
+                crlf_content_ += '\r';
+            crlf_content_ += c;
+        }
+    }
+
+    static void TearDownTestCase ()
+    {
+        Tls_Context::instance ()->close ();
+        unlink (path_.c_str ());
+        unlink ((dir_ + "/cert.pem").c_str ());
+        rmdir (dir_.c_str ());
+    }
+
+    static std::string dir_;
+    static std::string path_;
+    static std::string content_;
+    static std::string crlf_content_;
+};
+
+std::string data_handler_test::dir_;
+std::string data_handler_test::path_;
+std::string data_handler_test::content_;
+std::string data_handler_test::crlf_content_;
+
+TEST_F(data_handler_test, compressed_tls_cache_miss)
+{
+    // 关闭 Transform_Cache, 由 Parallel_Deflate 压缩后经用户态 TLS 发送
+    Transform_Cache::instance ()->configure ("", 0);
+    EXPECT_EQ (content_, retrieve_compressed (path_));
+}
+
+TEST_F(data_handler_test, compressed_tls_cache_hit)
+{
+    // 第一次传输生成缓存 (未启动 Compress_Pool 时在本线程生成), 第二次从缓存读取压缩结果
+    Transform_Cache::instance ()->configure ("", 64LL * 1024 * 1024);
+    EXPECT_EQ (content_, retrieve_compressed (path_));
+    ASSERT_GT (Transform_Cache::instance ()->size (), 0);
+    EXPECT_EQ (content_, retrieve_compressed (path_));
+    Transform_Cache::instance ()->clear ();
+}
+
+TEST_F(data_handler_test, ascii_tls_cache_miss)
+{
+    Transform_Cache::instance ()->configure ("", 0);
+    EXPECT_EQ (crlf_content_, retrieve_ascii (path_));
+}
+
+TEST_F(data_handler_test, ascii_tls_cache_hit)
+{
+    // 第二次从 "ascii-crlf" 缓存读取已转换的内容, 不再逐块转换
+    Transform_Cache::instance ()->configure ("", 64LL * 1024 * 1024);
+    EXPECT_EQ (crlf_content_, retrieve_ascii (path_));
+    ASSERT_GT (Transform_Cache::instance ()->size (), 0);
+    EXPECT_EQ (crlf_content_, retrieve_ascii (path_));
+    Transform_Cache::instance ()->clear ();
+}
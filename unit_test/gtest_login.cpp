@@ -2,6 +2,8 @@
 
 #include "gtest/gtest.h"
 
+#include <fstream>
+
 TEST(user_test, login)
 {
     User_Inf user;
@@ -23,9 +25,46 @@ TEST(user_test, login)
     EXPECT_EQ (0, user.check_password("123456"));
 }
 
+TEST(user_test, scrypt)
+{
+    std::string hash;
+    EXPECT_EQ (0, User_Inf::hash_password("123456", hash));
+
+    // 每次使用不同的盐
+    std::string other_hash;
+    User_Inf::hash_password("123456", other_hash);
+    EXPECT_NE (hash, other_hash);
+
+    EXPECT_EQ (0, User_Inf::verify_password("123456", hash));
+    EXPECT_EQ (-1, User_Inf::verify_password("111111", hash));
+    EXPECT_EQ (-1, User_Inf::verify_password("123456", "$scrypt$14$8$1$00$00"));
+}
+
+TEST(user_test, reload)
+{
+    User_Inf user;
+    User_Inf::read_passwords();
+    EXPECT_EQ (0, user.check_username("fuzhihao"));
+
+    // 重新加载后用户已被删除
+    std::string hash;
+    user.sha256 (std::string ("654321") + SALT, hash);
+    std::ofstream ("./users_reload.txt") << "other " << hash << "\n";
+    Credential_Store::instance ()->set_path ("./users_reload.txt");
+    EXPECT_EQ (1, Credential_Store::instance ()->reload ());
+    EXPECT_EQ (-1, user.check_password("123456"));
+    EXPECT_EQ (-1, user.check_username("fuzhihao"));
+    EXPECT_EQ (0, user.check_username("other"));
+    EXPECT_EQ (0, user.check_password("654321"));
+
+    Credential_Store::instance ()->set_path ("./users.txt");
+    Credential_Store::instance ()->reload ();
+    remove ("./users_reload.txt");
+}
+
 int main (int argc, char *argv[])
 {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
-// g++ ../user_inf.cpp gtest_login.cpp -o test -lgtest -lpthread -lACE -lssl -lcrypto
\ No newline at end of file
+// g++ -I.. ../user_inf.cpp ../credential_store.cpp ../async_log.cpp gtest_login.cpp -o test -lgtest -lpthread -lACE -lssl -lcrypto
\ No newline at end of file
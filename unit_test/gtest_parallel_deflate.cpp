@@ -0,0 +1,113 @@
+#include "../parallel_deflate.h"
+
+#include "gtest/gtest.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+
+/**
+ * @brief Sizes around the block boundaries, a few lines of text repeated
+ *        with numbers so the stream is neither trivial nor incompressible
+ */
+static const size_t test_sizes[] = { 0, 1, 1000, DEFLATE_BLOCK_SIZE - 1, DEFLATE_BLOCK_SIZE,
+                                     DEFLATE_BLOCK_SIZE + 1, 5000000 };
+
+static std::string make_content (size_t size)
+{
+    std::string content;
+    for (unsigned i = 0; content.size () < size; ++i)
+        content += "block " + std::to_string (i * 2654435761u % 100003) + " of the test file\n";
+    content.resize (size);
+    return content;
+}
+
+static int make_file (const std::string &content)
+{
+    FILE *file = tmpfile ();
+    fwrite (content.data (), 1, content.size (), file);
+    fflush (file);
+    return dup (fileno (file));
+}
+
+static std::string uncompress_all (const std::string &src, size_t size)
+{
+    std::string des (size + 1, '\0');
+    uLongf length = des.size ();
+    if (uncompress ((Bytef *)&des[0], &length, (const Bytef *)src.data (), src.size ()) != Z_OK)
+        return "uncompress failed";
+    des.resize (length);
+    return des;
+}
+
+/**
+ * @brief Take the whole stream of a Parallel_Deflate as the data handler does,
+ *        waiting while the next block is compressed
+ */
+static std::string parallel_deflate (int fd)
+{
+    auto deflate = std::make_shared<Parallel_Deflate> (fd, DEFAULT_DEFLATE_LEVEL, [] {});
+    std::string out;
+    if (deflate->start () == -1)
+        return out;
+    int result;
+    while ((result = deflate->next (out)) != Deflate_Results::DEFLATE_END)
+    {
+        if (result == Deflate_Results::DEFLATE_FAILED)
+            return "";
+        if (result == Deflate_Results::DEFLATE_PENDING)
+            while (!deflate->is_ready ())
+                std::this_thread::yield ();
+    }
+    return out;
+}
+
+static void check_sizes ()
+{
+    for (size_t size : test_sizes)
+    {
+        SCOPED_TRACE (size);
+        std::string content = make_content (size);
+        int fd = make_file (content);
+        ASSERT_NE (-1, fd);
+
+        EXPECT_EQ (content, uncompress_all (parallel_deflate (fd), size));
+
+        FILE *output = tmpfile ();
+        ASSERT_EQ (0, deflate_file (fd, DEFAULT_DEFLATE_LEVEL, fileno (output)));
+        std::string compressed;
+        char buf[16384];
+        size_t length;
+        rewind (output);
+        while ((length = fread (buf, 1, sizeof (buf), output)) > 0)
+            compressed.append (buf, length);
+        fclose (output);
+        EXPECT_EQ (content, uncompress_all (compressed, size));
+        close (fd);
+    }
+}
+
+TEST(parallel_deflate_test, inline_blocks)
+{
+    // 未启动 Compress_Pool 时各块在调用线程压缩
+    check_sizes ();
+}
+
+TEST(parallel_deflate_test, pool_blocks)
+{
+    // 各块在多个工作线程并行压缩, 输出仍按顺序拼成一个 zlib 流
+    ASSERT_EQ (0, Compress_Pool::instance ()->open (4));
+    check_sizes ();
+    Compress_Pool::instance ()->close ();
+}
+
+TEST(parallel_deflate_test, deflate_buffer)
+{
+    std::string content = make_content (DEFLATE_BLOCK_SIZE + 1);
+    std::string compressed;
+    ASSERT_EQ (0, deflate_buffer (content, DEFAULT_DEFLATE_LEVEL, compressed));
+    EXPECT_EQ (content, uncompress_all (compressed, content.size ()));
+}
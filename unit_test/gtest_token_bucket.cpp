@@ -0,0 +1,56 @@
+#include "../token_bucket.h"
+
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <climits>
+#include <thread>
+
+TEST(token_bucket_test, unlimited)
+{
+    Token_Bucket bucket;
+
+    // 不限速时总是可用
+    EXPECT_EQ (LONG_MAX, bucket.available ());
+    bucket.take (1L << 30);
+    EXPECT_EQ (LONG_MAX, bucket.available ());
+    EXPECT_EQ (0, bucket.usec_until (1L << 30));
+}
+
+TEST(token_bucket_test, burst_and_refill)
+{
+    Token_Bucket bucket (1000000, 100000);
+
+    // 初始为满桶
+    EXPECT_EQ (100000, bucket.available ());
+
+    // 透支后需要等待
+    bucket.take (150000);
+    EXPECT_LT (bucket.available (), 0);
+    EXPECT_GT (bucket.usec_until (10000), 50000);
+
+    // 按速率补充
+    std::this_thread::sleep_for (std::chrono::milliseconds (100));
+    EXPECT_GE (bucket.available (), 40000);
+}
+
+TEST(token_bucket_test, set_rate)
+{
+    Token_Bucket bucket (1000000, 100000);
+
+    // 降低速率时令牌不超过新的桶大小
+    bucket.set_rate (1000, 20000);
+    EXPECT_EQ (1000, bucket.get_rate ());
+    EXPECT_LE (bucket.available (), 20000);
+
+    // 取消限速
+    bucket.set_rate (0);
+    EXPECT_EQ (LONG_MAX, bucket.available ());
+}
+
+int main (int argc, char *argv[])
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+// g++ ../token_bucket.cpp gtest_token_bucket.cpp -o test_token_bucket -lgtest -lpthread
@@ -0,0 +1,238 @@
+#include "../memory_vfs.h"
+#include "../vfs.h"
+
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+/**
+ * A backend remembering the paths it is called with, so a test sees which
+ * mount Vfs resolved a path to and what the path became inside it.
+ */
+class Recording_Vfs : public Vfs_Backend
+{
+public:
+    virtual int open (const std::string &path, int, mode_t) { return record (path); }
+    virtual int stat (const std::string &path, struct stat &) { return record (path); }
+    virtual int lstat (const std::string &path, struct stat &) { return record (path); }
+    virtual int rename (const std::string &old_path, const std::string &new_path)
+    {
+        record (old_path);
+        return record (new_path);
+    }
+    virtual int remove (const std::string &path) { return record (path); }
+    virtual int mkdir (const std::string &path, mode_t) { return record (path); }
+    virtual int rmdir (const std::string &path) { return record (path); }
+    virtual int list (const std::string &path, std::vector<Vfs_Entry> &) { return record (path); }
+
+    std::string last_path;
+
+private:
+    int record (const std::string &path)
+    {
+        last_path = path;
+        return 0;
+    }
+};
+
+/**
+ * @brief Stat a path through Vfs, get the path the backend saw, empty when
+ *        another backend got it; Vfs is process-wide and mounts never go
+ *        away, so every test mounts under a prefix of its own
+ */
+static std::string stat_path (const std::shared_ptr<Recording_Vfs> &backend, const std::string &path)
+{
+    struct stat file_stat;
+    backend->last_path.clear ();
+    if (Vfs::instance ()->stat (path, file_stat) != 0)
+        return "";
+    return backend->last_path;
+}
+
+TEST(vfs_test, longest_prefix)
+{
+    auto data = std::make_shared<Recording_Vfs> ();
+    auto sub = std::make_shared<Recording_Vfs> ();
+    Vfs::instance ()->mount ("/prefix/data", data);
+    Vfs::instance ()->mount ("/prefix/data/sub/", sub);
+
+    // 最长的挂载点优先
+    EXPECT_EQ ("/file", stat_path (sub, "/prefix/data/sub/file"));
+    EXPECT_EQ ("/", stat_path (sub, "/prefix/data/sub"));
+    EXPECT_EQ ("/other/file", stat_path (data, "/prefix/data/other/file"));
+    EXPECT_EQ ("/", stat_path (data, "/prefix/data/"));
+
+    // 只按完整的路径分量匹配
+    EXPECT_EQ ("/subway", stat_path (data, "/prefix/data/subway"));
+    EXPECT_TRUE (Vfs::instance ()->is_local ("/prefix/database"));
+    EXPECT_TRUE (Vfs::instance ()->is_local ("/prefix"));
+    EXPECT_FALSE (Vfs::instance ()->is_local ("/prefix/data"));
+
+    // 重复的斜杠和 "." 不影响匹配
+    EXPECT_EQ ("/a/b", stat_path (sub, "//prefix/./data//sub/a/./b/"));
+}
+
+TEST(vfs_test, dot_dot)
+{
+    auto data = std::make_shared<Recording_Vfs> ();
+    auto sub = std::make_shared<Recording_Vfs> ();
+    Vfs::instance ()->mount ("/dotdot/data", data);
+    Vfs::instance ()->mount ("/dotdot/data/sub", sub);
+
+    // ".." 先于匹配解析, 可以离开挂载点
+    EXPECT_EQ ("/file", stat_path (data, "/dotdot/data/sub/../file"));
+    EXPECT_EQ ("/file", stat_path (sub, "/dotdot/data/other/../sub/file"));
+    EXPECT_TRUE (Vfs::instance ()->is_local ("/dotdot/data/../file"));
+    EXPECT_TRUE (Vfs::instance ()->is_local ("/dotdot/data/sub/../../file"));
+
+    // 根目录之上的 ".." 停在根目录
+    EXPECT_EQ ("/file", stat_path (sub, "/../../dotdot/data/sub/file"));
+    EXPECT_EQ ("/", stat_path (data, "/dotdot/data/sub/.."));
+}
+
+TEST(vfs_test, relative_path)
+{
+    auto data = std::make_shared<Recording_Vfs> ();
+    Vfs::instance ()->mount ("/relative/data", data);
+
+    // 相对路径总是交给本地文件系统
+    EXPECT_TRUE (Vfs::instance ()->is_local ("relative/data/file"));
+    EXPECT_TRUE (Vfs::instance ()->is_local ("data/file"));
+    EXPECT_TRUE (Vfs::instance ()->is_local (""));
+    EXPECT_EQ ("", stat_path (data, "relative/data/file"));
+}
+
+TEST(vfs_test, rename_across_mounts)
+{
+    auto data = std::make_shared<Recording_Vfs> ();
+    auto sub = std::make_shared<Recording_Vfs> ();
+    Vfs::instance ()->mount ("/rename/data", data);
+    Vfs::instance ()->mount ("/rename/data/sub", sub);
+
+    // 跨挂载点重命名失败, errno 为 EXDEV
+    errno = 0;
+    EXPECT_EQ (-1, Vfs::instance ()->rename ("/rename/data/file", "/rename/data/sub/file"));
+    EXPECT_EQ (EXDEV, errno);
+    errno = 0;
+    EXPECT_EQ (-1, Vfs::instance ()->rename ("/rename/data/file", "/rename/file"));
+    EXPECT_EQ (EXDEV, errno);
+
+    // 同一挂载点内交给其后端
+    EXPECT_EQ (0, Vfs::instance ()->rename ("/rename/data/a", "/rename/data/sub/../b"));
+    EXPECT_EQ ("/b", data->last_path);
+}
+
+static std::string read_all (int fd)
+{
+    std::string content;
+    char buf[256];
+    ssize_t read_count;
+    while ((read_count = pread (fd, buf, sizeof (buf), content.size ())) > 0)
+        content.append (buf, read_count);
+    return content;
+}
+
+TEST(memory_vfs_test, open_flags)
+{
+    Memory_Vfs vfs;
+
+    // 不存在的文件需要 O_CREAT
+    EXPECT_EQ (-1, vfs.open ("/file", O_RDWR, 0644));
+    EXPECT_EQ (ENOENT, errno);
+    int fd = vfs.open ("/file", O_RDWR | O_CREAT | O_EXCL, 0644);
+    ASSERT_NE (-1, fd);
+    ASSERT_EQ (5, pwrite (fd, "hello", 5, 0));
+
+    // O_EXCL 不打开已存在的文件
+    EXPECT_EQ (-1, vfs.open ("/file", O_RDWR | O_CREAT | O_EXCL, 0644));
+    EXPECT_EQ (EEXIST, errno);
+
+    // 再次打开看到同一内容
+    int read_fd = vfs.open ("/file", O_RDONLY, 0);
+    ASSERT_NE (-1, read_fd);
+    EXPECT_EQ ("hello", read_all (read_fd));
+
+    // O_TRUNC 清空内容, 已打开的描述符也看到
+    int trunc_fd = vfs.open ("/file", O_RDWR | O_TRUNC, 0);
+    ASSERT_NE (-1, trunc_fd);
+    struct stat file_stat;
+    ASSERT_EQ (0, vfs.stat ("/file", file_stat));
+    EXPECT_EQ (0, file_stat.st_size);
+    EXPECT_EQ ("", read_all (read_fd));
+
+    // 目录不能作为文件打开
+    ASSERT_EQ (0, vfs.mkdir ("/dir", 0755));
+    EXPECT_EQ (-1, vfs.open ("/dir", O_RDONLY, 0));
+    EXPECT_EQ (EISDIR, errno);
+    close (fd);
+    close (read_fd);
+    close (trunc_fd);
+}
+
+TEST(memory_vfs_test, rename)
+{
+    Memory_Vfs vfs;
+    ASSERT_EQ (0, vfs.mkdir ("/dir", 0755));
+    int fd = vfs.open ("/dir/old", O_RDWR | O_CREAT, 0644);
+    ASSERT_NE (-1, fd);
+    ASSERT_EQ (3, pwrite (fd, "old", 3, 0));
+    close (fd);
+    fd = vfs.open ("/new", O_RDWR | O_CREAT, 0644);
+    ASSERT_NE (-1, fd);
+    close (fd);
+
+    // 移动到另一目录并替换已有文件
+    ASSERT_EQ (0, vfs.rename ("/dir/old", "/new"));
+    struct stat file_stat;
+    EXPECT_EQ (-1, vfs.stat ("/dir/old", file_stat));
+    EXPECT_EQ (ENOENT, errno);
+    ASSERT_EQ (0, vfs.stat ("/new", file_stat));
+    EXPECT_EQ (3, file_stat.st_size);
+
+    // 文件不能替换目录, 目录不能移入自身
+    EXPECT_EQ (-1, vfs.rename ("/new", "/dir"));
+    EXPECT_EQ (EISDIR, errno);
+    EXPECT_EQ (-1, vfs.rename ("/dir", "/dir/inner"));
+    EXPECT_EQ (EINVAL, errno);
+
+    // 目录连同其内容一起移动
+    fd = vfs.open ("/dir/file", O_RDWR | O_CREAT, 0644);
+    ASSERT_NE (-1, fd);
+    close (fd);
+    ASSERT_EQ (0, vfs.rename ("/dir", "/moved"));
+    EXPECT_EQ (0, vfs.stat ("/moved/file", file_stat));
+    EXPECT_EQ (-1, vfs.stat ("/dir", file_stat));
+}
+
+TEST(memory_vfs_test, rmdir)
+{
+    Memory_Vfs vfs;
+    ASSERT_EQ (0, vfs.mkdir ("/dir", 0755));
+    ASSERT_EQ (0, vfs.mkdir ("/dir/sub", 0755));
+
+    // 非空目录不能删除
+    EXPECT_EQ (-1, vfs.rmdir ("/dir"));
+    EXPECT_EQ (ENOTEMPTY, errno);
+    EXPECT_EQ (-1, vfs.remove ("/dir"));
+    EXPECT_EQ (ENOTEMPTY, errno);
+
+    int fd = vfs.open ("/dir/sub/file", O_RDWR | O_CREAT, 0644);
+    ASSERT_NE (-1, fd);
+    close (fd);
+    EXPECT_EQ (-1, vfs.rmdir ("/dir/sub"));
+    EXPECT_EQ (ENOTEMPTY, errno);
+    EXPECT_EQ (-1, vfs.rmdir ("/dir/sub/file"));
+    EXPECT_EQ (ENOTDIR, errno);
+
+    // 清空后可以逐级删除
+    EXPECT_EQ (0, vfs.remove ("/dir/sub/file"));
+    EXPECT_EQ (0, vfs.rmdir ("/dir/sub"));
+    EXPECT_EQ (0, vfs.rmdir ("/dir"));
+    std::vector<Vfs_Entry> entries;
+    ASSERT_EQ (0, vfs.list ("/", entries));
+    EXPECT_TRUE (entries.empty ());
+}
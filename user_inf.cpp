@@ -1,48 +1,52 @@
 #include "user_inf.h"
 
-#include "ace/Log_Msg.h"
-
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <sstream>
 
-const std::string User_Inf::passwords_file_path_ = "./users.txt";
-
-std::unordered_map<std::string, std::string> User_Inf::passwords_;
-
-int User_Inf::read_passwords ()
+static void to_hex (const unsigned char *data, size_t length, std::string &des)
 {
-    if (!passwords_.empty ())
-        return 0;
-    
-    std::ifstream file_stream;
-    file_stream.open (passwords_file_path_);
-    if (!file_stream.is_open ())
+    static const char digits[] = "0123456789abcdef";
+    des.resize (length * 2);
+    for (size_t i = 0; i < length; ++i)
     {
-        ACE_DEBUG ( (LM_DEBUG, "user information init failed.\n"));
-        return -1;
+        des[i * 2] = digits[data[i] >> 4];
+        des[i * 2 + 1] = digits[data[i] & 0xf];
     }
-    
-    std::string str_line;
-    while(std::getline (file_stream, str_line))
+}
+
+static int from_hex (const std::string &str, unsigned char *data, size_t length)
+{
+    if (str.length () != length * 2)
+        return -1;
+    for (size_t i = 0; i < length; ++i)
     {
-        if (str_line.empty ())
-            continue;
-        int pos = str_line.find (' ', 0);
-        std::string user = str_line.substr (0, pos);
-        std::string password = str_line.substr (pos+1);
-        ACE_DEBUG ( (LM_DEBUG, "%s\n", user.c_str ()));
-        ACE_DEBUG ( (LM_DEBUG, "%s\n", password.c_str ()));
-        passwords_[user] = password;
+        char byte[3] = { str[i * 2], str[i * 2 + 1], '\0' };
+        char *end = nullptr;
+        data[i] = (unsigned char)strtoul (byte, &end, 16);
+        if (end != byte + 2)
+            return -1;
     }
     return 0;
 }
 
+int User_Inf::read_passwords ()
+{
+    Credential_Store *store = Credential_Store::instance ();
+    if (store->size () != 0)
+        return 0;
+    return store->reload () == -1 ? -1 : 0;
+}
+
 int User_Inf::check_username (const std::string &username) 
 {   
-    auto ite = passwords_.find (username);
-    if (ite == passwords_.end ())
+    Credential_Store::Reader reader;
+    if (reader.find (username) == nullptr)
         return -1;
     else
     {
@@ -56,17 +60,84 @@ int User_Inf::check_password (const std::string &password)
     if (username_.length () == 0)
         return -1;
     
-    std::string pass_with_salt = password + SALT;
-    std::string pass_sha256;
-    sha256 (pass_with_salt, pass_sha256);
-    
-    if (pass_sha256 == passwords_[username_])
+    std::string stored;
     {
-        is_logged_in_ = true;
-        return 0;
+        // the user may have been removed by a reload since USER
+        Credential_Store::Reader reader;
+        const User_Entry *entry = reader.find (username_);
+        if (entry == nullptr)
+            return -1;
+        stored = entry->password;
     }
-    else 
+    if (verify_password (password, stored) == -1)
+        return -1;
+    return log_in ();
+}
+
+int User_Inf::log_in ()
+{
+    Credential_Store::Reader reader;
+    const User_Entry *entry = reader.find (username_);
+    if (entry == nullptr)
+        return -1;
+    is_logged_in_ = true;
+    rate_limit_ = entry->rate_limit;
+    class_name_ = entry->class_name;
+    weight_ = entry->weight;
+    return 0;
+}
+
+int User_Inf::hash_password (const std::string &password, std::string &des)
+{
+    unsigned char salt[SCRYPT_SALT_LENGTH];
+    unsigned char hash[SCRYPT_HASH_LENGTH];
+    if (RAND_bytes (salt, sizeof (salt)) != 1)
+        return -1;
+    if (EVP_PBE_scrypt (password.c_str (), password.length (), salt, sizeof (salt),
+                        1ULL << SCRYPT_LOG2_N, SCRYPT_R, SCRYPT_P, SCRYPT_MAX_MEM,
+                        hash, sizeof (hash)) != 1)
+        return -1;
+    std::string salt_hex, hash_hex;
+    to_hex (salt, sizeof (salt), salt_hex);
+    to_hex (hash, sizeof (hash), hash_hex);
+    des = SCRYPT_PREFIX + std::to_string (SCRYPT_LOG2_N) + "$" + std::to_string (SCRYPT_R) + "$" +
+          std::to_string (SCRYPT_P) + "$" + salt_hex + "$" + hash_hex;
+    return 0;
+}
+
+int User_Inf::verify_password (const std::string &password, const std::string &stored)
+{
+    if (stored.compare (0, strlen (SCRYPT_PREFIX), SCRYPT_PREFIX) != 0)
+    {
+        // legacy entry: sha256 of password with the shared SALT
+        std::string pass_sha256;
+        User_Inf ().sha256 (password + SALT, pass_sha256);
+        return (pass_sha256.length () == stored.length () &&
+                CRYPTO_memcmp (pass_sha256.data (), stored.data (), stored.length ()) == 0) ? 0 : -1;
+    }
+
+    // $scrypt$LOG2_N$R$P$SALT$HASH
+    std::istringstream fields (stored.substr (strlen (SCRYPT_PREFIX)));
+    std::string log2_n, r, p, salt_hex, hash_hex;
+    if (!std::getline (fields, log2_n, '$') || !std::getline (fields, r, '$') ||
+        !std::getline (fields, p, '$') || !std::getline (fields, salt_hex, '$') ||
+        !std::getline (fields, hash_hex))
+        return -1;
+    long n_bits = strtol (log2_n.c_str (), nullptr, 10);
+    unsigned long block_size = strtoul (r.c_str (), nullptr, 10);
+    unsigned long parallel = strtoul (p.c_str (), nullptr, 10);
+    unsigned char salt[SCRYPT_SALT_LENGTH];
+    unsigned char expected[SCRYPT_HASH_LENGTH];
+    unsigned char hash[SCRYPT_HASH_LENGTH];
+    if (n_bits < 1 || n_bits > 30 || block_size == 0 || parallel == 0 ||
+        from_hex (salt_hex, salt, sizeof (salt)) == -1 ||
+        from_hex (hash_hex, expected, sizeof (expected)) == -1)
+        return -1;
+    if (EVP_PBE_scrypt (password.c_str (), password.length (), salt, sizeof (salt),
+                        1ULL << n_bits, block_size, parallel, SCRYPT_MAX_MEM,
+                        hash, sizeof (hash)) != 1)
         return -1;
+    return CRYPTO_memcmp (hash, expected, sizeof (hash)) == 0 ? 0 : -1;
 }
 
 void User_Inf::sha256 (const std::string &src, std::string &des)
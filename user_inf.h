@@ -1,10 +1,18 @@
 #ifndef USER_INF_H
 #define USER_INF_H
 
+#include "credential_store.h"
+
 #include <string>
-#include <unordered_map>
 
 #define SALT "scutech"
+#define SCRYPT_PREFIX "$scrypt$"
+#define SCRYPT_LOG2_N 14            // cost, 2^14 blocks of 128 * r bytes, 16 MiB with r = 8
+#define SCRYPT_R 8
+#define SCRYPT_P 1
+#define SCRYPT_MAX_MEM (64 * 1024 * 1024)
+#define SCRYPT_SALT_LENGTH 16
+#define SCRYPT_HASH_LENGTH 32
 
 class User_Inf
 {
@@ -13,7 +21,13 @@ public:
      * @brief Construct a new User_Inf object
      * 
      */
-    User_Inf () : is_logged_in_ (false), current_dir_ ("/home/scutech") {}
+    User_Inf () : 
+        is_logged_in_ (false),
+        current_dir_ ("/home/scutech"),
+        rate_limit_ (0),
+        class_name_ (DEFAULT_USER_CLASS),
+        weight_ (0)
+    {}
 
     /**
      * @brief Check whether user has logged in.
@@ -34,6 +48,8 @@ public:
 
     /**
      * @brief Check whether password is correct, if it's correct, log in.
+     *        The password hash is computed on the calling thread, the server
+     *        verifies through Auth_Pool instead.
      * 
      * @param password 
      * @return int , 0 for correct and log in successfully,
@@ -41,6 +57,14 @@ public:
      */
     int check_password (const std::string &password);
 
+    /**
+     * @brief Log in as the user set by check_username () once its password is
+     *        verified, take the settings of the user from the credential store
+     * 
+     * @return int , 0 for success, -1 for the user has been removed
+     */
+    int log_in ();
+
     /**
      * @brief Get the current working directory
      * 
@@ -55,6 +79,27 @@ public:
      */
     std::string get_user_name () { return username_; }
 
+    /**
+     * @brief Get the transfer rate limit of the logged in user
+     * 
+     * @return long bytes per second, 0 for unlimited
+     */
+    long get_rate_limit () { return rate_limit_; }
+
+    /**
+     * @brief Get the scheduling class of the logged in user
+     * 
+     * @return std::string class name
+     */
+    std::string get_class_name () { return class_name_; }
+
+    /**
+     * @brief Get the scheduling weight of the logged in user
+     * 
+     * @return long weight, 0 for the weight of its class
+     */
+    long get_weight () { return weight_; }
+
     /**
      * @brief Get the old file name, ftp RNFR command sets it
      * 
@@ -86,7 +131,29 @@ public:
     void sha256(const std::string &str, std::string &des);
 
     /**
-     * @brief Read valid username and password to passwords_
+     * @brief Hash a password with scrypt and a random salt, the result is
+     *        "$scrypt$LOG2_N$R$P$SALT$HASH" with salt and hash in hex
+     * 
+     * @param password 
+     * @param des 
+     * @return int , 0 for success, -1 for failure
+     */
+    static int hash_password (const std::string &password, std::string &des);
+
+    /**
+     * @brief Check a password against a stored hash, either made by
+     *        hash_password () or the legacy sha256 of password with SALT.
+     *        Slow by design, keep it off the event loop.
+     * 
+     * @param password 
+     * @param stored password hash from the users file
+     * @return int , 0 for match, -1 for mismatch or malformed hash
+     */
+    static int verify_password (const std::string &password, const std::string &stored);
+
+    /**
+     * @brief Load the users into the credential store unless already loaded,
+     *        see Credential_Store::reload () for the file format
      * 
      * @return int , 0 for success, -1 for failure
      */
@@ -96,10 +163,9 @@ private:
     std::string username_;      // username
     std::string current_dir_;   // current working directory
     std::string old_file_name_; // Before renaming a file, store the origin name of the file
-
-    // valid username and passwords, coming from a file
-    static std::unordered_map<std::string, std::string> passwords_;
-    static const std::string passwords_file_path_;  // path of the file storing username and passwords
+    long rate_limit_;           // transfer rate limit in bytes per second, 0 for unlimited
+    std::string class_name_;    // scheduling class
+    long weight_;               // scheduling weight, 0 for the weight of its class
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "vfs.h"
+#include "async_log.h"
+#include "memory_vfs.h"
+#include "server_config.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+
+int Local_Vfs::open (const std::string &path, int flags, mode_t mode)
+{
+    return ::open (path.c_str (), flags | O_CLOEXEC, mode);
+}
+
+int Local_Vfs::stat (const std::string &path, struct stat &file_stat)
+{
+    return ::stat (path.c_str (), &file_stat);
+}
+
+int Local_Vfs::lstat (const std::string &path, struct stat &file_stat)
+{
+    return ::lstat (path.c_str (), &file_stat);
+}
+
+int Local_Vfs::rename (const std::string &old_path, const std::string &new_path)
+{
+    return ::rename (old_path.c_str (), new_path.c_str ());
+}
+
+int Local_Vfs::remove (const std::string &path)
+{
+    return ::remove (path.c_str ());
+}
+
+int Local_Vfs::mkdir (const std::string &path, mode_t mode)
+{
+    return ::mkdir (path.c_str (), mode);
+}
+
+int Local_Vfs::rmdir (const std::string &path)
+{
+    return ::rmdir (path.c_str ());
+}
+
+int Local_Vfs::list (const std::string &path, std::vector<Vfs_Entry> &entries)
+{
+    std::string dir_path = path;
+    if (dir_path.empty () || dir_path.back () != '/')
+        dir_path.push_back ('/');
+    DIR *dir = opendir (dir_path.c_str ());
+    if (dir == nullptr)
+        return -1;
+    entries.clear ();
+    struct dirent *content;
+    Vfs_Entry entry;
+    while ((content = readdir (dir)) != nullptr)
+    {
+        entry.name = content->d_name;
+        if (::stat ((dir_path + entry.name).c_str (), &entry.file_stat) == 0)
+            entries.push_back (entry);
+    }
+    closedir (dir);
+    return 0;
+}
+
+Vfs *Vfs::instance ()
+{
+    static Vfs vfs;
+    return &vfs;
+}
+
+Vfs::Vfs () : local_ (std::make_shared<Local_Vfs> ())
+{
+}
+
+void Vfs::configure ()
+{
+    std::istringstream mount_stream (Server_Config::instance ()->get_string ("vfs_memory_mounts", ""));
+    std::string prefix;
+    while (mount_stream >> prefix)
+    {
+        if (prefix[0] != '/')
+        {
+            FTP_LOG (LOG_LEVEL_ERROR, "memory mount %s is not an absolute path\n", prefix.c_str ());
+            continue;
+        }
+        mount (prefix, std::make_shared<Memory_Vfs> ());
+        FTP_LOG (LOG_LEVEL_INFO, "memory filesystem mounted at %s\n", normalize (prefix).c_str ());
+    }
+}
+
+void Vfs::mount (const std::string &prefix, const std::shared_ptr<Vfs_Backend> &backend)
+{
+    std::string path = normalize (prefix);
+    for (auto &mount : mounts_)
+    {
+        if (mount.first == path)
+        {
+            mount.second = backend;
+            return;
+        }
+    }
+    auto ite = mounts_.begin ();
+    while (ite != mounts_.end () && ite->first.length () >= path.length ())
+        ++ite;
+    mounts_.emplace (ite, path, backend);
+}
+
+std::string Vfs::normalize (const std::string &path)
+{
+    std::vector<std::string> components;
+    std::string component;
+    std::istringstream path_stream (path);
+    while (std::getline (path_stream, component, '/'))
+    {
+        if (component.empty () || component == ".")
+            continue;
+        if (component != "..")
+            components.push_back (component);
+        else if (!components.empty ())
+            components.pop_back ();
+    }
+    std::string normalized;
+    for (const std::string &name : components)
+        normalized += '/' + name;
+    return normalized.empty () ? "/" : normalized;
+}
+
+Vfs_Backend *Vfs::resolve (const std::string &path, std::string &inner_path) const
+{
+    // a relative path, as LIST may get, is the local filesystem's
+    if (!mounts_.empty () && !path.empty () && path[0] == '/')
+    {
+        std::string normalized = normalize (path);
+        for (const auto &mount : mounts_)
+        {
+            const std::string &prefix = mount.first;
+            if (prefix == "/")
+            {
+                inner_path = normalized;
+                return mount.second.get ();
+            }
+            if (normalized.compare (0, prefix.length (), prefix) == 0 &&
+                (normalized.length () == prefix.length () || normalized[prefix.length ()] == '/'))
+            {
+                inner_path = (normalized.length () == prefix.length () ? "/" : normalized.substr (prefix.length ()));
+                return mount.second.get ();
+            }
+        }
+    }
+    inner_path = path;
+    return local_.get ();
+}
+
+bool Vfs::is_local (const std::string &path) const
+{
+    std::string inner_path;
+    return resolve (path, inner_path) == local_.get ();
+}
+
+int Vfs::open (const std::string &path, int flags, mode_t mode)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->open (inner_path, flags, mode);
+}
+
+int Vfs::stat (const std::string &path, struct stat &file_stat)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->stat (inner_path, file_stat);
+}
+
+int Vfs::lstat (const std::string &path, struct stat &file_stat)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->lstat (inner_path, file_stat);
+}
+
+int Vfs::rename (const std::string &old_path, const std::string &new_path)
+{
+    std::string old_inner_path, new_inner_path;
+    Vfs_Backend *backend = resolve (old_path, old_inner_path);
+    if (resolve (new_path, new_inner_path) != backend)
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    return backend->rename (old_inner_path, new_inner_path);
+}
+
+int Vfs::remove (const std::string &path)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->remove (inner_path);
+}
+
+int Vfs::mkdir (const std::string &path, mode_t mode)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->mkdir (inner_path, mode);
+}
+
+int Vfs::rmdir (const std::string &path)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->rmdir (inner_path);
+}
+
+int Vfs::list (const std::string &path, std::vector<Vfs_Entry> &entries)
+{
+    std::string inner_path;
+    return resolve (path, inner_path)->list (inner_path, entries);
+}
@@ -0,0 +1,252 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+struct Vfs_Entry
+{
+    std::string name;           // name in the directory
+    struct stat file_stat;      // what stat () gives for it
+};
+
+/**
+ * Storage behind a part of the namespace. Paths are absolute within the
+ * backend, and the calls fail like their POSIX namesakes: -1 with errno.
+ * A file is opened to a descriptor the data path uses as it is, with
+ * pread, pwrite, sendfile, fstat, ftruncate and flock.
+ */
+class Vfs_Backend
+{
+public:
+    virtual ~Vfs_Backend () {}
+
+    /**
+     * @brief Open a file
+     *
+     * @param path
+     * @param flags O_RDONLY or O_RDWR, with O_CREAT, O_EXCL and O_TRUNC
+     * @param mode permissions of a created file
+     * @return int , the descriptor, -1 for failure
+     */
+    virtual int open (const std::string &path, int flags, mode_t mode) = 0;
+
+    /**
+     * @brief Get the status of a file or directory, following symbolic links
+     *
+     * @param path
+     * @param file_stat
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int stat (const std::string &path, struct stat &file_stat) = 0;
+
+    /**
+     * @brief Get the status of a file or directory, a symbolic link itself
+     *
+     * @param path
+     * @param file_stat
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int lstat (const std::string &path, struct stat &file_stat) = 0;
+
+    /**
+     * @brief Rename a file or directory, replacing a file at the new path
+     *
+     * @param old_path
+     * @param new_path
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int rename (const std::string &old_path, const std::string &new_path) = 0;
+
+    /**
+     * @brief Remove a file or an empty directory, like remove (3)
+     *
+     * @param path
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int remove (const std::string &path) = 0;
+
+    /**
+     * @brief Make a directory
+     *
+     * @param path
+     * @param mode
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int mkdir (const std::string &path, mode_t mode) = 0;
+
+    /**
+     * @brief Remove an empty directory
+     *
+     * @param path
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int rmdir (const std::string &path) = 0;
+
+    /**
+     * @brief Read a directory, entries that vanish while it is read are skipped
+     *
+     * @param path
+     * @param entries set to the entries with their status
+     * @return int , 0 for success, -1 for failure
+     */
+    virtual int list (const std::string &path, std::vector<Vfs_Entry> &entries) = 0;
+};
+
+/**
+ * The local filesystem, what the server always served.
+ */
+class Local_Vfs : public Vfs_Backend
+{
+public:
+    virtual int open (const std::string &path, int flags, mode_t mode);
+    virtual int stat (const std::string &path, struct stat &file_stat);
+    virtual int lstat (const std::string &path, struct stat &file_stat);
+    virtual int rename (const std::string &old_path, const std::string &new_path);
+    virtual int remove (const std::string &path);
+    virtual int mkdir (const std::string &path, mode_t mode);
+    virtual int rmdir (const std::string &path);
+    virtual int list (const std::string &path, std::vector<Vfs_Entry> &entries);
+};
+
+/**
+ * The namespace Command_Handler and Data_Handler see: backends mounted at
+ * path prefixes over the local filesystem. A path belongs to the longest
+ * prefix that matches it whole components, after "." and ".." are
+ * resolved, and reaches its backend relative to that prefix; other paths
+ * go to the local filesystem unchanged. Mounts are made before the server
+ * starts and never change after, lookups take no lock.
+ */
+class Vfs
+{
+public:
+    /**
+     * @brief Get the process-wide namespace
+     *
+     * @return Vfs*
+     */
+    static Vfs *instance ();
+
+    /**
+     * @brief Mount a Memory_Vfs at each prefix of vfs_memory_mounts in Server_Config
+     */
+    void configure ();
+
+    /**
+     * @brief Mount a backend, replacing one at the same prefix
+     *
+     * @param prefix absolute path, the backend's root
+     * @param backend
+     */
+    void mount (const std::string &prefix, const std::shared_ptr<Vfs_Backend> &backend);
+
+    /**
+     * @brief Check whether a path is on the local filesystem, where the other
+     *        paths Dedup_Store and Segmented_Upload make live as well
+     *
+     * @param path
+     * @return true , local
+     * @return false , mounted
+     */
+    bool is_local (const std::string &path) const;
+
+    /**
+     * @brief Open a file, see Vfs_Backend::open ()
+     *
+     * @param path
+     * @param flags
+     * @param mode
+     * @return int , the descriptor, -1 for failure
+     */
+    int open (const std::string &path, int flags, mode_t mode);
+
+    /**
+     * @brief Get the status of a path, see Vfs_Backend::stat ()
+     *
+     * @param path
+     * @param file_stat
+     * @return int , 0 for success, -1 for failure
+     */
+    int stat (const std::string &path, struct stat &file_stat);
+
+    /**
+     * @brief Get the status of a path, see Vfs_Backend::lstat ()
+     *
+     * @param path
+     * @param file_stat
+     * @return int , 0 for success, -1 for failure
+     */
+    int lstat (const std::string &path, struct stat &file_stat);
+
+    /**
+     * @brief Rename within one backend
+     *
+     * @param old_path
+     * @param new_path
+     * @return int , 0 for success, -1 for failure, errno EXDEV across backends
+     */
+    int rename (const std::string &old_path, const std::string &new_path);
+
+    /**
+     * @brief Remove a file or an empty directory, see Vfs_Backend::remove ()
+     *
+     * @param path
+     * @return int , 0 for success, -1 for failure
+     */
+    int remove (const std::string &path);
+
+    /**
+     * @brief Make a directory, see Vfs_Backend::mkdir ()
+     *
+     * @param path
+     * @param mode
+     * @return int , 0 for success, -1 for failure
+     */
+    int mkdir (const std::string &path, mode_t mode);
+
+    /**
+     * @brief Remove an empty directory, see Vfs_Backend::rmdir ()
+     *
+     * @param path
+     * @return int , 0 for success, -1 for failure
+     */
+    int rmdir (const std::string &path);
+
+    /**
+     * @brief Read a directory, see Vfs_Backend::list ()
+     *
+     * @param path
+     * @param entries
+     * @return int , 0 for success, -1 for failure
+     */
+    int list (const std::string &path, std::vector<Vfs_Entry> &entries);
+
+private:
+    Vfs ();
+
+    /**
+     * @brief Find the backend of a path
+     *
+     * @param path
+     * @param inner_path set to the path within the backend
+     * @return Vfs_Backend*
+     */
+    Vfs_Backend *resolve (const std::string &path, std::string &inner_path) const;
+
+    /**
+     * @brief Resolve ".", ".." and repeated slashes of an absolute path
+     *
+     * @param path
+     * @return std::string
+     */
+    static std::string normalize (const std::string &path);
+
+    std::shared_ptr<Vfs_Backend> local_;                                        // everything not mounted
+    std::vector<std::pair<std::string, std::shared_ptr<Vfs_Backend>>> mounts_;  // by prefix, longest first
+};
+
+#endif